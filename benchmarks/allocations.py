@@ -0,0 +1,102 @@
+"""Measure the overhead of allocation sampling.
+
+An allocation heavy workload (small objects from pymalloc, larger strings
+and lists that pymalloc passes on to malloc) is timed without profiling,
+with the usual cpu sampling and with cpu and allocation sampling. The
+configurations take turns, every round runs each of them once, and the
+median of the per round ratios is printed: the speed of a shared machine
+drifts more than the overhead that is measured. The overhead of
+``allocations`` is the ratio to cpu sampling alone::
+
+    python benchmarks/allocations.py --rates 524288 65536 8192
+"""
+import argparse
+import sys
+import tempfile
+import time
+
+import vmprof
+from vmprof.profiler import read_profile
+
+
+def work(rounds):
+    for _ in range(rounds):
+        objects = [(i, str(i), [i] * 4) for i in range(2000)]
+        text = "".join(item[1] for item in objects) * 8
+        table = {item[1]: item for item in objects}
+        del objects, text, table
+
+
+def best_time(rounds, repeat):
+    best = None
+    for _ in range(repeat):
+        start = time.process_time()
+        work(rounds)
+        elapsed = time.process_time() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+def profiled_time(rounds, period, allocations, count_samples=False):
+    with tempfile.NamedTemporaryFile() as tmp:
+        vmprof.enable(tmp.fileno(), period=period, allocations=allocations)
+        try:
+            elapsed = best_time(rounds, 1)
+        finally:
+            vmprof.disable()
+        samples = len(read_profile(tmp.name).allocations) if count_samples else None
+    return elapsed, samples
+
+
+def median(values):
+    values = sorted(values)
+    middle = len(values) // 2
+    if len(values) % 2:
+        return values[middle]
+    return (values[middle - 1] + values[middle]) / 2.0
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        "--rates",
+        type=int,
+        nargs="+",
+        default=[512 * 1024, 64 * 1024, 8 * 1024],
+        help="mean number of bytes between two samples",
+    )
+    parser.add_argument("--rounds", type=int, default=200, help="size of the workload")
+    parser.add_argument("--repeat", type=int, default=15, help="runs per measurement")
+    parser.add_argument(
+        "--period", type=float, default=0.00099, help="cpu sampling period"
+    )
+    args = parser.parse_args(argv)
+
+    if sys.platform == "win32":
+        print("allocation sampling is not available on windows")
+        return 1
+
+    plain, cpu = [], []
+    rates = dict((rate, []) for rate in args.rates)
+    samples = {}
+    for i in range(args.repeat):
+        last = i == args.repeat - 1
+        plain.append(best_time(args.rounds, 1))
+        cpu.append(profiled_time(args.rounds, args.period, False)[0])
+        for rate in args.rates:
+            elapsed, samples[rate] = profiled_time(args.rounds, args.period, rate, last)
+            rates[rate].append(elapsed)
+    ratio = median([c / p for c, p in zip(cpu, plain)])
+    print("not profiled: %.3fs, cpu sampling: %.3fs (%+.1f%%)"
+          % (median(plain), median(cpu), (ratio - 1) * 100))
+    print("%12s %10s %12s %14s" % ("bytes/sample", "samples", "seconds", "vs cpu only"))
+    for rate in args.rates:
+        ratio = median([t / c for t, c in zip(rates[rate], cpu)])
+        print("%12d %10d %12.3f %13.1f%%"
+              % (rate, samples[rate], median(rates[rate]), (ratio - 1) * 100))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
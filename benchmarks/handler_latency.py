@@ -0,0 +1,104 @@
+"""Measure the cost of a single sample as the number of sampled threads grows.
+
+Every thread hashes a large buffer (hashlib releases the GIL, thus the
+threads really run in parallel) and is sampled by its own cpu time timer
+(``per_thread=True``), so signal handlers of different threads run
+concurrently. The cpu time a thread needs for a fixed amount of work is
+measured once with and once without profiling; the difference divided by
+the number of samples taken in that thread is the handler latency.
+
+If the handler entry serialized all threads, the latency would grow with
+the thread count. It should stay flat::
+
+    python benchmarks/handler_latency.py --threads 1 2 4 8 16 32 64
+"""
+import argparse
+import hashlib
+import os
+import sys
+import tempfile
+import threading
+import time
+
+import vmprof
+from vmprof.profiler import read_profile
+
+BUFFER = b"x" * (1 << 20)
+
+
+def work(rounds):
+    h = hashlib.sha256()
+    for _ in range(rounds):
+        h.update(BUFFER)
+
+
+def run_threads(count, rounds):
+    cpu = {}
+    barrier = threading.Barrier(count)
+
+    def target():
+        barrier.wait()
+        start = time.thread_time()
+        work(rounds)
+        cpu[threading.get_ident()] = time.thread_time() - start
+
+    threads = [threading.Thread(target=target) for _ in range(count)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return cpu
+
+
+def measure(count, rounds, period):
+    baseline = run_threads(count, rounds)
+    with tempfile.NamedTemporaryFile() as tmp:
+        vmprof.enable(tmp.fileno(), period=period, per_thread=True)
+        try:
+            profiled = run_threads(count, rounds)
+        finally:
+            vmprof.disable()
+        stats = read_profile(tmp.name)
+    # the thread id of a sample is its thread state, samples of the main
+    # thread (outside of the measured work) are few and counted anyway
+    taken = sum(profile[1] for profile in stats.profiles)
+    if not taken:
+        return None, 0
+    latency = (sum(profiled.values()) - sum(baseline.values())) / taken
+    return latency, taken
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        "--threads",
+        type=int,
+        nargs="+",
+        default=[1, 2, 4, 8, 16, 32, 64],
+        help="sampled thread counts to measure",
+    )
+    parser.add_argument(
+        "--rounds", type=int, default=400, help="MiB hashed by each thread"
+    )
+    parser.add_argument(
+        "--period", type=float, default=0.001, help="sampling period per thread"
+    )
+    args = parser.parse_args(argv)
+
+    if not sys.platform.startswith("linux"):
+        print("per-thread timers are only available on linux")
+        return 1
+
+    print("cpus: %d, period: %gs" % (os.cpu_count(), args.period))
+    print("%8s %10s %16s" % ("threads", "samples", "us per sample"))
+    for count in args.threads:
+        latency, taken = measure(count, args.rounds, args.period)
+        if latency is None:
+            print("%8d %10d %16s" % (count, taken, "-"))
+        else:
+            print("%8d %10d %16.2f" % (count, taken, latency * 1e6))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
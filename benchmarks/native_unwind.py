@@ -0,0 +1,132 @@
+"""Compare the cost of a native sample for the different stack walks.
+
+With ``native=True`` every sample walks the C stack. The walk either starts
+at the instruction the signal interrupted (the ucontext handed to the
+signal handler) or takes the context of the signal handler itself and
+steps through the handler frames until it finds the signal frame (needs
+libunwind). Starting at the ucontext, the stack is walked by the built-in
+unwinder (src/vmp_unwind.c, x86_64 and aarch64 linux) or by libunwind
+(>= 1.3). The time spent in the signal handler is read from the
+latency histogram of the profiler (``vmprof.get_profiler_stats()``, log2
+buckets), the mean is estimated from the bucket midpoints::
+
+    python benchmarks/native_unwind.py --depth 10 50 100
+
+``--native-pcs`` records the pc of every native frame instead of the start
+of its function (``vmprof.enable(native_pcs=True)``), libunwind then skips
+the procedure info lookup of every frame.
+
+For comparison, ``leaf`` does not walk the native stack at all and only
+records the interrupted pc on top of the python stack
+(``vmprof.enable(native_leaf=True)``), ``python`` records no native frame.
+"""
+import argparse
+import sys
+import tempfile
+import zlib
+
+import _vmprof
+import vmprof
+
+DATA = bytes(range(256)) * 4096
+
+
+def work(depth, rounds):
+    if depth > 0:
+        return work(depth - 1, rounds)
+    for _ in range(rounds):
+        zlib.compress(DATA, 6)
+
+
+WALKS = (
+    # name, native, from_ucontext, builtin
+    ("signal frame", True, False, False),
+    ("libunwind", True, True, False),
+    ("built-in", True, True, True),
+    ("leaf", "leaf", True, True),
+    ("python", False, True, True),
+)
+
+
+def measure(depth, rounds, period, native, from_ucontext, builtin, native_pcs):
+    _vmprof.unwind_from_ucontext(from_ucontext)
+    _vmprof.builtin_unwind(builtin)
+    if native == "leaf":
+        kwargs = dict(native=False, native_leaf=True)
+    else:
+        kwargs = dict(native=native, native_pcs=native_pcs and native)
+    with tempfile.NamedTemporaryFile() as tmp:
+        vmprof.enable(tmp.fileno(), period=period, **kwargs)
+        try:
+            work(depth, rounds)
+            stats = vmprof.get_profiler_stats()
+        finally:
+            vmprof.disable()
+            _vmprof.unwind_from_ucontext(True)
+            _vmprof.builtin_unwind(True)
+    buckets = stats["handler_latency_ns_log2"]
+    taken = sum(buckets)
+    if not taken:
+        return None, None, 0, stats["unwind_failures"]
+    mean = sum(count * 1.5 * 2**i for i, count in enumerate(buckets)) / taken
+    seen = 0
+    for i, count in enumerate(buckets):
+        seen += count
+        if seen * 2 >= taken:
+            median = 2**i
+            break
+    return mean, median, taken, stats["unwind_failures"]
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        "--depth",
+        type=int,
+        nargs="+",
+        default=[10, 50, 100],
+        help="python frames above the native work",
+    )
+    parser.add_argument(
+        "--rounds", type=int, default=150, help="MiB compressed per measurement"
+    )
+    parser.add_argument(
+        "--period", type=float, default=0.001, help="sampling period"
+    )
+    parser.add_argument(
+        "--native-pcs", action="store_true", help="record the pc of native frames"
+    )
+    args = parser.parse_args(argv)
+
+    if not hasattr(_vmprof, "unwind_from_ucontext"):
+        print("native profiling is not supported on this platform")
+        return 1
+
+    sys.setrecursionlimit(max(args.depth) + 100)
+    print(
+        "%6s %-14s %8s %9s %14s %14s"
+        % ("depth", "walk", "samples", "failures", "~mean us", "median us >=")
+    )
+    for depth in args.depth:
+        for name, native, from_ucontext, builtin in WALKS:
+            mean, median, taken, failures = measure(
+                depth,
+                args.rounds,
+                args.period,
+                native,
+                from_ucontext,
+                builtin,
+                args.native_pcs,
+            )
+            if mean is None:
+                print("%6d %-14s %8d %9d %14s %14s" % (depth, name, 0, failures, "-", "-"))
+                continue
+            print(
+                "%6d %-14s %8d %9d %14.1f %14.1f"
+                % (depth, name, taken, failures, mean / 1e3, median / 1e3)
+            )
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,87 @@
+"""Compare the ways vmprof.disable() can name native addresses.
+
+The addresses are spread over the executable mappings of this process
+(every ``--step`` bytes). They are resolved one at a time
+(``_vmprof.resolve_addr``, what ``disable()`` used to do), in one batch
+by one thread and by all threads (``_vmprof.resolve_addrs``), and looked
+up in a warm symbol cache (``vmprof.enable(symbol_cache=...)``)::
+
+    python benchmarks/symbolize.py --step 256
+
+The first lookup of a process reads the debug information of all modules,
+it is done before the measurements.
+"""
+import argparse
+import shutil
+import sys
+import tempfile
+import time
+
+import _vmprof
+from vmprof.symcache import SymbolCache
+
+
+def executable_mappings():
+    with open("/proc/self/maps") as fd:
+        for line in fd:
+            fields = line.split()
+            if len(fields) >= 6 and "x" in fields[1] and fields[5].startswith("/"):
+                start, end = (int(x, 16) for x in fields[0].split("-"))
+                yield start, end, int(fields[2], 16), fields[5]
+
+
+def timed(function, *args):
+    start = time.perf_counter()
+    result = function(*args)
+    return time.perf_counter() - start, result
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        "--step", type=int, default=256, help="bytes between two addresses"
+    )
+    args = parser.parse_args(argv)
+
+    if not hasattr(_vmprof, "resolve_addrs"):
+        print("native profiling is not supported on this platform")
+        return 1
+
+    mappings = list(executable_mappings())
+    addrs = [
+        addr | 1
+        for start, end, _, _ in mappings
+        for addr in range(start, end, args.step)
+    ]
+    _vmprof.resolve_addr(addrs[0])
+
+    print("%d addresses in %d mappings" % (len(addrs), len(mappings)))
+    elapsed, expected = timed(lambda: [_vmprof.resolve_addr(a) for a in addrs])
+    print("%-24s %8.3f s" % ("resolve_addr loop", elapsed))
+    for name, workers in (("resolve_addrs 1 thread", 1), ("resolve_addrs", 0)):
+        elapsed, result = timed(_vmprof.resolve_addrs, addrs, workers)
+        assert result == expected
+        print("%-24s %8.3f s" % (name, elapsed))
+
+    # keyed like the cache of disable(), the path stands in for the build-id
+    directory = tempfile.mkdtemp()
+    try:
+        cache = SymbolCache(directory)
+        keys = []
+        for start, end, offset, path in mappings:
+            build_id = "%016x" % (hash(path) & (2**64 - 1))
+            keys += [(build_id, a - start + offset) for a in range(start, end, args.step)]
+        for key, symbol in zip(keys, expected):
+            if symbol is not None:
+                cache.put(key[0], key[1], symbol)
+        cache.save()
+        cache = SymbolCache(directory)
+        elapsed, _ = timed(lambda: [cache.get(*key) for key in keys])
+        print("%-24s %8.3f s" % ("symbol cache", elapsed))
+    finally:
+        shutil.rmtree(directory)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
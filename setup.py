@@ -25,6 +25,14 @@ def _supported_unix():
     return False
 
 
+def _have_zlib():
+    # libbacktrace uncompresses compressed debug sections with zlib
+    import sysconfig
+
+    dirs = ["/usr/include", "/usr/local/include", sysconfig.get_paths()["include"]]
+    return any(os.path.exists(os.path.join(d, "zlib.h")) for d in dirs)
+
+
 if IS_PYPY:
     ext_modules = []  # built-in
 else:
@@ -47,39 +55,58 @@ else:
         # it might use the regiter rbx...
         extra_compile_args += ["-g"]
         extra_compile_args += ["-O2"]
-        extra_source_files += ["src/vmprof_unix.c", "src/vmprof_mt.c"]
+        extra_source_files += [
+            "src/vmprof_unix.c",
+            "src/vmprof_mt.c",
+            "src/vmprof_dedup.c",
+            "src/vmprof_chunk.c",
+        ]
     elif _supported_unix():
-        libraries = ["dl", "unwind"]
+        libraries = ["dl"]
+        unwind_libraries = ["unwind"]
         extra_compile_args = ["-Wno-unused"]
         if _supported_unix() == "linux":
+            # timer_create() lives in librt on older glibc versions
+            libraries.append("rt")
             extra_compile_args += ["-DVMPROF_LINUX=1"]
+            if _have_zlib():
+                libraries.append("z")
+                extra_compile_args += ["-DHAVE_ZLIB=1"]
         if _supported_unix() == "bsd":
-            libraries = ["unwind"]
+            libraries = []
             extra_compile_args += ["-DVMPROF_BSD=1"]
             extra_compile_args += ["-I/usr/local/include"]
         extra_compile_args += ["-DVMPROF_UNIX=1"]
         if platform.machine().startswith("arm"):
-            libraries.append("unwind-arm")
+            unwind_libraries.append("unwind-arm")
         elif (
             platform.machine().startswith("x86")
             or platform.machine().startswith("i686")
             or platform.machine().startswith("amd64")
         ):
             if sys.maxsize == 2**63 - 1:
-                libraries.append("unwind-x86_64")
+                unwind_libraries.append("unwind-x86_64")
             else:
-                libraries.append("unwind-x86")
+                unwind_libraries.append("unwind-x86")
         elif platform.machine() == "aarch64":
-            libraries.append("unwind-aarch64")
+            unwind_libraries.append("unwind-aarch64")
         elif platform.machine() == "ppc64le":
-            libraries.append("unwind-ppc64")
+            unwind_libraries.append("unwind-ppc64")
         else:
             raise NotImplementedError(
                 "unknown platform.machine(): %s" % platform.machine()
             )
+        if _supported_unix() == "bsd":
+            libraries += unwind_libraries
+        # on linux, libunwind is loaded at runtime (if at all, see
+        # vmp_native_enable), src/vmp_unwind.c walks the stack of samples
         extra_source_files += [
             "src/vmprof_mt.c",
             "src/vmprof_unix.c",
+            "src/vmprof_dedup.c",
+            "src/vmprof_chunk.c",
+            "src/vmp_unwind.c",
+            "src/vmp_modules.c",
             "src/libbacktrace/backtrace.c",
             "src/libbacktrace/state.c",
             "src/libbacktrace/elf.c",
@@ -120,6 +147,8 @@ else:
                 "src/vmprof_mt.h",
                 "src/vmprof_common.h",
                 "src/vmp_stack.h",
+                "src/vmp_unwind.h",
+                "src/vmp_modules.h",
                 "src/symboltable.h",
                 "src/machine.h",
                 "src/vmprof.h",
@@ -152,7 +181,12 @@ setup(
     ]
     + extra_install_requires,
     tests_require=["pytest", "cffi", "hypothesis"],
-    entry_points={"console_scripts": ["vmprofshow = vmprof.show:main"]},
+    entry_points={
+        "console_scripts": [
+            "vmprofshow = vmprof.show:main",
+            "vmprofsymbolize = vmprof.symbolize:main",
+        ]
+    },
     classifiers=[
         "License :: OSI Approved :: MIT License",
         "Programming Language :: Python",
@@ -19,12 +19,209 @@ static PyObject* (*_default_eval_loop)(PyFrameObject *, int) = 0;
 #include "machine.h"
 #include "symboltable.h"
 #include "vmprof_unix.h"
+#include "vmprof_dedup.h"
+#include "vmprof_chunk.h"
+#include "vmprof_memory.h"
+#include "vmp_modules.h"
 #else
 #include "vmprof_win.h"
 #endif
 #include "vmp_stack.h"
 
 #ifdef VMPROF_UNIX
+#include <math.h>
+
+/* Allocation sampling: the mem and obj allocators are wrapped by hooks
+   that count the bytes every thread allocates. Both are only called
+   with the GIL held: a sample records the python stack of the thread
+   and may write its buffer like any other code that holds the GIL. The
+   raw allocator is called without the GIL (and by pymalloc for its
+   arenas and the large blocks already counted), it is not hooked. Samples form a
+   Poisson process over the allocated bytes: the distance to the next
+   sample is drawn from an exponential distribution with a mean of
+   alloc_sample_bytes, thus large and small allocations are sampled
+   proportionally to their size and every sample stands for
+   alloc_sample_bytes bytes (times the number of sample points the
+   allocation crossed). The fast path is a thread local subtraction. */
+struct alloc_hook_s {
+    PyMemAllocatorDomain domain;
+    PyMemAllocatorEx original;
+};
+
+static struct alloc_hook_s alloc_hooks[] = {
+    {PYMEM_DOMAIN_MEM, {0}},
+    {PYMEM_DOMAIN_OBJ, {0}},
+};
+#define ALLOC_HOOK_COUNT (sizeof(alloc_hooks) / sizeof(alloc_hooks[0]))
+
+static long alloc_sample_bytes = 0;
+static int alloc_hooks_installed = 0;
+/* initial-exec: every allocation reads these, a plain %fs/tpidr relative
+   access instead of a __tls_get_addr call */
+static __thread int64_t alloc_countdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t alloc_rng __attribute__((tls_model("initial-exec")));
+/* set while the thread is inside a hook: the allocations made by the
+   original allocator or by a sample must not be counted */
+static __thread int alloc_in_hook __attribute__((tls_model("initial-exec")));
+
+static int64_t _alloc_next_distance(void)
+{
+    /* xorshift64*, u is uniform in (0, 1] */
+    double u;
+    alloc_rng ^= alloc_rng >> 12;
+    alloc_rng ^= alloc_rng << 25;
+    alloc_rng ^= alloc_rng >> 27;
+    u = ((alloc_rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+    return (int64_t)(-log(1.0 - u) * alloc_sample_bytes) + 1;
+}
+
+static void _alloc_sample(size_t size)
+{
+    /* slow path, the countdown of this thread crossed 0 */
+    size_t points = 0;
+
+    if (alloc_sample_bytes <= 0) {
+        /* the hooks could not be removed, see remove_alloc_hooks(): look
+           again after a MiB, the next profile might sample again */
+        alloc_countdown = 1 << 20;
+        return;
+    }
+    alloc_in_hook = 1;
+    if (alloc_rng == 0) {
+        /* first allocation of this thread: the countdown was 0, not a
+           drawn distance */
+        alloc_rng = ((uint64_t)(uintptr_t)&alloc_rng) ^ (uint64_t)time(NULL) ^
+                    0x9E3779B97F4A7C15ULL;
+        alloc_countdown += _alloc_next_distance();
+    }
+    while (alloc_countdown <= 0) {
+        alloc_countdown += _alloc_next_distance();
+        points++;
+    }
+    if (points > 0) {
+        vmprof_sample_allocation(PyGILState_GetThisThreadState(), size,
+                                 points * alloc_sample_bytes);
+    }
+    alloc_in_hook = 0;
+}
+
+static inline void _alloc_account(size_t size)
+{
+    alloc_countdown -= (int64_t)size;
+    if (alloc_countdown <= 0) {
+        _alloc_sample(size);
+    }
+}
+
+static void *alloc_hook_malloc(void *ctx, size_t size)
+{
+    PyMemAllocatorEx *original = (PyMemAllocatorEx *)ctx;
+    void *ptr;
+    if (alloc_in_hook) {
+        return original->malloc(original->ctx, size);
+    }
+    alloc_in_hook = 1;
+    ptr = original->malloc(original->ctx, size);
+    alloc_in_hook = 0;
+    if (ptr != NULL) {
+        _alloc_account(size);
+    }
+    return ptr;
+}
+
+static void *alloc_hook_calloc(void *ctx, size_t nelem, size_t elsize)
+{
+    PyMemAllocatorEx *original = (PyMemAllocatorEx *)ctx;
+    void *ptr;
+    if (alloc_in_hook) {
+        return original->calloc(original->ctx, nelem, elsize);
+    }
+    alloc_in_hook = 1;
+    ptr = original->calloc(original->ctx, nelem, elsize);
+    alloc_in_hook = 0;
+    if (ptr != NULL) {
+        _alloc_account(nelem * elsize);
+    }
+    return ptr;
+}
+
+static void *alloc_hook_realloc(void *ctx, void *old, size_t size)
+{
+    /* counted like a new allocation of the full size, not only the
+       growth: the hook is not told the old size and pymalloc has no way
+       to ask for it. A realloc of a pymalloc block that crosses its size
+       class copies it to a new block anyway. */
+    PyMemAllocatorEx *original = (PyMemAllocatorEx *)ctx;
+    void *ptr;
+    if (alloc_in_hook) {
+        return original->realloc(original->ctx, old, size);
+    }
+    alloc_in_hook = 1;
+    ptr = original->realloc(original->ctx, old, size);
+    alloc_in_hook = 0;
+    if (ptr != NULL) {
+        _alloc_account(size);
+    }
+    return ptr;
+}
+
+static void alloc_hook_free(void *ctx, void *ptr)
+{
+    PyMemAllocatorEx *original = (PyMemAllocatorEx *)ctx;
+    original->free(original->ctx, ptr);
+}
+
+static void install_alloc_hooks(long sample_bytes)
+{
+    /* must hold the GIL, like tracemalloc.start() */
+    size_t i;
+    PyMemAllocatorEx hook;
+
+    alloc_sample_bytes = sample_bytes;
+    if (alloc_hooks_installed || sample_bytes <= 0) {
+        return;
+    }
+    for (i = 0; i < ALLOC_HOOK_COUNT; i++) {
+        PyMem_GetAllocator(alloc_hooks[i].domain, &alloc_hooks[i].original);
+        hook.ctx = &alloc_hooks[i].original;
+        hook.malloc = alloc_hook_malloc;
+        hook.calloc = alloc_hook_calloc;
+        hook.realloc = alloc_hook_realloc;
+        hook.free = alloc_hook_free;
+        PyMem_SetAllocator(alloc_hooks[i].domain, &hook);
+    }
+    alloc_hooks_installed = 1;
+}
+
+static int remove_alloc_hooks(void)
+{
+    /* Returns -1 if the warning is turned into an exception. If another hook (tracemalloc.start() for example) was
+       installed on top of ours, restoring the original allocator would
+       remove it: ours stay installed and stop sampling. */
+    size_t i;
+    PyMemAllocatorEx current;
+
+    alloc_sample_bytes = 0;
+    if (!alloc_hooks_installed) {
+        return 0;
+    }
+    for (i = 0; i < ALLOC_HOOK_COUNT; i++) {
+        PyMem_GetAllocator(alloc_hooks[i].domain, &current);
+        if (current.malloc != alloc_hook_malloc ||
+                current.ctx != &alloc_hooks[i].original) {
+            return PyErr_WarnEx(PyExc_RuntimeWarning,
+                                "another allocator hook was installed after the "
+                                "one of vmprof, it stays installed but does not "
+                                "sample anymore", 1);
+        }
+    }
+    for (i = 0; i < ALLOC_HOOK_COUNT; i++) {
+        PyMem_SetAllocator(alloc_hooks[i].domain, &alloc_hooks[i].original);
+    }
+    alloc_hooks_installed = 0;
+    return 0;
+}
+
 #ifdef __clang__
 __attribute__((optnone))
 #elif defined(__GNUC__)
@@ -64,12 +261,170 @@ PY_EVAL_RETURN_T * vmprof_eval(PY_STACK_FRAME_T *f, int throwflag)
 }
 #endif
 
-static int emit_code_object(PyCodeObject *co)
+static void _line_table_add(long *table, long *count, long offset, long line)
+{
+    long n = *count;
+    if (n > 0 && table[2 * n - 2] == offset) {
+        /* an empty range, the later line wins */
+        table[2 * n - 1] = line;
+        return;
+    }
+    if (n > 0 && table[2 * n - 1] == line) {
+        return;
+    }
+    table[2 * n] = offset;
+    table[2 * n + 1] = line;
+    *count = n + 1;
+}
+
+static int emit_line_table(PyCodeObject *co, intptr_t code_uid)
+{
+    /* Writes the (byte offset, line) pairs at which the line of the code
+       object changes, the reader maps the instruction offsets recorded in
+       lines mode to line numbers with it. This decodes the table the same
+       way as PyCode_Addr2Line. */
+    const unsigned char *p;
+    Py_ssize_t size, i;
+    long *table;
+    long count = 0;
+    long offset = 0;
+    long line = co->co_firstlineno;
+    int res;
+
+#if PY_VERSION_HEX >= 0x030A0000
+    p = (const unsigned char *)PyBytes_AS_STRING(co->co_linetable);
+    size = PyBytes_GET_SIZE(co->co_linetable) / 2;
+#else
+    p = (const unsigned char *)PyBytes_AS_STRING(co->co_lnotab);
+    size = PyBytes_GET_SIZE(co->co_lnotab) / 2;
+#endif
+    table = (long *)malloc((size + 1) * 2 * sizeof(long));
+    if (table == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+#if PY_VERSION_HEX >= 0x030A0000
+    /* (size of the range, line delta), -128 is a range without a line */
+    for (i = 0; i < size; i++) {
+        long start = offset;
+        offset += p[2 * i];
+        if ((signed char)p[2 * i + 1] != -128) {
+            line += (signed char)p[2 * i + 1];
+            _line_table_add(table, &count, start, line);
+        }
+    }
+#else
+    /* (offset delta, line delta) of the start of every line */
+    _line_table_add(table, &count, 0, line);
+    for (i = 0; i < size; i++) {
+        offset += p[2 * i];
+#if PY_VERSION_HEX >= 0x03060000
+        line += (signed char)p[2 * i + 1];
+#else
+        line += p[2 * i + 1];
+#endif
+        _line_table_add(table, &count, offset, line);
+    }
+#endif
+    res = vmprof_register_line_table(code_uid, count, table, 500000);
+    free(table);
+    return res;
+}
+
+/* The ids of the strings written to the profile so far (see
+   MARKER_STRING), a set with linear probing. Only used with the GIL held,
+   emptied when profiling starts. */
+static uint64_t *written_strings = NULL;
+static size_t written_strings_size = 0;     /* a power of two */
+static size_t written_strings_count = 0;
+
+static int64_t string_id(const char *string, size_t len)
+{
+    /* FNV-1a of the bytes, vmprof.reader.string_id computes the same.
+       A hash and not an index: symbols are added to the profile by other
+       writers later, they need not know the strings written here. */
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 1099511628211ULL;
+    }
+    hash &= 0x7fffffffffffffffULL;
+    return hash ? (int64_t)hash : 1;
+}
+
+static void _written_strings_add(uint64_t id)
+{
+    /* ID must not be in the set yet */
+    size_t i;
+
+    if (2 * (written_strings_count + 1) > written_strings_size) {
+        size_t size = written_strings_size ? 2 * written_strings_size : 1024;
+        uint64_t *table = calloc(size, sizeof(uint64_t));
+        if (table == NULL)
+            return;     /* the string is written again next time */
+        for (i = 0; i < written_strings_size; i++) {
+            uint64_t old = written_strings[i];
+            size_t j = old & (size - 1);
+            if (old == 0)
+                continue;
+            while (table[j] != 0)
+                j = (j + 1) & (size - 1);
+            table[j] = old;
+        }
+        free(written_strings);
+        written_strings = table;
+        written_strings_size = size;
+    }
+    i = id & (written_strings_size - 1);
+    while (written_strings[i] != 0)
+        i = (i + 1) & (written_strings_size - 1);
+    written_strings[i] = id;
+    written_strings_count++;
+}
+
+static int _written_strings_contains(uint64_t id)
+{
+    size_t i;
+
+    if (written_strings_size == 0)
+        return 0;
+    i = id & (written_strings_size - 1);
+    while (written_strings[i] != 0) {
+        if (written_strings[i] == id)
+            return 1;
+        i = (i + 1) & (written_strings_size - 1);
+    }
+    return 0;
+}
+
+static void written_strings_reset(void)
+{
+    free(written_strings);
+    written_strings = NULL;
+    written_strings_size = 0;
+    written_strings_count = 0;
+}
+
+static int64_t intern_string(const char *string)
+{
+    /* the id of STRING, written to the profile the first time */
+    long len = (long)strnlen(string, MAX_FUNC_NAME - 1);
+    int64_t id = string_id(string, len);
+
+    if (_written_strings_contains(id))
+        return id;
+    if (vmprof_register_string(id, string, len, 500000) < 0)
+        return -1;
+    _written_strings_add(id);
+    return id;
+}
+
+static int emit_code_object_as(PyCodeObject *co, intptr_t code_uid)
 {
-    char buf[MAX_FUNC_NAME + 1];
     const char *co_name, *co_filename;
-    int co_firstlineno;
-    int sz;
+    int64_t lang_id, name_id, file_id;
 #if PY_MAJOR_VERSION >= 3
     co_name = PyUnicode_AsUTF8(co->co_name);
     if (co_name == NULL)
@@ -81,14 +436,24 @@ static int emit_code_object(PyCodeObject *co)
     co_name = PyString_AS_STRING(co->co_name);
     co_filename = PyString_AS_STRING(co->co_filename);
 #endif
-    co_firstlineno = co->co_firstlineno;
 
-    sz = snprintf(buf, MAX_FUNC_NAME / 2, "py:%s", co_name);
-    if (sz < 0) sz = 0;
-    if (sz > MAX_FUNC_NAME / 2) sz = MAX_FUNC_NAME / 2;
-    snprintf(buf + sz, MAX_FUNC_NAME / 2, ":%d:%s", co_firstlineno,
-             co_filename);
-    return vmprof_register_virtual_function(buf, CODE_ADDR_TO_UID(co), 500000);
+    /* 'py:<name>:<line>:<file>', the file is written once for all of its
+       code objects */
+    if ((lang_id = intern_string("py")) < 0 ||
+        (name_id = intern_string(co_name)) < 0 ||
+        (file_id = intern_string(co_filename)) < 0)
+        return -1;
+    if (vmprof_register_code_name(code_uid, lang_id, name_id,
+                                  co->co_firstlineno, file_id, 500000) < 0)
+        return -1;
+    if (vmp_profiles_python_lines())
+        return emit_line_table(co, code_uid);
+    return 0;
+}
+
+static int emit_code_object(PyCodeObject *co)
+{
+    return emit_code_object_as(co, CODE_ADDR_TO_UID(co));
 }
 
 static int _look_for_code_object(PyObject *o, void * param)
@@ -164,26 +529,223 @@ void emit_all_code_objects(PyObject * seen_code_ids)
     Py_XDECREF(gc_module);
 }
 
+#ifdef VMPROF_UNIX
+/* set by stop_sampling: nothing must be written while the profile is
+   read back */
+static int code_names_paused = 0;
+/* set while the thread of vmprof_dedup.c writes the names: it holds the
+   GIL and must not wait for a free buffer, it tries again next time */
+static int code_names_in_watcher = 0;
+
+#if PY_VERSION_HEX >= 0x03060000
+/* the co_extra slot of stable code ids, -1 if they are not used */
+static Py_ssize_t code_id_index = -1;
+static Py_ssize_t code_id_extra_index = -1;  /* requested once */
+/* the profiling session, ids that earlier ones assigned are written again */
+static uintptr_t code_id_generation = 0;
+
+static intptr_t stable_code_id(PyCodeObject *co)
+{
+    /* FNV-1a of name, file, first line and bytecode, the same in every
+       process of one python version. The bytecode tells apart most of
+       the lambdas and comprehensions that start on the same line. */
+    const char *parts[3];
+    Py_ssize_t sizes[3];
+    uint64_t hash = 14695981039346656037ULL;
+    long line = co->co_firstlineno;
+    Py_ssize_t j;
+    int i;
+
+    parts[0] = PyUnicode_AsUTF8AndSize(co->co_name, &sizes[0]);
+    parts[1] = PyUnicode_AsUTF8AndSize(co->co_filename, &sizes[1]);
+    if (parts[0] == NULL || parts[1] == NULL)
+        return 0;
+    if (!PyBytes_Check(co->co_code))
+        return 0;
+    parts[2] = PyBytes_AS_STRING(co->co_code);
+    sizes[2] = PyBytes_GET_SIZE(co->co_code);
+    for (i = 0; i < 3; i++) {
+        const unsigned char *c = (const unsigned char *)parts[i];
+        for (j = 0; j < sizes[i]; j++) {
+            hash ^= c[j];
+            hash *= 1099511628211ULL;
+        }
+        hash ^= 0xff;   /* separator */
+        hash *= 1099511628211ULL;
+        if (i == 1) {
+            for (j = 0; j < 4; j++, line >>= 8) {
+                hash ^= (unsigned char)line;
+                hash *= 1099511628211ULL;
+            }
+        }
+    }
+    return (intptr_t)(((hash << 2) | VMP_CODE_ID_TAG) & VMP_CODE_ID_MASK);
+}
+
+static int write_code_id(PyCodeObject *co, int assign)
+{
+    /* Gives the code object its stable id (unless it is freed), writes
+       the name for it and an alias for the samples that recorded the
+       address. Returns 1 if the alias must be written later: the id and
+       the name are then not written again. */
+    intptr_t id = stable_code_id(co);
+    void *value = (void *)((code_id_generation << VMP_CODE_ID_BITS) | id);
+    void *current = NULL;
+    int res, later;
+    if (id == 0)
+        return -1;
+    if (_PyCode_GetExtra((PyObject *)co, code_id_index, &current) < 0)
+        return -1;
+    if (current != value) {
+        if (assign) {
+            /* _PyCode_SetExtra might move co_extra, which the signal
+               handler reads (see vmp_stable_code_ids) */
+            vmprof_ignore_signals(1);
+            res = _PyCode_SetExtra((PyObject *)co, code_id_index, value);
+            vmprof_ignore_signals(0);
+            if (res < 0)
+                return -1;
+        }
+        if (emit_code_object_as(co, id) < 0)
+            return -1;
+    }
+    /* a freed code object has no next time */
+    later = code_names_in_watcher && assign;
+    if (vmprof_register_code_alias(CODE_ADDR_TO_UID(co), id, later ? 0 : 500000) < 0)
+        return later ? 1 : -1;
+    return 0;
+}
+#endif
+
+static int emit_seen_code(void *arg, intptr_t code_uid)
+{
+    // the id is the address of the code object, see vmprof_dedup.h why
+    // it is still alive. ARG is non-NULL if it is being freed.
+    int res;
+#if PY_VERSION_HEX >= 0x03060000
+    if (code_id_index >= 0)
+        res = write_code_id((PyCodeObject *)code_uid, arg == NULL);
+    else
+#endif
+        res = emit_code_object((PyCodeObject *)code_uid);
+    if (res < 0) {
+        PyErr_Clear();
+        return 0;
+    }
+    return res;
+}
+#endif
+
 static void cpyprof_code_dealloc(PyObject *co)
 {
     if (vmprof_is_enabled()) {
+#if defined(VMPROF_UNIX) && PY_VERSION_HEX >= 0x03060000
+        if (code_id_index >= 0) {
+            // only code objects that were sampled without their id
+            if (vmp_seen_code_freed(CODE_ADDR_TO_UID(co)) == VMP_CODE_PENDING)
+                emit_seen_code(co, CODE_ADDR_TO_UID(co));
+            Original_code_dealloc(co);
+            return;
+        }
+#endif
         emit_code_object((PyCodeObject *)co);
         /* xxx error return values are ignored */
+#ifdef VMPROF_UNIX
+        vmp_seen_code_freed(CODE_ADDR_TO_UID(co));
+#endif
     }
     Original_code_dealloc(co);
 }
 
-static PyObject *enable_vmprof(PyObject* self, PyObject *args)
+#ifdef VMPROF_UNIX
+static int write_sampled_code_objects(void)
+{
+    // runs in the thread of vmprof_dedup.c. Not a pending call: before
+    // 3.12 the main thread only notices those that it adds itself.
+    PyGILState_STATE state;
+    if (!Py_IsInitialized()) {
+        return -1;
+    }
+    state = PyGILState_Ensure();
+    if (vmprof_is_enabled() && !code_names_paused) {
+        code_names_in_watcher = 1;
+        (void)vmp_seen_take_codes(emit_seen_code, NULL);
+        code_names_in_watcher = 0;
+    }
+    PyGILState_Release(state);
+    return 0;
+}
+#endif
+
+static PyObject *enable_vmprof(PyObject* self, PyObject *args, PyObject *kwargs)
 {
+    static char *kwlist[] = {"fileno", "period", "memory", "lines", "native",
+                             "real_time", "per_thread", "dedup", "writer",
+                             "rss_period", "allocations", "native_pcs",
+                             "native_leaf", "stable_ids", "format", NULL};
     int fd;
     int memory = 0;
     int lines = 0;
     int native = 0;
     int real_time = 0;
+    int per_thread = 0;
+    int dedup = 0;
+    int writer = 0;
     double interval;
+    double rss_interval = 0.0;
+    long allocations = 0;
+    int native_pcs = 0;
+    int native_leaf = 0;
+    int stable_ids = 0;
+    int format = 1;
     char *p_error;
 
-    if (!PyArg_ParseTuple(args, "id|iiii", &fd, &interval, &memory, &lines, &native, &real_time)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "id|iiiiiiidliiii", kwlist,
+                                     &fd, &interval, &memory, &lines, &native,
+                                     &real_time, &per_thread, &dedup, &writer,
+                                     &rss_interval, &allocations, &native_pcs,
+                                     &native_leaf, &stable_ids, &format)) {
+        return NULL;
+    }
+    if (format != 1 && format != 2) {
+        PyErr_SetString(PyExc_ValueError, "format must be 1 or 2");
+        return NULL;
+    }
+#if !defined(VMPROF_UNIX) || PY_VERSION_HEX < 0x03060000
+    if (stable_ids) {
+        PyErr_SetString(PyExc_ValueError, "stable_ids requires python 3.6+ on unix");
+        return NULL;
+    }
+#else
+    if (stable_ids && sizeof(void *) < 8) {
+        PyErr_SetString(PyExc_ValueError, "stable_ids requires a 64 bit platform");
+        return NULL;
+    }
+#endif
+
+    if (native_pcs && !native) {
+        PyErr_SetString(PyExc_ValueError, "native_pcs requires native profiling");
+        return NULL;
+    }
+
+    if (native_leaf && native) {
+        PyErr_SetString(PyExc_ValueError, "native_leaf cannot be combined with native profiling");
+        return NULL;
+    }
+#if !defined(VMPROF_UNIX) || defined(VMPROF_APPLE)
+    if (native_leaf) {
+        PyErr_SetString(PyExc_ValueError, "native_leaf is not supported on this platform");
+        return NULL;
+    }
+#endif
+
+    if (allocations < 0) {
+        PyErr_SetString(PyExc_ValueError, "allocations must be a positive number of bytes");
+        return NULL;
+    }
+
+    if (rss_interval < 0 || rss_interval > 1e6) {
+        PyErr_SetString(PyExc_ValueError, "rss_period must be between 0 and 1e6 seconds");
         return NULL;
     }
 
@@ -192,7 +754,7 @@ static PyObject *enable_vmprof(PyObject* self, PyObject *args)
         return NULL;
     }
 
-    if ((read(fd, NULL, 0) != 0) && (native != 0)) {
+    if ((read(fd, NULL, 0) != 0) && (native != 0 || native_leaf != 0)) {
         PyErr_SetString(PyExc_ValueError, "file descriptor must be readable");
         return NULL;
     }
@@ -210,22 +772,110 @@ static PyObject *enable_vmprof(PyObject* self, PyObject *args)
 #endif
 
     vmp_profile_lines(lines);
+    vmp_native_record_pcs(native_pcs);
+    vmp_native_record_leaf(native_leaf);
+    written_strings_reset();
+#ifdef VMPROF_UNIX
+    vmp_dedup_enable(dedup);
+    vmp_seen_reset();
+#if PY_VERSION_HEX >= 0x03060000
+    code_id_index = -1;
+    if (stable_ids) {
+        if (code_id_extra_index < 0) {
+            code_id_extra_index = _PyEval_RequestCodeExtraIndex(NULL);
+            if (code_id_extra_index < 0) {
+                PyErr_SetString(PyExc_ValueError, "no co_extra slot is left for stable_ids");
+                return NULL;
+            }
+        }
+        code_id_index = code_id_extra_index;
+        code_id_generation = (code_id_generation + 1) & 0xffff;
+        if (code_id_generation == 0)
+            code_id_generation = 1;
+    }
+    vmp_stable_code_ids(code_id_index, code_id_generation);
+#endif
+    if (writer < VMP_WRITER_OFF || writer > VMP_WRITER_DROP_OLDEST) {
+        PyErr_SetString(PyExc_ValueError, "unknown buffer writer policy");
+        return NULL;
+    }
+    if (format == 2 && writer == VMP_WRITER_OFF) {
+        // the samples are encoded by the buffer writer thread, never in
+        // the signal handler (see vmprof_chunk.h)
+        writer = VMP_WRITER_DROP_NEWEST;
+    }
+    set_buffer_writer_policy(writer);
+    set_rss_interval_usec((long)(rss_interval * 1000000.0));
+    if (vmp_chunks_enable(format == 2) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+#else
+    if (per_thread) {
+        PyErr_SetString(PyExc_ValueError, "per-thread timers are only supported on Linux");
+        return NULL;
+    }
+    if (dedup) {
+        PyErr_SetString(PyExc_ValueError, "stack deduplication is only supported on unix");
+        return NULL;
+    }
+    if (writer) {
+        PyErr_SetString(PyExc_ValueError, "the buffer writer is only supported on unix");
+        return NULL;
+    }
+    if (allocations) {
+        PyErr_SetString(PyExc_ValueError, "allocation sampling is only supported on unix");
+        return NULL;
+    }
+    if (format == 2) {
+        PyErr_SetString(PyExc_ValueError, "format 2 is only supported on unix");
+        return NULL;
+    }
+#endif
 
     if (!Original_code_dealloc) {
         Original_code_dealloc = PyCode_Type.tp_dealloc;
         PyCode_Type.tp_dealloc = &cpyprof_code_dealloc;
     }
 
+#ifdef VMPROF_UNIX
+    /* read by vmprof_init, reset if profiling does not start */
+    vmprof_set_thread_timers(per_thread);
+#endif
     p_error = vmprof_init(fd, interval, memory, lines, "cpython", native, real_time);
     if (p_error) {
+#ifdef VMPROF_UNIX
+        vmprof_set_thread_timers(0);
+#endif
         PyErr_SetString(PyExc_ValueError, p_error);
         return NULL;
     }
 
+#ifdef VMPROF_UNIX
+    if (allocations) {
+        /* written while nothing else writes to the file */
+        char value[32];
+        snprintf(value, sizeof(value), "%ld", allocations);
+        vmp_write_meta("alloc_sample_bytes", value);
+    }
+#endif
+
     if (vmprof_enable(memory, native, real_time) < 0) {
+#ifdef VMPROF_UNIX
+        vmprof_set_thread_timers(0);
+#endif
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+#ifdef VMPROF_UNIX
+    install_alloc_hooks(allocations);
+    code_names_paused = 0;
+    if (vmp_seen_codes_start(write_sampled_code_objects) < 0) {
         PyErr_SetFromErrno(PyExc_OSError);
         return NULL;
     }
+#endif
 
     vmprof_set_enabled(1);
 
@@ -242,6 +892,21 @@ static PyObject * vmp_is_enabled(PyObject *module, PyObject *noargs) {
 static PyObject *
 disable_vmprof(PyObject *module, PyObject *noargs)
 {
+#ifdef VMPROF_UNIX
+    int err;
+#endif
+#ifdef VMPROF_UNIX
+    /* a warning turned into an error is raised when profiling stopped */
+    (void)remove_alloc_hooks();
+    // the thread might wait for the GIL
+    Py_BEGIN_ALLOW_THREADS
+    err = vmp_seen_codes_stop();
+    Py_END_ALLOW_THREADS
+    if (err < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+#endif
     if (vmprof_disable() < 0) {
         PyErr_SetFromErrno(PyExc_OSError);
         return NULL;
@@ -255,6 +920,18 @@ disable_vmprof(PyObject *module, PyObject *noargs)
     Py_RETURN_NONE;
 }
 
+#ifdef VMPROF_UNIX
+static PyObject *
+write_seen_code_objects(PyObject *module, PyObject *noargs)
+{
+    // the names of the code objects that were sampled since the last
+    // pending call
+    if (vmp_seen_take_codes(emit_seen_code, NULL) < 0 || PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+#endif
+
 static PyObject *
 write_all_code_objects(PyObject *module, PyObject * seen_code_ids)
 {
@@ -353,12 +1030,162 @@ error:
 
     Py_RETURN_NONE;
 }
+
+static PyObject *
+resolve_addrs(PyObject *module, PyObject *args) {
+    PyObject * o_addrs;
+    PyObject * result = NULL;
+    void ** addrs = NULL;
+    vmp_symbol_t * symbols = NULL;
+    Py_ssize_t count, i;
+    int workers = 0, err;
+
+    if (!PyArg_ParseTuple(args, "O|i", &o_addrs, &workers)) {
+        return NULL;
+    }
+    o_addrs = PySequence_Fast(o_addrs, "addresses must be a sequence");
+    if (o_addrs == NULL) {
+        return NULL;
+    }
+    count = PySequence_Fast_GET_SIZE(o_addrs);
+    addrs = PyMem_Malloc((count + 1) * sizeof(void*));
+    symbols = PyMem_Malloc((count + 1) * sizeof(vmp_symbol_t));
+    if (addrs == NULL || symbols == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < count; i++) {
+        addrs[i] = PyLong_AsVoidPtr(PySequence_Fast_GET_ITEM(o_addrs, i));
+        if (addrs[i] == NULL && PyErr_Occurred()) {
+            goto error;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    err = vmp_resolve_addrs(addrs, symbols, count, workers);
+    Py_END_ALLOW_THREADS
+    if (err != 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto error;
+    }
+
+    result = PyList_New(count);
+    if (result == NULL) {
+        goto error;
+    }
+    for (i = 0; i < count; i++) {
+        PyObject * item;
+        if (symbols[i].failed) {
+            Py_INCREF(Py_None);
+            item = Py_None;
+        } else {
+            item = Py_BuildValue("(sis)", symbols[i].name, symbols[i].lineno,
+                                 symbols[i].srcfile);
+            if (item == NULL) {
+                Py_CLEAR(result);
+                goto error;
+            }
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+error:
+    PyMem_Free(addrs);
+    PyMem_Free(symbols);
+    Py_DECREF(o_addrs);
+    return result;
+}
+
+static PyObject *
+symbol_memory_limit(PyObject *module, PyObject *args) {
+    long limit;
+    if (!PyArg_ParseTuple(args, "l", &limit)) {
+        return NULL;
+    }
+    if (limit < 0) {
+        PyErr_SetString(PyExc_ValueError, "limit must not be negative");
+        return NULL;
+    }
+    return PyLong_FromLong(vmp_symbol_memory_limit(limit));
+}
+
+static PyObject *
+set_debug_dir(PyObject *module, PyObject *args) {
+    PyObject * o_dir;
+    if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &o_dir)) {
+        return NULL;
+    }
+    (void)vmp_set_debug_dir(PyBytes_AS_STRING(o_dir));
+    Py_DECREF(o_dir);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+symbol_memory_stats(PyObject *module, PyObject *noargs) {
+    size_t size, decoded, evicted;
+    if (vmp_symbol_memory_stats(&size, &decoded, &evicted) != 0) {
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue("(nnn)", (Py_ssize_t)size, (Py_ssize_t)decoded,
+                         (Py_ssize_t)evicted);
+}
+
+static PyObject *
+native_function_start(PyObject *module, PyObject *args) {
+    long long addr;
+    intptr_t start;
+
+    if (!PyArg_ParseTuple(args, "L", &addr)) {
+        return NULL;
+    }
+    start = vmp_native_function_start((intptr_t)addr);
+    if (start == 0) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromLongLong((long long)start);
+}
+
+static PyObject *
+unwind_from_ucontext(PyObject *module, PyObject *arg)
+{
+    int enabled = PyObject_IsTrue(arg);
+    if (enabled < 0) {
+        return NULL;
+    }
+    vmp_native_unwind_from_ucontext(enabled);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+builtin_unwind(PyObject *module, PyObject *arg)
+{
+    int enabled = PyObject_IsTrue(arg);
+    if (enabled < 0) {
+        return NULL;
+    }
+    vmp_native_builtin_unwind(enabled);
+    Py_RETURN_NONE;
+}
 #endif
 
 static PyObject *
 stop_sampling(PyObject *module, PyObject *noargs)
 {
     vmprof_ignore_signals(1);
+#ifdef VMPROF_UNIX
+    code_names_paused = 1;
+#endif
+#ifdef VMP_TRACK_MODULES
+    // the file position is shared with the reader, nothing must be
+    // written until the profile is disabled (or sampling resumes)
+    vmp_modules_pause(1);
+#endif
+#ifdef VMPROF_UNIX
+    // the profile is read back after this call, write what is pending
+    if (vmp_profile_fileno() >= 0 && flush_concurrent_bufs(vmp_profile_fileno()) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+#endif
     return PyLong_NEW(vmp_profile_fileno());
 }
 
@@ -366,10 +1193,141 @@ static PyObject *
 start_sampling(PyObject *module, PyObject *noargs)
 {
     vmprof_ignore_signals(0);
+#ifdef VMPROF_UNIX
+    code_names_paused = 0;
+#endif
+#ifdef VMP_TRACK_MODULES
+    vmp_modules_pause(0);
+#endif
     Py_RETURN_NONE;
 }
 
 #ifdef VMPROF_UNIX
+static PyObject *
+vmp_get_buffer_writer_stats(PyObject *module, PyObject *noargs)
+{
+    struct buffer_writer_stats_s stats;
+    get_buffer_writer_stats(&stats);
+    return Py_BuildValue("{s:l,s:l,s:l,s:l,s:l}",
+                         "fell_behind", stats.fell_behind,
+                         "dropped_newest", stats.dropped_newest,
+                         "dropped_oldest", stats.dropped_oldest,
+                         "writes", stats.writes,
+                         "max_backlog", stats.max_backlog);
+}
+
+static PyObject *
+seen_addresses(PyObject *module, PyObject *noargs)
+{
+    // assumptions: signals must be disabled (see stop_sampling)
+    uintptr_t *addrs;
+    PyObject *result = NULL;
+    long count, i;
+
+    addrs = PyMem_Malloc(VMP_SEEN_TABLE_SIZE * sizeof(uintptr_t));
+    if (addrs == NULL) {
+        return PyErr_NoMemory();
+    }
+    // waits until no signal handler adds to the table any more, one
+    // that entered before sampling was stopped might still run
+    vmprof_ignore_signals(1);
+    count = vmp_seen_addresses(addrs);
+    vmprof_ignore_signals(0);
+    if (count < 0) {
+        // not every address found a slot, the profile must be read
+        PyMem_Free(addrs);
+        Py_RETURN_NONE;
+    }
+    result = PyList_New(count);
+    for (i = 0; result != NULL && i < count; i++) {
+        PyObject *addr = PyLong_FromVoidPtr((void*)addrs[i]);
+        if (addr == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, addr);
+    }
+    PyMem_Free(addrs);
+    return result;
+}
+
+#ifdef VMP_TRACK_MODULES
+static int append_module(void *arg, uintptr_t base, uintptr_t start,
+                         uintptr_t end, const char *path,
+                         const unsigned char *build_id, long build_id_len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char build_id_hex[2 * VMP_BUILD_ID_MAX + 1];
+    PyObject *item;
+    long i;
+    int err;
+
+    for (i = 0; i < build_id_len; i++) {
+        build_id_hex[2 * i] = hex[build_id[i] >> 4];
+        build_id_hex[2 * i + 1] = hex[build_id[i] & 0xf];
+    }
+    build_id_hex[2 * build_id_len] = '\0';
+    // the layout of the module records of the reader (stats.modules)
+    item = Py_BuildValue("(iNNNssi)", VMP_MODULE_LOADED,
+                         PyLong_FromVoidPtr((void*)base),
+                         PyLong_FromVoidPtr((void*)start),
+                         PyLong_FromVoidPtr((void*)end),
+                         path, build_id_hex, 0);
+    if (item == NULL) {
+        return -1;
+    }
+    err = PyList_Append((PyObject *)arg, item);
+    Py_DECREF(item);
+    return err;
+}
+
+static PyObject *
+loaded_modules(PyObject *module, PyObject *noargs)
+{
+    PyObject *result = PyList_New(0);
+    if (result == NULL) {
+        return NULL;
+    }
+    if (vmp_modules_foreach(append_module, result) != 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+#endif
+
+static PyObject *
+vmp_get_stats(PyObject *module, PyObject *noargs)
+{
+    struct vmprof_handler_stats_s stats;
+    PyObject *latency, *result;
+    int i;
+
+    vmprof_get_handler_stats(&stats);
+    latency = PyList_New(VMP_LATENCY_BUCKETS);
+    if (latency == NULL)
+        return NULL;
+    for (i = 0; i < VMP_LATENCY_BUCKETS; i++) {
+        PyObject *count = PyLong_FromLong(stats.latency_ns_log2[i]);
+        if (count == NULL) {
+            Py_DECREF(latency);
+            return NULL;
+        }
+        PyList_SET_ITEM(latency, i, count);
+    }
+    result = Py_BuildValue("{s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:N}",
+                           "signals", stats.signals,
+                           "ignored", stats.ignored,
+                           "faults", stats.faults,
+                           "no_thread_state", stats.no_thread_state,
+                           "no_buffer", stats.no_buffer,
+                           "empty_stack", stats.empty_stack,
+                           "samples", stats.samples,
+                           "unwind_failures", stats.unwind_failures,
+                           "handler_latency_ns_log2", latency);
+    return result;
+}
+
 static PyObject * vmp_get_profile_path(PyObject *module, PyObject *noargs) {
     PyObject * o;
     if (vmprof_is_enabled()) {
@@ -459,11 +1417,79 @@ remove_real_time_thread(PyObject *module, PyObject * args) {
 }
 #endif
 
+#ifdef VMPROF_LINUX
+static PyObject *
+vmp_insert_thread_timer(PyObject *module, PyObject * args) {
+    ssize_t thread_count;
+    unsigned long thread_id = 0;
+    long native_id = 0;
+    pthread_t th;
+
+    if (!PyArg_ParseTuple(args, "|kl", &thread_id, &native_id)) {
+        return NULL;
+    }
+
+    if (!vmprof_is_enabled()) {
+        PyErr_SetString(PyExc_ValueError, "vmprof is not enabled");
+        return NULL;
+    }
+
+    if (!vmprof_get_thread_timers()) {
+        PyErr_SetString(PyExc_ValueError, "vmprof does not use per-thread timers");
+        return NULL;
+    }
+
+    if (!thread_id) {
+        return PyLong_FromSsize_t(insert_thread_timer_self());
+    }
+    if (!native_id) {
+        PyErr_SetString(PyExc_ValueError, "native_id is required to arm another thread");
+        return NULL;
+    }
+#if SIZEOF_LONG <= SIZEOF_PTHREAD_T
+    th = (pthread_t) thread_id;
+#else
+    th = (pthread_t) *(unsigned long *) &thread_id;
+#endif
+    thread_count = insert_thread_timer(th, (pid_t)native_id);
+    return PyLong_FromSsize_t(thread_count);
+}
+
+static PyObject *
+vmp_remove_thread_timer(PyObject *module, PyObject * args) {
+    unsigned long thread_id = 0;
+    pthread_t th = pthread_self();
+
+    if (!PyArg_ParseTuple(args, "|k", &thread_id)) {
+        return NULL;
+    }
+
+    if (thread_id) {
+#if SIZEOF_LONG <= SIZEOF_PTHREAD_T
+        th = (pthread_t) thread_id;
+#else
+        th = (pthread_t) *(unsigned long *) &thread_id;
+#endif
+    }
+
+    if (!vmprof_get_thread_timers()) {
+        PyErr_SetString(PyExc_ValueError, "vmprof does not use per-thread timers");
+        return NULL;
+    }
+
+    return PyLong_FromSsize_t(remove_thread_timer(th));
+}
+#endif
+
 static PyMethodDef VMProfMethods[] = {
-    {"enable",  enable_vmprof, METH_VARARGS, "Enable profiling."},
+    {"enable",  (PyCFunction)enable_vmprof, METH_VARARGS | METH_KEYWORDS, "Enable profiling."},
     {"disable", disable_vmprof, METH_NOARGS, "Disable profiling."},
     {"write_all_code_objects", write_all_code_objects, METH_O,
         "Write eagerly all the IDs of code objects"},
+#ifdef VMPROF_UNIX
+    {"write_seen_code_objects", write_seen_code_objects, METH_NOARGS,
+        "Write the code objects that were sampled but not written yet"},
+#endif
     {"sample_stack_now", sample_stack_now, METH_VARARGS,
         "Sample the stack now"},
     {"is_enabled", vmp_is_enabled, METH_NOARGS,
@@ -475,14 +1501,52 @@ static PyMethodDef VMProfMethods[] = {
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
     {"resolve_addr", resolve_addr, METH_VARARGS,
         "Returns the name of the given address"},
+    {"resolve_addrs", resolve_addrs, METH_VARARGS,
+        "Returns the names of the given addresses (a list like resolve_addr "
+        "returns), resolved by several threads"},
+    {"symbol_memory_limit", symbol_memory_limit, METH_VARARGS,
+        "Bounds the memory of the decoded debug information to about the "
+        "given number of bytes (0: no limit), returns the previous limit"},
+    {"set_debug_dir", set_debug_dir, METH_VARARGS,
+        "Sets the directory of the separate debug info of stripped modules, "
+        "before the first address is resolved"},
+    {"symbol_memory_stats", symbol_memory_stats, METH_NOARGS,
+        "Private API: (bytes in use, units decoded, units dropped) of the "
+        "decoded debug information, None if nothing is decoded"},
+    {"native_function_start", native_function_start, METH_VARARGS,
+        "Private API: start of the native function containing the given "
+        "address, None if it is not known"},
+    {"unwind_from_ucontext", unwind_from_ucontext, METH_O,
+        "Private API for benchmarks: start native stack walks at the "
+        "interrupted instruction (True, default) or search the signal frame"},
+    {"builtin_unwind", builtin_unwind, METH_O,
+        "Private API for benchmarks: walk the native stack with the built-in "
+        "unwinder (True, default, if available) or with libunwind"},
 #endif
 #ifdef VMPROF_UNIX
     {"get_profile_path", vmp_get_profile_path, METH_NOARGS,
         "Profile path the profiler logs to."},
+    {"get_buffer_writer_stats", vmp_get_buffer_writer_stats, METH_NOARGS,
+        "Counters of the sample buffers and the buffer writer."},
+    {"get_stats", vmp_get_stats, METH_NOARGS,
+        "Counters of what happened to every profiling signal."},
+    {"seen_addresses", seen_addresses, METH_NOARGS,
+        "The native addresses and code ids of the samples, None if there "
+        "were too many to keep track of."},
+#ifdef VMP_TRACK_MODULES
+    {"loaded_modules", loaded_modules, METH_NOARGS,
+        "The modules that are loaded while profiling, like stats.modules."},
+#endif
     {"insert_real_time_thread", insert_real_time_thread, METH_VARARGS,
         "Insert a thread into the real time profiling list."},
     {"remove_real_time_thread", remove_real_time_thread, METH_VARARGS,
         "Remove a thread from the real time profiling list."},
+#endif
+#ifdef VMPROF_LINUX
+    {"insert_thread_timer", vmp_insert_thread_timer, METH_VARARGS,
+        "Arm a per-thread cpu time timer for the given thread."},
+    {"remove_thread_timer", vmp_remove_thread_timer, METH_VARARGS,
+        "Disarm the per-thread cpu time timer of the given thread."},
 #endif
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
@@ -37,17 +37,25 @@
    as the identifier.  The mapping from identifiers to string
    representations of the code object is done elsewhere, namely:
 
+   * Shortly after the first sample of the code object, by the thread
+     of vmprof_dedup.c.
+
    * If the code object dies while vmprof is enabled,
      PyCode_Type.tp_dealloc will emit it.  (We don't handle nicely
      for now the case where several code objects are created and die
      at the same memory address.)
 
-   * When _vmprof.disable() is called, then we look around the
-     process for code objects and emit all the ones that we can
-     find (which we hope is very close to 100% of them).
+   With enable(stable_ids=True) most samples carry a stable id instead,
+   see vmp_stable_code_ids.
 */
 #define CODE_ADDR_TO_UID(co)  (((intptr_t)(co)))
 
+/* Stable ids end in binary 10: code objects are aligned (00) and native
+   addresses are odd */
+#define VMP_CODE_ID_BITS 48
+#define VMP_CODE_ID_MASK ((((uintptr_t)1) << VMP_CODE_ID_BITS) - 1)
+#define VMP_CODE_ID_TAG 2
+
 #define CPYTHON_HAS_FRAME_EVALUATION PY_VERSION_HEX >= 0x30600B0
 
 int vmp_write_all(const char *buf, size_t bufsize);
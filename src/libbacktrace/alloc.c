@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.  */
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include "backtrace.h"
@@ -44,6 +45,41 @@ POSSIBILITY OF SUCH DAMAGE.  */
    backtrace functions may not be safely invoked from a signal
    handler.  */
 
+/* The arena of this thread, see backtrace_arena_enter.  Every
+   allocation is a chunk of its own.  */
+
+static __thread struct backtrace_arena *current_arena;
+
+void
+backtrace_arena_enter (struct backtrace_arena *arena)
+{
+  current_arena = arena;
+}
+
+void
+backtrace_arena_leave (void)
+{
+  current_arena = NULL;
+}
+
+void
+backtrace_arena_release (struct backtrace_arena *arena)
+{
+  void *chunk;
+
+  chunk = arena->chunks;
+  while (chunk != NULL)
+    {
+      void *next;
+
+      next = *(void **) chunk;
+      free (chunk);
+      chunk = next;
+    }
+  arena->chunks = NULL;
+  arena->size = 0;
+}
+
 /* Allocate memory like malloc.  If ERROR_CALLBACK is NULL, don't
    report an error.  */
 
@@ -54,6 +90,23 @@ backtrace_alloc (struct backtrace_state *state ATTRIBUTE_UNUSED,
 {
   void *ret;
 
+  if (current_arena != NULL)
+    {
+      void **chunk;
+
+      chunk = malloc (size + 16);
+      if (chunk == NULL)
+	{
+	  if (error_callback)
+	    error_callback (data, "malloc", errno);
+	  return NULL;
+	}
+      chunk[0] = current_arena->chunks;
+      current_arena->chunks = chunk;
+      current_arena->size += size;
+      return (char *) chunk + 16;
+    }
+
   ret = malloc (size);
   if (ret == NULL)
     {
@@ -71,13 +124,15 @@ backtrace_free (struct backtrace_state *state ATTRIBUTE_UNUSED,
 		backtrace_error_callback error_callback ATTRIBUTE_UNUSED,
 		void *data ATTRIBUTE_UNUSED)
 {
-  free (p);
+  /* The arena is released as a whole.  */
+  if (current_arena == NULL)
+    free (p);
 }
 
 /* Grow VEC by SIZE bytes.  */
 
 void *
-backtrace_vector_grow (struct backtrace_state *state ATTRIBUTE_UNUSED,
+backtrace_vector_grow (struct backtrace_state *state,
 		       size_t size, backtrace_error_callback error_callback,
 		       void *data, struct backtrace_vector *vec)
 {
@@ -98,11 +153,23 @@ backtrace_vector_grow (struct backtrace_state *state ATTRIBUTE_UNUSED,
       if (alc < vec->size + size)
 	alc = vec->size + size;
 
-      base = realloc (vec->base, alc);
-      if (base == NULL)
+      if (current_arena != NULL)
 	{
-	  error_callback (data, "realloc", errno);
-	  return NULL;
+	  /* Arena blocks can not be reallocated.  */
+	  base = backtrace_alloc (state, alc, error_callback, data);
+	  if (base == NULL)
+	    return NULL;
+	  if (vec->size > 0)
+	    memcpy (base, vec->base, vec->size);
+	}
+      else
+	{
+	  base = realloc (vec->base, alc);
+	  if (base == NULL)
+	    {
+	      error_callback (data, "realloc", errno);
+	      return NULL;
+	    }
 	}
 
       vec->base = base;
@@ -145,6 +212,11 @@ backtrace_vector_release (struct backtrace_state *state ATTRIBUTE_UNUSED,
 			  backtrace_error_callback error_callback,
 			  void *data)
 {
+  if (current_arena != NULL)
+    {
+      vec->alc = 0;
+      return 1;
+    }
   vec->base = realloc (vec->base, vec->size);
   if (vec->base == NULL)
     {
@@ -192,6 +192,30 @@ extern int backtrace_syminfo (struct backtrace_state *state, uintptr_t addr,
 			      backtrace_error_callback error_callback,
 			      void *data);
 
+/* The line tables and function names of a compilation unit are
+   decoded on the first lookup of one of its PCs.  Bound the memory of
+   what was decoded, for all states, to about LIMIT bytes: beyond it,
+   the least recently used units are dropped, and decoded again when
+   they are needed.  0 means no limit.  Returns the previous limit.  */
+
+extern size_t backtrace_dwarf_memory_limit (size_t limit);
+
+/* Report the memory in use by decoded units, how many units were
+   decoded and how many were dropped since the start.  */
+
+extern void backtrace_dwarf_memory_stats (size_t *size,
+					  size_t *decoded_count,
+					  size_t *evicted_count);
+
+/* Stripped ELF files name a separate file with their debug info, by
+   build-id or with a .gnu_debuglink section.  Set the directory where
+   these files are looked for (DIR/.build-id/xx/yyyy.debug, and DIR
+   followed by the directory of the stripped file), /usr/lib/debug by
+   default.  This only affects states whose debug info was not read
+   yet.  */
+
+extern void backtrace_set_debug_dir (const char *dir);
+
 #ifdef __cplusplus
 } /* End extern "C".  */
 #endif
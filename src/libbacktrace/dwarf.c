@@ -293,25 +293,48 @@ struct unit
   const char *comp_dir;
   /* Absolute file name, only set if needed.  */
   const char *abs_filename;
-  /* The abbreviations for this unit.  */
-  struct abbrevs abbrevs;
+  /* Offset of the abbreviations for this unit, they are read again
+     whenever the unit is decoded.  */
+  uint64_t abbrev_offset;
 
   /* The fields above this point are read in during initialization and
-     may be accessed freely.  The fields below this point are read in
-     as needed, and therefore require care, as different threads may
-     try to initialize them simultaneously.  */
+     may be accessed freely.  The field below this point is read in
+     as needed, and therefore requires care, as different threads may
+     try to initialize it simultaneously, and it is reset when the
+     unit is evicted.  */
+
+  /* The decoded lines and functions.  This is NULL if they have not
+     been read (or were evicted).  This is UNIT_LINES_NONE if there
+     was an error reading them.  */
+  struct unit_lines *decoded;
+};
 
-  /* PC to line number mapping.  This is NULL if the values have not
-     been read.  This is (struct line *) -1 if there was an error
-     reading the values.  */
+/* The line table and the functions of a compilation unit, decoded on
+   the first lookup of one of its PCs.  All of it, this struct
+   included, is allocated from ARENA, and dropped at once when the unit
+   is evicted (see lines_cache).  */
+
+struct unit_lines
+{
+  /* PC to line number mapping.  */
   struct line *lines;
   /* Number of entries in lines.  */
   size_t lines_count;
   /* PC ranges to function.  */
   struct function_addrs *function_addrs;
   size_t function_addrs_count;
+  /* The memory of all of the above.  */
+  struct backtrace_arena arena;
+  /* The unit that points here.  */
+  struct unit *u;
+  /* Value of the lines_cache clock at the last lookup.  */
+  uint64_t last_use;
+  /* Next on the list of decoded or retired units.  */
+  struct unit_lines *next;
 };
 
+#define UNIT_LINES_NONE ((struct unit_lines *) (uintptr_t) -1)
+
 /* An address range for a compilation unit.  This maps a PC value to a
    specific compilation unit.  Note that we invert the representation
    in DWARF: instead of listing the units and attaching a list of
@@ -361,13 +384,37 @@ struct dwarf_data
   /* The unparsed .debug_str section.  */
   const unsigned char *dwarf_str;
   size_t dwarf_str_size;
+  /* The unparsed .debug_abbrev section.  */
+  const unsigned char *dwarf_abbrev;
+  size_t dwarf_abbrev_size;
   /* Whether the data is big-endian or not.  */
   int is_bigendian;
-  /* A vector used for function addresses.  We keep this here so that
-     we can grow the vector as we read more functions.  */
-  struct function_vector fvec;
 };
 
+/* The decoded units of all modules.  Their memory is bounded by LIMIT
+   bytes (0 for no limit): when a unit is decoded beyond it, the least
+   recently used ones are evicted.  Other threads might be reading an
+   evicted unit at that point, so it is only retired, and freed by the
+   next lookup that runs while no other one does.  ACTIVE counts the
+   lookups in progress.  */
+
+#ifndef BACKTRACE_DWARF_MEMORY_LIMIT
+#define BACKTRACE_DWARF_MEMORY_LIMIT (64 * 1024 * 1024)
+#endif
+
+static struct
+{
+  int lock;
+  int active;
+  size_t limit;
+  size_t size;
+  uint64_t clock;
+  size_t decoded_count;
+  size_t evicted_count;
+  struct unit_lines *decoded;
+  struct unit_lines *retired;
+} lines_cache = { 0, 0, BACKTRACE_DWARF_MEMORY_LIMIT, 0, 0, 0, 0, NULL, NULL };
+
 /* Report an error for a DWARF buffer.  */
 
 static void
@@ -885,21 +932,6 @@ add_unit_addr (struct backtrace_state *state, uintptr_t base_address,
   return 1;
 }
 
-/* Free a unit address vector.  */
-
-static void
-free_unit_addrs_vector (struct backtrace_state *state,
-			struct unit_addrs_vector *vec,
-			backtrace_error_callback error_callback, void *data)
-{
-  struct unit_addrs *addrs;
-  size_t i;
-
-  addrs = (struct unit_addrs *) vec->vec.base;
-  for (i = 0; i < vec->count; ++i)
-    free_abbrevs (state, &addrs[i].u->abbrevs, error_callback, data);
-}
-
 /* Compare unit_addrs for qsort.  When ranges are nested, make the
    smallest one sort last.  */
 
@@ -1251,7 +1283,7 @@ find_address_ranges (struct backtrace_state *state, uintptr_t base_address,
 		     const unsigned char *dwarf_ranges,
 		     size_t dwarf_ranges_size,
 		     int is_bigendian, backtrace_error_callback error_callback,
-		     void *data, struct unit *u,
+		     void *data, struct unit *u, struct abbrevs *abbrevs,
 		     struct unit_addrs_vector *addrs)
 {
   while (unit_buf->left > 0)
@@ -1271,7 +1303,7 @@ find_address_ranges (struct backtrace_state *state, uintptr_t base_address,
       if (code == 0)
 	return 1;
 
-      abbrev = lookup_abbrev (&u->abbrevs, code, error_callback, data);
+      abbrev = lookup_abbrev (abbrevs, code, error_callback, data);
       if (abbrev == NULL)
 	return 0;
 
@@ -1387,7 +1419,7 @@ find_address_ranges (struct backtrace_state *state, uintptr_t base_address,
 				    dwarf_str, dwarf_str_size,
 				    dwarf_ranges, dwarf_ranges_size,
 				    is_bigendian, error_callback, data,
-				    u, addrs))
+				    u, abbrevs, addrs))
 	    return 0;
 	}
     }
@@ -1486,32 +1518,24 @@ build_address_map (struct backtrace_state *state, uintptr_t base_address,
       u->comp_dir = NULL;
       u->abs_filename = NULL;
       u->lineoff = 0;
-      u->abbrevs = abbrevs;
-      memset (&abbrevs, 0, sizeof abbrevs);
+      u->abbrev_offset = abbrev_offset;
 
       /* The actual line number mappings will be read as needed.  */
-      u->lines = NULL;
-      u->lines_count = 0;
-      u->function_addrs = NULL;
-      u->function_addrs_count = 0;
+      u->decoded = NULL;
 
+      /* Only the unit DIE is read here, the abbrevs are not kept: with
+	 many units they would take more memory than the address map.  */
       if (!find_address_ranges (state, base_address, &unit_buf,
 				dwarf_str, dwarf_str_size,
 				dwarf_ranges, dwarf_ranges_size,
 				is_bigendian, error_callback, data,
-				u, addrs))
+				u, &abbrevs, addrs)
+	  || unit_buf.reported_underflow)
 	{
-	  free_abbrevs (state, &u->abbrevs, error_callback, data);
-	  backtrace_free (state, u, sizeof *u, error_callback, data);
-	  goto fail;
-	}
-
-      if (unit_buf.reported_underflow)
-	{
-	  free_abbrevs (state, &u->abbrevs, error_callback, data);
 	  backtrace_free (state, u, sizeof *u, error_callback, data);
 	  goto fail;
 	}
+      free_abbrevs (state, &abbrevs, error_callback, data);
     }
   if (info.reported_underflow)
     goto fail;
@@ -1520,7 +1544,6 @@ build_address_map (struct backtrace_state *state, uintptr_t base_address,
 
  fail:
   free_abbrevs (state, &abbrevs, error_callback, data);
-  free_unit_addrs_vector (state, addrs, error_callback, data);
   return 0;
 }
 
@@ -2046,8 +2069,8 @@ read_line_info (struct backtrace_state *state, struct dwarf_data *ddata,
 
 static const char *
 read_referenced_name (struct dwarf_data *ddata, struct unit *u,
-		      uint64_t offset, backtrace_error_callback error_callback,
-		      void *data)
+		      struct abbrevs *abbrevs, uint64_t offset,
+		      backtrace_error_callback error_callback, void *data)
 {
   struct dwarf_buf unit_buf;
   uint64_t code;
@@ -2086,7 +2109,7 @@ read_referenced_name (struct dwarf_data *ddata, struct unit *u,
       return NULL;
     }
 
-  abbrev = lookup_abbrev (&u->abbrevs, code, error_callback, data);
+  abbrev = lookup_abbrev (abbrevs, code, error_callback, data);
   if (abbrev == NULL)
     return NULL;
 
@@ -2129,7 +2152,7 @@ read_referenced_name (struct dwarf_data *ddata, struct unit *u,
 	    {
 	      const char *name;
 
-	      name = read_referenced_name (ddata, u, val.u.uint,
+	      name = read_referenced_name (ddata, u, abbrevs, val.u.uint,
 					   error_callback, data);
 	      if (name != NULL)
 		ret = name;
@@ -2247,7 +2270,8 @@ add_function_ranges (struct backtrace_state *state, struct dwarf_data *ddata,
 
 static int
 read_function_entry (struct backtrace_state *state, struct dwarf_data *ddata,
-		     struct unit *u, uint64_t base, struct dwarf_buf *unit_buf,
+		     struct unit *u, struct abbrevs *abbrevs, uint64_t base,
+		     struct dwarf_buf *unit_buf,
 		     const struct line_header *lhdr,
 		     backtrace_error_callback error_callback, void *data,
 		     struct function_vector *vec_function,
@@ -2273,7 +2297,7 @@ read_function_entry (struct backtrace_state *state, struct dwarf_data *ddata,
       if (code == 0)
 	return 1;
 
-      abbrev = lookup_abbrev (&u->abbrevs, code, error_callback, data);
+      abbrev = lookup_abbrev (abbrevs, code, error_callback, data);
       if (abbrev == NULL)
 	return 0;
 
@@ -2365,8 +2389,9 @@ read_function_entry (struct backtrace_state *state, struct dwarf_data *ddata,
 		    {
 		      const char *name;
 
-		      name = read_referenced_name (ddata, u, val.u.uint,
-						   error_callback, data);
+		      name = read_referenced_name (ddata, u, abbrevs,
+						   val.u.uint, error_callback,
+						   data);
 		      if (name != NULL)
 			function->name = name;
 		    }
@@ -2464,9 +2489,9 @@ read_function_entry (struct backtrace_state *state, struct dwarf_data *ddata,
 	{
 	  if (!is_function)
 	    {
-	      if (!read_function_entry (state, ddata, u, base, unit_buf, lhdr,
-					error_callback, data, vec_function,
-					vec_inlined))
+	      if (!read_function_entry (state, ddata, u, abbrevs, base,
+					unit_buf, lhdr, error_callback, data,
+					vec_function, vec_inlined))
 		return 0;
 	    }
 	  else
@@ -2478,9 +2503,9 @@ read_function_entry (struct backtrace_state *state, struct dwarf_data *ddata,
 
 	      memset (&fvec, 0, sizeof fvec);
 
-	      if (!read_function_entry (state, ddata, u, base, unit_buf, lhdr,
-					error_callback, data, vec_function,
-					&fvec))
+	      if (!read_function_entry (state, ddata, u, abbrevs, base,
+					unit_buf, lhdr, error_callback, data,
+					vec_function, &fvec))
 		return 0;
 
 	      if (fvec.count > 0)
@@ -2513,7 +2538,8 @@ static void
 read_function_info (struct backtrace_state *state, struct dwarf_data *ddata,
 		    const struct line_header *lhdr,
 		    backtrace_error_callback error_callback, void *data,
-		    struct unit *u, struct function_vector *fvec,
+		    struct unit *u, struct abbrevs *abbrevs,
+		    struct function_vector *fvec,
 		    struct function_addrs **ret_addrs,
 		    size_t *ret_addrs_count)
 {
@@ -2543,7 +2569,7 @@ read_function_info (struct backtrace_state *state, struct dwarf_data *ddata,
 
   while (unit_buf.left > 0)
     {
-      if (!read_function_entry (state, ddata, u, 0, &unit_buf, lhdr,
+      if (!read_function_entry (state, ddata, u, abbrevs, 0, &unit_buf, lhdr,
 				error_callback, data, pfvec, pfvec))
 	return;
     }
@@ -2631,6 +2657,194 @@ report_inlined_functions (uintptr_t pc, struct function *function,
   return 0;
 }
 
+/* Lock the lines cache.  The critical sections are short, spinning
+   is fine.  */
+
+static void
+lines_cache_lock (void)
+{
+  while (__sync_lock_test_and_set (&lines_cache.lock, 1))
+    ;
+}
+
+static void
+lines_cache_unlock (void)
+{
+  __sync_lock_release (&lines_cache.lock);
+}
+
+/* Free the retired units of the list at P.  */
+
+static void
+free_unit_lines (struct unit_lines *p)
+{
+  while (p != NULL)
+    {
+      struct unit_lines *next;
+      struct backtrace_arena arena;
+
+      /* P lives in its own arena.  */
+      next = p->next;
+      arena = p->arena;
+      backtrace_arena_release (&arena);
+      p = next;
+    }
+}
+
+/* Count a lookup in progress: the units it reads are not freed until
+   it is over.  */
+
+static void
+lines_cache_enter (void)
+{
+  __atomic_add_fetch (&lines_cache.active, 1, __ATOMIC_SEQ_CST);
+}
+
+/* End a lookup, and free the retired units if it was the only one in
+   progress.  A unit is retired after its pointer was cleared, a lookup
+   that still reads it was counted before.  */
+
+static void
+lines_cache_leave (void)
+{
+  struct unit_lines *retired;
+
+  retired = NULL;
+  if (__atomic_load_n (&lines_cache.retired, __ATOMIC_SEQ_CST) != NULL)
+    {
+      lines_cache_lock ();
+      if (__atomic_load_n (&lines_cache.active, __ATOMIC_SEQ_CST) == 1)
+	{
+	  retired = lines_cache.retired;
+	  lines_cache.retired = NULL;
+	}
+      lines_cache_unlock ();
+    }
+  __atomic_sub_fetch (&lines_cache.active, 1, __ATOMIC_SEQ_CST);
+  free_unit_lines (retired);
+}
+
+/* Mark D as the most recently used unit.  */
+
+static void
+lines_cache_touch (struct unit_lines *d)
+{
+  __atomic_store_n (&d->last_use,
+		    __atomic_add_fetch (&lines_cache.clock, 1,
+					__ATOMIC_RELAXED),
+		    __ATOMIC_RELAXED);
+}
+
+/* Account for the newly decoded unit D, and evict the least recently
+   used units (not D) while the cache is beyond its limit.  */
+
+static void
+lines_cache_add (struct unit_lines *d)
+{
+  lines_cache_lock ();
+  d->next = lines_cache.decoded;
+  lines_cache.decoded = d;
+  lines_cache.size += d->arena.size;
+  ++lines_cache.decoded_count;
+
+  while (lines_cache.limit != 0 && lines_cache.size > lines_cache.limit)
+    {
+      struct unit_lines **pp;
+      struct unit_lines **oldest;
+      struct unit_lines *evicted;
+
+      oldest = NULL;
+      for (pp = &lines_cache.decoded; *pp != NULL; pp = &(*pp)->next)
+	if (*pp != d
+	    && (oldest == NULL || (*pp)->last_use < (*oldest)->last_use))
+	  oldest = pp;
+      if (oldest == NULL)
+	break;
+
+      evicted = *oldest;
+      *oldest = evicted->next;
+      __atomic_store_n (&evicted->u->decoded, NULL, __ATOMIC_SEQ_CST);
+      lines_cache.size -= evicted->arena.size;
+      ++lines_cache.evicted_count;
+      evicted->next = lines_cache.retired;
+      __atomic_store_n (&lines_cache.retired, evicted, __ATOMIC_SEQ_CST);
+    }
+  lines_cache_unlock ();
+}
+
+/* Bound the memory of the decoded units, see backtrace.h.  */
+
+size_t
+backtrace_dwarf_memory_limit (size_t limit)
+{
+  size_t previous;
+
+  lines_cache_lock ();
+  previous = lines_cache.limit;
+  lines_cache.limit = limit;
+  lines_cache_unlock ();
+  return previous;
+}
+
+/* Report the memory of the decoded units, see backtrace.h.  */
+
+void
+backtrace_dwarf_memory_stats (size_t *size, size_t *decoded_count,
+			      size_t *evicted_count)
+{
+  lines_cache_lock ();
+  *size = lines_cache.size;
+  *decoded_count = lines_cache.decoded_count;
+  *evicted_count = lines_cache.evicted_count;
+  lines_cache_unlock ();
+}
+
+/* Read the lines and the functions of U into an arena of their own.
+   Returns UNIT_LINES_NONE if there are none, or on error.  */
+
+static struct unit_lines *
+read_unit_lines (struct backtrace_state *state, struct dwarf_data *ddata,
+		 struct unit *u, backtrace_error_callback error_callback,
+		 void *data)
+{
+  struct backtrace_arena arena;
+  struct unit_lines *d;
+  struct abbrevs abbrevs;
+  struct line_header lhdr;
+
+  memset (&arena, 0, sizeof arena);
+  backtrace_arena_enter (&arena);
+
+  d = ((struct unit_lines *)
+       backtrace_alloc (state, sizeof *d, error_callback, data));
+  if (d == NULL
+      || !read_line_info (state, ddata, error_callback, data, u, &lhdr,
+			  &d->lines, &d->lines_count))
+    {
+      backtrace_arena_leave ();
+      backtrace_arena_release (&arena);
+      return UNIT_LINES_NONE;
+    }
+
+  d->function_addrs = NULL;
+  d->function_addrs_count = 0;
+  if (read_abbrevs (state, u->abbrev_offset, ddata->dwarf_abbrev,
+		    ddata->dwarf_abbrev_size, ddata->is_bigendian,
+		    error_callback, data, &abbrevs))
+    read_function_info (state, ddata, &lhdr, error_callback, data, u,
+			&abbrevs, NULL, &d->function_addrs,
+			&d->function_addrs_count);
+  free_line_header (state, &lhdr, error_callback, data);
+  backtrace_arena_leave ();
+
+  /* The abbrevs go with the arena.  */
+  d->arena = arena;
+  d->u = u;
+  d->next = NULL;
+  lines_cache_touch (d);
+  return d;
+}
+
 /* Look for a PC in the DWARF mapping for one module.  On success,
    call CALLBACK and return whatever it returns.  On error, call
    ERROR_CALLBACK and return 0.  Sets *FOUND to 1 if the PC is found,
@@ -2645,7 +2859,7 @@ dwarf_lookup_pc (struct backtrace_state *state, struct dwarf_data *ddata,
   struct unit_addrs *entry;
   struct unit *u;
   int new_data;
-  struct line *lines;
+  struct unit_lines *decoded;
   struct line *ln;
   struct function_addrs *function_addrs;
   struct function *function;
@@ -2674,94 +2888,60 @@ dwarf_lookup_pc (struct backtrace_state *state, struct dwarf_data *ddata,
 	 && pc < (entry + 1)->high)
     ++entry;
 
-  /* We need the lines, lines_count, function_addrs,
-     function_addrs_count fields of u.  If they are not set, we need
-     to set them.  When running in threaded mode, we need to allow for
-     the possibility that some other thread is setting them
-     simultaneously.  */
+  /* We need the decoded field of u.  If it is not set, we need to set
+     it.  Some other thread might be setting it simultaneously, or
+     evicting it (see lines_cache).  */
 
   u = entry->u;
-  lines = u->lines;
+  decoded = __atomic_load_n (&u->decoded, __ATOMIC_SEQ_CST);
 
   /* Skip units with no useful line number information by walking
      backward.  Useless line number information is marked by setting
-     lines == -1.  */
+     decoded == UNIT_LINES_NONE.  */
   while (entry > ddata->addrs
 	 && pc >= (entry - 1)->low
 	 && pc < (entry - 1)->high)
     {
-      if (state->threaded)
-	lines = (struct line *) backtrace_atomic_load_pointer (&u->lines);
-
-      if (lines != (struct line *) (uintptr_t) -1)
+      if (decoded != UNIT_LINES_NONE)
 	break;
 
       --entry;
 
       u = entry->u;
-      lines = u->lines;
+      decoded = __atomic_load_n (&u->decoded, __ATOMIC_SEQ_CST);
     }
 
-  if (state->threaded)
-    lines = backtrace_atomic_load_pointer (&u->lines);
-
   new_data = 0;
-  if (lines == NULL)
+  if (decoded == NULL)
     {
-      size_t function_addrs_count;
-      struct line_header lhdr;
-      size_t count;
+      struct unit_lines *expected;
 
-      /* We have never read the line information for this unit.  Read
-	 it now.  */
+      /* We have never read the line information for this unit, or it
+	 was evicted.  Read it now.  */
 
-      function_addrs = NULL;
-      function_addrs_count = 0;
-      if (read_line_info (state, ddata, error_callback, data, entry->u, &lhdr,
-			  &lines, &count))
-	{
-	  struct function_vector *pfvec;
-
-	  /* If not threaded, reuse DDATA->FVEC for better memory
-	     consumption.  */
-	  if (state->threaded)
-	    pfvec = NULL;
-	  else
-	    pfvec = &ddata->fvec;
-	  read_function_info (state, ddata, &lhdr, error_callback, data,
-			      entry->u, pfvec, &function_addrs,
-			      &function_addrs_count);
-	  free_line_header (state, &lhdr, error_callback, data);
-	  new_data = 1;
-	}
+      decoded = read_unit_lines (state, ddata, u, error_callback, data);
+      new_data = 1;
 
-      /* Atomically store the information we just read into the unit.
-	 If another thread is simultaneously writing, it presumably
-	 read the same information, and we don't care which one we
-	 wind up with; we just leak the other one.  We do have to
-	 write the lines field last, so that the acquire-loads above
-	 ensure that the other fields are set.  */
+      /* If another thread is simultaneously reading, we use what it
+	 read and drop ours.  */
 
-      if (!state->threaded)
-	{
-	  u->lines_count = count;
-	  u->function_addrs = function_addrs;
-	  u->function_addrs_count = function_addrs_count;
-	  u->lines = lines;
-	}
-      else
+      expected = NULL;
+      if (!__atomic_compare_exchange_n (&u->decoded, &expected, decoded, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
 	{
-	  backtrace_atomic_store_size_t (&u->lines_count, count);
-	  backtrace_atomic_store_pointer (&u->function_addrs, function_addrs);
-	  backtrace_atomic_store_size_t (&u->function_addrs_count,
-					 function_addrs_count);
-	  backtrace_atomic_store_pointer (&u->lines, lines);
+	  if (decoded != UNIT_LINES_NONE)
+	    free_unit_lines (decoded);
+	  decoded = expected;
 	}
+      else if (decoded != UNIT_LINES_NONE)
+	lines_cache_add (decoded);
     }
+  else if (decoded != UNIT_LINES_NONE)
+    lines_cache_touch (decoded);
 
-  /* Now all fields of U have been initialized.  */
+  /* Now DECODED can be read until the end of the lookup.  */
 
-  if (lines == (struct line *) (uintptr_t) -1)
+  if (decoded == UNIT_LINES_NONE)
     {
       /* If reading the line number information failed in some way,
 	 try again to see if there is a better compilation unit for
@@ -2774,7 +2954,7 @@ dwarf_lookup_pc (struct backtrace_state *state, struct dwarf_data *ddata,
 
   /* Search for PC within this unit.  */
 
-  ln = (struct line *) bsearch (&pc, lines, entry->u->lines_count,
+  ln = (struct line *) bsearch (&pc, decoded->lines, decoded->lines_count,
 				sizeof (struct line), line_search);
   if (ln == NULL)
     {
@@ -2821,12 +3001,12 @@ dwarf_lookup_pc (struct backtrace_state *state, struct dwarf_data *ddata,
 
   /* Search for function name within this unit.  */
 
-  if (entry->u->function_addrs_count == 0)
+  if (decoded->function_addrs_count == 0)
     return callback (data, pc, ln->filename, ln->lineno, NULL);
 
   function_addrs = ((struct function_addrs *)
-		    bsearch (&pc, entry->u->function_addrs,
-			     entry->u->function_addrs_count,
+		    bsearch (&pc, decoded->function_addrs,
+			     decoded->function_addrs_count,
 			     sizeof (struct function_addrs),
 			     function_addrs_search));
   if (function_addrs == NULL)
@@ -2835,8 +3015,8 @@ dwarf_lookup_pc (struct backtrace_state *state, struct dwarf_data *ddata,
   /* If there are multiple function ranges that contain PC, use the
      last one, in order to produce predictable results.  */
 
-  while (((size_t) (function_addrs - entry->u->function_addrs + 1)
-	  < entry->u->function_addrs_count)
+  while (((size_t) (function_addrs - decoded->function_addrs + 1)
+	  < decoded->function_addrs_count)
 	 && pc >= (function_addrs + 1)->low
 	 && pc < (function_addrs + 1)->high)
     ++function_addrs;
@@ -2867,6 +3047,10 @@ dwarf_fileline (struct backtrace_state *state, uintptr_t pc,
   int found;
   int ret;
 
+  /* The callbacks are made within the lookup, the strings they get
+     can live in a decoded unit.  */
+  lines_cache_enter ();
+
   if (!state->threaded)
     {
       for (ddata = (struct dwarf_data *) state->fileline_data;
@@ -2876,7 +3060,10 @@ dwarf_fileline (struct backtrace_state *state, uintptr_t pc,
 	  ret = dwarf_lookup_pc (state, ddata, pc, callback, error_callback,
 				 data, &found);
 	  if (ret != 0 || found)
-	    return ret;
+	    {
+	      lines_cache_leave ();
+	      return ret;
+	    }
 	}
     }
   else
@@ -2893,12 +3080,17 @@ dwarf_fileline (struct backtrace_state *state, uintptr_t pc,
 	  ret = dwarf_lookup_pc (state, ddata, pc, callback, error_callback,
 				 data, &found);
 	  if (ret != 0 || found)
-	    return ret;
+	    {
+	      lines_cache_leave ();
+	      return ret;
+	    }
 
 	  pp = &ddata->next;
 	}
     }
 
+  lines_cache_leave ();
+
   /* FIXME: See if any libraries have been dlopen'ed.  */
 
   return callback (data, pc, NULL, 0, NULL);
@@ -2960,8 +3152,9 @@ build_dwarf_data (struct backtrace_state *state,
   fdata->dwarf_ranges_size = dwarf_ranges_size;
   fdata->dwarf_str = dwarf_str;
   fdata->dwarf_str_size = dwarf_str_size;
+  fdata->dwarf_abbrev = dwarf_abbrev;
+  fdata->dwarf_abbrev_size = dwarf_abbrev_size;
   fdata->is_bigendian = is_bigendian;
-  memset (&fdata->fvec, 0, sizeof fdata->fvec);
 
   return fdata;
 }
@@ -32,14 +32,22 @@ POSSIBILITY OF SUCH DAMAGE.  */
 
 #include "config.h"
 
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #ifdef HAVE_DL_ITERATE_PHDR
 #include <link.h>
 #endif
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include "backtrace.h"
 #include "internal.h"
 
@@ -103,6 +111,10 @@ dl_iterate_phdr (int (*callback) (struct dl_phdr_info *,
 #undef SHT_SYMTAB
 #undef SHT_STRTAB
 #undef SHT_DYNSYM
+#undef SHT_NOTE
+#undef SHF_COMPRESSED
+#undef ELFCOMPRESS_ZLIB
+#undef NT_GNU_BUILD_ID
 #undef STT_OBJECT
 #undef STT_FUNC
 
@@ -193,8 +205,47 @@ typedef struct {
 
 #define SHT_SYMTAB 2
 #define SHT_STRTAB 3
+#define SHT_NOTE 7
 #define SHT_DYNSYM 11
 
+#define SHF_COMPRESSED 0x800
+
+/* The header of a section with SHF_COMPRESSED.  */
+
+#if BACKTRACE_ELF_SIZE == 32
+
+typedef struct
+{
+  b_elf_word	ch_type;		/* Compression algorithm */
+  b_elf_word	ch_size;		/* Uncompressed size */
+  b_elf_word	ch_addralign;		/* Uncompressed alignment */
+} b_elf_chdr;  /* Elf_Chdr.  */
+
+#else /* BACKTRACE_ELF_SIZE != 32 */
+
+typedef struct
+{
+  b_elf_word	ch_type;		/* Compression algorithm */
+  b_elf_word	ch_reserved;
+  b_elf_xword	ch_size;		/* Uncompressed size */
+  b_elf_xword	ch_addralign;		/* Uncompressed alignment */
+} b_elf_chdr;  /* Elf_Chdr.  */
+
+#endif /* BACKTRACE_ELF_SIZE != 32 */
+
+#define ELFCOMPRESS_ZLIB 1
+
+/* The header of a note.  */
+
+typedef struct
+{
+  b_elf_word	n_namesz;		/* Length of the name */
+  b_elf_word	n_descsz;		/* Length of the descriptor */
+  b_elf_word	n_type;			/* Type of note */
+} b_elf_note;  /* Elf_Nhdr.  */
+
+#define NT_GNU_BUILD_ID 3
+
 #if BACKTRACE_ELF_SIZE == 32
 
 typedef struct
@@ -247,6 +298,19 @@ static const char * const debug_section_names[DEBUG_MAX] =
   ".debug_str"
 };
 
+/* How a debug section is compressed.  */
+
+enum debug_compression
+{
+  /* Not at all.  */
+  COMPRESSED_NONE,
+  /* SHF_COMPRESSED, the data starts with a b_elf_chdr.  */
+  COMPRESSED_ELF,
+  /* A .zdebug section of old GNU tools, the data starts with "ZLIB"
+     and the uncompressed size (8 bytes, big-endian).  */
+  COMPRESSED_GNU
+};
+
 /* Information we gather for the sections we care about.  */
 
 struct debug_section_info
@@ -257,8 +321,17 @@ struct debug_section_info
   size_t size;
   /* Section contents, after read from file.  */
   const unsigned char *data;
+  /* Whether the contents must be uncompressed.  */
+  enum debug_compression compressed;
+  /* Whether DATA was allocated by elf_uncompress_section.  */
+  int allocated;
 };
 
+/* The directory of separate debug info files, see
+   backtrace_set_debug_dir.  */
+
+static const char *debug_dir = "/usr/lib/debug";
+
 /* Information we keep for an ELF symbol.  */
 
 struct elf_symbol
@@ -510,16 +583,289 @@ elf_syminfo (struct backtrace_state *state, uintptr_t addr,
     callback (data, addr, sym->name, sym->address, sym->size);
 }
 
+/* Set the directory of separate debug info files, see backtrace.h.  */
+
+void
+backtrace_set_debug_dir (const char *dir)
+{
+  char *copy;
+
+  copy = strdup (dir);
+  if (copy != NULL)
+    debug_dir = copy;
+}
+
+/* Open a separate debug info file.  Returns the descriptor, or -1 if
+   the file does not exist.  */
+
+static int
+elf_try_debugfile (const char *path,
+		   backtrace_error_callback error_callback, void *data)
+{
+  int does_not_exist;
+
+  return backtrace_open (path, error_callback, data, &does_not_exist);
+}
+
+/* Open the separate debug info file named by the build-id notes
+   NOTES, DEBUG_DIR/.build-id/xx/yyyy.debug.  Returns the descriptor,
+   or -1 if there is none.  */
+
+static int
+elf_open_debugfile_by_buildid (const unsigned char *notes, size_t size,
+			       backtrace_error_callback error_callback,
+			       void *data)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *end;
+
+  end = notes + size;
+  while ((size_t) (end - notes) >= sizeof (b_elf_note))
+    {
+      b_elf_note note;
+      const unsigned char *name;
+      const unsigned char *desc;
+      char path[PATH_MAX];
+      size_t len;
+      size_t i;
+
+      memcpy (&note, notes, sizeof note);
+      name = notes + sizeof note;
+      desc = name + ((note.n_namesz + 3) & ~ (size_t) 3);
+      if (desc > end
+	  || (size_t) (end - desc) < ((note.n_descsz + 3) & ~ (size_t) 3))
+	break;
+      notes = desc + ((note.n_descsz + 3) & ~ (size_t) 3);
+
+      if (note.n_type != NT_GNU_BUILD_ID
+	  || note.n_namesz != 4
+	  || memcmp (name, "GNU", 4) != 0
+	  || note.n_descsz < 2)
+	continue;
+
+      len = strlen (debug_dir);
+      if (len + sizeof "/.build-id/" + 2 * note.n_descsz + sizeof ".debug"
+	  > sizeof path)
+	return -1;
+      memcpy (path, debug_dir, len);
+      memcpy (path + len, "/.build-id/", sizeof "/.build-id/" - 1);
+      len += sizeof "/.build-id/" - 1;
+      for (i = 0; i < note.n_descsz; ++i)
+	{
+	  path[len++] = hex[desc[i] >> 4];
+	  path[len++] = hex[desc[i] & 0xf];
+	  if (i == 0)
+	    path[len++] = '/';
+	}
+      memcpy (path + len, ".debug", sizeof ".debug");
+      return elf_try_debugfile (path, error_callback, data);
+    }
+  return -1;
+}
+
+/* Whether the contents of the file DESCRIPTOR have the CRC32 that the
+   debuglink names.  Without zlib, the file is taken as it is.  */
+
+static int
+elf_debugfile_crc_matches (struct backtrace_state *state, int descriptor,
+			   uint32_t crc,
+			   backtrace_error_callback error_callback,
+			   void *data)
+{
+#ifdef HAVE_ZLIB
+  struct stat st;
+  struct backtrace_view view;
+  const unsigned char *p;
+  size_t left;
+  uLong file_crc;
+
+  if (fstat (descriptor, &st) < 0 || st.st_size == 0)
+    return 0;
+  if (!backtrace_get_view (state, descriptor, 0, st.st_size, error_callback,
+			   data, &view))
+    return 0;
+  /* crc32 takes at most 4 GB at a time.  */
+  file_crc = crc32 (0L, Z_NULL, 0);
+  p = (const unsigned char *) view.data;
+  left = st.st_size;
+  while (left > 0)
+    {
+      uInt chunk;
+
+      chunk = left > (1U << 30) ? (1U << 30) : (uInt) left;
+      file_crc = crc32 (file_crc, p, chunk);
+      p += chunk;
+      left -= chunk;
+    }
+  backtrace_release_view (state, &view, error_callback, data);
+  return (uint32_t) file_crc == crc;
+#else
+  return 1;
+#endif
+}
+
+/* Open the separate debug info file named by the .gnu_debuglink
+   section DEBUGLINK of the file FILENAME.  Like gdb, it is looked for
+   next to the file, in the .debug directory there, and below
+   DEBUG_DIR.  Returns the descriptor, or -1 if there is none.  */
+
+static int
+elf_open_debugfile_by_debuglink (struct backtrace_state *state,
+				 const char *filename,
+				 const unsigned char *debuglink, size_t size,
+				 backtrace_error_callback error_callback,
+				 void *data)
+{
+  const char *link;
+  size_t link_len;
+  size_t crc_offset;
+  uint32_t crc;
+  char resolved[PATH_MAX];
+  char path[PATH_MAX];
+  const char *slash;
+  size_t dir_len;
+  int pass;
+
+  if (filename == NULL || filename[0] == '\0')
+    return -1;
+
+  /* The name, padded to 4 bytes, and the CRC32 of the file.  */
+  link = (const char *) debuglink;
+  link_len = strnlen (link, size);
+  crc_offset = (link_len + 4) & ~ (size_t) 3;
+  if (link_len == 0 || crc_offset + 4 > size)
+    return -1;
+  memcpy (&crc, debuglink + crc_offset, sizeof crc);
+
+  /* The link is relative to the file, not to a symbolic link to it.  */
+  if (realpath (filename, resolved) == NULL)
+    return -1;
+  slash = strrchr (resolved, '/');
+  if (slash == NULL)
+    return -1;
+  dir_len = slash - resolved;
+
+  for (pass = 0; pass < 3; ++pass)
+    {
+      int n;
+      int descriptor;
+
+      switch (pass)
+	{
+	case 0:
+	  n = snprintf (path, sizeof path, "%.*s/%s", (int) dir_len,
+			resolved, link);
+	  break;
+	case 1:
+	  n = snprintf (path, sizeof path, "%.*s/.debug/%s", (int) dir_len,
+			resolved, link);
+	  break;
+	default:
+	  n = snprintf (path, sizeof path, "%s%.*s/%s", debug_dir,
+			(int) dir_len, resolved, link);
+	  break;
+	}
+      if (n < 0 || (size_t) n >= sizeof path || strcmp (path, resolved) == 0)
+	continue;
+
+      descriptor = elf_try_debugfile (path, error_callback, data);
+      if (descriptor < 0)
+	continue;
+      if (elf_debugfile_crc_matches (state, descriptor, crc, error_callback,
+				     data))
+	return descriptor;
+      backtrace_close (descriptor, error_callback, data);
+    }
+  return -1;
+}
+
+/* Uncompress the debug section SECTION with zlib.  The uncompressed
+   data is freed by elf_add if the debug info can not be added, else it
+   is kept as long as STATE.  Returns 1 on success, 0 if the section can
+   not be used.  */
+
+static int
+elf_uncompress_section (struct backtrace_state *state,
+			struct debug_section_info *section,
+			backtrace_error_callback error_callback, void *data)
+{
+#ifdef HAVE_ZLIB
+  const unsigned char *compressed;
+  size_t compressed_size;
+  uint64_t size;
+  unsigned char *uncompressed;
+  uLongf uncompressed_size;
+
+  if (section->compressed == COMPRESSED_ELF)
+    {
+      b_elf_chdr chdr;
+
+      if (section->size < sizeof chdr)
+	return 0;
+      memcpy (&chdr, section->data, sizeof chdr);
+      if (chdr.ch_type != ELFCOMPRESS_ZLIB)
+	{
+	  error_callback (data, "unsupported compression of debug section",
+			  0);
+	  return 0;
+	}
+      size = chdr.ch_size;
+      compressed = section->data + sizeof chdr;
+      compressed_size = section->size - sizeof chdr;
+    }
+  else
+    {
+      int i;
+
+      if (section->size < 12 || memcmp (section->data, "ZLIB", 4) != 0)
+	return 0;
+      size = 0;
+      for (i = 4; i < 12; ++i)
+	size = (size << 8) | section->data[i];
+      compressed = section->data + 12;
+      compressed_size = section->size - 12;
+    }
+
+  if (size == 0 || size != (size_t) size)
+    return 0;
+  uncompressed = ((unsigned char *)
+		  backtrace_alloc (state, size, error_callback, data));
+  if (uncompressed == NULL)
+    return 0;
+  uncompressed_size = size;
+  if (uncompress (uncompressed, &uncompressed_size, compressed,
+		  compressed_size) != Z_OK
+      || uncompressed_size != size)
+    {
+      error_callback (data, "invalid compressed debug section", 0);
+      backtrace_free (state, uncompressed, size, error_callback, data);
+      return 0;
+    }
+  section->data = uncompressed;
+  section->size = size;
+  section->compressed = COMPRESSED_NONE;
+  section->allocated = 1;
+  return 1;
+#else
+  error_callback (data, "compressed debug section, built without zlib", 0);
+  return 0;
+#endif
+}
+
 /* Add the backtrace data for one ELF file.  Returns 1 on success,
    0 on failure (in both cases descriptor is closed) or -1 if exe
    is non-zero and the ELF file is ET_DYN, which tells the caller that
    elf_add will need to be called on the descriptor again after
-   base_address is determined.  */
+   base_address is determined.  FILENAME is the name of the file, it
+   can be NULL.  If the file has no debug info, it is read from a
+   separate debug info file, unless DEBUGINFO is non-zero (this is that
+   file).  */
 
 static int
-elf_add (struct backtrace_state *state, int descriptor, uintptr_t base_address,
-	 backtrace_error_callback error_callback, void *data,
-	 fileline *fileline_fn, int *found_sym, int *found_dwarf, int exe)
+elf_add (struct backtrace_state *state, const char *filename, int descriptor,
+	 uintptr_t base_address, backtrace_error_callback error_callback,
+	 void *data, fileline *fileline_fn, int *found_sym, int *found_dwarf,
+	 int exe, int debuginfo)
 {
   struct backtrace_view ehdr_view;
   b_elf_ehdr ehdr;
@@ -547,6 +893,10 @@ elf_add (struct backtrace_state *state, int descriptor, uintptr_t base_address,
   off_t max_offset;
   struct backtrace_view debug_view;
   int debug_view_valid;
+  off_t buildid_offset;
+  size_t buildid_size;
+  off_t debuglink_offset;
+  size_t debuglink_size;
 
   *found_sym = 0;
   *found_dwarf = 0;
@@ -556,6 +906,7 @@ elf_add (struct backtrace_state *state, int descriptor, uintptr_t base_address,
   symtab_view_valid = 0;
   strtab_view_valid = 0;
   debug_view_valid = 0;
+  memset (sections, 0, sizeof sections);
 
   if (!backtrace_get_view (state, descriptor, 0, sizeof ehdr, error_callback,
 			   data, &ehdr_view))
@@ -671,8 +1022,11 @@ elf_add (struct backtrace_state *state, int descriptor, uintptr_t base_address,
 
   symtab_shndx = 0;
   dynsym_shndx = 0;
+  buildid_offset = 0;
+  buildid_size = 0;
+  debuglink_offset = 0;
+  debuglink_size = 0;
 
-  memset (sections, 0, sizeof sections);
 
   /* Look for the symbol table.  */
   for (i = 1; i < shnum; ++i)
@@ -704,8 +1058,31 @@ elf_add (struct backtrace_state *state, int descriptor, uintptr_t base_address,
 	    {
 	      sections[j].offset = shdr->sh_offset;
 	      sections[j].size = shdr->sh_size;
+	      sections[j].compressed = ((shdr->sh_flags & SHF_COMPRESSED) != 0
+					? COMPRESSED_ELF : COMPRESSED_NONE);
 	      break;
 	    }
+	  /* .zdebug_info is the compressed .debug_info.  */
+	  if (name[0] == '.' && name[1] == 'z'
+	      && strcmp (name + 2, debug_section_names[j] + 1) == 0)
+	    {
+	      sections[j].offset = shdr->sh_offset;
+	      sections[j].size = shdr->sh_size;
+	      sections[j].compressed = COMPRESSED_GNU;
+	      break;
+	    }
+	}
+
+      if (shdr->sh_type == SHT_NOTE
+	  && strcmp (name, ".note.gnu.build-id") == 0)
+	{
+	  buildid_offset = shdr->sh_offset;
+	  buildid_size = shdr->sh_size;
+	}
+      else if (strcmp (name, ".gnu_debuglink") == 0)
+	{
+	  debuglink_offset = shdr->sh_offset;
+	  debuglink_size = shdr->sh_size;
 	}
     }
 
@@ -763,13 +1140,63 @@ elf_add (struct backtrace_state *state, int descriptor, uintptr_t base_address,
       elf_add_syminfo_data (state, sdata);
     }
 
-  /* FIXME: Need to handle compressed debug sections.  */
-
   backtrace_release_view (state, &shdrs_view, error_callback, data);
   shdrs_view_valid = 0;
   backtrace_release_view (state, &names_view, error_callback, data);
   names_view_valid = 0;
 
+  /* A stripped file names its debug info, by build-id or by
+     .gnu_debuglink.  */
+
+  if (!debuginfo && sections[DEBUG_INFO].size == 0)
+    {
+      int debug_descriptor;
+      struct backtrace_view view;
+
+      debug_descriptor = -1;
+      if (buildid_size > 0
+	  && backtrace_get_view (state, descriptor, buildid_offset,
+				 buildid_size, error_callback, data, &view))
+	{
+	  debug_descriptor
+	    = elf_open_debugfile_by_buildid ((const unsigned char *) view.data,
+					     buildid_size, error_callback,
+					     data);
+	  backtrace_release_view (state, &view, error_callback, data);
+	}
+      if (debug_descriptor < 0
+	  && debuglink_size > 0
+	  && backtrace_get_view (state, descriptor, debuglink_offset,
+				 debuglink_size, error_callback, data, &view))
+	{
+	  debug_descriptor
+	    = elf_open_debugfile_by_debuglink (state, filename,
+					       ((const unsigned char *)
+						view.data),
+					       debuglink_size,
+					       error_callback, data);
+	  backtrace_release_view (state, &view, error_callback, data);
+	}
+
+      if (debug_descriptor >= 0)
+	{
+	  int found_debug_sym;
+
+	  if (!backtrace_close (descriptor, error_callback, data))
+	    {
+	      backtrace_close (debug_descriptor, error_callback, data);
+	      return 0;
+	    }
+	  /* The symbols of this file have been added already.  */
+	  if (elf_add (state, NULL, debug_descriptor, base_address,
+		       error_callback, data, fileline_fn, &found_debug_sym,
+		       found_dwarf, 0, 1)
+	      && found_debug_sym)
+	    *found_sym = 1;
+	  return 1;
+	}
+    }
+
   /* Read all the debug sections in a single view, since they are
      probably adjacent in the file.  We never release this view.  */
 
@@ -812,6 +1239,23 @@ elf_add (struct backtrace_state *state, int descriptor, uintptr_t base_address,
       else
 	sections[i].data = ((const unsigned char *) debug_view.data
 			    + (sections[i].offset - min_offset));
+      if (sections[i].compressed != COMPRESSED_NONE
+	  && !elf_uncompress_section (state, &sections[i], error_callback,
+				      data))
+	{
+	  sections[i].data = NULL;
+	  sections[i].size = 0;
+	}
+    }
+
+  /* Nothing points into the view if every section was uncompressed.  */
+  for (i = 0; i < (int) DEBUG_MAX; ++i)
+    if (sections[i].size != 0 && !sections[i].allocated)
+      break;
+  if (i == (int) DEBUG_MAX)
+    {
+      backtrace_release_view (state, &debug_view, error_callback, data);
+      debug_view_valid = 0;
     }
 
   if (!backtrace_dwarf_add (state, base_address,
@@ -834,6 +1278,10 @@ elf_add (struct backtrace_state *state, int descriptor, uintptr_t base_address,
   return 1;
 
  fail:
+  for (i = 0; i < (int) DEBUG_MAX; ++i)
+    if (sections[i].allocated)
+      backtrace_free (state, (void *) sections[i].data, sections[i].size,
+		      error_callback, data);
   if (shdrs_view_valid)
     backtrace_release_view (state, &shdrs_view, error_callback, data);
   if (names_view_valid)
@@ -859,6 +1307,7 @@ struct phdr_data
   fileline *fileline_fn;
   int *found_sym;
   int *found_dwarf;
+  const char *exe_filename;
   int exe_descriptor;
 };
 
@@ -873,6 +1322,7 @@ phdr_callback (struct dl_phdr_info *info, size_t size ATTRIBUTE_UNUSED,
 	       void *pdata)
 {
   struct phdr_data *pd = (struct phdr_data *) pdata;
+  const char *filename;
   int descriptor;
   int does_not_exist;
   fileline elf_fileline_fn;
@@ -886,6 +1336,7 @@ phdr_callback (struct dl_phdr_info *info, size_t size ATTRIBUTE_UNUSED,
       if (pd->exe_descriptor == -1)
 	return 0;
       descriptor = pd->exe_descriptor;
+      filename = pd->exe_filename;
       pd->exe_descriptor = -1;
     }
   else
@@ -896,14 +1347,16 @@ phdr_callback (struct dl_phdr_info *info, size_t size ATTRIBUTE_UNUSED,
 	  pd->exe_descriptor = -1;
 	}
 
-      descriptor = backtrace_open (info->dlpi_name, pd->error_callback,
+      filename = info->dlpi_name;
+      descriptor = backtrace_open (filename, pd->error_callback,
 				   pd->data, &does_not_exist);
       if (descriptor < 0)
 	return 0;
     }
 
-  if (elf_add (pd->state, descriptor, info->dlpi_addr, pd->error_callback,
-	       pd->data, &elf_fileline_fn, pd->found_sym, &found_dwarf, 0))
+  if (elf_add (pd->state, filename, descriptor, info->dlpi_addr,
+	       pd->error_callback, pd->data, &elf_fileline_fn, pd->found_sym,
+	       &found_dwarf, 0, 0))
     {
       if (found_dwarf)
 	{
@@ -920,8 +1373,8 @@ phdr_callback (struct dl_phdr_info *info, size_t size ATTRIBUTE_UNUSED,
    sections.  */
 
 int
-backtrace_initialize (struct backtrace_state *state, int descriptor,
-		      backtrace_error_callback error_callback,
+backtrace_initialize (struct backtrace_state *state, const char *filename,
+		      int descriptor, backtrace_error_callback error_callback,
 		      void *data, fileline *fileline_fn)
 {
   int ret;
@@ -930,8 +1383,8 @@ backtrace_initialize (struct backtrace_state *state, int descriptor,
   fileline elf_fileline_fn = elf_nodebug;
   struct phdr_data pd;
 
-  ret = elf_add (state, descriptor, 0, error_callback, data, &elf_fileline_fn,
-		 &found_sym, &found_dwarf, 1);
+  ret = elf_add (state, filename, descriptor, 0, error_callback, data,
+		 &elf_fileline_fn, &found_sym, &found_dwarf, 1, 0);
   if (!ret)
     return 0;
 
@@ -941,6 +1394,7 @@ backtrace_initialize (struct backtrace_state *state, int descriptor,
   pd.fileline_fn = &elf_fileline_fn;
   pd.found_sym = &found_sym;
   pd.found_dwarf = &found_dwarf;
+  pd.exe_filename = filename;
   pd.exe_descriptor = ret < 0 ? descriptor : -1;
 
   dl_iterate_phdr (phdr_callback, (void *) &pd);
@@ -216,6 +216,35 @@ extern void backtrace_free (struct backtrace_state *state, void *mem,
 			    backtrace_error_callback error_callback,
 			    void *data);
 
+/* An arena takes all the allocations the calling thread makes between
+   backtrace_arena_enter and backtrace_arena_leave (vectors included),
+   and gives them back to the system at once in backtrace_arena_release.
+   Freeing memory while an arena is entered does nothing.  This lets
+   dwarf.c drop what it decoded for a compilation unit.  */
+
+struct backtrace_arena
+{
+  /* The chunks of the arena, linked through their first word.  */
+  void *chunks;
+  /* Free space at the end of the newest chunk.  */
+  char *next;
+  size_t left;
+  /* The size of all chunks.  */
+  size_t size;
+};
+
+/* Start allocating from ARENA in this thread.  Arenas do not nest.  */
+
+extern void backtrace_arena_enter (struct backtrace_arena *arena);
+
+/* Stop allocating from the arena of this thread.  */
+
+extern void backtrace_arena_leave (void);
+
+/* Free all the memory of ARENA, which must not be entered.  */
+
+extern void backtrace_arena_release (struct backtrace_arena *arena);
+
 /* A growable vector of some struct.  This is used for more efficient
    allocation when we don't know the final size of some group of data
    that we want to represent as an array.  */
@@ -261,13 +290,15 @@ extern int backtrace_vector_release (struct backtrace_state *state,
    fileline_data, syminfo_fn, and syminfo_data fields of STATE.
    Return the fileln_fn field in *FILELN_FN--this is done this way so
    that the synchronization code is only implemented once.  This is
-   called after the descriptor has first been opened.  It will close
-   the descriptor if it is no longer needed.  Returns 1 on success, 0
+   called after the descriptor has first been opened, FILENAME is the
+   name it was opened with.  It will close the descriptor if it is no
+   longer needed.  Returns 1 on success, 0
    on error.  There will be multiple implementations of this function,
    for different file formats.  Each system will compile the
    appropriate one.  */
 
 extern int backtrace_initialize (struct backtrace_state *state,
+				 const char *filename,
 				 int descriptor,
 				 backtrace_error_callback error_callback,
 				 void *data,
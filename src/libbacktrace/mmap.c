@@ -64,6 +64,93 @@ struct backtrace_freelist_struct
   size_t size;
 };
 
+/* The arena of this thread, see backtrace_arena_enter.  */
+
+static __thread struct backtrace_arena *current_arena;
+
+/* Smallest chunk of an arena.  */
+
+#define ARENA_CHUNK_SIZE (8 * 1024)
+
+void
+backtrace_arena_enter (struct backtrace_arena *arena)
+{
+  current_arena = arena;
+}
+
+void
+backtrace_arena_leave (void)
+{
+  current_arena = NULL;
+}
+
+/* Allocate from the arena of this thread.  The chunks come straight
+   from mmap, they are returned to the system when the arena is
+   released.  */
+
+static void *
+arena_alloc (struct backtrace_arena *arena, size_t size,
+	     backtrace_error_callback error_callback, void *data)
+{
+  void *ret;
+
+  /* Round for alignment, like backtrace_alloc.  */
+  size = (size + 7) & ~ (size_t) 7;
+  if (size > arena->left)
+    {
+      size_t pagesize;
+      size_t asksize;
+      void *chunk;
+
+      /* Chunks grow with the arena, the first word links them.  */
+      pagesize = getpagesize ();
+      asksize = arena->size / 2;
+      if (asksize < ARENA_CHUNK_SIZE)
+	asksize = ARENA_CHUNK_SIZE;
+      if (asksize < size + 8)
+	asksize = size + 8;
+      asksize = (asksize + pagesize - 1) & ~ (pagesize - 1);
+      chunk = mmap (NULL, asksize, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (chunk == MAP_FAILED)
+	{
+	  if (error_callback)
+	    error_callback (data, "mmap", errno);
+	  return NULL;
+	}
+      *(void **) chunk = arena->chunks;
+      ((size_t *) chunk)[1] = asksize;
+      arena->chunks = chunk;
+      arena->next = (char *) chunk + 16;
+      arena->left = asksize - 16;
+      arena->size += asksize;
+    }
+  ret = arena->next;
+  arena->next += size;
+  arena->left -= size;
+  return ret;
+}
+
+void
+backtrace_arena_release (struct backtrace_arena *arena)
+{
+  void *chunk;
+
+  chunk = arena->chunks;
+  while (chunk != NULL)
+    {
+      void *next;
+
+      next = *(void **) chunk;
+      munmap (chunk, ((size_t *) chunk)[1]);
+      chunk = next;
+    }
+  arena->chunks = NULL;
+  arena->next = NULL;
+  arena->left = 0;
+  arena->size = 0;
+}
+
 /* Free memory allocated by backtrace_alloc.  */
 
 static void
@@ -96,6 +183,9 @@ backtrace_alloc (struct backtrace_state *state,
   size_t asksize;
   void *page;
 
+  if (current_arena != NULL)
+    return arena_alloc (current_arena, size, error_callback, data);
+
   ret = NULL;
 
   /* If we can acquire the lock, then see if there is space on the
@@ -172,6 +262,10 @@ backtrace_free (struct backtrace_state *state, void *addr, size_t size,
 {
   int locked;
 
+  /* The arena is released as a whole.  */
+  if (current_arena != NULL)
+    return;
+
   /* If we are freeing a large aligned block, just release it back to
      the system.  This case arises when growing a vector for a large
      binary with lots of debug info.  Calling munmap here may cause us
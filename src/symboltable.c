@@ -265,3 +265,230 @@ int vmp_resolve_addr(void * addr, char * name, int name_len, int * lineno, char
 #endif
     return 0;
 }
+
+static void resolve_symbol(void * addr, vmp_symbol_t * symbol)
+{
+    /* the same defaults as resolve_addr in _vmprof.c */
+    symbol->name[0] = '\x00';
+    symbol->srcfile[0] = '-';
+    symbol->srcfile[1] = '\x00';
+    symbol->lineno = 0;
+    symbol->failed = vmp_resolve_addr(addr, symbol->name, sizeof(symbol->name),
+                                      &symbol->lineno, symbol->srcfile,
+                                      sizeof(symbol->srcfile)) != 0;
+    /* strncpy does not terminate long names */
+    symbol->name[sizeof(symbol->name) - 1] = '\x00';
+    symbol->srcfile[sizeof(symbol->srcfile) - 1] = '\x00';
+}
+
+#if defined(VMPROF_LINUX)
+#include <pthread.h>
+#include <unistd.h>
+
+struct resolve_range_s {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+struct resolve_ranges_s {
+    struct resolve_range_s * ranges;
+    size_t count;
+    size_t capacity;
+};
+
+struct resolve_addr_s {
+    uintptr_t addr;
+    size_t index;               /* of the address in the callers array */
+};
+
+struct resolve_job_s {
+    void ** addrs;
+    vmp_symbol_t * symbols;
+    struct resolve_addr_s * sorted;
+    size_t * groups;            /* group g is sorted[groups[g]] .. sorted[groups[g+1]-1] */
+    size_t group_count;
+    size_t next_group;          /* taken with an atomic add */
+};
+
+static int add_resolve_range(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    struct resolve_ranges_s * ranges = (struct resolve_ranges_s*)arg;
+    uintptr_t start = UINTPTR_MAX, end = 0;
+    int i;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD) {
+            uintptr_t seg = info->dlpi_addr + phdr->p_vaddr;
+            if (seg < start) start = seg;
+            if (seg + phdr->p_memsz > end) end = seg + phdr->p_memsz;
+        }
+    }
+    if (start >= end) {
+        return 0;
+    }
+    if (ranges->count == ranges->capacity) {
+        size_t capacity = ranges->capacity ? ranges->capacity * 2 : 64;
+        struct resolve_range_s * r = realloc(ranges->ranges, capacity * sizeof(*r));
+        if (r == NULL) {
+            return -1;
+        }
+        ranges->ranges = r;
+        ranges->capacity = capacity;
+    }
+    ranges->ranges[ranges->count].start = start;
+    ranges->ranges[ranges->count].end = end;
+    ranges->count++;
+    return 0;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    uintptr_t sa = ((const struct resolve_range_s*)a)->start;
+    uintptr_t sb = ((const struct resolve_range_s*)b)->start;
+    return sa < sb ? -1 : sa > sb;
+}
+
+static int compare_addrs(const void *a, const void *b)
+{
+    uintptr_t sa = ((const struct resolve_addr_s*)a)->addr;
+    uintptr_t sb = ((const struct resolve_addr_s*)b)->addr;
+    return sa < sb ? -1 : sa > sb;
+}
+
+static void resolve_group(struct resolve_job_s * job, size_t g)
+{
+    size_t i;
+    for (i = job->groups[g]; i < job->groups[g+1]; i++) {
+        size_t k = job->sorted[i].index;
+        resolve_symbol(job->addrs[k], &job->symbols[k]);
+    }
+}
+
+static void * resolve_worker(void * arg)
+{
+    struct resolve_job_s * job = (struct resolve_job_s*)arg;
+    size_t g;
+    while ((g = __atomic_fetch_add(&job->next_group, 1, __ATOMIC_RELAXED)) < job->group_count) {
+        resolve_group(job, g);
+    }
+    return NULL;
+}
+
+int vmp_resolve_addrs(void ** addrs, vmp_symbol_t * symbols, size_t count, int workers)
+{
+    struct resolve_ranges_s ranges = {NULL, 0, 0};
+    struct resolve_job_s job;
+    pthread_t threads[VMP_RESOLVE_MAX_WORKERS];
+    size_t i, r = 0, current = (size_t)-1;
+    int started = 0, t;
+
+    if (count == 0) {
+        return 0;
+    }
+    job.addrs = addrs;
+    job.symbols = symbols;
+    job.sorted = malloc(count * sizeof(struct resolve_addr_s));
+    job.groups = malloc((count + 1) * sizeof(size_t));
+    if (job.sorted == NULL || job.groups == NULL ||
+            dl_iterate_phdr(add_resolve_range, &ranges) != 0) {
+        free(job.sorted);
+        free(job.groups);
+        free(ranges.ranges);
+        return -1;
+    }
+    qsort(ranges.ranges, ranges.count, sizeof(struct resolve_range_s), compare_ranges);
+    for (i = 0; i < count; i++) {
+        job.sorted[i].addr = (uintptr_t)addrs[i];
+        job.sorted[i].index = i;
+    }
+    qsort(job.sorted, count, sizeof(struct resolve_addr_s), compare_addrs);
+
+    /* one group per module, both lists are sorted. An address outside of
+       all modules is a group of its own. */
+    job.group_count = 0;
+    for (i = 0; i < count; i++) {
+        uintptr_t addr = job.sorted[i].addr;
+        size_t module;
+        while (r < ranges.count && ranges.ranges[r].end <= addr) {
+            r++;
+        }
+        module = (r < ranges.count && ranges.ranges[r].start <= addr) ? r : ranges.count + i;
+        if (module != current) {
+            job.groups[job.group_count++] = i;
+            current = module;
+        }
+    }
+    job.groups[job.group_count] = count;
+    free(ranges.ranges);
+
+    /* the first lookup reads the debug information of all modules (and
+       creates the state of libbacktrace), the workers only search it */
+    resolve_group(&job, 0);
+    job.next_group = 1;
+
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+    }
+    if (workers > VMP_RESOLVE_MAX_WORKERS) {
+        workers = VMP_RESOLVE_MAX_WORKERS;
+    }
+    if ((size_t)workers > job.group_count - 1) {
+        workers = (int)(job.group_count - 1);
+    }
+    for (t = 1; t < workers; t++) {
+        if (pthread_create(&threads[started], NULL, resolve_worker, &job) != 0) {
+            break;
+        }
+        started++;
+    }
+    resolve_worker(&job);
+    for (t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(job.sorted);
+    free(job.groups);
+    return 0;
+}
+
+#else
+
+int vmp_resolve_addrs(void ** addrs, vmp_symbol_t * symbols, size_t count, int workers)
+{
+    size_t i;
+    for (i = 0; i < count; i++) {
+        resolve_symbol(addrs[i], &symbols[i]);
+    }
+    return 0;
+}
+
+#endif
+
+int vmp_set_debug_dir(const char * dir)
+{
+#if defined(VMPROF_LINUX)
+    backtrace_set_debug_dir(dir);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+long vmp_symbol_memory_limit(long limit)
+{
+#if defined(VMPROF_LINUX)
+    return (long)backtrace_dwarf_memory_limit((size_t)limit);
+#else
+    return -1;
+#endif
+}
+
+int vmp_symbol_memory_stats(size_t * size, size_t * decoded, size_t * evicted)
+{
+#if defined(VMPROF_LINUX)
+    backtrace_dwarf_memory_stats(size, decoded, evicted);
+    return 0;
+#else
+    return -1;
+#endif
+}
@@ -2,5 +2,38 @@
 
 #define _GNU_SOURCE 1
 
+#include <stddef.h>
+
 int vmp_resolve_addr(void * addr, char * name, int name_len, int * lineno,
                       char * srcfile, int srcfile_len);
+
+typedef struct vmp_symbol_s {
+    char name[128];
+    char srcfile[256];
+    int lineno;
+    int failed;                 /* set if nothing is known about the address */
+} vmp_symbol_t;
+
+/* Resolves many addresses at once, symbols[i] is the result of addrs[i].
+   The addresses are sorted and grouped by the module that maps them, up to
+   `workers` threads take one group after the other (0: one per cpu, at
+   most VMP_RESOLVE_MAX_WORKERS). Does not need the GIL. */
+#define VMP_RESOLVE_MAX_WORKERS 8
+int vmp_resolve_addrs(void ** addrs, vmp_symbol_t * symbols, size_t count,
+                      int workers);
+
+/* Separate debug info of stripped modules is looked for in this directory
+   (dir/.build-id/xx/yyyy.debug and .gnu_debuglink), /usr/lib/debug by
+   default. Only has an effect before the first address is resolved.
+   Returns -1 if this platform does not read debug information. */
+int vmp_set_debug_dir(const char * dir);
+
+/* The debug information of a module (line tables and function names) is
+   decoded one compilation unit at a time, on the first lookup of one of its
+   addresses. Bounds the memory of what was decoded to about `limit` bytes
+   (0: no limit), the least recently used units are dropped beyond it.
+   Returns the previous limit, -1 if nothing is decoded on this platform. */
+long vmp_symbol_memory_limit(long limit);
+/* The bytes in use, the units that were decoded and dropped so far.
+   Returns -1 if nothing is decoded on this platform. */
+int vmp_symbol_memory_stats(size_t * size, size_t * decoded, size_t * evicted);
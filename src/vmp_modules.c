@@ -0,0 +1,393 @@
+#include "vmp_modules.h"
+
+#ifdef VMP_TRACK_MODULES
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <link.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmp_stack.h"
+#include "vmp_unwind.h"
+#include "vmprof_unix.h"
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+struct module_s {
+    uintptr_t base;             /* load bias (dlpi_addr) */
+    uintptr_t start;            /* extent of the PT_LOAD segments */
+    uintptr_t end;
+    char *path;
+    unsigned char build_id[VMP_BUILD_ID_MAX];
+    long build_id_len;          /* 0 if the module has none */
+};
+
+struct snapshot_s {
+    struct module_s *modules;
+    size_t count;
+    size_t capacity;
+};
+
+/* the last snapshot, only touched with modules_lock held */
+static struct snapshot_s current = {NULL, 0, 0};
+static unsigned long long last_adds = 0;
+static unsigned long long last_subs = 0;
+static int counters_known = 0;
+static int tracking = 0;
+static int paused = 0;
+
+static pthread_mutex_t modules_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t modules_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t modules_thread;
+static int volatile modules_running = 0;
+
+static void free_snapshot(struct snapshot_s *snapshot)
+{
+    size_t i;
+    for (i = 0; i < snapshot->count; i++) {
+        free(snapshot->modules[i].path);
+    }
+    free(snapshot->modules);
+    snapshot->modules = NULL;
+    snapshot->count = 0;
+    snapshot->capacity = 0;
+}
+
+static int read_counters(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    unsigned long long *counters = (unsigned long long *)arg;
+    if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        /* an old loader, every refresh takes a snapshot */
+        return -1;
+    }
+    counters[0] = info->dlpi_adds;
+    counters[1] = info->dlpi_subs;
+    return 1;
+}
+
+static const char *main_program_path(void)
+{
+    /* dl_iterate_phdr does not name the executable */
+    static char path[PATH_MAX];
+    static int known = 0;
+#ifdef VMPROF_LINUX
+    if (!known) {
+        ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        path[n < 0 ? 0 : n] = '\0';
+        known = 1;
+    }
+#endif
+    return path;
+}
+
+static long read_build_id(struct dl_phdr_info *info, unsigned char *build_id)
+{
+    /* the NT_GNU_BUILD_ID note is mapped with the module, it names the
+       binary (and its separate debug info) on another machine */
+    int i;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        const char *note, *notes_end;
+        if (phdr->p_type != PT_NOTE) {
+            continue;
+        }
+        note = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+        notes_end = note + phdr->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= notes_end) {
+            const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+            const char *name = note + sizeof(ElfW(Nhdr));
+            const char *desc = name + ((nhdr->n_namesz + 3) & ~3u);
+            note = desc + ((nhdr->n_descsz + 3) & ~3u);
+            if (note > notes_end) {
+                break;
+            }
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                    memcmp(name, "GNU", 4) == 0 && nhdr->n_descsz > 0 &&
+                    nhdr->n_descsz <= VMP_BUILD_ID_MAX) {
+                memcpy(build_id, desc, nhdr->n_descsz);
+                return nhdr->n_descsz;
+            }
+        }
+    }
+    return 0;
+}
+
+static int add_module(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    struct snapshot_s *snapshot = (struct snapshot_s *)arg;
+    struct module_s *module;
+    const char *path = info->dlpi_name;
+    uintptr_t start = UINTPTR_MAX, end = 0;
+    int i;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD) {
+            uintptr_t seg = info->dlpi_addr + phdr->p_vaddr;
+            if (seg < start) {
+                start = seg;
+            }
+            if (seg + phdr->p_memsz > end) {
+                end = seg + phdr->p_memsz;
+            }
+        }
+    }
+    if (start >= end) {
+        return 0;
+    }
+    if (path == NULL || path[0] == '\0') {
+        path = snapshot->count == 0 ? main_program_path() : "";
+    }
+
+    if (snapshot->count == snapshot->capacity) {
+        size_t capacity = snapshot->capacity ? snapshot->capacity * 2 : 64;
+        module = realloc(snapshot->modules, capacity * sizeof(*module));
+        if (module == NULL) {
+            return -1;
+        }
+        snapshot->modules = module;
+        snapshot->capacity = capacity;
+    }
+    module = &snapshot->modules[snapshot->count];
+    module->path = strdup(path);
+    if (module->path == NULL) {
+        return -1;
+    }
+    module->base = info->dlpi_addr;
+    module->start = start;
+    module->end = end;
+    module->build_id_len = read_build_id(info, module->build_id);
+    snapshot->count++;
+    return 0;
+}
+
+static int compare_modules(const void *a, const void *b)
+{
+    uintptr_t sa = ((const struct module_s *)a)->start;
+    uintptr_t sb = ((const struct module_s *)b)->start;
+    return sa < sb ? -1 : sa > sb;
+}
+
+static int same_module(const struct module_s *a, const struct module_s *b)
+{
+    return a->start == b->start && a->end == b->end && a->base == b->base &&
+           strcmp(a->path, b->path) == 0;
+}
+
+static int write_event(int event, const struct module_s *module)
+{
+    return vmprof_register_module(event, module->base, module->start,
+                                  module->end, module->path, module->build_id,
+                                  module->build_id_len, 100) == 0;
+}
+
+static void publish_ignore_ranges(const struct snapshot_s *snapshot)
+{
+    /* sorted (start, end) pairs, see vmp_ignore_ip */
+    intptr_t *ranges = malloc((2 * snapshot->count + 2) * sizeof(intptr_t));
+    ssize_t count = 0;
+    size_t i;
+
+    if (ranges == NULL) {
+        return;
+    }
+    for (i = 0; i < snapshot->count; i++) {
+        const struct module_s *module = &snapshot->modules[i];
+        if (!_ignore_symbols_from_path(module->path)) {
+            continue;
+        }
+        if (count > 0 && ranges[count - 1] >= (intptr_t)module->start) {
+            ranges[count - 1] = (intptr_t)module->end;
+        } else {
+            ranges[count++] = (intptr_t)module->start;
+            ranges[count++] = (intptr_t)module->end;
+        }
+    }
+    vmp_publish_ignore_ranges(ranges, count);
+}
+
+static int refresh_locked(void)
+{
+    struct snapshot_s snapshot = {NULL, 0, 0};
+    unsigned long long counters[2];
+    size_t i = 0, j = 0;
+    int written = 0, changed = 0;
+    int known;
+
+    known = dl_iterate_phdr(read_counters, counters) == 1;
+    if (known && counters_known && counters[0] == last_adds && counters[1] == last_subs) {
+        return 0;
+    }
+    if (dl_iterate_phdr(add_module, &snapshot) != 0) {
+        free_snapshot(&snapshot);
+        return -1;
+    }
+    qsort(snapshot.modules, snapshot.count, sizeof(struct module_s), compare_modules);
+
+    /* both snapshots are sorted by their start, modules that are
+       replaced by another one at the same address are reported as an
+       unload followed by a load */
+    while (i < current.count || j < snapshot.count) {
+        struct module_s *old = i < current.count ? &current.modules[i] : NULL;
+        struct module_s *new = j < snapshot.count ? &snapshot.modules[j] : NULL;
+        if (old != NULL && new != NULL && same_module(old, new)) {
+            i++;
+            j++;
+        } else if (new == NULL || (old != NULL && old->start <= new->start)) {
+            written += write_event(VMP_MODULE_UNLOADED, old);
+            changed = 1;
+            i++;
+        } else {
+            written += write_event(VMP_MODULE_LOADED, new);
+            changed = 1;
+            j++;
+        }
+    }
+
+    if (changed) {
+        publish_ignore_ranges(&snapshot);
+#ifdef VMP_BUILTIN_UNWIND
+        if (current.modules != NULL && vmp_unwind_ready()) {
+            /* the modules that are new have no unwind tables yet */
+            (void)vmp_unwind_init();
+        }
+#endif
+    }
+    free_snapshot(&current);
+    current = snapshot;
+    counters_known = known;
+    if (known) {
+        last_adds = counters[0];
+        last_subs = counters[1];
+    }
+    return written;
+}
+
+int vmp_modules_refresh(void)
+{
+    int written = 0;
+    pthread_mutex_lock(&modules_lock);
+    if (tracking && !paused) {
+        written = refresh_locked();
+    }
+    pthread_mutex_unlock(&modules_lock);
+    return written;
+}
+
+static void *modules_main(void *arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&modules_lock);
+    while (modules_running) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (VMP_MODULES_INTERVAL_USEC % 1000000) * 1000;
+        deadline.tv_sec += VMP_MODULES_INTERVAL_USEC / 1000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&modules_wakeup, &modules_lock, &deadline);
+        if (modules_running && !paused) {
+            (void)refresh_locked();
+        }
+    }
+    pthread_mutex_unlock(&modules_lock);
+    return NULL;
+}
+
+int vmp_modules_start(void)
+{
+    sigset_t all, previous;
+    int err;
+
+    if (tracking) {
+        return 0;
+    }
+    pthread_mutex_lock(&modules_lock);
+    free_snapshot(&current);
+    counters_known = 0;
+    tracking = 1;
+    paused = 0;
+    err = refresh_locked() < 0;
+    pthread_mutex_unlock(&modules_lock);
+    if (err) {
+        tracking = 0;
+        return -1;
+    }
+
+    /* the thread must never run the profiling signal handler, it
+       inherits this signal mask */
+    modules_running = 1;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    err = pthread_create(&modules_thread, NULL, modules_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (err != 0) {
+        modules_running = 0;
+        tracking = 0;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void vmp_modules_pause(int pause)
+{
+    pthread_mutex_lock(&modules_lock);
+    paused = pause;
+    pthread_mutex_unlock(&modules_lock);
+}
+
+int vmp_modules_stop(void)
+{
+    if (!tracking) {
+        return 0;
+    }
+    pthread_mutex_lock(&modules_lock);
+    modules_running = 0;
+    pthread_cond_signal(&modules_wakeup);
+    pthread_mutex_unlock(&modules_lock);
+    if (pthread_join(modules_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&modules_lock);
+    (void)refresh_locked();
+    free_snapshot(&current);
+    tracking = 0;
+    pthread_mutex_unlock(&modules_lock);
+    return 0;
+}
+
+int vmp_modules_foreach(vmp_module_callback callback, void *arg)
+{
+    size_t i;
+    int result = 0;
+    pthread_mutex_lock(&modules_lock);
+    for (i = 0; i < current.count && result == 0; i++) {
+        const struct module_s *module = &current.modules[i];
+        result = callback(arg, module->base, module->start, module->end,
+                          module->path, module->build_id, module->build_id_len);
+    }
+    pthread_mutex_unlock(&modules_lock);
+    return result;
+}
+
+void vmp_modules_forget(void)
+{
+    /* the lock might have been held by the thread at the time of fork() */
+    pthread_mutex_init(&modules_lock, NULL);
+    modules_running = 0;
+    tracking = 0;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#pragma once
+/* The shared objects that are mapped while profiling */
+
+#include "vmprof.h"
+
+#include <stdint.h>
+
+/* A snapshot of the loaded modules (dl_iterate_phdr) is taken when
+   profiling starts and refreshed by a housekeeping thread whenever the
+   loader reports that objects were added or removed (dlpi_adds and
+   dlpi_subs, a cheap check). Every difference is written to the profile
+   as a MARKER_MODULE record, the reader thus knows what was mapped at any
+   point of the sample stream. The GNU build-id of a module is part of its
+   record: native addresses can be symbolized after the fact, on another
+   machine (see vmprof/symbolize.py). On a change, the ignore ranges of the
+   native walk (see vmp_ignore_ip) are rebuilt and swapped in, and the
+   tables of the built-in unwinder are rebuilt.
+
+   Nothing of this runs in the signal handler. */
+#if (defined(VMPROF_LINUX) || defined(VMPROF_BSD)) && defined(VMP_SUPPORTS_NATIVE_PROFILING)
+#define VMP_TRACK_MODULES 1
+#endif
+
+#define VMP_MODULE_UNLOADED 0
+#define VMP_MODULE_LOADED 1
+
+/* longest GNU build-id that is written (SHA-1 ids have 20 bytes) */
+#define VMP_BUILD_ID_MAX 64
+
+#ifdef VMP_TRACK_MODULES
+
+/* how often the housekeeping thread looks for new modules */
+#define VMP_MODULES_INTERVAL_USEC 100000
+
+/* Take the first snapshot (writes a load record for every module) and
+   start the housekeeping thread */
+int vmp_modules_start(void);
+/* Stop the thread and write what changed since the last snapshot */
+int vmp_modules_stop(void);
+/* Compare with the last snapshot. Returns the number of records that
+   were written, -1 on error. */
+int vmp_modules_refresh(void);
+/* Stop writing records until resumed, a refresh that is in progress is
+   finished when this returns. vmp_modules_stop writes nevertheless. */
+void vmp_modules_pause(int paused);
+/* in the child of fork() the thread does not exist */
+void vmp_modules_forget(void);
+/* Calls CALLBACK for every module of the last snapshot, until it
+   returns non-zero (which is returned) */
+typedef int (*vmp_module_callback)(void *arg, uintptr_t base, uintptr_t start,
+                                   uintptr_t end, const char *path,
+                                   const unsigned char *build_id,
+                                   long build_id_len);
+int vmp_modules_foreach(vmp_module_callback callback, void *arg);
+
+#endif
@@ -16,14 +16,22 @@
 
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
 
+#include "vmp_unwind.h"
+#include "vmprof_getpc.h"
+
 #if defined(VMPROF_LINUX) || defined(VMPROF_BSD)
 #include "unwind/vmprof_unwind.h"
-typedef mcontext_t unw_context_t;
+/* unw_getcontext stores a whole ucontext_t (the fp state too), not only
+   the machine context */
+typedef ucontext_t unw_context_t;
+#define UNW_INIT_SIGNAL_FRAME 1
 
 // functions copied from libunwind using dlopen
 static int (*unw_get_reg)(unw_cursor_t*, int, unw_word_t*) = NULL;
 static int (*unw_step)(unw_cursor_t*) = NULL;
 static int (*unw_init_local)(unw_cursor_t *, unw_context_t *) = NULL;
+// libunwind >= 1.3, NULL if not available
+static int (*unw_init_local2)(unw_cursor_t *, unw_context_t *, int) = NULL;
 static int (*unw_get_proc_info)(unw_cursor_t *, unw_proc_info_t *) = NULL;
 static int (*unw_get_proc_name)(unw_cursor_t *, char *, size_t, unw_word_t*) = NULL;
 static int (*unw_is_signal_frame)(unw_cursor_t *) = NULL;
@@ -52,6 +60,18 @@ static int (*unw_getcontext)(unw_context_t *) = NULL;
 void *pypy_find_codemap_at_addr(long addr, long *start_addr);
 #endif
 
+/* how often walking the native stack failed and the sample was
+   reduced to the python stack (or dropped), see vmp_unwind_failures */
+static long volatile unwind_failures = 0;
+
+long vmp_unwind_failures(void) {
+    return unwind_failures;
+}
+
+void vmp_reset_unwind_failures(void) {
+    unwind_failures = 0;
+}
+
 int _per_loop(void) {
     // how many void* are written to the stack trace per loop iterations?
 #ifdef RPYTHON_VMPROF
@@ -71,11 +91,28 @@ PY_EVAL_RETURN_T * vmprof_eval(PY_STACK_FRAME_T *f, int throwflag) { return NULL
 #endif
 
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
+// sorted (start, end) pairs of the code vmp_ignore_ip reports. A table
+// is never modified once it is published, vmp_ignore_ip reads the
+// current one without a lock. Replaced tables stay allocated until
+// vmp_native_cleanup, a signal handler might still be reading them.
+struct vmp_range_table_s {
+    struct vmp_range_table_s *retired;
+    intptr_t *ranges;
+    ssize_t count;
+    int owned;              // ranges is freed with the table
+};
+static struct vmp_range_table_s *volatile vmp_range_table = NULL;
+static struct vmp_range_table_s *vmp_retired_ranges = NULL;
+// the table vmp_read_vmaps is building
 static intptr_t *vmp_ranges = NULL;
 static ssize_t vmp_range_count = 0;
 static int vmp_native_traces_enabled = 0;
 #endif
 static int _vmp_profiles_lines = 0;
+static int _vmp_native_pcs = 0;
+static int _vmp_native_leaf = 0;
+static Py_ssize_t _vmp_code_id_index = -1;
+static uintptr_t _vmp_code_id_generation = 0;
 
 void vmp_profile_lines(int lines) {
     _vmp_profiles_lines = lines;
@@ -84,23 +121,82 @@ int vmp_profiles_python_lines(void) {
     return _vmp_profiles_lines;
 }
 
+void vmp_native_record_pcs(int pcs) {
+    _vmp_native_pcs = pcs;
+}
+int vmp_native_records_pcs(void) {
+    return _vmp_native_pcs;
+}
+int vmp_native_records_leaf(void) {
+    return _vmp_native_leaf;
+}
+
+// With stable ids a code object is recorded with the id in its co_extra
+// slot INDEX, a hash of its name, file and first line that does not
+// depend on the process (see write_code_id in _vmprof.c). The slot holds
+// the id in the low VMP_CODE_ID_BITS and the profiling session that
+// assigned it above, ids of earlier sessions are not named in this
+// profile. Code objects without an id yet are recorded with their
+// address, until the id is assigned and an alias is written.
+// The slot is read here without the GIL, directly from co_extra:
+// _PyCode_GetExtra might set an exception. _PyCode_SetExtra reallocates
+// co_extra when the slot is past its end, write_code_id stops the
+// sampling around it. Another extension that sets a higher slot of a
+// sampled code object races with this read: it might see the freed
+// block, a wrong id (which is then not named) or, if its memory was
+// unmapped, fault.
+void vmp_stable_code_ids(Py_ssize_t index, uintptr_t generation) {
+    _vmp_code_id_index = index;
+    _vmp_code_id_generation = generation;
+}
+
+#if !defined(RPYTHON_VMPROF) && PY_VERSION_HEX >= 0x03060000
+// the layout of co_extra, _PyCodeObjectExtra of Objects/codeobject.c
+typedef struct {
+    Py_ssize_t ce_size;
+    void * ce_extras[1];
+} vmp_code_extra_t;
+#endif
+
+static intptr_t _code_uid(PY_STACK_FRAME_T * frame)
+{
+#if !defined(RPYTHON_VMPROF) && PY_VERSION_HEX >= 0x03060000
+    if (_vmp_code_id_index >= 0) {
+        vmp_code_extra_t * extra = (vmp_code_extra_t *)FRAME_CODE(frame)->co_extra;
+        uintptr_t value;
+        if (extra != NULL && _vmp_code_id_index < extra->ce_size) {
+            value = (uintptr_t)extra->ce_extras[_vmp_code_id_index];
+            if (value != 0 && (value >> VMP_CODE_ID_BITS) == _vmp_code_id_generation) {
+                return (intptr_t)(value & VMP_CODE_ID_MASK);
+            }
+        }
+    }
+#endif
+    return CODE_ADDR_TO_UID(FRAME_CODE(frame));
+}
+
 static PY_STACK_FRAME_T * _write_python_stack_entry(PY_STACK_FRAME_T * frame, void ** result, int * depth, int max_depth)
 {
 #ifndef RPYTHON_VMPROF // pypy does not support line profiling
     if (vmp_profiles_python_lines()) {
-        // In the line profiling mode we save a line number for every frame.
-        // Actual line number isn't stored in the frame directly (f_lineno
-        // points to the beginning of the frame), so we need to compute it
-        // from f_lasti and f_code->co_lnotab. Here is explained what co_lnotab
-        // is:
-        // https://svn.python.org/projects/python/trunk/Objects/lnotab_notes.txt
-
-        // NOTE: the profiling overhead can be reduced by storing co_lnotab in the dump and
-        // moving this computation to the reader instead of doing it here.
-        result[*depth] = (void*) (int64_t) PyFrame_GetLineNumber(frame);
+        // In the line profiling mode we save the offset of the current
+        // instruction (in bytes) for every frame. The line number is not
+        // stored in the frame (f_lineno points to the beginning of the
+        // frame) and decoding co_lnotab here would cost a lot for deep
+        // stacks. Instead the line table of every code object is written
+        // once (see MARKER_LINE_TABLE) and the reader maps the offsets.
+        long offset = frame->f_lasti;
+        if (offset < 0) {
+            offset = 0;  // the frame did not start executing yet
+        }
+#if PY_VERSION_HEX >= 0x030A0000
+        // f_lasti counts code units since 3.10
+        offset *= sizeof(_Py_CODEUNIT);
+#endif
+        result[*depth] = (void*) (int64_t) offset;
         *depth = *depth + 1;
     }
-    result[*depth] = (void*)CODE_ADDR_TO_UID(FRAME_CODE(frame));
+    result[*depth] = (void*)_code_uid(frame);
     *depth = *depth + 1;
 #else
 
@@ -156,8 +252,117 @@ int _write_native_stack(void* addr, void ** result, int depth, int max_depth) {
 }
 #endif
 
-int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
-                              int max_depth, int signal, intptr_t pc) {
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+// [start, end) of the frame evaluation function if it is known, in the
+// native_pcs mode the pc of a frame is then enough to recognize it
+static uintptr_t eval_start = 0;
+static uintptr_t eval_end = 0;
+static int unwind_from_ucontext = 1;
+// libunwind is optional if the built-in unwinder is available, it is
+// only needed to walk the stack without the context of a signal
+static int libunwind_loaded = 0;
+#endif
+#ifdef VMP_BUILTIN_UNWIND
+static int builtin_unwind = 1;
+#endif
+#if defined(VMPROF_LINUX) && !defined(RPYTHON_VMPROF) && CPYTHON_HAS_FRAME_EVALUATION
+static void _find_eval_range(void);
+#endif
+
+void vmp_native_record_leaf(int leaf) {
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+#if defined(VMPROF_LINUX) && !defined(RPYTHON_VMPROF) && CPYTHON_HAS_FRAME_EVALUATION
+    // the native stack walk is not enabled, vmp_native_enable does not
+    // look for the eval loop
+    if (leaf && eval_end == 0) {
+        _find_eval_range();
+    }
+#endif
+#endif
+    _vmp_native_leaf = leaf;
+}
+
+void vmp_native_unwind_from_ucontext(int enabled) {
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    unwind_from_ucontext = enabled;
+#endif
+}
+
+void vmp_native_builtin_unwind(int enabled) {
+#ifdef VMP_BUILTIN_UNWIND
+    builtin_unwind = enabled;
+#endif
+}
+
+#ifdef VMP_BUILTIN_UNWIND
+static int _vmp_walk_builtin(PY_STACK_FRAME_T *frame, void ** result,
+                             int max_depth, void * ucontext, intptr_t pc) {
+    // the same walk as below, with the unwinder of vmp_unwind.c
+    vmp_unw_cursor_t cursor;
+    sigjmp_buf restore;
+    int depth = 0;
+    int found = 0;
+    int err;
+
+    // the unwinder reads saved registers and return addresses from the
+    // stack, on a corrupted stack it might fault: the sample is thrown
+    // away (-1). Only this walk is guarded, it holds no locks. Jumping
+    // out of libunwind or the dynamic loader could leave theirs held.
+    if (sigsetjmp(restore, 0) != 0) {
+        return -1;
+    }
+    vmp_set_fault_guard(&restore);
+    err = vmp_unwind_init_cursor(&cursor, ucontext) < 0 ? -1 : 1;
+    while (err > 0 && (depth + _per_loop()) <= max_depth) {
+        uintptr_t addr = cursor.start_ip;
+        if (IS_VMPROF_EVAL((void*)addr)) {
+            found = 1;
+            break;
+        }
+        if (_vmp_native_pcs) {
+            // a return address belongs to the line after the call
+            addr = cursor.first ? cursor.pc : cursor.pc - 1;
+        }
+        if (addr != 0) {
+            depth = _write_native_stack((void*)(addr | 0x1), result, depth, max_depth);
+        }
+        err = vmp_unwind_step(&cursor);
+    }
+    vmp_set_fault_guard(NULL);
+    if (err < 0) {
+        __sync_fetch_and_add(&unwind_failures, 1);
+    }
+    if (!found) {
+        // no python frame above the native ones, only the python stack
+        // is recorded
+        depth = 0;
+    }
+    return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
+}
+#endif
+
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+static int _vmp_walk_leaf(PY_STACK_FRAME_T *frame, void ** result,
+                          int max_depth, void * ucontext, intptr_t pc) {
+    // the native_leaf mode: no unwinding at all, the instruction the
+    // signal interrupted is put on top of the python stack. It is left
+    // out if it is inside of the eval loop, the python frame on top
+    // already stands for it.
+    uintptr_t ip = (uintptr_t)GetPC((ucontext_t *)ucontext);
+    int depth = 0;
+    if (ip != 0 && !(eval_start <= ip && ip < eval_end)) {
+        depth = _write_native_stack((void*)(ip | 0x1), result, depth, max_depth);
+    }
+    return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
+}
+#endif
+
+// always inlined: on mac os x the number of frames between unw_getcontext
+// and the signal frame is hard coded below
+static inline __attribute__((always_inline))
+int _vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
+                               int max_depth, int signal, void * ucontext,
+                               intptr_t pc) {
 
     // called in signal handler
     //
@@ -166,7 +371,10 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
     //
     // The idea is the following (in the native case):
     //
-    // 1) Remove frames until the signal frame is found (skipping it as well)
+    // 1) Remove frames until the signal frame is found (skipping it as well),
+    //    or start at the interrupted instruction if the ucontext of the
+    //    signal is known (the built-in unwinder of vmp_unwind.c always
+    //    starts there, libunwind if it can be seeded with it)
     // 2) if the current frame corresponds to PyEval_EvalFrameEx (or the equivalent
     //    for each python version), the jump to 4)
     // 3) jump to 2)
@@ -187,15 +395,40 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
     int ret;
 
     if (vmp_native_enabled() == 0) {
+        if (_vmp_native_leaf && ucontext != NULL) {
+            return _vmp_walk_leaf(frame, result, max_depth, ucontext, pc);
+        }
         return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
     }
 
+#ifdef VMP_BUILTIN_UNWIND
+    if (ucontext != NULL && unwind_from_ucontext && builtin_unwind) {
+        return _vmp_walk_builtin(frame, result, max_depth, ucontext, pc);
+    }
+#endif
+#ifdef VMPROF_LINUX
+    if (!libunwind_loaded) {
+        return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
+    }
+#endif
+
+#if defined(VMPROF_LINUX) || defined(VMPROF_BSD)
+    if (ucontext != NULL && unw_init_local2 != NULL && unwind_from_ucontext) {
+        // no need to step through the handler: the cursor starts in the
+        // frame the signal interrupted
+        if (unw_init_local2(&cursor, (unw_context_t *)ucontext, UNW_INIT_SIGNAL_FRAME) >= 0) {
+            goto walk;
+        }
+    }
+#endif
+
     ret = unw_getcontext(&uc);
     if (ret < 0) {
         // could not initialize lib unwind cursor and context
 #if DEBUG
         fprintf(stderr, "WARNING: unw_getcontext did not retreive context, switching to python profiling mode \n");
 #endif
+        __sync_fetch_and_add(&unwind_failures, 1);
         vmp_native_disable();
         return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
     }
@@ -205,6 +438,7 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
 #if DEBUG
         fprintf(stderr, "WARNING: unw_init_local did not succeed, switching to python profiling mode \n");
 #endif
+        __sync_fetch_and_add(&unwind_failures, 1);
         vmp_native_disable();
         return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
     }
@@ -216,6 +450,7 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
 #if DEBUG
                 fprintf(stderr, "WARNING: did not find signal frame, skipping sample\n");
 #endif
+                __sync_fetch_and_add(&unwind_failures, 1);
                 return 0;
             }
             signal++;
@@ -233,6 +468,7 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
 #if DEBUG
                 fprintf(stderr,"WARNING: did not find signal frame, skipping sample\n");
 #endif
+                __sync_fetch_and_add(&unwind_failures, 1);
                 return 0;
             }
         }
@@ -240,7 +476,7 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
         // who would have guessed that unw_is_signal_frame does not work on mac os x
         if (signal) {
             unw_step(&cursor); // vmp_walk_and_record_stack
-            // get_stack_trace is inlined
+            // _get_stack_trace is inlined
             unw_step(&cursor); // _vmprof_sample_stack
             unw_step(&cursor); // sigprof_handler
             unw_step(&cursor); // _sigtramp
@@ -248,12 +484,31 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
 #endif
     }
 
+#if defined(VMPROF_LINUX) || defined(VMPROF_BSD)
+walk: ;
+#endif
     int depth = 0;
+    // only the pc of the first frame is not a return address
+    int exact = 1;
     //PY_STACK_FRAME_T * top_most_frame = frame;
     while ((depth + _per_loop()) <= max_depth) {
-        unw_get_proc_info(&cursor, &pip);
-
-        func_addr = (void*)pip.start_ip;
+        unw_word_t ip = 0;
+        if (_vmp_native_pcs) {
+            if (unw_get_reg(&cursor, UNW_REG_IP, &ip) < 0) {
+                __sync_fetch_and_add(&unwind_failures, 1);
+                return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
+            }
+            if (!exact) {
+                ip -= 1;
+            }
+        }
+        if (_vmp_native_pcs && eval_end != 0) {
+            // no need to look up the procedure info of every frame
+            func_addr = (eval_start <= ip && ip < eval_end) ? (void*)eval_start : NULL;
+        } else {
+            unw_get_proc_info(&cursor, &pip);
+            func_addr = (void*)pip.start_ip;
+        }
 
         //{
         //    char name[64];
@@ -279,7 +534,7 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
         }
 #endif
 
-        if (IS_VMPROF_EVAL((void*)pip.start_ip)) {
+        if (IS_VMPROF_EVAL(func_addr)) {
             // yes we found one stack entry of the python frames!
             return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
 #ifdef PYPY_JIT_CODEMAP
@@ -290,17 +545,21 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
         } else {
             // mark native routines with the first bit set,
             // this is possible because compiler align to 8 bytes.
-            //
-            if (func_addr != 0x0) {
-                depth = _write_native_stack((void*)(((uint64_t)func_addr) | 0x1), result, depth, max_depth);
+            // (in the native_pcs mode the bit might hide the lowest bit
+            // of the pc, it stays inside of the same instruction or line)
+            void * addr = _vmp_native_pcs ? (void*)ip : func_addr;
+            if (addr != 0x0) {
+                depth = _write_native_stack((void*)(((uint64_t)addr) | 0x1), result, depth, max_depth);
             }
         }
 
+        exact = 0;
         int err = unw_step(&cursor);
         if (err == 0) {
             break;
         } else if (err < 0) {
             // this sample is broken, cannot walk native level... record python level (at least)
+            __sync_fetch_and_add(&unwind_failures, 1);
             return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
         }
     }
@@ -310,6 +569,17 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
     return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
 }
 
+int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
+                              int max_depth, int signal, intptr_t pc) {
+    return _vmp_walk_and_record_stack(frame, result, max_depth, signal, NULL, pc);
+}
+
+int vmp_walk_and_record_signal_stack(PY_STACK_FRAME_T *frame, void ** result,
+                                     int max_depth, void * ucontext, intptr_t pc) {
+    // ucontext is the third argument of the SA_SIGINFO signal handler
+    return _vmp_walk_and_record_stack(frame, result, max_depth, 1, ucontext, pc);
+}
+
 int vmp_native_enabled(void) {
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
     return vmp_native_traces_enabled;
@@ -319,6 +589,18 @@ int vmp_native_enabled(void) {
 }
 
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
+#ifdef __unix__
+static int _ends_with_so(const char * name) {
+    // a line of /proc/self/maps ends with a newline, the names of
+    // dl_iterate_phdr (see vmp_modules.c) do not
+    size_t len = strlen(name);
+    if (len > 0 && name[len-1] == '\n') {
+        len--;
+    }
+    return len >= 3 && memcmp(name + len - 3, ".so", 3) == 0;
+}
+#endif
+
 int _ignore_symbols_from_path(const char * name) {
     // which symbols should not be considered while walking
     // the native stack?
@@ -331,7 +613,7 @@ int _ignore_symbols_from_path(const char * name) {
     // cpython
     if (strstr(name, "python") != NULL &&
 #  ifdef __unix__
-        strstr(name, ".so\n") == NULL
+        !_ends_with_so(name)
 #  elif defined(__APPLE__)
         strstr(name, ".so") == NULL
 #  endif
@@ -342,6 +624,38 @@ int _ignore_symbols_from_path(const char * name) {
     return 0;
 }
 
+static void _publish_ranges(intptr_t *ranges, ssize_t count, int owned) {
+    // not async-signal-safe
+    struct vmp_range_table_s *table = NULL, *old;
+    if (ranges != NULL) {
+        table = malloc(sizeof(struct vmp_range_table_s));
+        if (table == NULL) {
+            if (owned) { free(ranges); }
+            return;
+        }
+        table->ranges = ranges;
+        table->count = count;
+        table->owned = owned;
+        table->retired = NULL;
+    }
+    old = __atomic_exchange_n(&vmp_range_table, table, __ATOMIC_ACQ_REL);
+    if (old != NULL) {
+        old->retired = vmp_retired_ranges;
+        vmp_retired_ranges = old;
+    }
+}
+
+void vmp_publish_ignore_ranges(intptr_t *ranges, ssize_t count) {
+    _publish_ranges(ranges, count, 1);
+}
+
+static int _publish_vmp_ranges(void) {
+    _publish_ranges(vmp_ranges, vmp_range_count, 1);
+    vmp_ranges = NULL;
+    vmp_range_count = 0;
+    return 1;
+}
+
 int _reset_vmp_ranges(void) {
     // initially 10 (start, stop) entries!
     int max_count = 10;
@@ -431,7 +745,7 @@ int vmp_read_vmaps(const char * fname) {
     }
 
     fclose(fd);
-    return 1;
+    return _publish_vmp_ranges();
 }
 #endif
 
@@ -484,7 +798,7 @@ int vmp_read_vmaps(const char * fname) {
         }
     } while (kr == KERN_SUCCESS);
 
-    ret = 1;
+    ret = _publish_vmp_ranges();
 
 teardown:
     if (task != MACH_PORT_NULL) {
@@ -514,7 +828,29 @@ static void * libhandle = NULL;
 #define UL_PREFIX "_UL"
 #endif
 
+#if defined(VMPROF_LINUX) && !defined(RPYTHON_VMPROF) && CPYTHON_HAS_FRAME_EVALUATION
+static void _find_eval_range(void) {
+    Dl_info info;
+    const ElfW(Sym) * sym = NULL;
+    if (dladdr1((void*)_PyEval_EvalFrameDefault, &info, (void**)&sym, RTLD_DL_SYMENT) != 0
+        && sym != NULL && sym->st_size > 0
+        && info.dli_saddr == (void*)_PyEval_EvalFrameDefault) {
+        eval_start = (uintptr_t)info.dli_saddr;
+        eval_end = eval_start + sym->st_size;
+    }
+}
+#endif
+
 int vmp_native_enable(void) {
+#if defined(VMPROF_LINUX) && !defined(RPYTHON_VMPROF) && CPYTHON_HAS_FRAME_EVALUATION
+    if (eval_end == 0) {
+        _find_eval_range();
+    }
+#endif
+#ifdef VMP_BUILTIN_UNWIND
+    // the module table is kept until vmp_native_cleanup
+    int builtin = vmp_unwind_ready() || vmp_unwind_init() == 0;
+#endif
 #ifdef VMPROF_LINUX
     void * oldhandle = NULL;
     struct link_map * map = NULL;
@@ -569,6 +905,8 @@ loaded_libunwind:
         if ((unw_is_signal_frame = dlsym(libhandle, UL_PREFIX PREFIX "_is_signal_frame")) == NULL) {
             goto bail_out;
         }
+        // optional, older versions search the signal frame instead
+        unw_init_local2 = dlsym(libhandle, UL_PREFIX PREFIX "_init_local2");
 #if __powerpc64__
 //getcontext() naming follows a different pattern on PPC64
 #define U_PREFIX
@@ -580,6 +918,7 @@ loaded_libunwind:
         if ((unw_getcontext = dlsym(libhandle, U_PREFIX PREFIX USCORE "getcontext")) == NULL) {
             goto bail_out;
         }
+        libunwind_loaded = 1;
     }
 #endif
 
@@ -589,6 +928,17 @@ loaded_libunwind:
 #ifdef VMPROF_LINUX
 bail_out:
     vmprof_error = dlerror();
+    if (libhandle != NULL) {
+        (void)dlclose(libhandle);
+        libhandle = NULL;
+    }
+#ifdef VMP_BUILTIN_UNWIND
+    if (builtin) {
+        // samples are taken without libunwind
+        vmp_native_traces_enabled = 1;
+        return 1;
+    }
+#endif
     fprintf(stderr, "could not load libunwind at runtime. error: %s\n", vmprof_error);
     vmp_native_traces_enabled = 0;
     return 0;
@@ -606,28 +956,58 @@ void vmp_native_disable(void) {
         }
         libhandle = NULL;
     }
+    libunwind_loaded = 0;
 
     vmp_native_traces_enabled = 0;
-    if (vmp_ranges != NULL) {
-        free(vmp_ranges);
-        vmp_ranges = NULL;
+}
+
+intptr_t vmp_native_function_start(intptr_t pc) {
+    // not called from the signal handler
+#ifdef VMP_BUILTIN_UNWIND
+    uintptr_t start = vmp_unwind_function_start((uintptr_t)pc);
+    if (start != 0) {
+        return (intptr_t)start;
+    }
+#endif
+#ifdef __unix__
+    Dl_info info;
+    if (dladdr((void*)pc, &info) != 0 && info.dli_saddr != NULL) {
+        return (intptr_t)info.dli_saddr;
+    }
+#endif
+    return 0;
+}
+
+void vmp_native_cleanup(void) {
+    // called once no signal handler can walk the stack anymore
+    struct vmp_range_table_s *table;
+#ifdef VMP_BUILTIN_UNWIND
+    vmp_unwind_fini();
+#endif
+    _publish_ranges(NULL, 0, 0);
+    while ((table = vmp_retired_ranges) != NULL) {
+        vmp_retired_ranges = table->retired;
+        if (table->owned) {
+            free(table->ranges);
+        }
+        free(table);
     }
-    vmp_range_count = 0;
 }
 
 int vmp_ignore_ip(intptr_t ip) {
-    if (vmp_range_count == 0) {
+    struct vmp_range_table_s *table = __atomic_load_n(&vmp_range_table, __ATOMIC_ACQUIRE);
+    if (table == NULL || table->count == 0) {
         return 0;
     }
-    int i = vmp_binary_search_ranges(ip, vmp_ranges, (int)vmp_range_count);
+    int i = vmp_binary_search_ranges(ip, table->ranges, (int)table->count);
     if (i == -1) {
         return 0;
     }
 
     assert((i & 1) == 0 && "returned index MUST be even");
 
-    intptr_t v = vmp_ranges[i];
-    intptr_t v2 = vmp_ranges[i+1];
+    intptr_t v = table->ranges[i];
+    intptr_t v2 = table->ranges[i+1];
     return v <= ip && ip <= v2;
 }
 
@@ -664,15 +1044,17 @@ int vmp_binary_search_ranges(intptr_t ip, intptr_t * l, int count) {
 }
 
 int vmp_ignore_symbol_count(void) {
-    return (int)vmp_range_count;
+    struct vmp_range_table_s *table = vmp_range_table;
+    return table == NULL ? 0 : (int)table->count;
 }
 
 intptr_t * vmp_ignore_symbols(void) {
-    return vmp_ranges;
+    struct vmp_range_table_s *table = vmp_range_table;
+    return table == NULL ? NULL : table->ranges;
 }
 
 void vmp_set_ignore_symbols(intptr_t * symbols, int count) {
-    vmp_ranges = symbols;
-    vmp_range_count = count;
+    // the caller keeps the ownership of symbols
+    _publish_ranges(symbols, count, 0);
 }
 #endif
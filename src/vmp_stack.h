@@ -4,19 +4,40 @@
 
 int vmp_walk_and_record_stack(PY_STACK_FRAME_T * frame, void **data,
                               int max_depth, int signal, intptr_t pc);
+int vmp_walk_and_record_signal_stack(PY_STACK_FRAME_T * frame, void **data,
+                                     int max_depth, void * ucontext, intptr_t pc);
+void vmp_native_unwind_from_ucontext(int enabled);
+void vmp_native_builtin_unwind(int enabled);
+int vmp_walk_and_record_python_stack_only(PY_STACK_FRAME_T *frame, void ** result,
+                                          int max_depth, int depth, intptr_t pc);
 
 int vmp_native_enabled(void);
 int vmp_native_enable(void);
 int vmp_ignore_ip(intptr_t ip);
+void vmp_publish_ignore_ranges(intptr_t * ranges, ssize_t count);
+int _ignore_symbols_from_path(const char * name);
 int vmp_binary_search_ranges(intptr_t ip, intptr_t * l, int count);
 int vmp_native_symbols_read(void);
 void vmp_profile_lines(int);
 int vmp_profiles_python_lines(void);
+/* words written per frame, the address of the frame is the last one */
+int _per_loop(void);
+void vmp_native_record_pcs(int);
+int vmp_native_records_pcs(void);
+void vmp_native_record_leaf(int);
+int vmp_native_records_leaf(void);
+/* Stable code ids: INDEX is the co_extra slot (-1 records the address of
+   the code object), see vmp_stable_code_ids in vmp_stack.c */
+void vmp_stable_code_ids(Py_ssize_t index, uintptr_t generation);
 
 int vmp_ignore_symbol_count(void);
 intptr_t * vmp_ignore_symbols(void);
 void vmp_set_ignore_symbols(intptr_t * symbols, int count);
 void vmp_native_disable(void);
+void vmp_native_cleanup(void);
+intptr_t vmp_native_function_start(intptr_t pc);
+long vmp_unwind_failures(void);
+void vmp_reset_unwind_failures(void);
 
 #ifdef __unix__
 int vmp_read_vmaps(const char * fname);
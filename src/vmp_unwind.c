@@ -0,0 +1,887 @@
+#include "vmp_unwind.h"
+
+#ifdef VMP_BUILTIN_UNWIND
+
+#include <link.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+/* pointer encodings of .eh_frame and .eh_frame_hdr */
+#define DW_EH_PE_absptr   0x00
+#define DW_EH_PE_uleb128  0x01
+#define DW_EH_PE_udata2   0x02
+#define DW_EH_PE_udata4   0x03
+#define DW_EH_PE_udata8   0x04
+#define DW_EH_PE_sleb128  0x09
+#define DW_EH_PE_sdata2   0x0a
+#define DW_EH_PE_sdata4   0x0b
+#define DW_EH_PE_sdata8   0x0c
+#define DW_EH_PE_pcrel    0x10
+#define DW_EH_PE_datarel  0x30
+#define DW_EH_PE_indirect 0x80
+#define DW_EH_PE_omit     0xff
+
+/* rules that say where the caller finds a register */
+#define RULE_SAME 0
+#define RULE_UNDEFINED 1
+#define RULE_OFFSET 2           /* saved at cfa + value */
+#define RULE_VAL_OFFSET 3       /* is cfa + value */
+#define RULE_REGISTER 4         /* saved in register value */
+#define RULE_EXPRESSION 5       /* saved at the address an expression computes */
+#define RULE_VAL_EXPRESSION 6   /* is what an expression computes */
+
+/* nesting of DW_CFA_remember_state, gcc and clang use one level */
+#define REMEMBERED_ROWS 4
+#define EXPR_STACK 16
+/* frames larger than this are rather a broken frame pointer */
+#define MAX_FRAME_SIZE (1 << 26)
+
+#define REG_BIT(reg) (((uint64_t)1) << (reg))
+
+struct unw_module_s {
+    uintptr_t start;            /* executable segments of the module */
+    uintptr_t end;
+    const uint8_t *hdr;         /* .eh_frame_hdr */
+    const int32_t *table;       /* (function, FDE) pairs, relative to hdr */
+    size_t count;
+};
+
+struct unw_table_s {
+    struct unw_table_s *retired;
+    size_t count;
+    struct unw_module_s modules[];
+};
+
+/* published with a release store, the signal handler reads the table
+   it finds without taking a lock */
+static struct unw_table_s *volatile current_table = NULL;
+
+struct cie_s {
+    uintptr_t code_align;
+    intptr_t data_align;
+    uintptr_t ra_reg;
+    uint8_t fde_enc;
+    int has_aug_data;
+    const uint8_t *insns;
+    const uint8_t *insns_end;
+};
+
+struct fde_s {
+    uintptr_t start;
+    uintptr_t end;
+    const uint8_t *insns;
+    const uint8_t *insns_end;
+};
+
+struct rule_s {
+    uint8_t how;
+    intptr_t value;             /* offset, register or expression block */
+};
+
+struct row_s {
+    uintptr_t cfa_reg;
+    intptr_t cfa_offset;
+    const uint8_t *cfa_expr;    /* NULL if cfa = cfa_reg + cfa_offset */
+    int ra_signed;              /* aarch64: the return address has a PAC */
+    struct rule_s rules[VMP_UNW_REGS];
+};
+
+static uintptr_t read_uleb(const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+    uintptr_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = *p++;
+        if (shift < 64) {
+            value |= ((uintptr_t)(byte & 0x7f)) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    *pp = p;
+    return value;
+}
+
+static intptr_t read_sleb(const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+    uintptr_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = *p++;
+        if (shift < 64) {
+            value |= ((uintptr_t)(byte & 0x7f)) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+        value |= ~(uintptr_t)0 << shift;
+    }
+    *pp = p;
+    return (intptr_t)value;
+}
+
+#define READ_FIXED(type, p) ({ type _v; memcpy(&_v, (p), sizeof(type)); (p) += sizeof(type); _v; })
+
+static int read_encoded(const uint8_t **pp, uint8_t enc, uintptr_t datarel,
+                        uintptr_t *out)
+{
+    const uint8_t *p = *pp;
+    uintptr_t value;
+
+    switch (enc & 0x0f) {
+    case DW_EH_PE_absptr: value = READ_FIXED(uintptr_t, p); break;
+    case DW_EH_PE_uleb128: value = read_uleb(&p); break;
+    case DW_EH_PE_udata2: value = READ_FIXED(uint16_t, p); break;
+    case DW_EH_PE_udata4: value = READ_FIXED(uint32_t, p); break;
+    case DW_EH_PE_udata8: value = READ_FIXED(uint64_t, p); break;
+    case DW_EH_PE_sleb128: value = read_sleb(&p); break;
+    case DW_EH_PE_sdata2: value = READ_FIXED(int16_t, p); break;
+    case DW_EH_PE_sdata4: value = READ_FIXED(int32_t, p); break;
+    case DW_EH_PE_sdata8: value = READ_FIXED(int64_t, p); break;
+    default: return -1;
+    }
+    switch (enc & 0x70) {
+    case 0: break;
+    case DW_EH_PE_pcrel: value += (uintptr_t)*pp; break;
+    case DW_EH_PE_datarel:
+        if (datarel == 0) {
+            return -1;
+        }
+        value += datarel;
+        break;
+    default: return -1;     /* textrel, funcrel and aligned are not used */
+    }
+    if (enc & DW_EH_PE_indirect) {
+        value = *(const uintptr_t *)value;
+    }
+    *pp = p;
+    *out = value;
+    return 0;
+}
+
+/* the length field of a CIE or FDE, returns the end of the entry */
+static const uint8_t *read_entry_length(const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+    uint64_t length = READ_FIXED(uint32_t, p);
+    if (length == 0xffffffff) {
+        length = READ_FIXED(uint64_t, p);
+    }
+    if (length == 0) {
+        return NULL;        /* terminator */
+    }
+    *pp = p;
+    return p + length;
+}
+
+static int parse_cie(const uint8_t *p, struct cie_s *cie)
+{
+    const uint8_t *end, *aug_end;
+    const char *aug;
+    uint8_t version;
+
+    if ((end = read_entry_length(&p)) == NULL || READ_FIXED(uint32_t, p) != 0) {
+        return -1;
+    }
+    version = *p++;
+    if (version != 1 && version != 3) {
+        return -1;
+    }
+    aug = (const char *)p;
+    p += strlen(aug) + 1;
+    if (aug[0] == 'e' && aug[1] == 'h') {
+        p += sizeof(void *);
+    }
+    cie->code_align = read_uleb(&p);
+    cie->data_align = read_sleb(&p);
+    cie->ra_reg = version == 1 ? *p++ : read_uleb(&p);
+    cie->fde_enc = DW_EH_PE_absptr;
+    cie->has_aug_data = aug[0] == 'z';
+    if (cie->has_aug_data) {
+        uintptr_t skipped, length = read_uleb(&p);
+        aug_end = p + length;
+        for (aug++; *aug != '\0'; aug++) {
+            if (*aug == 'R') {
+                cie->fde_enc = *p++;
+            } else if (*aug == 'L') {
+                p++;
+            } else if (*aug == 'P') {
+                uint8_t enc = *p++;
+                // only the size of the personality pointer matters
+                if (read_encoded(&p, enc & 0x0f, 0, &skipped) < 0) {
+                    return -1;
+                }
+            } else {
+                // 'S', 'B' and 'G' carry no data
+                break;
+            }
+        }
+        p = aug_end;
+    }
+    cie->insns = p;
+    cie->insns_end = end;
+    return 0;
+}
+
+static int parse_fde(const uint8_t *p, struct cie_s *cie, struct fde_s *fde)
+{
+    const uint8_t *end, *cie_p;
+    uintptr_t range;
+    uint32_t cie_offset;
+
+    if ((end = read_entry_length(&p)) == NULL) {
+        return -1;
+    }
+    cie_p = p;
+    cie_offset = READ_FIXED(uint32_t, p);
+    if (cie_offset == 0) {
+        return -1;          /* a CIE, not an FDE */
+    }
+    if (parse_cie(cie_p - cie_offset, cie) < 0) {
+        return -1;
+    }
+    if (read_encoded(&p, cie->fde_enc, 0, &fde->start) < 0 ||
+        read_encoded(&p, cie->fde_enc & 0x0f, 0, &range) < 0) {
+        return -1;
+    }
+    fde->end = fde->start + range;
+    if (cie->has_aug_data) {
+        uintptr_t length = read_uleb(&p);
+        p += length;
+    }
+    fde->insns = p;
+    fde->insns_end = end;
+    return 0;
+}
+
+static const uint8_t *find_fde(uintptr_t pc)
+{
+    struct unw_table_s *table = __atomic_load_n(&current_table, __ATOMIC_ACQUIRE);
+    const struct unw_module_s *module;
+    size_t lo, hi, mid;
+
+    if (table == NULL) {
+        return NULL;
+    }
+    lo = 0;
+    hi = table->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (table->modules[mid].start <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    module = &table->modules[lo - 1];
+    if (pc >= module->end) {
+        return NULL;
+    }
+
+    /* the last function that starts at or before pc */
+    lo = 0;
+    hi = module->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)(module->hdr + module->table[2 * mid]) <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    return module->hdr + module->table[2 * (lo - 1) + 1];
+}
+
+static void set_rule(struct row_s *row, uintptr_t reg, uint8_t how, intptr_t value)
+{
+    // rules of other registers (vector, flags) are not needed for a walk
+    if (reg < VMP_UNW_REGS) {
+        row->rules[reg].how = how;
+        row->rules[reg].value = value;
+    }
+}
+
+/* Evaluate the CFA program of a CIE or FDE up to (and including) the
+   instructions for target, loc is the address the program starts at */
+static int run_cfa(const uint8_t *p, const uint8_t *end, const struct cie_s *cie,
+                   uintptr_t loc, uintptr_t target, struct row_s *row,
+                   const struct row_s *initial)
+{
+    struct row_s remembered[REMEMBERED_ROWS];
+    int remembered_count = 0;
+    uintptr_t reg, value;
+
+    while (p < end) {
+        uint8_t op = *p++;
+        switch (op & 0xc0) {
+        case 0x40:      /* DW_CFA_advance_loc */
+            loc += (op & 0x3f) * cie->code_align;
+            if (loc > target) {
+                return 0;
+            }
+            continue;
+        case 0x80:      /* DW_CFA_offset */
+            value = read_uleb(&p);
+            set_rule(row, op & 0x3f, RULE_OFFSET, (intptr_t)value * cie->data_align);
+            continue;
+        case 0xc0:      /* DW_CFA_restore */
+            reg = op & 0x3f;
+            if (initial == NULL) {
+                return -1;
+            }
+            if (reg < VMP_UNW_REGS) {
+                row->rules[reg] = initial->rules[reg];
+            }
+            continue;
+        }
+        switch (op) {
+        case 0x00:      /* DW_CFA_nop */
+            break;
+        case 0x01:      /* DW_CFA_set_loc */
+            if (read_encoded(&p, cie->fde_enc, 0, &loc) < 0) {
+                return -1;
+            }
+            if (loc > target) {
+                return 0;
+            }
+            break;
+        case 0x02:      /* DW_CFA_advance_loc1 */
+        case 0x03:      /* DW_CFA_advance_loc2 */
+        case 0x04:      /* DW_CFA_advance_loc4 */
+            if (op == 0x02) {
+                value = *p++;
+            } else if (op == 0x03) {
+                value = READ_FIXED(uint16_t, p);
+            } else {
+                value = READ_FIXED(uint32_t, p);
+            }
+            loc += value * cie->code_align;
+            if (loc > target) {
+                return 0;
+            }
+            break;
+        case 0x05:      /* DW_CFA_offset_extended */
+            reg = read_uleb(&p);
+            value = read_uleb(&p);
+            set_rule(row, reg, RULE_OFFSET, (intptr_t)value * cie->data_align);
+            break;
+        case 0x06:      /* DW_CFA_restore_extended */
+            reg = read_uleb(&p);
+            if (initial == NULL) {
+                return -1;
+            }
+            if (reg < VMP_UNW_REGS) {
+                row->rules[reg] = initial->rules[reg];
+            }
+            break;
+        case 0x07:      /* DW_CFA_undefined */
+            set_rule(row, read_uleb(&p), RULE_UNDEFINED, 0);
+            break;
+        case 0x08:      /* DW_CFA_same_value */
+            set_rule(row, read_uleb(&p), RULE_SAME, 0);
+            break;
+        case 0x09:      /* DW_CFA_register */
+            reg = read_uleb(&p);
+            value = read_uleb(&p);
+            set_rule(row, reg, RULE_REGISTER, (intptr_t)value);
+            break;
+        case 0x0a:      /* DW_CFA_remember_state */
+            if (remembered_count == REMEMBERED_ROWS) {
+                return -1;
+            }
+            remembered[remembered_count++] = *row;
+            break;
+        case 0x0b:      /* DW_CFA_restore_state */
+            if (remembered_count == 0) {
+                return -1;
+            }
+            *row = remembered[--remembered_count];
+            break;
+        case 0x0c:      /* DW_CFA_def_cfa */
+            row->cfa_reg = read_uleb(&p);
+            row->cfa_offset = (intptr_t)read_uleb(&p);
+            row->cfa_expr = NULL;
+            break;
+        case 0x0d:      /* DW_CFA_def_cfa_register */
+            row->cfa_reg = read_uleb(&p);
+            row->cfa_expr = NULL;
+            break;
+        case 0x0e:      /* DW_CFA_def_cfa_offset */
+            row->cfa_offset = (intptr_t)read_uleb(&p);
+            break;
+        case 0x0f:      /* DW_CFA_def_cfa_expression */
+            row->cfa_expr = p;
+            value = read_uleb(&p);
+            p += value;
+            break;
+        case 0x10:      /* DW_CFA_expression */
+        case 0x16:      /* DW_CFA_val_expression */
+            reg = read_uleb(&p);
+            set_rule(row, reg, op == 0x10 ? RULE_EXPRESSION : RULE_VAL_EXPRESSION,
+                     (intptr_t)p);
+            value = read_uleb(&p);
+            p += value;
+            break;
+        case 0x11:      /* DW_CFA_offset_extended_sf */
+            reg = read_uleb(&p);
+            set_rule(row, reg, RULE_OFFSET, read_sleb(&p) * cie->data_align);
+            break;
+        case 0x12:      /* DW_CFA_def_cfa_sf */
+            row->cfa_reg = read_uleb(&p);
+            row->cfa_offset = read_sleb(&p) * cie->data_align;
+            row->cfa_expr = NULL;
+            break;
+        case 0x13:      /* DW_CFA_def_cfa_offset_sf */
+            row->cfa_offset = read_sleb(&p) * cie->data_align;
+            break;
+        case 0x14:      /* DW_CFA_val_offset */
+            reg = read_uleb(&p);
+            value = read_uleb(&p);
+            set_rule(row, reg, RULE_VAL_OFFSET, (intptr_t)value * cie->data_align);
+            break;
+        case 0x15:      /* DW_CFA_val_offset_sf */
+            reg = read_uleb(&p);
+            set_rule(row, reg, RULE_VAL_OFFSET, read_sleb(&p) * cie->data_align);
+            break;
+#ifdef __aarch64__
+        case 0x2d:      /* DW_CFA_AARCH64_negate_ra_state */
+            row->ra_signed = !row->ra_signed;
+            break;
+#endif
+        case 0x2e:      /* DW_CFA_GNU_args_size */
+            (void)read_uleb(&p);
+            break;
+        case 0x2f:      /* DW_CFA_GNU_negative_offset_extended */
+            reg = read_uleb(&p);
+            value = read_uleb(&p);
+            set_rule(row, reg, RULE_OFFSET, -(intptr_t)value * cie->data_align);
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* A DWARF expression as used by CFI: register relative addresses,
+   constants, arithmetic and loads (e.g. the .plt entries on x86_64 or
+   functions that realign the stack). block points to its length. */
+static int eval_expr(const vmp_unw_cursor_t *cursor, const uint8_t *block,
+                     uintptr_t initial, int push_initial, uintptr_t *out)
+{
+    uintptr_t stack[EXPR_STACK];
+    int top = 0;
+    const uint8_t *p = block, *end;
+    uintptr_t a, reg;
+
+#define PUSH(v) do { if (top == EXPR_STACK) return -1; stack[top++] = (v); } while (0)
+#define POP(v) do { if (top == 0) return -1; (v) = stack[--top]; } while (0)
+#define BINARY(expr) do { uintptr_t b; POP(b); POP(a); PUSH(expr); } while (0)
+
+    a = read_uleb(&p);
+    end = p + a;
+    if (push_initial) {
+        PUSH(initial);
+    }
+    while (p < end) {
+        uint8_t op = *p++;
+        if (op >= 0x30 && op <= 0x4f) {            /* DW_OP_lit<n> */
+            PUSH(op - 0x30);
+            continue;
+        }
+        if (op >= 0x70 && op <= 0x8f) {            /* DW_OP_breg<n> */
+            reg = op - 0x70;
+            if (reg >= VMP_UNW_REGS || !(cursor->known & REG_BIT(reg))) {
+                return -1;
+            }
+            PUSH(cursor->regs[reg] + read_sleb(&p));
+            continue;
+        }
+        switch (op) {
+        case 0x06: POP(a); PUSH(*(const uintptr_t *)a); break;     /* deref */
+        case 0x08: PUSH(*p); p++; break;                            /* const1u */
+        case 0x09: PUSH((intptr_t)(int8_t)*p); p++; break;          /* const1s */
+        case 0x0a: PUSH(READ_FIXED(uint16_t, p)); break;            /* const2u */
+        case 0x0b: PUSH((intptr_t)READ_FIXED(int16_t, p)); break;   /* const2s */
+        case 0x0c: PUSH(READ_FIXED(uint32_t, p)); break;            /* const4u */
+        case 0x0d: PUSH((intptr_t)READ_FIXED(int32_t, p)); break;   /* const4s */
+        case 0x0e: PUSH(READ_FIXED(uint64_t, p)); break;            /* const8u */
+        case 0x0f: PUSH((intptr_t)READ_FIXED(int64_t, p)); break;   /* const8s */
+        case 0x10: PUSH(read_uleb(&p)); break;                      /* constu */
+        case 0x11: PUSH(read_sleb(&p)); break;                      /* consts */
+        case 0x12: POP(a); PUSH(a); PUSH(a); break;                 /* dup */
+        case 0x13: POP(a); break;                                   /* drop */
+        case 0x14:                                                  /* over */
+            if (top < 2) {
+                return -1;
+            }
+            a = stack[top - 2];
+            PUSH(a);
+            break;
+        case 0x16:                                                  /* swap */
+            if (top < 2) {
+                return -1;
+            }
+            a = stack[top - 1];
+            stack[top - 1] = stack[top - 2];
+            stack[top - 2] = a;
+            break;
+        case 0x1a: BINARY(a & b); break;                            /* and */
+        case 0x1c: BINARY(a - b); break;                            /* minus */
+        case 0x1e: BINARY(a * b); break;                            /* mul */
+        case 0x21: BINARY(a | b); break;                            /* or */
+        case 0x22: BINARY(a + b); break;                            /* plus */
+        case 0x23: POP(a); PUSH(a + read_uleb(&p)); break;          /* plus_uconst */
+        case 0x24: BINARY(a << b); break;                           /* shl */
+        case 0x25: BINARY(a >> b); break;                           /* shr */
+        case 0x26: BINARY((uintptr_t)((intptr_t)a >> b)); break;    /* shra */
+        case 0x27: BINARY(a ^ b); break;                            /* xor */
+        case 0x29: BINARY(a == b); break;                           /* eq */
+        case 0x2a: BINARY((intptr_t)a >= (intptr_t)b); break;       /* ge */
+        case 0x2b: BINARY((intptr_t)a > (intptr_t)b); break;        /* gt */
+        case 0x2c: BINARY((intptr_t)a <= (intptr_t)b); break;       /* le */
+        case 0x2d: BINARY((intptr_t)a < (intptr_t)b); break;        /* lt */
+        case 0x2e: BINARY(a != b); break;                           /* ne */
+        case 0x96: break;                                           /* nop */
+        default:
+            return -1;
+        }
+    }
+    POP(a);
+    *out = a;
+    return 0;
+
+#undef PUSH
+#undef POP
+#undef BINARY
+}
+
+static uintptr_t strip_pac(uintptr_t ra)
+{
+#ifdef __aarch64__
+    // the pointer authentication code lives in the unused upper bits
+    // of a 48 bit virtual address
+    ra &= (((uintptr_t)1) << 48) - 1;
+#endif
+    return ra;
+}
+
+static void lookup(vmp_unw_cursor_t *cursor)
+{
+    struct cie_s cie;
+    struct fde_s fde;
+    // a return address might be the first instruction of the next function
+    uintptr_t target = cursor->first ? cursor->pc : cursor->pc - 1;
+
+    cursor->start_ip = 0;
+    cursor->fde = find_fde(target);
+    if (cursor->fde == NULL) {
+        return;
+    }
+    if (parse_fde(cursor->fde, &cie, &fde) < 0 ||
+        target < fde.start || target >= fde.end) {
+        // pc lies between two functions, e.g. in a .plt section
+        cursor->fde = NULL;
+        return;
+    }
+    cursor->start_ip = fde.start;
+}
+
+uintptr_t vmp_unwind_function_start(uintptr_t pc)
+{
+    vmp_unw_cursor_t cursor;
+    cursor.pc = pc;
+    cursor.first = 1;
+    lookup(&cursor);
+    return cursor.start_ip;
+}
+
+int vmp_unwind_init_cursor(vmp_unw_cursor_t *cursor, void *ucontext)
+{
+    const ucontext_t *uc = (const ucontext_t *)ucontext;
+#if defined(__x86_64__)
+    static const int gregs[VMP_UNW_REGS] = {
+        REG_RAX, REG_RDX, REG_RCX, REG_RBX, REG_RSI, REG_RDI, REG_RBP, REG_RSP,
+        REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+        REG_RIP,
+    };
+    int i;
+    for (i = 0; i < VMP_UNW_REGS; i++) {
+        cursor->regs[i] = (uintptr_t)uc->uc_mcontext.gregs[gregs[i]];
+    }
+    cursor->pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+#else
+    int i;
+    for (i = 0; i < 31; i++) {
+        cursor->regs[i] = (uintptr_t)uc->uc_mcontext.regs[i];
+    }
+    cursor->regs[VMP_UNW_REG_SP] = (uintptr_t)uc->uc_mcontext.sp;
+    cursor->pc = (uintptr_t)uc->uc_mcontext.pc;
+#endif
+    cursor->known = ~(uint64_t)0;
+    cursor->first = 1;
+    if (cursor->pc == 0) {
+        return -1;
+    }
+    lookup(cursor);
+    return 0;
+}
+
+static int step_frame_pointer(vmp_unw_cursor_t *cursor)
+{
+    uintptr_t fp = cursor->regs[VMP_UNW_REG_FP];
+    uintptr_t sp = cursor->regs[VMP_UNW_REG_SP];
+    const uintptr_t *record;
+    uintptr_t ra;
+
+    // both x86_64 and aarch64 keep (caller fp, return address) at fp
+    if (!(cursor->known & REG_BIT(VMP_UNW_REG_FP)) ||
+        !(cursor->known & REG_BIT(VMP_UNW_REG_SP)) ||
+        fp < sp || fp - sp > MAX_FRAME_SIZE || (fp & (sizeof(void *) - 1)) != 0) {
+        return -1;
+    }
+    record = (const uintptr_t *)fp;
+    ra = strip_pac(record[1]);
+    if (ra == 0) {
+        return 0;
+    }
+    cursor->regs[VMP_UNW_REG_FP] = record[0];
+    cursor->regs[VMP_UNW_REG_SP] = fp + 2 * sizeof(void *);
+    cursor->regs[VMP_UNW_REG_RA] = ra;
+    cursor->known = REG_BIT(VMP_UNW_REG_FP) | REG_BIT(VMP_UNW_REG_SP) |
+                    REG_BIT(VMP_UNW_REG_RA);
+    cursor->pc = ra;
+    cursor->first = 0;
+    lookup(cursor);
+    return 1;
+}
+
+int vmp_unwind_step(vmp_unw_cursor_t *cursor)
+{
+    struct cie_s cie;
+    struct fde_s fde;
+    struct row_s row, initial;
+    uintptr_t regs[VMP_UNW_REGS];
+    uint64_t known;
+    uintptr_t cfa, value, ra;
+    int i;
+
+    if (cursor->fde == NULL) {
+        return step_frame_pointer(cursor);
+    }
+    if (parse_fde(cursor->fde, &cie, &fde) < 0 || cie.ra_reg >= VMP_UNW_REGS) {
+        return -1;
+    }
+    memset(&row, 0, sizeof(row));       // RULE_SAME for every register
+    if (run_cfa(cie.insns, cie.insns_end, &cie, 0, UINTPTR_MAX, &row, NULL) < 0) {
+        return -1;
+    }
+    initial = row;
+    if (run_cfa(fde.insns, fde.insns_end, &cie, fde.start,
+                cursor->first ? cursor->pc : cursor->pc - 1, &row, &initial) < 0) {
+        return -1;
+    }
+
+    if (row.cfa_expr != NULL) {
+        if (eval_expr(cursor, row.cfa_expr, 0, 0, &cfa) < 0) {
+            return -1;
+        }
+    } else {
+        if (row.cfa_reg >= VMP_UNW_REGS || !(cursor->known & REG_BIT(row.cfa_reg))) {
+            return -1;
+        }
+        cfa = cursor->regs[row.cfa_reg] + row.cfa_offset;
+    }
+
+    if (row.rules[cie.ra_reg].how == RULE_UNDEFINED) {
+        return 0;           // the outermost frame, e.g. _start
+    }
+
+    memcpy(regs, cursor->regs, sizeof(regs));
+    known = cursor->known;
+    for (i = 0; i < VMP_UNW_REGS; i++) {
+        const struct rule_s *rule = &row.rules[i];
+        switch (rule->how) {
+        case RULE_SAME:
+            continue;
+        case RULE_UNDEFINED:
+            known &= ~REG_BIT(i);
+            continue;
+        case RULE_OFFSET:
+            value = *(const uintptr_t *)(cfa + rule->value);
+            break;
+        case RULE_VAL_OFFSET:
+            value = cfa + rule->value;
+            break;
+        case RULE_REGISTER:
+            if ((uintptr_t)rule->value >= VMP_UNW_REGS || !(cursor->known & REG_BIT(rule->value))) {
+                known &= ~REG_BIT(i);
+                continue;
+            }
+            value = cursor->regs[rule->value];
+            break;
+        case RULE_EXPRESSION:
+        case RULE_VAL_EXPRESSION:
+            if (eval_expr(cursor, (const uint8_t *)rule->value, cfa, 1, &value) < 0) {
+                known &= ~REG_BIT(i);
+                continue;
+            }
+            if (rule->how == RULE_EXPRESSION) {
+                value = *(const uintptr_t *)value;
+            }
+            break;
+        default:
+            return -1;
+        }
+        regs[i] = value;
+        known |= REG_BIT(i);
+    }
+    // by definition, the stack pointer of the caller is the cfa
+    if (row.rules[VMP_UNW_REG_SP].how == RULE_SAME) {
+        regs[VMP_UNW_REG_SP] = cfa;
+        known |= REG_BIT(VMP_UNW_REG_SP);
+    }
+
+    if (!(known & REG_BIT(cie.ra_reg))) {
+        return -1;
+    }
+    ra = regs[cie.ra_reg];
+    if (row.ra_signed) {
+        ra = strip_pac(ra);
+    }
+    if (ra == 0) {
+        return 0;
+    }
+    // the stack grows down, a caller never lives below its callee
+    if (regs[VMP_UNW_REG_SP] < cursor->regs[VMP_UNW_REG_SP] ||
+        (regs[VMP_UNW_REG_SP] == cursor->regs[VMP_UNW_REG_SP] && ra == cursor->pc)) {
+        return -1;
+    }
+
+    memcpy(cursor->regs, regs, sizeof(regs));
+    cursor->known = known;
+    cursor->pc = ra;
+    cursor->first = 0;
+    lookup(cursor);
+    return 1;
+}
+
+struct table_builder_s {
+    struct unw_module_s *modules;
+    size_t count;
+    size_t capacity;
+};
+
+static int add_module(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    struct table_builder_s *builder = (struct table_builder_s *)arg;
+    struct unw_module_s *module;
+    const uint8_t *hdr = NULL, *p;
+    uintptr_t start = UINTPTR_MAX, end = 0, eh_frame, count;
+    int i;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+            uintptr_t seg = info->dlpi_addr + phdr->p_vaddr;
+            if (seg < start) {
+                start = seg;
+            }
+            if (seg + phdr->p_memsz > end) {
+                end = seg + phdr->p_memsz;
+            }
+        } else if (phdr->p_type == PT_GNU_EH_FRAME) {
+            hdr = (const uint8_t *)(info->dlpi_addr + phdr->p_vaddr);
+        }
+    }
+    if (hdr == NULL || start >= end) {
+        return 0;
+    }
+    // version 1, the search table must be present and hold 32 bit
+    // offsets relative to the header (which is what ld, gold and lld write)
+    if (hdr[0] != 1 || hdr[3] != (DW_EH_PE_datarel | DW_EH_PE_sdata4)) {
+        return 0;
+    }
+    p = hdr + 4;
+    if (read_encoded(&p, hdr[1], (uintptr_t)hdr, &eh_frame) < 0 ||
+        read_encoded(&p, hdr[2], (uintptr_t)hdr, &count) < 0 || count == 0) {
+        return 0;
+    }
+
+    if (builder->count == builder->capacity) {
+        size_t capacity = builder->capacity ? builder->capacity * 2 : 32;
+        struct unw_module_s *modules = realloc(builder->modules, capacity * sizeof(*modules));
+        if (modules == NULL) {
+            return 0;
+        }
+        builder->modules = modules;
+        builder->capacity = capacity;
+    }
+    module = &builder->modules[builder->count++];
+    module->start = start;
+    module->end = end;
+    module->hdr = hdr;
+    module->table = (const int32_t *)p;
+    module->count = count;
+    return 0;
+}
+
+static int compare_modules(const void *a, const void *b)
+{
+    uintptr_t sa = ((const struct unw_module_s *)a)->start;
+    uintptr_t sb = ((const struct unw_module_s *)b)->start;
+    return sa < sb ? -1 : sa > sb;
+}
+
+int vmp_unwind_init(void)
+{
+    struct table_builder_s builder = {NULL, 0, 0};
+    struct unw_table_s *table;
+
+    dl_iterate_phdr(add_module, &builder);
+    if (builder.count == 0) {
+        free(builder.modules);
+        return -1;
+    }
+    qsort(builder.modules, builder.count, sizeof(struct unw_module_s), compare_modules);
+    table = malloc(sizeof(struct unw_table_s) + builder.count * sizeof(struct unw_module_s));
+    if (table == NULL) {
+        free(builder.modules);
+        return -1;
+    }
+    memcpy(table->modules, builder.modules, builder.count * sizeof(struct unw_module_s));
+    table->count = builder.count;
+    free(builder.modules);
+
+    table->retired = current_table;
+    __atomic_store_n(&current_table, table, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void vmp_unwind_fini(void)
+{
+    struct unw_table_s *table = current_table, *retired;
+    current_table = NULL;
+    while (table != NULL) {
+        retired = table->retired;
+        free(table);
+        table = retired;
+    }
+}
+
+int vmp_unwind_ready(void)
+{
+    return current_table != NULL;
+}
+
+#endif
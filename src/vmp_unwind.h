@@ -0,0 +1,75 @@
+#pragma once
+/* A small unwinder for the native stack walk of the signal handler */
+
+#include "vmprof.h"
+
+#include <stdint.h>
+
+/* Instead of calling into libunwind for every frame, the handler walks
+   the native stack with the DWARF call frame information (CFI) of the
+   .eh_frame sections. The index the linker writes for them
+   (.eh_frame_hdr, a sorted table of function start -> FDE) is collected
+   for every loaded module by vmp_unwind_init, outside of the signal
+   handler. In the handler, the FDE of a pc is found by two binary
+   searches (module, function) and its CFA program is evaluated on the
+   stack: no heap, no locks, no system calls. Frames without CFI are
+   stepped by following the frame pointer chain.
+
+   Memory reads can fault on a corrupted stack, the walk of the signal
+   handler is guarded (see fault_guard in vmprof_unix.c). */
+#if defined(VMPROF_LINUX) && (defined(__x86_64__) || defined(__aarch64__))
+#define VMP_BUILTIN_UNWIND 1
+#endif
+
+#ifdef VMP_BUILTIN_UNWIND
+
+#include <setjmp.h>
+
+#if defined(__x86_64__)
+/* DWARF register numbers: rax rdx rcx rbx rsi rdi rbp rsp r8-r15 rip */
+#define VMP_UNW_REGS 17
+#define VMP_UNW_REG_FP 6
+#define VMP_UNW_REG_SP 7
+#define VMP_UNW_REG_RA 16
+#else
+/* DWARF register numbers: x0-x30 sp */
+#define VMP_UNW_REGS 32
+#define VMP_UNW_REG_FP 29
+#define VMP_UNW_REG_SP 31
+#define VMP_UNW_REG_RA 30
+#endif
+
+typedef struct vmp_unw_cursor_s {
+    uintptr_t regs[VMP_UNW_REGS];
+    uint64_t known;         /* bit n is set if regs[n] holds a value */
+    uintptr_t pc;
+    uintptr_t start_ip;     /* start of the function of pc, 0 if unknown */
+    const uint8_t *fde;     /* FDE that covers pc, NULL if there is none */
+    int first;              /* pc is the interrupted instruction itself */
+} vmp_unw_cursor_t;
+
+/* (Re)build the module table, not async-signal-safe. Returns -1 if no
+   module could be indexed. Tables that are replaced stay allocated until
+   vmp_unwind_fini, a handler might still be reading them. */
+int vmp_unwind_init(void);
+/* Free all tables, the signal handler must not run anymore */
+void vmp_unwind_fini(void);
+int vmp_unwind_ready(void);
+
+/* The start of the function that contains pc (as its FDE says), 0 if
+   it is not known. Works for static functions of stripped modules too. */
+uintptr_t vmp_unwind_function_start(uintptr_t pc);
+
+/* async-signal-safe: start at the instruction the signal interrupted,
+   ucontext is the third argument of a SA_SIGINFO handler */
+int vmp_unwind_init_cursor(vmp_unw_cursor_t *cursor, void *ucontext);
+/* async-signal-safe: move to the caller. Returns 1 if there is one,
+   0 at the outermost frame and -1 if the frame could not be stepped */
+int vmp_unwind_step(vmp_unw_cursor_t *cursor);
+
+/* A SIGSEGV in this thread jumps to GUARD (sigsetjmp(*guard, 0)) until it
+   is set to NULL again. Only code that holds no locks may be guarded.
+   Implemented in vmprof_unix.c, which installs the SIGSEGV handler. */
+void vmp_set_fault_guard(sigjmp_buf *guard);
+
+#endif
@@ -19,6 +19,17 @@
 #define MARKER_TIME_N_ZONE '\x06'
 #define MARKER_META '\x07'
 #define MARKER_NATIVE_SYMBOLS '\x08'
+#define MARKER_STACKTRACE_DEF '\x09'
+#define MARKER_STACKTRACE_REF '\x0a'
+#define MARKER_PROFILER_STATS '\x0b'
+#define MARKER_ALLOCATION '\x0c'
+#define MARKER_LINE_TABLE '\x0d'
+#define MARKER_MODULE '\x0e'
+#define MARKER_CODE_ALIAS '\x0f'
+#define MARKER_STRING '\x10'
+#define MARKER_CODE_NAME '\x11'
+#define MARKER_CHUNK '\x12'
+#define MARKER_CHUNK_INDEX '\x13'
 
 #define VERSION_BASE '\x00'
 #define VERSION_THREAD_ID '\x01'
@@ -27,12 +38,16 @@
 #define VERSION_MODE_AWARE '\x04'
 #define VERSION_DURATION '\x05'
 #define VERSION_TIMESTAMP '\x06'
+#define VERSION_LINE_OFFSETS '\x07'
+#define VERSION_CHUNKS '\x08'
 
 #define PROFILE_MEMORY '\x01'
 #define PROFILE_LINES  '\x02'
 #define PROFILE_NATIVE '\x04'
 #define PROFILE_RPYTHON '\x08'
 #define PROFILE_REAL_TIME '\x10'
+#define PROFILE_NATIVE_PCS '\x20'
+#define PROFILE_NATIVE_LEAF '\x40'
 
 #define DYN_JIT_FLAG 0xbeefbeef
 
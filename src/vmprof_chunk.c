@@ -0,0 +1,432 @@
+#include "vmprof_chunk.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/* a record of one buffer has fewer words */
+#define CHUNK_MAX_DEPTH (SINGLE_BUF_SIZE / sizeof(void *))
+/* room for the marker, the size and the four numbers of the header */
+#define CHUNK_HEADER_MAX (1 + 4 + 4 * 10)
+#define CHUNK_KIND_STACK 0
+#define CHUNK_KIND_DEFINITION 1
+#define CHUNK_KIND_REFERENCE 2
+#define CHUNK_HAS_RSS 4
+
+struct chunk_builder_s {
+    uintptr_t thread;       /* 0 if the builder is free */
+    long samples;
+    int64_t first_usec, last_usec;
+    long size;              /* of the encoded samples */
+    long depth;             /* of the previous stack */
+    intptr_t rss;           /* the previous one */
+    /* CHUNK_HEADER_MAX bytes for the header, then the samples */
+    unsigned char *data;
+    /* the previous stack, root first */
+    uintptr_t *stack;
+    /* while the chunk is written: its first byte in DATA (NULL before),
+       the bytes written so far and its offset in the file */
+    unsigned char *write_start;
+    long written;
+    off_t write_offset;
+};
+
+struct chunk_index_s {
+    int64_t offset, size, thread, samples, first_usec, last_usec;
+};
+
+static int chunks_enabled = 0;
+static char *chunks_memory = NULL;
+static size_t chunks_memory_size = 0;
+static struct chunk_builder_s builders[VMP_CHUNK_BUILDERS];
+static struct chunk_index_s *chunk_index = NULL;
+static long chunk_index_count = 0;
+static int chunk_index_complete = 1;
+static struct timespec chunks_start;
+static off_t chunk_index_offset = -1;
+/* the builder of a chunk that was written in part (a write() error),
+   nothing else must be written before the rest of it */
+static struct chunk_builder_s *chunk_pending = NULL;
+
+void vmp_chunks_release(void)
+{
+    if (chunks_memory != NULL) {
+        munmap(chunks_memory, chunks_memory_size);
+        chunks_memory = NULL;
+    }
+    chunks_enabled = 0;
+}
+
+int vmp_chunks_enable(int enabled)
+{
+    /* only called while the signal handler is not installed */
+    size_t per_builder = VMP_CHUNK_SIZE + CHUNK_MAX_DEPTH * sizeof(uintptr_t);
+    char *p;
+    long i;
+
+    vmp_chunks_release();
+    memset(builders, 0, sizeof(builders));
+    chunk_pending = NULL;
+    chunk_index_count = 0;
+    chunk_index_complete = 1;
+    chunk_index_offset = -1;
+    if (!enabled)
+        return 0;
+    /* untouched pages cost nothing, most threads never get a builder */
+    chunks_memory_size = VMP_CHUNK_BUILDERS * per_builder +
+                         VMP_CHUNK_INDEX_SIZE * sizeof(struct chunk_index_s);
+    p = mmap(NULL, chunks_memory_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    chunks_memory = p;
+    for (i = 0; i < VMP_CHUNK_BUILDERS; i++) {
+        builders[i].data = (unsigned char *)p;
+        builders[i].stack = (uintptr_t *)(p + VMP_CHUNK_SIZE);
+        p += per_builder;
+    }
+    chunk_index = (struct chunk_index_s *)p;
+    clock_gettime(CLOCK_MONOTONIC, &chunks_start);
+    chunks_enabled = 1;
+    return 0;
+}
+
+int vmp_chunks_enabled(void)
+{
+    return chunks_enabled;
+}
+
+void vmp_chunks_forget(void)
+{
+    /* the memory is not unmapped, a signal handler might still run */
+    chunks_enabled = 0;
+    chunk_pending = NULL;
+}
+
+int64_t vmp_chunks_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - chunks_start.tv_sec) * 1000000 +
+           (now.tv_nsec - chunks_start.tv_nsec) / 1000;
+}
+
+static unsigned char *_put_varint(unsigned char *p, uint64_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+static unsigned char *_put_zigzag(unsigned char *p, int64_t value)
+{
+    return _put_varint(p, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static int _write_fully(int fd, const unsigned char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static int _write_builder(int fd, struct chunk_builder_s *b)
+{
+    /* writes the rest of the chunk of B, B is kept until all of it is
+       written (and the following writes wait for it) */
+    long size = b->data + CHUNK_HEADER_MAX + b->size - b->write_start;
+
+    while (b->written < size) {
+        ssize_t count = write(fd, b->write_start + b->written, size - b->written);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            chunk_pending = b;
+            return -1;
+        }
+        b->written += count;
+    }
+    chunk_pending = NULL;
+    if (b->write_offset < 0 || chunk_index_count >= VMP_CHUNK_INDEX_SIZE) {
+        chunk_index_complete = 0;
+    } else {
+        struct chunk_index_s *entry = &chunk_index[chunk_index_count++];
+        entry->offset = b->write_offset;
+        entry->size = size;
+        entry->thread = (int64_t)b->thread;
+        entry->samples = b->samples;
+        entry->first_usec = b->first_usec;
+        entry->last_usec = b->last_usec;
+    }
+    b->thread = 0;
+    b->samples = 0;
+    b->size = 0;
+    b->depth = 0;
+    b->rss = 0;
+    b->write_start = NULL;
+    return 0;
+}
+
+static int _flush_builder(int fd, struct chunk_builder_s *b)
+{
+    unsigned char header[CHUNK_HEADER_MAX];
+    unsigned char *end;
+    uint32_t rest;
+
+    if (b->samples == 0) {
+        b->thread = 0;
+        return 0;
+    }
+    end = _put_varint(header + 5, b->thread);
+    end = _put_varint(end, b->samples);
+    end = _put_varint(end, b->first_usec);
+    end = _put_varint(end, b->last_usec);
+    rest = (uint32_t)((end - header - 5) + b->size);
+    header[0] = MARKER_CHUNK;
+    memcpy(header + 1, &rest, 4);
+    /* right before the samples, one write() for the chunk */
+    b->write_start = b->data + CHUNK_HEADER_MAX - (end - header);
+    memcpy(b->write_start, header, end - header);
+    b->written = 0;
+    b->write_offset = lseek(fd, 0, SEEK_CUR);
+    return _write_builder(fd, b);
+}
+
+static struct chunk_builder_s *_builder_of(uintptr_t thread)
+{
+    /* the builder of THREAD or a free one, NULL if all are taken */
+    struct chunk_builder_s *free_builder = NULL;
+    long i;
+
+    for (i = 0; i < VMP_CHUNK_BUILDERS; i++) {
+        struct chunk_builder_s *b = &builders[i];
+        if (b->thread == thread)
+            return b;
+        if (b->thread == 0 && free_builder == NULL)
+            free_builder = b;
+    }
+    if (free_builder != NULL)
+        free_builder->thread = thread;
+    return free_builder;
+}
+
+static struct chunk_builder_s *_oldest_builder(void)
+{
+    struct chunk_builder_s *oldest = &builders[0];
+    long i;
+
+    for (i = 1; i < VMP_CHUNK_BUILDERS; i++) {
+        if (builders[i].first_usec < oldest->first_usec)
+            oldest = &builders[i];
+    }
+    return oldest;
+}
+
+int vmp_chunks_pending(void)
+{
+    return chunk_pending != NULL;
+}
+
+int vmp_chunks_resume(int fd)
+{
+    if (chunk_pending == NULL)
+        return 0;
+    return _write_builder(fd, chunk_pending);
+}
+
+int vmp_chunks_add(int fd, const char *data, long size, int64_t usec,
+                   int may_write)
+{
+    /* DATA starts at the marker of a record of the signal handler (see
+       _vmprof_sample_stack): the count and the depth (longs), the
+       frames, the thread id, the RSS if it is known and, for a
+       definition, the id of the stack */
+    char marker;
+    long count, depth, words, extra, kind, i, keep;
+    uintptr_t thread, stack_id = 0;
+    intptr_t rss = 0;
+    const char *frames;
+    struct chunk_builder_s *b;
+    unsigned char *p;
+
+    if (!chunks_enabled || size < (long)(1 + 2 * sizeof(long)))
+        return 0;
+    if (chunk_pending != NULL && (!may_write || vmp_chunks_resume(fd) < 0))
+        return -1;
+    marker = data[0];
+    memcpy(&count, data + 1, sizeof(long));
+    memcpy(&depth, data + 1 + sizeof(long), sizeof(long));
+    frames = data + 1 + 2 * sizeof(long);
+    words = (size - 1 - 2 * sizeof(long)) / sizeof(void *);
+    if (count != 1)
+        return 0;
+    if (marker == MARKER_STACKTRACE) {
+        kind = CHUNK_KIND_STACK;
+        extra = words - depth - 1;
+    } else if (marker == MARKER_STACKTRACE_DEF) {
+        kind = CHUNK_KIND_DEFINITION;
+        extra = words - depth - 2;
+    } else if (marker == MARKER_STACKTRACE_REF) {
+        /* the depth is the id of the stack */
+        kind = CHUNK_KIND_REFERENCE;
+        stack_id = depth;
+        depth = 0;
+        extra = words - 1;
+    } else {
+        return 0;
+    }
+    if (depth < 0 || depth > (long)CHUNK_MAX_DEPTH || extra < 0 || extra > 1)
+        return 0;
+    memcpy(&thread, frames + depth * sizeof(void *), sizeof(void *));
+    if (extra)
+        memcpy(&rss, frames + (depth + 1) * sizeof(void *), sizeof(void *));
+    if (kind == CHUNK_KIND_DEFINITION)
+        memcpy(&stack_id, frames + (depth + 1 + extra) * sizeof(void *),
+               sizeof(void *));
+    if (thread == 0)
+        return 0;
+
+    b = _builder_of(thread);
+    if (b == NULL) {
+        /* more threads than builders: the oldest chunk is written */
+        if (!may_write)
+            return 0;
+        b = _oldest_builder();
+        if (_flush_builder(fd, b) < 0)
+            return -1;
+        b->thread = thread;
+    }
+    /* every number takes 10 bytes at most */
+    if (b->size + 10 * (depth + 5) > VMP_CHUNK_SIZE - CHUNK_HEADER_MAX) {
+        if (!may_write)
+            return 0;
+        if (_flush_builder(fd, b) < 0)
+            return -1;
+        b->thread = thread;
+    }
+
+    p = b->data + CHUNK_HEADER_MAX + b->size;
+    p = _put_varint(p, kind | (extra ? CHUNK_HAS_RSS : 0));
+    if (kind != CHUNK_KIND_REFERENCE) {
+        /* the frames are leaf first, the previous stack root first */
+        uintptr_t *prev = b->stack;
+        keep = 0;
+        while (keep < depth && keep < b->depth &&
+               memcmp(frames + (depth - 1 - keep) * sizeof(void *),
+                      &prev[keep], sizeof(void *)) == 0)
+            keep++;
+        p = _put_varint(p, keep);
+        p = _put_varint(p, depth - keep);
+        for (i = keep; i < depth; i++) {
+            uintptr_t word;
+            memcpy(&word, frames + (depth - 1 - i) * sizeof(void *), sizeof(void *));
+            p = _put_zigzag(p, (int64_t)(word - (i < b->depth ? prev[i] : 0)));
+            prev[i] = word;
+        }
+        b->depth = depth;
+    }
+    if (kind != CHUNK_KIND_STACK)
+        p = _put_varint(p, stack_id);
+    if (extra) {
+        p = _put_zigzag(p, (int64_t)(rss - b->rss));
+        b->rss = rss;
+    }
+    b->size = p - (b->data + CHUNK_HEADER_MAX);
+    /* the buffers of a thread are not drained in the order of their
+       samples */
+    if (b->samples++ == 0) {
+        b->first_usec = b->last_usec = usec;
+    } else {
+        if (usec < b->first_usec)
+            b->first_usec = usec;
+        if (usec > b->last_usec)
+            b->last_usec = usec;
+    }
+    return 1;
+}
+
+int vmp_chunks_flush(int fd, int all)
+{
+    int64_t now;
+    long i;
+
+    if (!chunks_enabled)
+        return 0;
+    if (vmp_chunks_resume(fd) < 0)
+        return -1;
+    now = vmp_chunks_now();
+    for (i = 0; i < VMP_CHUNK_BUILDERS; i++) {
+        struct chunk_builder_s *b = &builders[i];
+        if (b->thread != 0 &&
+            (all || now - b->first_usec >= VMP_CHUNK_MAX_AGE_USEC)) {
+            /* the next one is written after the rest of this one */
+            if (_flush_builder(fd, b) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int vmp_chunks_write_index(int fd)
+{
+    /* MARKER_CHUNK_INDEX, 1 if it lists all chunks, their number and
+       (offset, size, thread id, samples, first and last time) of each
+       of them, 8 byte numbers */
+    unsigned char head[1 + 2 * 8];
+    int64_t complete, count;
+
+    if (!chunks_enabled)
+        return 0;
+    /* the rest of a chunk adds its entry */
+    if (vmp_chunks_resume(fd) < 0)
+        return -1;
+    complete = chunk_index_complete;
+    count = chunk_index_count;
+    chunk_index_offset = lseek(fd, 0, SEEK_CUR);
+    head[0] = MARKER_CHUNK_INDEX;
+    memcpy(head + 1, &complete, 8);
+    memcpy(head + 9, &count, 8);
+    if (_write_fully(fd, head, sizeof(head)) < 0 ||
+        _write_fully(fd, (const unsigned char *)chunk_index,
+                     count * sizeof(struct chunk_index_s)) < 0)
+        return -1;
+    return 0;
+}
+
+int vmp_chunks_write_footer(int fd)
+{
+    unsigned char footer[16];
+    off_t end;
+    int64_t distance;
+
+    if (!chunks_enabled || chunk_index_offset < 0)
+        return 0;
+    end = lseek(fd, 0, SEEK_CUR);
+    if (end < 0)
+        return -1;
+    distance = end + (off_t)sizeof(footer) - chunk_index_offset;
+    memcpy(footer, &distance, 8);
+    memcpy(footer + 8, VMP_CHUNK_FOOTER_MAGIC, 8);
+    return _write_fully(fd, footer, sizeof(footer));
+}
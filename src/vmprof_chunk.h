@@ -0,0 +1,76 @@
+#pragma once
+/* Compact samples: varint and delta encoded chunks (format 2) */
+
+#include "vmprof.h"
+
+#include <stdint.h>
+
+/* With format 2 the signal handler still fills one buffer per sample
+   (see vmprof_mt.h), but the samples are not written as they are. The
+   buffer writer thread (always running with format 2) and
+   flush_concurrent_bufs() encode them instead, never the signal
+   handler, into one open chunk per sampled thread:
+
+     MARKER_CHUNK, the size of the rest (4 bytes), the thread id, the
+     number of samples, the times of the first and the last sample
+     (microseconds since profiling started), then the samples
+
+   All numbers are LEB128 varints. A sample is a tag (0 stack, 1 stack
+   definition, 2 stack reference, plus 4 if the RSS follows), then for a
+   stack the number of frames it shares with the previous stack of the
+   chunk (from the root) and the other frames, each as the zigzag encoded
+   difference to the word at the same depth of the previous stack. A
+   definition or reference carries the id of its stack, the RSS is the
+   difference to the previous one. A chunk can be decoded on its own.
+   The time of a sample is read when its buffer is committed, in the
+   signal handler, not when it is encoded.
+
+   Only the CPU samples are compacted: allocation samples
+   (MARKER_ALLOCATION) and all other records are written as in format 1,
+   between the chunks.
+
+   A chunk is written when it is full, when its first sample is older
+   than VMP_CHUNK_MAX_AGE_USEC, when the buffers are flushed and when
+   profiling stops. The position and the time range of every chunk is
+   kept in an index, written before the trailer (MARKER_CHUNK_INDEX). A
+   footer after the trailer (the distance from the end of the file to the
+   index and VMP_CHUNK_FOOTER_MAGIC) lets a reader find it without reading
+   the profile.
+
+   A chunk that could only be written in part (EAGAIN, ENOSPC, ...) keeps
+   its builder, the rest of it is written before anything else: every
+   writer calls vmp_chunks_resume() first. Its index entry is added once
+   it is complete.
+
+   Everything here but vmp_chunks_now() is called with the write lock
+   held: the memory is allocated when profiling starts. */
+#define VMP_CHUNK_SIZE (32 * 1024)
+#define VMP_CHUNK_BUILDERS 64
+#define VMP_CHUNK_INDEX_SIZE (1 << 18)
+#define VMP_CHUNK_MAX_AGE_USEC 1000000
+#define VMP_CHUNK_FOOTER_MAGIC "vmpchidx"
+
+/* 1 to write format 2, allocates the chunks */
+int vmp_chunks_enable(int enabled);
+int vmp_chunks_enabled(void);
+/* Microseconds since profiling started, signal-safe */
+int64_t vmp_chunks_now(void);
+/* Encodes the record DATA (SIZE bytes) of a buffer, a sample taken at
+   USEC (see vmp_chunks_now), returns 0 if it is no sample or the chunk of its thread is full and MAY_WRITE is 0: the
+   record must then be written as it is. -1 if a chunk could not be
+   written: the record stays in its buffer, nothing must be written. */
+int vmp_chunks_add(int fd, const char *data, long size, int64_t usec,
+                   int may_write);
+/* Writes the chunks whose first sample is old, all of them if ALL, -1
+   on a write() error */
+int vmp_chunks_flush(int fd, int all);
+/* 1 if the rest of a chunk must be written before anything else */
+int vmp_chunks_pending(void);
+/* Writes the rest of that chunk, -1 if it is still pending */
+int vmp_chunks_resume(int fd);
+/* Writes the index (before the trailer) and the footer (after it) */
+int vmp_chunks_write_index(int fd);
+int vmp_chunks_write_footer(int fd);
+void vmp_chunks_release(void);
+/* in the child of fork(), the chunks are not written */
+void vmp_chunks_forget(void);
@@ -23,6 +23,10 @@ int get_stack_trace(PY_THREAD_STATE_T * current, void** result, int max_depth, i
 #include "vmp_stack.h" // reduces warings
 #endif
 
+#ifdef VMPROF_UNIX
+#include "vmprof_chunk.h"
+#endif
+
 
 static volatile int is_enabled = 0;
 static long prepare_interval_usec = 0;
@@ -31,6 +35,7 @@ static long profile_interval_usec = 0;
 #ifdef VMPROF_UNIX
 static int signal_type = SIGPROF;
 static int itimer_type = ITIMER_PROF;
+static int thread_timers = 0;
 static pthread_t *threads = NULL;
 static size_t threads_size = 0;
 static size_t thread_count = 0;
@@ -43,6 +48,14 @@ int vmprof_get_itimer_type(void) {
 int vmprof_get_signal_type(void) {
     return signal_type;
 }
+
+int vmprof_get_thread_timers(void) {
+    return thread_timers;
+}
+
+void vmprof_set_thread_timers(int value) {
+    thread_timers = value;
+}
 #endif
 
 #ifdef VMPROF_WINDOWS
@@ -85,6 +98,14 @@ char *vmprof_init(int fd, double interval, int memory,
     if (prepare_concurrent_bufs() < 0)
         return "out of memory";
 #if VMPROF_UNIX
+#ifndef VMPROF_LINUX
+    if (thread_timers) {
+        return "per-thread timers are only supported on linux";
+    }
+#endif
+    if (real_time && thread_timers) {
+        return "per-thread timers measure cpu time and cannot be combined with real_time";
+    }
     if (real_time) {
         signal_type = SIGALRM;
         itimer_type = ITIMER_REAL;
@@ -135,9 +156,20 @@ int opened_profile(const char *interp_name, int memory, int proflines, int nativ
     }
     header.interp_name[0] = MARKER_HEADER;
     header.interp_name[1] = '\x00';
-    header.interp_name[2] = VERSION_TIMESTAMP;
+    header.interp_name[2] = VERSION_LINE_OFFSETS;
+#ifdef VMPROF_UNIX
+    if (vmp_chunks_enabled())
+        header.interp_name[2] = VERSION_CHUNKS;
+#endif
     header.interp_name[3] = memory*PROFILE_MEMORY + proflines*PROFILE_LINES + \
                             native*PROFILE_NATIVE + real_time*PROFILE_REAL_TIME;
+    if (native && vmp_native_records_pcs()) {
+        header.interp_name[3] += PROFILE_NATIVE_PCS;
+    }
+    if (vmp_native_records_leaf()) {
+        /* the leaf is the interrupted pc, it is resolved like one */
+        header.interp_name[3] += PROFILE_NATIVE_PCS + PROFILE_NATIVE_LEAF;
+    }
 #ifdef RPYTHON_VMPROF
     header.interp_name[3] += PROFILE_RPYTHON;
 #endif
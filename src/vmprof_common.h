@@ -101,4 +101,6 @@ int vmprof_get_itimer_type(void);
 #ifdef VMPROF_UNIX
 int broadcast_signal_for_threads(void);
 int is_main_thread(void);
+int vmprof_get_thread_timers(void);
+void vmprof_set_thread_timers(int value);
 #endif
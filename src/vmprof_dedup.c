@@ -0,0 +1,321 @@
+#include "vmprof_dedup.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+static int dedup_enabled = 0;
+static volatile uint64_t dedup_table[VMP_DEDUP_TABLE_SIZE];
+/* the second hash of the stack in the same slot, 0 until it is set */
+static volatile uint64_t dedup_check[VMP_DEDUP_TABLE_SIZE];
+/* 1 once the definition of the stack in the same slot is written */
+static volatile unsigned char dedup_written[VMP_DEDUP_TABLE_SIZE];
+
+void vmp_dedup_enable(int enabled)
+{
+    /* only called while the signal handler is not installed */
+    memset((void*)dedup_table, 0, sizeof(dedup_table));
+    memset((void*)dedup_check, 0, sizeof(dedup_check));
+    memset((void*)dedup_written, 0, sizeof(dedup_written));
+    dedup_enabled = enabled;
+}
+
+int vmp_dedup_enabled(void)
+{
+    return dedup_enabled;
+}
+
+static uint64_t hash_stack(void **stack, long depth)
+{
+    /* FNV-1a, one word at a time */
+    uint64_t hash = 14695981039346656037ULL;
+    long i;
+    for (i = 0; i < depth; i++) {
+        hash ^= (uint64_t)(uintptr_t)stack[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= (uint64_t)depth;
+    hash *= 1099511628211ULL;
+    /* 0 marks a free slot */
+    return hash == 0 ? 1 : hash;
+}
+
+static uint64_t check_stack(void **stack, long depth)
+{
+    /* independent of hash_stack: the words are added, not xor-ed, and
+       every step is finished with the mixer of splitmix64 */
+    uint64_t check = (uint64_t)depth;
+    long i;
+    for (i = 0; i < depth; i++) {
+        check += (uint64_t)(uintptr_t)stack[i] + 0x9E3779B97F4A7C15ULL;
+        check = (check ^ (check >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        check = (check ^ (check >> 27)) * 0x94D049BB133111EBULL;
+        check ^= check >> 31;
+    }
+    /* 0 marks a check that is not set yet */
+    return check == 0 ? 1 : check;
+}
+
+long vmp_dedup_stack_id(void **stack, long depth, int *is_new)
+{
+    uint64_t hash = hash_stack(stack, depth);
+    uint64_t check = check_stack(stack, depth);
+    uint64_t seen, seen_check;
+    long i, slot;
+
+    *is_new = 0;
+    for (i = 0; i < VMP_DEDUP_MAX_PROBES; i++) {
+        slot = (long)((hash + i) & (VMP_DEDUP_TABLE_SIZE - 1));
+        seen = dedup_table[slot];
+        if (seen == 0) {
+            seen = __sync_val_compare_and_swap(&dedup_table[slot], 0, hash);
+            if (seen == 0) {
+                dedup_check[slot] = check;
+                *is_new = 1;
+                return slot + 1;
+            }
+            /* another thread claimed the slot in the meantime */
+        }
+        if (seen == hash) {
+            seen_check = dedup_check[slot];
+            if (seen_check == check) {
+                /* the definition might be lost (or still wait in its
+                   buffer), it is written again */
+                if (!dedup_written[slot])
+                    *is_new = 1;
+                return slot + 1;
+            }
+            if (seen_check == 0) {
+                /* the thread that claimed the slot did not set the
+                   check yet, the sample is written in full */
+                return 0;
+            }
+            /* another stack with the same hash, keep probing */
+        }
+    }
+    return 0;
+}
+
+void vmp_dedup_written(long stack_id)
+{
+    if (stack_id > 0 && stack_id <= VMP_DEDUP_TABLE_SIZE)
+        dedup_written[stack_id - 1] = 1;
+}
+
+static volatile uintptr_t seen_table[VMP_SEEN_TABLE_SIZE];
+/* the state of the code id in the same slot, see VMP_CODE_PENDING */
+static volatile unsigned char seen_state[VMP_SEEN_TABLE_SIZE];
+static volatile int seen_overflowed = 0;
+/* set when a code id became pending, cleared by the watcher thread */
+static volatile int seen_new_codes = 0;
+/* the number of slots in the state VMP_CODE_FREED */
+static volatile long seen_freed = 0;
+
+static pthread_mutex_t watcher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watcher_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t watcher_thread;
+static int volatile watcher_running = 0;
+static int (*watcher_notify)(void) = NULL;
+
+void vmp_seen_reset(void)
+{
+    /* only called while the signal handler is not installed */
+    memset((void*)seen_table, 0, sizeof(seen_table));
+    memset((void*)seen_state, VMP_CODE_PENDING, sizeof(seen_state));
+    seen_overflowed = 0;
+    seen_new_codes = 0;
+    seen_freed = 0;
+}
+
+static long seen_find(uintptr_t addr, int add)
+{
+    /* Fibonacci hashing, addresses differ in the low bits */
+    uint64_t hash = ((uint64_t)addr * 11400714819323198485ULL) >> 32;
+    uintptr_t seen;
+    long i, slot;
+
+    for (i = 0; i < VMP_SEEN_MAX_PROBES; i++) {
+        slot = (long)((hash + i) & (VMP_SEEN_TABLE_SIZE - 1));
+        seen = seen_table[slot];
+        if (seen == 0) {
+            if (!add) {
+                return -1;
+            }
+            seen = __sync_val_compare_and_swap(&seen_table[slot], 0, addr);
+            if (seen == 0) {
+                /* a new slot is pending, unless it is a native
+                   address or a stable code id */
+                if ((addr & 3) == 0) {
+                    seen_new_codes = 1;
+                }
+                return slot;
+            }
+        }
+        if (seen == addr) {
+            return slot;
+        }
+    }
+    if (add) {
+        seen_overflowed = 1;
+    }
+    return -1;
+}
+
+void vmp_seen_add_stack(void **stack, long depth, int step)
+{
+    long i, slot;
+    uintptr_t addr;
+    for (i = step - 1; i < depth; i += step) {
+        addr = (uintptr_t)stack[i];
+        /* 0 marks a free slot, it is not an address either */
+        if (addr == 0) {
+            continue;
+        }
+        slot = seen_find(addr, 1);
+        /* the code object of a freed id was written when it was
+           freed, a new one has its address now */
+        if (slot >= 0 && (addr & 3) == 0 && seen_state[slot] == VMP_CODE_FREED &&
+                __sync_bool_compare_and_swap(&seen_state[slot], VMP_CODE_FREED,
+                                             VMP_CODE_PENDING)) {
+            __sync_fetch_and_sub(&seen_freed, 1);
+            seen_new_codes = 1;
+        }
+    }
+}
+
+long vmp_seen_take_codes(int (*emit)(void *arg, intptr_t code_uid), void *arg)
+{
+    long i, count = 0;
+    uintptr_t addr;
+    int res;
+    for (i = 0; i < VMP_SEEN_TABLE_SIZE; i++) {
+        addr = seen_table[i];
+        if (addr == 0 || (addr & 3) != 0 || seen_state[i] != VMP_CODE_PENDING) {
+            continue;
+        }
+        if (__sync_bool_compare_and_swap(&seen_state[i], VMP_CODE_PENDING,
+                                         VMP_CODE_WRITTEN)) {
+            res = emit(arg, (intptr_t)addr);
+            if (res < 0) {
+                return -1;
+            }
+            if (res > 0) {
+                /* not written yet, the watcher thread tries again */
+                __sync_bool_compare_and_swap(&seen_state[i], VMP_CODE_WRITTEN,
+                                             VMP_CODE_PENDING);
+                seen_new_codes = 1;
+                continue;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+int vmp_seen_code_freed(intptr_t code_uid)
+{
+    long slot = seen_find((uintptr_t)code_uid, 0);
+    if (slot < 0) {
+        return -1;
+    }
+    int state = __sync_lock_test_and_set(&seen_state[slot], VMP_CODE_FREED);
+    if (state != VMP_CODE_FREED) {
+        __sync_fetch_and_add(&seen_freed, 1);
+    }
+    return state;
+}
+
+int vmp_seen_has_freed(void)
+{
+    return seen_freed > 0;
+}
+
+static void *watcher_main(void *arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&watcher_lock);
+    while (watcher_running) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (VMP_SEEN_CODES_INTERVAL_USEC % 1000000) * 1000;
+        deadline.tv_sec += VMP_SEEN_CODES_INTERVAL_USEC / 1000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&watcher_wakeup, &watcher_lock, &deadline);
+        if (watcher_running && seen_new_codes) {
+            seen_new_codes = 0;
+            /* NOTIFY waits for the GIL, vmp_seen_codes_stop might be
+               called by its holder */
+            pthread_mutex_unlock(&watcher_lock);
+            if (watcher_notify() != 0) {
+                /* try again next time */
+                seen_new_codes = 1;
+            }
+            pthread_mutex_lock(&watcher_lock);
+        }
+    }
+    pthread_mutex_unlock(&watcher_lock);
+    return NULL;
+}
+
+int vmp_seen_codes_start(int (*notify)(void))
+{
+    sigset_t all, previous;
+    int err;
+
+    if (watcher_running) {
+        return 0;
+    }
+    watcher_notify = notify;
+    watcher_running = 1;
+    /* the thread must never run the profiling signal handler, it
+       inherits this signal mask */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    err = pthread_create(&watcher_thread, NULL, watcher_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (err != 0) {
+        watcher_running = 0;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int vmp_seen_codes_stop(void)
+{
+    if (!watcher_running) {
+        return 0;
+    }
+    pthread_mutex_lock(&watcher_lock);
+    watcher_running = 0;
+    pthread_cond_signal(&watcher_wakeup);
+    pthread_mutex_unlock(&watcher_lock);
+    if (pthread_join(watcher_thread, NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void vmp_seen_codes_forget(void)
+{
+    /* in the child of fork() the thread does not exist, the lock might
+       have been held by it */
+    pthread_mutex_init(&watcher_lock, NULL);
+    watcher_running = 0;
+}
+
+long vmp_seen_addresses(uintptr_t *out)
+{
+    long i, count = 0;
+    if (seen_overflowed) {
+        return -1;
+    }
+    for (i = 0; i < VMP_SEEN_TABLE_SIZE; i++) {
+        if (seen_table[i] != 0) {
+            out[count++] = seen_table[i];
+        }
+    }
+    return count;
+}
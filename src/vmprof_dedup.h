@@ -0,0 +1,78 @@
+#pragma once
+/* Deduplication of stack traces inside the signal handler */
+
+#include "vmprof.h"
+
+#include <stdint.h>
+
+/* Every distinct stack (hashed to 64 bits) claims one slot of a
+   preallocated open addressing table with a compare-and-swap, the index
+   of the slot (+1) is the id of the stack. A second, independent 64 bit
+   hash is stored next to it and compared as well: two stacks share an id
+   only if both hashes collide. The samples of a stack write a
+   MARKER_STACKTRACE_DEF record (the full stack plus its id) until one of
+   them is written to the file (vmp_dedup_written), all later samples
+   only a small MARKER_STACKTRACE_REF record: a definition that is lost
+   (a write error, a dropped buffer) is written again, a reader keeps
+   the last definition of an id. Slots are
+   never freed while profiling; once the probe sequence of a stack finds
+   no free slot, its samples are written in full again.
+
+   There is no hard guarantee about the order in which buffers are
+   written, a reference can thus end up in the file before the definition
+   of its stack. */
+#define VMP_DEDUP_TABLE_SIZE (1 << 14)
+#define VMP_DEDUP_MAX_PROBES 32
+
+void vmp_dedup_enable(int enabled);
+int vmp_dedup_enabled(void);
+long vmp_dedup_stack_id(void **stack, long depth, int *is_new);
+/* the definition of STACK_ID is in the file (or in a chunk) */
+void vmp_dedup_written(long stack_id);
+
+/* The native addresses and code ids of the samples, collected while they
+   are taken, in another preallocated open addressing table (one word per
+   address, claimed with a compare-and-swap). When profiling stops, the
+   symbols and code objects are written from this set, the profile is not
+   read back. With stack deduplication only the stacks that are new are
+   added. If an address finds no free slot the set is incomplete: it is
+   marked as overflowed and the profile has to be read instead. */
+#define VMP_SEEN_TABLE_SIZE (1 << 16)
+#define VMP_SEEN_MAX_PROBES 64
+
+void vmp_seen_reset(void);
+/* STEP is the number of words per frame, the address is the last one */
+void vmp_seen_add_stack(void **stack, long depth, int step);
+/* Copies the addresses to OUT (VMP_SEEN_TABLE_SIZE words), returns their
+   number or -1 if the set overflowed */
+long vmp_seen_addresses(uintptr_t *out);
+
+/* The names of code objects are written soon after their first sample,
+   not by scanning the heap when profiling stops. A code id is pending
+   from then on, until vmp_seen_take_codes hands it out. A thread looks
+   for pending ids every VMP_SEEN_CODES_INTERVAL_USEC and calls NOTIFY,
+   which takes the GIL and calls vmp_seen_take_codes.
+   The code object of a pending id is alive: when it is freed, its name
+   is written and the id is marked as freed (vmp_seen_code_freed), the
+   next sample of the address is that of a new code object and makes it
+   pending again. Code ids end in binary 00, stable ids (10) are never
+   pending. With deduplication, the new code object can have the stack
+   of a freed one, the samples of known stacks are looked up too as long
+   as there are freed ids (vmp_seen_has_freed). */
+#define VMP_CODE_PENDING 0
+#define VMP_CODE_WRITTEN 1
+#define VMP_CODE_FREED 2
+#define VMP_SEEN_CODES_INTERVAL_USEC 20000
+
+/* NOTIFY returns non-zero if it could not write the names */
+int vmp_seen_codes_start(int (*notify)(void));
+int vmp_seen_codes_stop(void);
+void vmp_seen_codes_forget(void);
+/* Calls EMIT for every pending code id (and marks it as written), the GIL
+   must be held. EMIT returns 1 to keep the id pending until the next
+   call. Returns the number of ids written or -1 if EMIT failed. */
+long vmp_seen_take_codes(int (*emit)(void *arg, intptr_t code_uid), void *arg);
+/* Returns the state of the id before, -1 if it was not sampled */
+int vmp_seen_code_freed(intptr_t code_uid);
+/* 1 if the address of a freed code id might be reused */
+int vmp_seen_has_freed(void);
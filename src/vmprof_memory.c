@@ -1,5 +1,8 @@
 #include "vmprof_memory.h"
 
+#include <stdint.h>
+#include <time.h>
+
 #ifdef VMPROF_APPLE
 /* On OS X we can get RSS using the Mach API. */
 #include <mach/mach.h>
@@ -16,17 +19,38 @@ static mach_port_t mach_task;
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-/* On '''normal''' Unices we can get RSS from '/proc/<pid>/status'. */
+/* On '''normal''' Unices we can get RSS from '/proc/self/statm'. Unlike
+   '/proc/self/status' it contains nothing but a few numbers (in pages),
+   a single pread() at offset 0 is enough to read it. */
 static int proc_file = -1;
+static long page_size_kb = 4;
 #endif
 
+/* The RSS is read at most once per rss_interval_ns, samples taken in
+   between reuse the last value. 0 reads it for every sample. */
+static int64_t rss_interval_ns = 0;
+static volatile int64_t rss_read_at_ns = 0;
+static volatile long rss_kb = -1;
+
+void set_rss_interval_usec(long usec)
+{
+    rss_interval_ns = usec > 0 ? (int64_t)usec * 1000 : 0;
+}
+
+long get_rss_interval_usec(void)
+{
+    return (long)(rss_interval_ns / 1000);
+}
+
 int setup_rss(void)
 {
+    rss_read_at_ns = 0;
+    rss_kb = -1;
 #ifdef VMPROF_LINUX
-    char buf[128];
-
-    sprintf(buf, "/proc/%d/status", getpid());
-    proc_file = open(buf, O_RDONLY);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size > 0)
+        page_size_kb = page_size / 1024;
+    proc_file = open("/proc/self/statm", O_RDONLY);
     return proc_file;
 #elif defined(VMPROF_APPLE)
     mach_task = mach_task_self();
@@ -39,7 +63,8 @@ int setup_rss(void)
 int teardown_rss(void)
 {
 #ifdef VMPROF_LINUX
-    close(proc_file);
+    if (proc_file != -1)
+        close(proc_file);
     proc_file = -1;
     return 0;
 #else
@@ -47,24 +72,32 @@ int teardown_rss(void)
 #endif
 }
 
-long get_current_proc_rss(void)
+static long read_proc_rss(void)
 {
 #ifdef VMPROF_LINUX
-    char buf[1024];
-    int i = 0;
+    char buf[128];
+    ssize_t size;
+    char *p, *end;
+    long pages = 0;
 
-    if (lseek(proc_file, 0, SEEK_SET) == -1)
+    if (proc_file == -1)
+        return -1;
+    size = pread(proc_file, buf, sizeof(buf), 0);
+    if (size <= 0)
         return -1;
-    if (read(proc_file, buf, 1024) == -1)
+    /* "size resident shared text lib data dt", resident is the second */
+    p = buf;
+    end = buf + size;
+    while (p < end && *p != ' ')
+        p++;
+    p++;
+    if (p >= end || *p < '0' || *p > '9')
         return -1;
-    while (i < 1020) {
-        if (strncmp(buf + i, "VmRSS:\t", 7) == 0) {
-            i += 7;
-            return atoi(buf + i);
-        }
-        i++;
+    while (p < end && *p >= '0' && *p <= '9') {
+        pages = pages * 10 + (*p - '0');
+        p++;
     }
-    return -1;
+    return pages * page_size_kb;
 #elif defined(VMPROF_APPLE)
     mach_msg_type_number_t out_count = MACH_TASK_BASIC_INFO_COUNT;
     mach_task_basic_info_data_t taskinfo = { .resident_size = 0 };
@@ -79,3 +112,36 @@ long get_current_proc_rss(void)
     return -1; // not implemented
 #endif
 }
+
+long get_current_proc_rss(void)
+{
+    struct timespec ts;
+    int64_t now, last;
+    long rss;
+
+#ifdef VMPROF_LINUX
+    if (proc_file == -1)
+        return -1;  /* not profiling memory */
+#endif
+    if (rss_interval_ns == 0)
+        return read_proc_rss();
+
+    /* clock_gettime does not enter the kernel on linux (vDSO) */
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return read_proc_rss();
+    now = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    last = rss_read_at_ns;
+    if (last != 0 && now - last < rss_interval_ns) {
+        rss = rss_kb;
+        if (rss >= 0)
+            return rss;
+    }
+    /* only the thread that moves the timestamp reads the file, the
+       others that raced with it use the previous value */
+    if (!__sync_bool_compare_and_swap(&rss_read_at_ns, last, now) && rss_kb >= 0)
+        return rss_kb;
+    rss = read_proc_rss();
+    if (rss >= 0)
+        rss_kb = rss;
+    return rss;
+}
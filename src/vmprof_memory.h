@@ -3,3 +3,5 @@
 int setup_rss(void);
 int teardown_rss(void);
 long get_current_proc_rss(void);
+void set_rss_interval_usec(long usec);
+long get_rss_interval_usec(void);
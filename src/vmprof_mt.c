@@ -1,7 +1,19 @@
 #include "vmprof_mt.h"
 /* Support for multithreaded write() operations (implementation) */
 
+#include "vmprof_chunk.h"
+#include "vmprof_dedup.h"
+
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef VMPROF_LINUX
+#include <sys/syscall.h>
+#endif
 
 #if defined(__i386__) || defined(__amd64__)
   static inline void write_fence(void) { asm("" : : : "memory"); }
@@ -14,11 +26,133 @@ static struct profbuf_s *profbuf_all_buffers = NULL;
 static int volatile profbuf_write_lock = 2;
 static long profbuf_pending_write;
 
+static int buffer_writer_policy = VMP_WRITER_OFF;
+static int volatile buffer_writer_running = 0;
+static pthread_t buffer_writer_thread;
+static int buffer_writer_fd;
+static long buffer_writer_interval_usec;
+static struct buffer_writer_stats_s buffer_writer_stats;
+/* commit order of the buffers, only maintained for DROP_OLDEST */
+static unsigned long profbuf_seq[VMP_ALL_BUFFERS];
+static unsigned long volatile profbuf_commit_seq;
+/* time of the sample of every buffer, only read with format 2 */
+static int64_t profbuf_usec[VMP_ALL_BUFFERS];
+/* the id of the stack a buffer defines (MARKER_STACKTRACE_DEF), 0 if
+   none, see vmprof_dedup.h */
+static long profbuf_defines[VMP_ALL_BUFFERS];
+
+#ifdef VMP_PER_THREAD_BUFFERS
+struct profbuf_ring_s {
+    long volatile owner;    /* id of the thread, 0 if not claimed yet */
+    char volatile state[VMP_RING_SIZE];
+} __attribute__((aligned(64)));   /* one cache line per ring */
+
+static struct profbuf_ring_s profbuf_rings[VMP_MAX_RINGS];
+/* rings [0, profbuf_rings_used) have been claimed by some thread */
+static long volatile profbuf_rings_used;
+/* bumped by prepare_concurrent_bufs(), this invalidates the cached
+   ring of every thread */
+static long volatile profbuf_generation;
+
+struct thread_ring_s {
+    long generation;
+    long owner;
+    long ring;
+};
+static __thread struct thread_ring_s thread_ring
+    __attribute__((tls_model("initial-exec")));
+
+static inline char volatile *_profbuf_state(long i)
+{
+    if (i < MAX_NUM_BUFFERS)
+        return &profbuf_state[i];
+    i -= MAX_NUM_BUFFERS;
+    return &profbuf_rings[i / VMP_RING_SIZE].state[i % VMP_RING_SIZE];
+}
+
+static inline long _profbuf_count(void)
+{
+    return MAX_NUM_BUFFERS + profbuf_rings_used * VMP_RING_SIZE;
+}
+
+static long _current_thread_id(void)
+{
+#ifdef VMPROF_LINUX
+    return (long)syscall(SYS_gettid);
+#else
+    return (long)pthread_self();
+#endif
+}
+
+static int _thread_is_gone(long owner)
+{
+#ifdef VMPROF_LINUX
+    int saved_errno = errno;
+    int gone = syscall(SYS_tgkill, getpid(), (pid_t)owner, 0) == -1 && errno == ESRCH;
+    errno = saved_errno;
+    return gone;
+#else
+    /* pthread_t values are reused, the ring is then adopted */
+    return 0;
+#endif
+}
+
+static int _ring_is_idle(struct profbuf_ring_s *ring)
+{
+    long i;
+    for (i = 0; i < VMP_RING_SIZE; i++) {
+        if (ring->state[i] != PROFBUF_UNUSED)
+            return 0;
+    }
+    return 1;
+}
+
+static long _claim_ring(long owner)
+{
+    long r, used;
+
+    /* a ring of a thread with the same id (which must be gone) */
+    used = profbuf_rings_used;
+    for (r = 0; r < used; r++) {
+        if (profbuf_rings[r].owner == owner)
+            return r;
+    }
+    /* a ring nobody used so far */
+    while ((used = profbuf_rings_used) < VMP_MAX_RINGS) {
+        if (__sync_bool_compare_and_swap(&profbuf_rings_used, used, used + 1)) {
+            profbuf_rings[used].owner = owner;
+            return used;
+        }
+    }
+    /* all are taken: reclaim the ring of a thread that is gone. This
+       is the slow path, it is taken once per thread at most. */
+    for (r = 0; r < VMP_MAX_RINGS; r++) {
+        long prev = profbuf_rings[r].owner;
+        if (_ring_is_idle(&profbuf_rings[r]) && _thread_is_gone(prev) &&
+            __sync_bool_compare_and_swap(&profbuf_rings[r].owner, prev, owner))
+            return r;
+    }
+    return -1;
+}
+#else
+#define _profbuf_state(i) (&profbuf_state[i])
+#define _profbuf_count() MAX_NUM_BUFFERS
+#endif
+
+static void _release_written_buffer(long i)
+{
+    /* the content of buffer 'i' is in the file (or in a chunk) */
+    if (profbuf_defines[i] != 0) {
+        vmp_dedup_written(profbuf_defines[i]);
+        profbuf_defines[i] = 0;
+    }
+    *_profbuf_state(i) = PROFBUF_UNUSED;
+}
 
 static void unprepare_concurrent_bufs(void)
 {
     if (profbuf_all_buffers != NULL) {
-        munmap(profbuf_all_buffers, sizeof(struct profbuf_s) * MAX_NUM_BUFFERS);
+        munmap(profbuf_all_buffers, sizeof(struct profbuf_s) * VMP_ALL_BUFFERS);
         profbuf_all_buffers = NULL;
     }
 }
@@ -28,44 +162,69 @@ int prepare_concurrent_bufs(void)
     assert(sizeof(struct profbuf_s) == 8192);
 
     unprepare_concurrent_bufs();
-    profbuf_all_buffers = mmap(NULL, sizeof(struct profbuf_s) * MAX_NUM_BUFFERS,
+    profbuf_all_buffers = mmap(NULL, sizeof(struct profbuf_s) * VMP_ALL_BUFFERS,
                                PROT_READ | PROT_WRITE,
-                               MAP_PRIVATE | MAP_ANONYMOUS,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
                                -1, 0);
     if (profbuf_all_buffers == MAP_FAILED) {
         profbuf_all_buffers = NULL;
         return -1;
     }
     memset((char *)profbuf_state, PROFBUF_UNUSED, sizeof(profbuf_state));
+    memset(profbuf_defines, 0, sizeof(profbuf_defines));
+#ifdef VMP_PER_THREAD_BUFFERS
+    memset((char *)profbuf_rings, 0, sizeof(profbuf_rings));
+    profbuf_rings_used = 0;
+    profbuf_generation++;
+#endif
+    memset(&buffer_writer_stats, 0, sizeof(buffer_writer_stats));
     profbuf_write_lock = 0;
     profbuf_pending_write = -1;
     return 0;
 }
 
-static int _write_single_ready_buffer(int fd, long i)
+static int _write_single_ready_buffer(int fd, long i, int may_encode)
 {
     /* Try to write to disk the buffer number 'i'.  This function must
-       only be called while we hold the write lock. */
+       only be called while we hold the write lock.  'may_encode' is 0 in
+       the signal handler: a sample is written as it is, never encoded
+       into a chunk (see vmprof_chunk.h). */
     assert(profbuf_write_lock != 0);
 
+    if (vmp_chunks_pending()) {
+        /* the rest of a chunk comes first */
+        if (!may_encode || vmp_chunks_resume(fd) < 0)
+            return -1;
+    }
+
     if (profbuf_pending_write >= 0) {
         /* A partially written buffer is waiting.  We'll write the
            rest of this buffer now, instead of 'i'. */
         i = profbuf_pending_write;
-        assert(profbuf_state[i] == PROFBUF_READY);
+        assert(*_profbuf_state(i) == PROFBUF_READY);
     }
 
-    if (profbuf_state[i] != PROFBUF_READY) {
+    if (*_profbuf_state(i) != PROFBUF_READY) {
         /* this used to be a race condition: the buffer was written by a
            different thread already, nothing to do now */
         return 0;
     }
 
-    int err;
     struct profbuf_s *p = &profbuf_all_buffers[i];
+    if (profbuf_pending_write < 0 && may_encode) {
+        int encoded = vmp_chunks_add(fd, p->data + p->data_offset, p->data_size,
+                                     profbuf_usec[i], 1);
+        if (encoded < 0)
+            return -1;
+        if (encoded > 0) {
+            /* a sample, it went into the chunk of its thread */
+            _release_written_buffer(i);
+            return 0;
+        }
+    }
     ssize_t count = write(fd, p->data + p->data_offset, p->data_size);
     if (count == p->data_size) {
-        profbuf_state[i] = PROFBUF_UNUSED;
+        _release_written_buffer(i);
         profbuf_pending_write = -1;
     }
     else {
@@ -80,43 +239,147 @@ static int _write_single_ready_buffer(int fd, long i)
     return 0;
 }
 
-static void _write_ready_buffers(int fd)
+static int _write_ready_buffers_in(int fd, long first, long count)
 {
+    /* Writes the ready buffers [first, first+count), the work is bounded
+       by the size of that range.  Must only be called while we hold the
+       write lock, from the signal handler: nothing is encoded and no
+       chunk is written. */
     long i;
-    int has_write_lock = 0;
-
-    for (i = 0; i < MAX_NUM_BUFFERS; i++) {
-        if (profbuf_state[i] == PROFBUF_READY) {
-            if (!has_write_lock) {
-                if (!__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1))
-                    return;   /* can't acquire the write lock, give up */
-                has_write_lock = 1;
-            }
-            if (_write_single_ready_buffer(fd, i) < 0)
-                break;
+
+    for (i = first; i < first + count; i++) {
+        if (*_profbuf_state(i) == PROFBUF_READY) {
+            if (_write_single_ready_buffer(fd, i, 0) < 0)
+                return -1;
         }
     }
-    if (has_write_lock)
-        profbuf_write_lock = 0;
+    return 0;
 }
 
-struct profbuf_s *reserve_buffer(int fd)
+static void _write_ready_buffers(int fd, long first, long count)
 {
-    /* Tries to enter a region of code that fills one buffer.  If
-       successful, returns the profbuf_s.  It fails only if the
-       concurrent buffers are all busy (extreme multithreaded usage).
+    if (profbuf_write_lock != 0 ||
+        !__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1))
+        return;   /* can't acquire the write lock, give up */
+    _write_ready_buffers_in(fd, first, count);
+    profbuf_write_lock = 0;
+}
 
-       This might call write() to emit the data sitting in
-       previously-prepared buffers.  In case of write() error, the
-       error is ignored but unwritten data stays in the buffers.
-    */
-    long i;
+#define VMP_WRITEV_BATCH 64
 
-    _write_ready_buffers(fd);
+static int _writev_buffers(int fd, long *indices, long n)
+{
+    /* Writes the buffers 'indices', which are in the state
+       PROFBUF_WRITING, and releases them.  Must only be called while
+       we hold the write lock. */
+    struct iovec iov[VMP_WRITEV_BATCH];
+    struct profbuf_s *p;
+    ssize_t count;
+    long k, first = 0;
 
-    for (i = 0; i < MAX_NUM_BUFFERS; i++) {
-        if (profbuf_state[i] == PROFBUF_UNUSED &&
-            __sync_bool_compare_and_swap(&profbuf_state[i], PROFBUF_UNUSED,
+    for (k = 0; k < n; k++) {
+        p = &profbuf_all_buffers[indices[k]];
+        iov[k].iov_base = p->data + p->data_offset;
+        iov[k].iov_len = p->data_size;
+    }
+    while (first < n) {
+        count = writev(fd, iov + first, (int)(n - first));
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        __sync_fetch_and_add(&buffer_writer_stats.writes, 1);
+        while (first < n && (size_t)count >= iov[first].iov_len) {
+            count -= iov[first].iov_len;
+            _release_written_buffer(indices[first]);
+            first++;
+        }
+        if (first < n && count > 0) {
+            p = &profbuf_all_buffers[indices[first]];
+            p->data_offset += count;
+            p->data_size -= count;
+            iov[first].iov_base = (char *)iov[first].iov_base + count;
+            iov[first].iov_len -= count;
+        }
+    }
+    if (first < n) {
+        /* write() error: the data stays in the buffers, the one that
+           might be partially written must be continued first */
+        profbuf_pending_write = indices[first];
+        for (k = first; k < n; k++)
+            *_profbuf_state(indices[k]) = PROFBUF_READY;
+        return -1;
+    }
+    return 0;
+}
+
+static int _writev_ready_buffers_locked(int fd)
+{
+    long indices[VMP_WRITEV_BATCH];
+    long i = 0, n, encoded, backlog = 0, count = _profbuf_count();
+    char volatile *state;
+    struct profbuf_s *p;
+    int partial, encoded_now;
+
+    /* nothing must be written before the rest of a chunk either */
+    if (vmp_chunks_resume(fd) < 0)
+        return -1;
+    do {
+        n = encoded = 0;
+        /* nothing must be written before the rest of a partially
+           written buffer, chunks included */
+        partial = 0;
+        if (profbuf_pending_write >= 0) {
+            state = _profbuf_state(profbuf_pending_write);
+            if (__sync_bool_compare_and_swap(state, PROFBUF_READY, PROFBUF_WRITING)) {
+                indices[n++] = profbuf_pending_write;
+                partial = 1;
+            }
+            profbuf_pending_write = -1;
+        }
+        for (; i < count && n < VMP_WRITEV_BATCH; i++) {
+            state = _profbuf_state(i);
+            if (*state == PROFBUF_READY &&
+                __sync_bool_compare_and_swap(state, PROFBUF_READY, PROFBUF_WRITING)) {
+                p = &profbuf_all_buffers[i];
+                encoded_now = vmp_chunks_add(fd, p->data + p->data_offset,
+                                             p->data_size, profbuf_usec[i], !partial);
+                if (encoded_now > 0) {
+                    _release_written_buffer(i);
+                    encoded++;
+                } else if (encoded_now == 0) {
+                    indices[n++] = i;
+                } else {
+                    /* a chunk was written in part (never with a partial
+                       buffer, that does not write chunks): the buffers
+                       wait for the rest of it */
+                    *state = PROFBUF_READY;
+                    while (n > 0)
+                        *_profbuf_state(indices[--n]) = PROFBUF_READY;
+                    return -1;
+                }
+            }
+        }
+        backlog += n + encoded;
+        if (n > 0 && _writev_buffers(fd, indices, n) < 0)
+            return -1;
+    } while (i < count);
+    if (vmp_chunks_flush(fd, 0) < 0)
+        return -1;
+
+    if (backlog > buffer_writer_stats.max_backlog)
+        buffer_writer_stats.max_backlog = backlog;
+    return 0;
+}
+
+static struct profbuf_s *_reserve_buffer_in(long first, long count)
+{
+    long i;
+    for (i = first; i < first + count; i++) {
+        char volatile *state = _profbuf_state(i);
+        if (*state == PROFBUF_UNUSED &&
+            __sync_bool_compare_and_swap(state, PROFBUF_UNUSED,
                                          PROFBUF_FILLING)) {
             struct profbuf_s *p = &profbuf_all_buffers[i];
             p->data_size = 0;
@@ -124,32 +387,164 @@ struct profbuf_s *reserve_buffer(int fd)
             return p;
         }
     }
-    /* no unused buffer found */
     return NULL;
 }
 
-void commit_buffer(int fd, struct profbuf_s *buf)
+static int _is_sample(struct profbuf_s *p)
 {
-    /* Leaves a region of code that filled 'buf'.
+    /* a buffer filled by the signal handler holds a single sample,
+       everything else (code objects, stack definitions, ...) is needed
+       to read the profile and must not be discarded */
+    char marker = p->data[p->data_offset];
+    return marker == MARKER_STACKTRACE || marker == MARKER_STACKTRACE_REF ||
+           marker == MARKER_ALLOCATION;
+}
+
+static struct profbuf_s *_discard_oldest_buffer_in(long first, long count)
+{
+    long i, oldest = -1;
+    char volatile *state;
+    struct profbuf_s *p;
+
+    for (i = first; i < first + count; i++) {
+        if (*_profbuf_state(i) == PROFBUF_READY &&
+            _is_sample(&profbuf_all_buffers[i]) &&
+            (oldest < 0 || profbuf_seq[i] < profbuf_seq[oldest]))
+            oldest = i;
+    }
+    if (oldest < 0)
+        return NULL;
+    state = _profbuf_state(oldest);
+    if (!__sync_bool_compare_and_swap(state, PROFBUF_READY, PROFBUF_FILLING))
+        return NULL;   /* the writer took it in the meantime */
+    if (oldest == profbuf_pending_write) {
+        /* partially written already */
+        *state = PROFBUF_READY;
+        return NULL;
+    }
+    __sync_fetch_and_add(&buffer_writer_stats.dropped_oldest, 1);
+    p = &profbuf_all_buffers[oldest];
+    p->data_size = 0;
+    p->data_offset = 0;
+    return p;
+}
+
+static struct profbuf_s *_no_free_buffer(void)
+{
+    struct profbuf_s *p = NULL;
+    __sync_fetch_and_add(&buffer_writer_stats.fell_behind, 1);
+    if (buffer_writer_policy == VMP_WRITER_DROP_OLDEST) {
+#ifdef VMP_PER_THREAD_BUFFERS
+        if (thread_ring.ring >= 0)
+            p = _discard_oldest_buffer_in(MAX_NUM_BUFFERS + thread_ring.ring * VMP_RING_SIZE,
+                                          VMP_RING_SIZE);
+#endif
+        if (p == NULL)
+            p = _discard_oldest_buffer_in(0, MAX_NUM_BUFFERS);
+    }
+    if (p == NULL)
+        __sync_fetch_and_add(&buffer_writer_stats.dropped_newest, 1);
+    return p;
+}
+
+struct profbuf_s *reserve_buffer(int fd)
+{
+    /* Tries to enter a region of code that fills one buffer.  If
+       successful, returns the profbuf_s.  It fails only if the
+       ring of the thread and the shared buffers are all busy (extreme
+       multithreaded usage).
 
-       This might call write() to emit the data now ready.  In case of
+       When the ring of the thread (or the shared buffers) are full,
+       this might call write() to emit the data sitting in them (not
+       with a buffer writer), never that of other rings.  In case of
        write() error, the error is ignored but unwritten data stays in
        the buffers.
     */
+    struct profbuf_s *p;
+    int may_write = !buffer_writer_running;
+
+#ifdef VMP_PER_THREAD_BUFFERS
+    struct thread_ring_s *t = &thread_ring;
+    long first;
+
+    if (t->generation != profbuf_generation) {
+        t->owner = _current_thread_id();
+        t->ring = _claim_ring(t->owner);
+        t->generation = profbuf_generation;
+    }
+    if (t->ring >= 0) {
+        first = MAX_NUM_BUFFERS + t->ring * VMP_RING_SIZE;
+        p = _reserve_buffer_in(first, VMP_RING_SIZE);
+        if (p != NULL)
+            return p;
+        if (may_write) {
+            /* the ring is full, its data is waiting to be written (the
+               write lock was busy when it was committed) */
+            _write_ready_buffers(fd, first, VMP_RING_SIZE);
+            p = _reserve_buffer_in(first, VMP_RING_SIZE);
+            if (p != NULL)
+                return p;
+        }
+    }
+#endif
+
+    /* no ring or it is full: fall back to the shared buffers */
+    p = _reserve_buffer_in(0, MAX_NUM_BUFFERS);
+    if (p == NULL && may_write) {
+        _write_ready_buffers(fd, 0, MAX_NUM_BUFFERS);
+        p = _reserve_buffer_in(0, MAX_NUM_BUFFERS);
+    }
+    if (p == NULL)
+        p = _no_free_buffer();
+    return p;
+}
+
+void commit_buffer(int fd, struct profbuf_s *buf)
+{
+    /* Leaves a region of code that filled 'buf'.
+
+       This might call write() to emit the data now ready, and only
+       that (after the rest of a partially written buffer): the work in
+       the signal handler does not grow with the number of threads.
+       Buffers that are left ready because the write lock was busy are
+       written when their ring runs full, by the buffer writer or by
+       flush_concurrent_bufs().  In case of write() error, the error is
+       ignored but unwritten data stays in the buffers.  Nothing is
+       encoded here: with format 2 the buffer writer is running.
+    */
+
+    long i = buf - profbuf_all_buffers;
+    if (buffer_writer_policy == VMP_WRITER_DROP_OLDEST)
+        profbuf_seq[i] = __sync_fetch_and_add(&profbuf_commit_seq, 1);
+    if (vmp_chunks_enabled())
+        profbuf_usec[i] = vmp_chunks_now();
+    profbuf_defines[i] = 0;
+    if (buf->data_size > sizeof(void *) &&
+            buf->data[buf->data_offset] == MARKER_STACKTRACE_DEF)
+        memcpy(&profbuf_defines[i],
+               buf->data + buf->data_offset + buf->data_size - sizeof(void *),
+               sizeof(void *));
 
     /* Make sure every thread sees the full content of 'buf' */
     write_fence();
 
     /* Then set the 'ready' flag */
-    long i = buf - profbuf_all_buffers;
-    assert(profbuf_state[i] == PROFBUF_FILLING);
-    profbuf_state[i] = PROFBUF_READY;
+    assert(*_profbuf_state(i) == PROFBUF_FILLING);
+    *_profbuf_state(i) = PROFBUF_READY;
 
-    if (!__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1)) {
+    if (buffer_writer_running) {
+        /* the buffer writer will pick it up */
+    }
+    else if (profbuf_write_lock != 0 ||
+        !__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1)) {
         /* can't acquire the write lock, ignore */
     }
     else {
-        _write_single_ready_buffer(fd, i);
+        if (_write_single_ready_buffer(fd, i, 0) == 0 && profbuf_pending_write < 0 &&
+                *_profbuf_state(i) == PROFBUF_READY) {
+            /* the rest of another buffer was written first */
+            _write_single_ready_buffer(fd, i, 0);
+        }
         profbuf_write_lock = 0;
     }
 }
@@ -157,8 +552,27 @@ void commit_buffer(int fd, struct profbuf_s *buf)
 void cancel_buffer(struct profbuf_s *buf)
 {
     long i = buf - profbuf_all_buffers;
-    assert(profbuf_state[i] == PROFBUF_FILLING);
-    profbuf_state[i] = PROFBUF_UNUSED;
+    assert(*_profbuf_state(i) == PROFBUF_FILLING);
+    *_profbuf_state(i) = PROFBUF_UNUSED;
+}
+
+int flush_concurrent_bufs(int fd)
+{
+    /* Writes all ready buffers now.  Not signal-safe: waits until the
+       write lock is available. */
+    int result;
+    if (profbuf_all_buffers == NULL)
+        return 0;
+    while (!__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1)) {
+        if (profbuf_write_lock == 2)
+            return 0;   /* shut down */
+        usleep(1);
+    }
+    result = _writev_ready_buffers_locked(fd);
+    if (result == 0)
+        result = vmp_chunks_flush(fd, 1);
+    profbuf_write_lock = 0;
+    return result;
 }
 
 int shutdown_concurrent_bufs(int fd)
@@ -169,13 +583,93 @@ int shutdown_concurrent_bufs(int fd)
     profbuf_write_lock = 2;
 
     /* last attempt to flush buffers */
-    int i;
-    for (i = 0; i < MAX_NUM_BUFFERS; i++) {
-        while (profbuf_state[i] == PROFBUF_READY) {
-            if (_write_single_ready_buffer(fd, i) < 0)
+    long i, count = _profbuf_count();
+    for (i = 0; i < count; i++) {
+        while (*_profbuf_state(i) == PROFBUF_READY) {
+            if (_write_single_ready_buffer(fd, i, 1) < 0)
                 return -1;
         }
     }
+    if (vmp_chunks_flush(fd, 1) < 0)
+        return -1;
     unprepare_concurrent_bufs();
     return 0;
 }
+
+void set_buffer_writer_policy(int policy)
+{
+    buffer_writer_policy = policy;
+}
+
+int get_buffer_writer_policy(void)
+{
+    return buffer_writer_policy;
+}
+
+static void *_buffer_writer_main(void *arg)
+{
+    struct timespec interval;
+    interval.tv_sec = buffer_writer_interval_usec / 1000000;
+    interval.tv_nsec = (buffer_writer_interval_usec % 1000000) * 1000;
+
+    while (buffer_writer_running) {
+        nanosleep(&interval, NULL);
+        if (__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1)) {
+            _writev_ready_buffers_locked(buffer_writer_fd);
+            profbuf_write_lock = 0;
+        }
+    }
+    return NULL;
+}
+
+int start_buffer_writer(int fd, long interval_usec)
+{
+    sigset_t all, previous;
+    int err;
+
+    if (buffer_writer_policy == VMP_WRITER_OFF || buffer_writer_running)
+        return 0;
+    /* drain a bit more often than every thread can sample, the rings
+       of the threads then never fill up */
+    if (interval_usec < 100)
+        interval_usec = 100;
+    if (interval_usec > 10000)
+        interval_usec = 10000;
+    buffer_writer_interval_usec = interval_usec;
+    buffer_writer_fd = fd;
+    buffer_writer_running = 1;
+
+    /* the writer thread must never run the profiling signal handler,
+       it inherits this signal mask */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    err = pthread_create(&buffer_writer_thread, NULL, _buffer_writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (err != 0) {
+        buffer_writer_running = 0;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int stop_buffer_writer(void)
+{
+    if (!buffer_writer_running)
+        return 0;
+    buffer_writer_running = 0;
+    if (pthread_join(buffer_writer_thread, NULL) != 0)
+        return -1;
+    return 0;
+}
+
+void forget_buffer_writer(void)
+{
+    /* in the child of fork() the writer thread does not exist */
+    buffer_writer_running = 0;
+}
+
+void get_buffer_writer_stats(struct buffer_writer_stats_s *stats)
+{
+    memcpy(stats, &buffer_writer_stats, sizeof(*stats));
+}
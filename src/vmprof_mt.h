@@ -6,15 +6,14 @@
 #include <string.h>
 #include <sys/mman.h>
 
-/* The idea is that we have MAX_NUM_BUFFERS available, all of size
-   SINGLE_BUF_SIZE.  Threads and signal handlers can ask to reserve a
-   buffer, fill it, and finally "commit" it, at which point its
-   content is written into the profile file.  There is no hard
-   guarantee about the order in which the committed blocks are
-   actually written.  We do this with two constrains:
+/* Threads and signal handlers reserve a buffer of SINGLE_BUF_SIZE
+   bytes, fill it, and finally "commit" it, at which point its content
+   is written into the profile file.  There is no hard guarantee about
+   the order in which the committed blocks are actually written.  Two
+   constraints:
 
    - write() calls should not overlap; only one thread can be
-     currently calling it.
+     currently calling it (the holder of the write lock).
 
    - the code needs to be multithread-safe *and* signal-handler-safe,
      which means it must be written in a wait-free style: never have
@@ -23,19 +22,75 @@
      code holding the lock could be running in the same thread,
      currently interrupted by the signal handler.
 
-   The value of MAX_NUM_BUFFERS is a trade-off between too high
-   (lots of unnecessary memory, lots of checking all of them)
-   and too low (risk that there is none left).
+   Except on OS X (where thread local storage cannot be trusted in the
+   signal handler), each thread owns a ring of VMP_RING_SIZE buffers,
+   claimed the first time the thread reserves a buffer.  Threads only
+   compete for the MAX_NUM_BUFFERS shared buffers when their ring is
+   full or when all VMP_MAX_RINGS rings are taken, thus reserving a
+   buffer does not contend with other cores.  A ring can be filled by
+   the thread and by the signal handler interrupting that thread at
+   the same time, so every slot has its own state that is claimed with
+   a compare-and-swap.  The rings of threads that are gone are
+   reclaimed on Linux.  All buffers are allocated from one
+   MAP_NORESERVE arena, memory of rings that are never claimed is
+   never touched.
+
+   Writing is not lock-free: without a buffer writer the thread that
+   commits a buffer writes that buffer only, and only if it gets the
+   write lock (a trylock, never a wait).  A buffer that is committed
+   while another thread writes stays ready until its ring (or the
+   shared buffers) runs full, until flush_concurrent_bufs() or until
+   profiling stops; a thread that stops being sampled can thus keep up
+   to VMP_RING_SIZE samples back until then.  The work in the signal
+   handler stays bounded by the range it writes, it never scans the
+   buffers of other threads.  With a buffer writer (see below) no
+   handler writes, the writer thread drains every buffer.
 */
 #define MAX_NUM_BUFFERS  20
 
+#if !defined(VMPROF_APPLE) && !defined(VMPROF_WINDOWS)
+#define VMP_PER_THREAD_BUFFERS 1
+#define VMP_MAX_RINGS    256
+#define VMP_RING_SIZE    8
+#else
+#define VMP_MAX_RINGS    0
+#define VMP_RING_SIZE    0
+#endif
+
+#define VMP_ALL_BUFFERS  (MAX_NUM_BUFFERS + VMP_MAX_RINGS * VMP_RING_SIZE)
+
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
 #define PROFBUF_UNUSED   0
 #define PROFBUF_FILLING  1
 #define PROFBUF_READY    2
+#define PROFBUF_WRITING  3
+
+/* By default, the thread that commits a buffer write()s it (if it gets
+   the write lock), which means from inside the signal handler.  With a
+   buffer writer, commit only publishes the buffer and a dedicated
+   thread drains all ready buffers with writev() every few
+   milliseconds.  The backlog is bounded by the number of buffers; when
+   a thread finds no free buffer, the policy decides whether the new
+   sample is lost (DROP_NEWEST) or the oldest sample waiting to be
+   written is discarded to make room for it (DROP_OLDEST). */
+#define VMP_WRITER_OFF          0
+#define VMP_WRITER_DROP_NEWEST  1
+#define VMP_WRITER_DROP_OLDEST  2
+
+struct buffer_writer_stats_s {
+    long fell_behind;     /* no free buffer could be reserved */
+    long dropped_newest;  /* ... and the new data was lost */
+    long dropped_oldest;  /* ... and a waiting sample was discarded */
+    long writes;          /* writev() calls of the buffer writer */
+    long max_backlog;     /* most buffers written in one pass */
+};
 
 
 struct profbuf_s {
@@ -48,4 +103,12 @@ int prepare_concurrent_bufs(void);
 struct profbuf_s *reserve_buffer(int fd);
 void commit_buffer(int fd, struct profbuf_s *buf);
 void cancel_buffer(struct profbuf_s *buf);
+int flush_concurrent_bufs(int fd);
 int shutdown_concurrent_bufs(int fd);
+
+void set_buffer_writer_policy(int policy);
+int get_buffer_writer_policy(void);
+int start_buffer_writer(int fd, long interval_usec);
+int stop_buffer_writer(void);
+void forget_buffer_writer(void);
+void get_buffer_writer_stats(struct buffer_writer_stats_s *stats);
@@ -24,6 +24,10 @@
 #include "vmprof_getpc.h"
 #include "vmprof_common.h"
 #include "vmprof_memory.h"
+#include "vmprof_dedup.h"
+#include "vmprof_chunk.h"
+#include "vmp_modules.h"
+#include "vmp_unwind.h"
 #include "compat.h"
 
 
@@ -34,8 +38,45 @@ static long volatile signal_handler_ignore = 1;
 static long volatile signal_handler_entries = 0;
 static char atfork_hook_installed = 0;
 static volatile int spinlock;
+#ifdef VMPROF_APPLE
 static jmp_buf restore_point;
+#else
+/* Points to the sigjmp_buf of the sample that is currently probing the
+   thread state or reading the stack with the built-in unwinder in this
+   thread, NULL otherwise. Neither holds a lock that a jump out of them
+   could leave behind. initial-exec keeps the
+   access a plain %fs/tpidr relative load (no __tls_get_addr call, which
+   might allocate) and thus usable from within the signal handler. */
+static __thread sigjmp_buf *volatile fault_guard
+    __attribute__((tls_model("initial-exec")));
+static struct sigaction prev_segv_action;
+static char segv_guard_installed = 0;
+#endif
 static struct profbuf_s *volatile current_codes;
+/* The counters of the signal handler are spread over shards of one or
+   more cache lines, every thread counts in its own shard (unless there
+   are more threads than shards), they are summed up when they are read:
+   concurrent samples do not bounce a shared line between the cores. */
+#define VMP_STAT_SHARDS 64
+static struct vmprof_handler_stats_s handler_stats[VMP_STAT_SHARDS]
+    __attribute__((aligned(64)));
+#ifdef VMPROF_APPLE
+/* thread local storage cannot be trusted in the signal handler */
+#define _stat_shard() (&handler_stats[0])
+#else
+static long volatile stat_shards_used;
+/* the shard of the thread + 1, 0 if it has none yet */
+static __thread long stat_shard __attribute__((tls_model("initial-exec")));
+
+static struct vmprof_handler_stats_s *_stat_shard(void)
+{
+    if (stat_shard == 0)
+        stat_shard = __sync_fetch_and_add(&stat_shards_used, 1) % VMP_STAT_SHARDS + 1;
+    return &handler_stats[stat_shard - 1];
+}
+#endif
+
+#define HANDLER_STAT_INC(field) __sync_fetch_and_add(&_stat_shard()->field, 1)
 
 
 void vmprof_ignore_signals(int ignored)
@@ -81,33 +122,159 @@ int install_pthread_atfork_hooks(void) {
     return 0;
 }
 
+#ifdef VMPROF_APPLE
 void segfault_handler(int arg)
 {
     longjmp(restore_point, SIGSEGV);
 }
+#else
+static void segfault_handler(int sig_nr, siginfo_t *info, void *ucontext)
+{
+    sigjmp_buf *guard = fault_guard;
+    if (guard != NULL) {
+        fault_guard = NULL;
+        siglongjmp(*guard, SIGSEGV);
+    }
+    /* not a fault of a sample: chain to the handler that was installed
+       before, e.g. the one of faulthandler */
+    if (prev_segv_action.sa_flags & SA_SIGINFO) {
+        prev_segv_action.sa_sigaction(sig_nr, info, ucontext);
+    } else if (prev_segv_action.sa_handler == SIG_DFL ||
+               prev_segv_action.sa_handler == SIG_IGN) {
+        /* returning re-executes the faulting instruction, which
+           then takes the default action */
+        signal(sig_nr, SIG_DFL);
+    } else {
+        prev_segv_action.sa_handler(sig_nr);
+    }
+}
+
+#ifdef VMP_BUILTIN_UNWIND
+void vmp_set_fault_guard(sigjmp_buf *guard)
+{
+    fault_guard = guard;
+}
+#endif
+
+static int install_segv_guard(void)
+{
+    struct sigaction sa;
+    if (segv_guard_installed)
+        return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = segfault_handler;
+    /* SA_NODEFER: siglongjmp leaves the handler without sigreturn,
+       SIGSEGV must not stay blocked afterwards */
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+    if (sigemptyset(&sa.sa_mask) == -1 ||
+        sigaction(SIGSEGV, &sa, &prev_segv_action) == -1)
+        return -1;
+    segv_guard_installed = 1;
+    return 0;
+}
+
+static int remove_segv_guard(void)
+{
+    struct sigaction current;
+    if (!segv_guard_installed)
+        return 0;
+    if (sigaction(SIGSEGV, NULL, &current) == -1)
+        return -1;
+    /* somebody installed another handler on top of ours, it might
+       chain to us: leave it alone */
+    if ((current.sa_flags & SA_SIGINFO) && current.sa_sigaction == segfault_handler) {
+        if (sigaction(SIGSEGV, &prev_segv_action, NULL) == -1)
+            return -1;
+        segv_guard_installed = 0;
+    }
+    return 0;
+}
+#endif
+
+// always inlined: on mac os x the number of frames between the walk and
+// the signal frame is hard coded (see _vmp_walk_and_record_stack)
+static inline __attribute__((always_inline))
+int _get_stack_trace(PY_THREAD_STATE_T * current, void** result, int max_depth,
+                     void * ucontext, intptr_t pc)
+{
+    PY_STACK_FRAME_T * frame;
+#ifdef RPYTHON_VMPROF
+    // do nothing here,
+    frame = (PY_STACK_FRAME_T*)current;
+#else
+    if (current == NULL) {
+#if DEBUG
+        fprintf(stderr, "WARNING: get_stack_trace, current is NULL\n");
+#endif
+        return 0;
+    }
+    frame = current->frame;
+#endif
+    if (frame == NULL) {
+#if DEBUG
+        fprintf(stderr, "WARNING: get_stack_trace, frame is NULL\n");
+#endif
+        return 0;
+    }
+    if (ucontext != NULL) {
+        /* the native walk starts at the interrupted instruction */
+        return vmp_walk_and_record_signal_stack(frame, result, max_depth, ucontext, pc);
+    }
+    return vmp_walk_and_record_stack(frame, result, max_depth, 1, pc);
+}
 
 int _vmprof_sample_stack(struct profbuf_s *p, PY_THREAD_STATE_T * tstate, ucontext_t * uc)
 {
     int depth;
+    long stack_id = 0;
+    int is_new = 0;
     struct prof_stacktrace_s *st = (struct prof_stacktrace_s *)p->data;
+    /* a definition record needs one more word for the id of the stack */
+    int max_depth = MAX_STACK_DEPTH - 1 - vmp_dedup_enabled();
     st->marker = MARKER_STACKTRACE;
     st->count = 1;
 #ifdef RPYTHON_VMPROF
-    depth = get_stack_trace(get_vmprof_stack(), st->stack, MAX_STACK_DEPTH-1, (intptr_t)GetPC(uc));
+    depth = get_stack_trace(get_vmprof_stack(), st->stack, max_depth, (intptr_t)GetPC(uc));
+#elif defined(VMPROF_APPLE)
+    depth = _get_stack_trace(tstate, st->stack, max_depth, NULL, (intptr_t)NULL);
 #else
-    depth = get_stack_trace(tstate, st->stack, MAX_STACK_DEPTH-1, (intptr_t)NULL);
+    depth = _get_stack_trace(tstate, st->stack, max_depth, uc, (intptr_t)NULL);
 #endif
+    if (depth < 0) {
+        return -1;
+    }
     // useful for tests (see test_stop_sampling)
 #ifndef RPYTHON_LL2CTYPES
     if (depth == 0) {
         return 0;
     }
 #endif
-    st->depth = depth;
+    if (vmp_dedup_enabled()) {
+        stack_id = vmp_dedup_stack_id(st->stack, depth, &is_new);
+    }
+    if (stack_id == 0 || is_new || vmp_seen_has_freed()) {
+        /* a known stack might hold a new code object at the address
+           of a freed one, see vmp_seen_code_freed */
+        vmp_seen_add_stack(st->stack, depth, _per_loop());
+    }
+    if (stack_id != 0 && !is_new) {
+        /* the stack has been written before, a reference has the same
+           layout as a stack trace without frames and its id in the
+           place of the depth */
+        st->marker = MARKER_STACKTRACE_REF;
+        st->depth = stack_id;
+        depth = 0;
+    } else {
+        st->depth = depth;
+    }
     st->stack[depth++] = tstate;
     long rss = get_current_proc_rss();
     if (rss >= 0)
         st->stack[depth++] = (void*)rss;
+    if (is_new) {
+        st->marker = MARKER_STACKTRACE_DEF;
+        st->stack[depth++] = (void*)stack_id;
+    }
     p->data_offset = offsetof(struct prof_stacktrace_s, marker);
     p->data_size = (depth * sizeof(void *) +
                     sizeof(struct prof_stacktrace_s) -
@@ -116,15 +283,72 @@ int _vmprof_sample_stack(struct profbuf_s *p, PY_THREAD_STATE_T * tstate, uconte
 }
 
 #ifndef RPYTHON_VMPROF
+int vmprof_sample_allocation(PY_THREAD_STATE_T * tstate, size_t size, size_t weight)
+{
+    /* Called by the allocator hooks (not in a signal handler) of the
+       thread that allocates. The record has the layout of a stack trace,
+       the count is the number of bytes the sample stands for and the size
+       of the sampled allocation follows the thread id. */
+    int depth, fd, written = 0;
+    struct profbuf_s *p;
+    struct prof_stacktrace_s *st;
+
+    if (vmprof_enter_signal() != 0) {
+        vmprof_exit_signal();
+        return 0;
+    }
+    fd = vmp_profile_fileno();
+    if (tstate == NULL || fd < 0 || (p = reserve_buffer(fd)) == NULL) {
+        vmprof_exit_signal();
+        return 0;
+    }
+    st = (struct prof_stacktrace_s *)p->data;
+    st->marker = MARKER_ALLOCATION;
+    st->count = (long)weight;
+    /* python frames only: a native unwind costs more than all the
+       allocations in between two samples at the default rate */
+    depth = 0;
+    if (tstate->frame != NULL)
+        depth = vmp_walk_and_record_python_stack_only(tstate->frame, st->stack,
+                                                      MAX_STACK_DEPTH - 2, 0, (intptr_t)NULL);
+    if (depth == 0) {
+        cancel_buffer(p);
+    } else {
+        vmp_seen_add_stack(st->stack, depth, _per_loop());
+        st->depth = depth;
+        st->stack[depth++] = tstate;
+        st->stack[depth++] = (void*)size;
+        p->data_offset = offsetof(struct prof_stacktrace_s, marker);
+        p->data_size = (depth * sizeof(void *) +
+                        sizeof(struct prof_stacktrace_s) -
+                        offsetof(struct prof_stacktrace_s, marker));
+        commit_buffer(fd, p);
+        written = 1;
+    }
+    vmprof_exit_signal();
+    return written;
+}
+
 PY_THREAD_STATE_T * _get_pystate_for_this_thread(void) {
     // see issue 116 on github.com/vmprof/vmprof-python.
     // PyGILState_GetThisThreadState(); can hang forever
+    // before 3.7, because it takes the keymutex of pythread. Since 3.7 it is
+    // a lock free pthread_getspecific of the autoTSSkey, thus O(1) instead of
+    // walking every thread state of every interpreter (which is O(threads)).
     //
     PyInterpreterState * istate;
     PyThreadState * state;
     long mythread_id;
 
     mythread_id = PyThread_get_thread_ident();
+#if PY_VERSION_HEX >= 0x03070000
+    state = PyGILState_GetThisThreadState();
+    if (state != NULL && (long)state->thread_id == mythread_id) {
+        return state;
+    }
+    // the key is only set for threads of the main interpreter,
+    // threads of sub interpreters are still found by the walk below
+#endif
     istate = PyInterpreterState_Head();
     if (istate == NULL) {
 #if DEBUG
@@ -174,11 +398,54 @@ void vmprof_release_lock(void) {
     __sync_lock_release(&spinlock);
 }
 
+static void _record_handler_latency(const struct timespec *start)
+{
+    struct timespec now;
+    unsigned long long ns;
+    int bucket = 0;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+        return;
+    ns = (unsigned long long)(now.tv_sec - start->tv_sec) * 1000000000ULL +
+         (now.tv_nsec - start->tv_nsec);
+    if (ns > 0)
+        bucket = 63 - __builtin_clzll(ns);
+    if (bucket >= VMP_LATENCY_BUCKETS)
+        bucket = VMP_LATENCY_BUCKETS - 1;
+    HANDLER_STAT_INC(latency_ns_log2[bucket]);
+}
+
+void vmprof_get_handler_stats(struct vmprof_handler_stats_s *stats)
+{
+    /* the struct holds nothing but counters */
+    long *sum = (long *)stats, *shard;
+    size_t i, k, n = sizeof(*stats) / sizeof(long);
+
+    memset(stats, 0, sizeof(*stats));
+    for (k = 0; k < VMP_STAT_SHARDS; k++) {
+        shard = (long *)&handler_stats[k];
+        for (i = 0; i < n; i++)
+            sum[i] += shard[i];
+    }
+    stats->unwind_failures = vmp_unwind_failures();
+}
+
+static void reset_handler_stats(void)
+{
+    memset(handler_stats, 0, sizeof(handler_stats));
+    vmp_reset_unwind_failures();
+}
+
 void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
 {
     int commit;
     PY_THREAD_STATE_T * tstate = NULL;
+    struct timespec start;
+#ifdef VMPROF_APPLE
     void (*prevhandler)(int);
+#else
+    sigjmp_buf restore;
+#endif
 
 #ifndef RPYTHON_VMPROF
 
@@ -187,19 +454,10 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
     if (!Py_IsInitialized()) {
         return;
     }
-
-    // TERRIBLE HACK AHEAD
-    // on OS X, the thread local storage is sometimes uninitialized
-    // when the signal handler runs - it means it's impossible to read errno
-    // or call any syscall or read PyThread_Current or pthread_self. Additionally,
-    // it seems impossible to read the register gs.
-    // here we register segfault handler (all guarded by a spinlock) and call
-    // longjmp in case segfault happens while reading a thread local
-    //
-    // We do the same error detection for linux to ensure that
-    // get_current_thread_state returns a sane result
-    while (__sync_lock_test_and_set(&spinlock, 1)) {
-    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    HANDLER_STAT_INC(signals);
+#ifndef RPYTHON_VMPROF
 
 #ifdef VMPROF_UNIX
     // SIGNAL ABUSE AHEAD
@@ -207,14 +465,29 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
     // because these timers are based on process and system time, and as such, are thread-aware.
     // For the real timer, the signal gets delivered to the main thread, seemingly always.
     // Consequently if we want to sample multiple threads, we need to forward this signal.
+    // The spinlock protects the thread list against insert/remove_real_time_thread.
     if (vmprof_get_signal_type() == SIGALRM) {
-        if (is_main_thread() && broadcast_signal_for_threads()) {
-            __sync_lock_release(&spinlock);
-            return;
+        if (is_main_thread()) {
+            int done;
+            vmprof_aquire_lock();
+            done = broadcast_signal_for_threads();
+            vmprof_release_lock();
+            if (done) {
+                return;
+            }
         }
     }
 #endif
 
+#ifdef VMPROF_APPLE
+    // TERRIBLE HACK AHEAD
+    // on OS X, the thread local storage is sometimes uninitialized
+    // when the signal handler runs - it means it's impossible to read errno
+    // or call any syscall or read PyThread_Current or pthread_self. Additionally,
+    // it seems impossible to read the register gs.
+    // here we register segfault handler (all guarded by a spinlock) and call
+    // longjmp in case segfault happens while reading a thread local
+    vmprof_aquire_lock();
     prevhandler = signal(SIGSEGV, &segfault_handler);
     int fault_code = setjmp(restore_point);
     if (fault_code == 0) {
@@ -222,11 +495,27 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
         tstate = _get_pystate_for_this_thread();
     } else {
         signal(SIGSEGV, prevhandler);
-        __sync_lock_release(&spinlock);
+        vmprof_release_lock();
+        HANDLER_STAT_INC(faults);
         return;
     }
     signal(SIGSEGV, prevhandler);
-    __sync_lock_release(&spinlock);
+    vmprof_release_lock();
+#else
+    // Ensure that get_current_thread_state returns a sane result: a fault
+    // while reading the thread state throws the sample away instead of
+    // crashing the process. The SIGSEGV handler has been installed once by
+    // install_sigprof_handler, so entering the handler takes no lock and
+    // makes no syscall (sigsetjmp with savemask=0 does not touch the
+    // signal mask), concurrent samples do not contend.
+    if (sigsetjmp(restore, 0) != 0) {
+        HANDLER_STAT_INC(faults);
+        return;
+    }
+    fault_guard = &restore;
+    tstate = _get_pystate_for_this_thread();
+    fault_guard = NULL;
+#endif
 #endif
 
     long val = vmprof_enter_signal();
@@ -236,26 +525,41 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
         int fd = vmp_profile_fileno();
         assert(fd >= 0);
 
-        struct profbuf_s *p = reserve_buffer(fd);
-        if (p == NULL) {
+        struct profbuf_s *p = NULL;
+#ifndef RPYTHON_VMPROF
+        if (tstate == NULL) {
+            HANDLER_STAT_INC(no_thread_state);
+        } else
+#endif
+        if ((p = reserve_buffer(fd)) == NULL) {
             /* ignore this signal: there are no free buffers right now */
+            HANDLER_STAT_INC(no_buffer);
         } else {
+            // -1 if the built-in unwinder faulted on a corrupted stack
 #ifdef RPYTHON_VMPROF
             commit = _vmprof_sample_stack(p, NULL, (ucontext_t*)ucontext);
 #else
             commit = _vmprof_sample_stack(p, tstate, (ucontext_t*)ucontext);
 #endif
-            if (commit) {
+            if (commit > 0) {
                 commit_buffer(fd, p);
+                HANDLER_STAT_INC(samples);
+            } else if (commit < 0) {
+                cancel_buffer(p);
+                HANDLER_STAT_INC(faults);
             } else {
 #if DEBUG
                 fprintf(stderr, "WARNING: canceled buffer, no stack trace was written\n");
 #endif
                 cancel_buffer(p);
+                HANDLER_STAT_INC(empty_stack);
             }
         }
+        _record_handler_latency(&start);
 
         errno = saved_errno;
+    } else {
+        HANDLER_STAT_INC(ignored);
     }
 
     vmprof_exit_signal();
@@ -264,6 +568,10 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
 int install_sigprof_handler(void)
 {
     struct sigaction sa;
+#ifndef VMPROF_APPLE
+    if (install_segv_guard() == -1)
+        return -1;
+#endif
     memset(&sa, 0, sizeof(sa));
     sa.sa_sigaction = sigprof_handler;
     sa.sa_flags = SA_RESTART | SA_SIGINFO;
@@ -284,12 +592,205 @@ int remove_sigprof_handler(void)
         fprintf(stderr, "Could not remove the signal handler (for profiling)\n");
         return -1;
     }
+#ifndef VMPROF_APPLE
+    if (remove_segv_guard() == -1)
+        return -1;
+#endif
+    return 0;
+}
+
+#ifdef VMPROF_LINUX
+/* Per-thread timers (see vmprof_set_thread_timers()).  Instead of one
+   process wide ITIMER_PROF, every profiled thread owns a timer that
+   counts its own cpu time and delivers SIGPROF to exactly that thread
+   (SIGEV_THREAD_ID).  The table is only touched outside of the signal
+   handler, thus a plain mutex is fine. */
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+struct thread_timer_s {
+    pthread_t thread;
+    pid_t native_id;
+    timer_t timer;
+};
+
+static struct thread_timer_s *thread_timers = NULL;
+static size_t thread_timers_count = 0;
+static size_t thread_timers_size = 0;
+static pthread_mutex_t thread_timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_timer_key;
+static pthread_once_t thread_timer_key_once = PTHREAD_ONCE_INIT;
+static int thread_timer_key_created = 0;
+
+static int _arm_thread_timer(timer_t timer, long interval_usec)
+{
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_usec / 1000000;
+    spec.it_interval.tv_nsec = (interval_usec % 1000000) * 1000;
+    spec.it_value = spec.it_interval;
+    return timer_settime(timer, 0, &spec, NULL);
+}
+
+static void _remove_thread_timer_at(size_t i)
+{
+    timer_delete(thread_timers[i].timer);
+    thread_timers[i] = thread_timers[--thread_timers_count];
+}
+
+static void _thread_timer_key_destructor(void *value)
+{
+    /* the thread armed its own timer and is exiting now */
+    remove_thread_timer(pthread_self());
+}
+
+static void _create_thread_timer_key(void)
+{
+    thread_timer_key_created =
+        pthread_key_create(&thread_timer_key, _thread_timer_key_destructor) == 0;
+}
+
+static void _remove_dead_thread_timers(void)
+{
+    /* Threads armed by another one (see vmprof._arm_thread_timers) do
+       not run the key's destructor when they exit, their timers are
+       removed here, every time a thread is armed. Must hold the lock. */
+    size_t i = 0;
+    int saved_errno = errno;
+    while (i < thread_timers_count) {
+        if (syscall(SYS_tgkill, getpid(), thread_timers[i].native_id, 0) == -1 &&
+                errno == ESRCH)
+            _remove_thread_timer_at(i);
+        else
+            i++;
+    }
+    errno = saved_errno;
+}
+
+ssize_t insert_thread_timer(pthread_t tid, pid_t native_id)
+{
+    size_t i;
+    clockid_t clock;
+    struct sigevent sev;
+    timer_t timer;
+    ssize_t result = -1;
+
+    pthread_mutex_lock(&thread_timers_lock);
+    _remove_dead_thread_timers();
+    for (i = 0; i < thread_timers_count; i++) {
+        if (pthread_equal(thread_timers[i].thread, tid)) {
+            if (thread_timers[i].native_id == native_id) {
+                /* already armed */
+                result = thread_timers_count;
+                goto done;
+            }
+            /* the pthread_t of a thread that died got reused */
+            _remove_thread_timer_at(i);
+            break;
+        }
+    }
+    if (thread_timers_count == thread_timers_size) {
+        size_t size = thread_timers_size + 8;
+        struct thread_timer_s *resized;
+        resized = realloc(thread_timers, sizeof(struct thread_timer_s) * size);
+        if (resized == NULL)
+            goto done;
+        thread_timers = resized;
+        thread_timers_size = size;
+    }
+    if (pthread_getcpuclockid(tid, &clock) != 0)
+        goto done;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = native_id;
+    if (timer_create(clock, &sev, &timer) != 0)
+        goto done;
+    if (_arm_thread_timer(timer, vmprof_get_profile_interval_usec()) != 0) {
+        timer_delete(timer);
+        goto done;
+    }
+    thread_timers[thread_timers_count].thread = tid;
+    thread_timers[thread_timers_count].native_id = native_id;
+    thread_timers[thread_timers_count].timer = timer;
+    result = ++thread_timers_count;
+done:
+    pthread_mutex_unlock(&thread_timers_lock);
+    return result;
+}
+
+ssize_t insert_thread_timer_self(void)
+{
+    ssize_t result = insert_thread_timer(pthread_self(), (pid_t)syscall(SYS_gettid));
+    if (result < 0)
+        return result;
+    /* the key's destructor removes the timer again when this thread exits */
+    pthread_once(&thread_timer_key_once, _create_thread_timer_key);
+    if (thread_timer_key_created)
+        pthread_setspecific(thread_timer_key, (void*)1);
+    return result;
+}
+
+ssize_t remove_thread_timer(pthread_t tid)
+{
+    size_t i;
+    ssize_t result = -1;
+
+    pthread_mutex_lock(&thread_timers_lock);
+    for (i = 0; i < thread_timers_count; i++) {
+        if (pthread_equal(thread_timers[i].thread, tid)) {
+            _remove_thread_timer_at(i);
+            result = thread_timers_count;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&thread_timers_lock);
+    return result;
+}
+
+int remove_thread_timers(void)
+{
+    pthread_mutex_lock(&thread_timers_lock);
+    while (thread_timers_count > 0) {
+        _remove_thread_timer_at(thread_timers_count - 1);
+    }
+    free(thread_timers);
+    thread_timers = NULL;
+    thread_timers_size = 0;
+    pthread_mutex_unlock(&thread_timers_lock);
     return 0;
 }
 
+static void _rearm_thread_timers(long interval_usec)
+{
+    size_t i;
+    pthread_mutex_lock(&thread_timers_lock);
+    for (i = 0; i < thread_timers_count; i++) {
+        _arm_thread_timer(thread_timers[i].timer, interval_usec);
+    }
+    pthread_mutex_unlock(&thread_timers_lock);
+}
+
+static void _forget_thread_timers(void)
+{
+    /* timers are not inherited by a forked child */
+    thread_timers_count = 0;
+    pthread_mutex_init(&thread_timers_lock, NULL);
+}
+#endif
+
 int install_sigprof_timer(void)
 {
     static struct itimerval timer;
+#ifdef VMPROF_LINUX
+    if (vmprof_get_thread_timers()) {
+        /* other threads are armed by insert_thread_timer() */
+        if (insert_thread_timer_self() < 0)
+            return -1;
+        return 0;
+    }
+#endif
     timer.it_interval.tv_sec = 0;
     timer.it_interval.tv_usec = (int)vmprof_get_profile_interval_usec();
     timer.it_value = timer.it_interval;
@@ -301,6 +802,11 @@ int install_sigprof_timer(void)
 int remove_sigprof_timer(void)
 {
     static struct itimerval timer;
+#ifdef VMPROF_LINUX
+    if (vmprof_get_thread_timers()) {
+        return remove_thread_timers();
+    }
+#endif
     timerclear(&(timer.it_interval));
     timerclear(&(timer.it_value));
     if (setitimer(vmprof_get_itimer_type(), &timer, NULL) != 0) {
@@ -313,6 +819,14 @@ int remove_sigprof_timer(void)
 void atfork_disable_timer(void)
 {
     if (vmprof_get_profile_interval_usec() > 0) {
+#ifdef VMPROF_LINUX
+        if (vmprof_get_thread_timers()) {
+            /* keep the timers, but pause them around fork() */
+            _rearm_thread_timers(0);
+            vmprof_set_enabled(0);
+            return;
+        }
+#endif
         remove_sigprof_timer();
         vmprof_set_enabled(0);
     }
@@ -324,10 +838,26 @@ void atfork_close_profile_file(void)
     if (fd != -1)
         close(fd);
     vmp_set_profile_fileno(-1);
+    forget_buffer_writer();
+    vmp_chunks_forget();
+    vmp_seen_codes_forget();
+#ifdef VMP_TRACK_MODULES
+    vmp_modules_forget();
+#endif
+#ifdef VMPROF_LINUX
+    _forget_thread_timers();
+#endif
 }
 void atfork_enable_timer(void)
 {
     if (vmprof_get_profile_interval_usec() > 0) {
+#ifdef VMPROF_LINUX
+        if (vmprof_get_thread_timers()) {
+            _rearm_thread_timers(vmprof_get_profile_interval_usec());
+            vmprof_set_enabled(1);
+            return;
+        }
+#endif
         install_sigprof_timer();
         vmprof_set_enabled(1);
     }
@@ -352,6 +882,9 @@ static void disable_cpyprof(void)
 
 int vmprof_enable(int memory, int native, int real_time)
 {
+    int handler_installed = 0;
+    int saved_errno;
+
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
     init_cpyprof(native);
 #endif
@@ -364,27 +897,105 @@ int vmprof_enable(int memory, int native, int real_time)
     if (real_time && insert_thread(pthread_self(), -1) == -1)
         goto error;
 #endif
+    reset_handler_stats();
     if (install_pthread_atfork_hooks() == -1)
         goto error;
+    if (start_buffer_writer(vmp_profile_fileno(), vmprof_get_profile_interval_usec()) == -1)
+        goto error;
+#ifdef VMP_TRACK_MODULES
+    /* native frames are symbolized with the modules mapped at the time */
+    if ((native || vmp_native_records_leaf()) && vmp_modules_start() == -1)
+        goto error;
+#endif
     if (install_sigprof_handler() == -1)
         goto error;
+    handler_installed = 1;
     if (install_sigprof_timer() == -1)
         goto error;
     signal_handler_ignore = 0;
     return 0;
 
  error:
+    /* undo what was started, the threads must not outlive the profile
+       file descriptor. The errno of the failure is kept. */
+    saved_errno = errno;
+    if (handler_installed)
+        (void)remove_sigprof_handler();
+#ifdef VMP_TRACK_MODULES
+    (void)vmp_modules_stop();
+#endif
+    (void)stop_buffer_writer();
+#if VMPROF_UNIX
+    if (real_time)
+        (void)remove_threads();
+#endif
+    if (memory)
+        (void)teardown_rss();
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    disable_cpyprof();
+#endif
     vmp_set_profile_fileno(-1);
     vmprof_set_profile_interval_usec(0);
+    errno = saved_errno;
     return -1;
 }
 
 
+static void write_buffer_writer_meta(void)
+{
+    struct buffer_writer_stats_s stats;
+    char value[32];
+
+    get_buffer_writer_stats(&stats);
+    snprintf(value, sizeof(value), "%ld", stats.fell_behind);
+    vmp_write_meta("writer_fell_behind", value);
+    snprintf(value, sizeof(value), "%ld", stats.dropped_newest);
+    vmp_write_meta("writer_dropped_newest", value);
+    snprintf(value, sizeof(value), "%ld", stats.dropped_oldest);
+    vmp_write_meta("writer_dropped_oldest", value);
+    snprintf(value, sizeof(value), "%ld", stats.max_backlog);
+    vmp_write_meta("writer_max_backlog", value);
+}
+
+static void write_profiler_stat(const char *key, long value)
+{
+    long len = (long)strlen(key);
+    vmp_write_all((char*)&len, sizeof(long));
+    vmp_write_all(key, len);
+    vmp_write_all((char*)&value, sizeof(long));
+}
+
+static void write_profiler_stats(void)
+{
+    struct vmprof_handler_stats_s stats;
+    char marker = MARKER_PROFILER_STATS;
+    long count = 8;
+    long buckets = VMP_LATENCY_BUCKETS;
+
+    vmprof_get_handler_stats(&stats);
+    vmp_write_all(&marker, 1);
+    vmp_write_all((char*)&count, sizeof(long));
+    write_profiler_stat("signals", stats.signals);
+    write_profiler_stat("ignored", stats.ignored);
+    write_profiler_stat("faults", stats.faults);
+    write_profiler_stat("no_thread_state", stats.no_thread_state);
+    write_profiler_stat("no_buffer", stats.no_buffer);
+    write_profiler_stat("empty_stack", stats.empty_stack);
+    write_profiler_stat("samples", stats.samples);
+    write_profiler_stat("unwind_failures", stats.unwind_failures);
+    vmp_write_all((char*)&buckets, sizeof(long));
+    vmp_write_all((char*)stats.latency_ns_log2, sizeof(stats.latency_ns_log2));
+}
+
 int close_profile(void)
 {
     int fileno = vmp_profile_fileno();
     fsync(fileno);
+    write_profiler_stats();
+    (void)vmp_chunks_write_index(fileno);
     (void)vmp_write_time_now(MARKER_TRAILER);
+    (void)vmp_chunks_write_footer(fileno);
+    vmp_chunks_release();
     teardown_rss();
 
     /* don't close() the file descriptor from here */
@@ -396,6 +1007,11 @@ int vmprof_disable(void)
 {
     signal_handler_ignore = 1;
     vmprof_set_profile_interval_usec(0);
+#ifdef VMP_TRACK_MODULES
+    /* before the native walk is torn down, a refresh rebuilds its tables */
+    if (vmp_modules_stop() == -1)
+        return -1;
+#endif
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
     disable_cpyprof();
 #endif
@@ -410,20 +1026,29 @@ int vmprof_disable(void)
     if ((vmprof_get_signal_type() == SIGALRM) && remove_threads() == -1) {
         return -1;
     }
+#endif
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    // wait for the handlers that are still walking a stack
+    while (signal_handler_entries != 0L) {
+        usleep(1);
+    }
+    vmp_native_cleanup();
 #endif
     flush_codes();
+    if (stop_buffer_writer() == -1)
+        return -1;
     if (shutdown_concurrent_bufs(vmp_profile_fileno()) < 0)
         return -1;
+    if (get_buffer_writer_policy() != VMP_WRITER_OFF)
+        write_buffer_writer_meta();
     return close_profile();
 }
 
-int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
-                                     int auto_retry)
+static struct profbuf_s *_reserve_code_block(long blocklen, int auto_retry)
 {
-    long namelen = strnlen(code_name, 1023);
-    long blocklen = 1 + sizeof(intptr_t) + sizeof(long) + namelen;
+    /* Returns a buffer with room for 'blocklen' more bytes, preferably
+       'current_codes'. Hand it back with _release_code_block. */
     struct profbuf_s *p;
-    char *t;
 
  retry:
     p = current_codes;
@@ -455,10 +1080,32 @@ int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
                 usleep(1);
                 goto retry;
             }
-            return -1;
+            return NULL;
         }
     }
+    return p;
+}
+
+static void _release_code_block(struct profbuf_s *p)
+{
+    /* try to reattach 'p' to 'current_codes' */
+    if (!__sync_bool_compare_and_swap(&current_codes, NULL, p)) {
+        /* failed, flush it */
+        commit_buffer(vmp_profile_fileno(), p);
+    }
+}
+
+int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
+                                     int auto_retry)
+{
+    long namelen = strnlen(code_name, 1023);
+    long blocklen = 1 + sizeof(intptr_t) + sizeof(long) + namelen;
+    struct profbuf_s *p;
+    char *t;
 
+    p = _reserve_code_block(blocklen, auto_retry);
+    if (p == NULL)
+        return -1;
     t = p->data + p->data_size;
     p->data_size += blocklen;
     assert(p->data_size <= SINGLE_BUF_SIZE);
@@ -466,35 +1113,149 @@ int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
     memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
     memcpy(t, &namelen, sizeof(long)); t += sizeof(long);
     memcpy(t, code_name, namelen);
+    _release_code_block(p);
+    return 0;
+}
 
-    /* try to reattach 'p' to 'current_codes' */
-    if (!__sync_bool_compare_and_swap(&current_codes, NULL, p)) {
-        /* failed, flush it */
-        commit_buffer(vmp_profile_fileno(), p);
+int vmprof_register_line_table(intptr_t code_uid, long count,
+                               const long *table, int auto_retry)
+{
+    /* 'table' holds 'count' (offset, line) pairs. A long table is split
+       into several records, each of them must fit into one buffer. */
+    long max_count = (SINGLE_BUF_SIZE - 1 - sizeof(intptr_t) - sizeof(long)) /
+                     (2 * sizeof(long));
+    struct profbuf_s *p;
+    char *t;
+
+    while (count > 0) {
+        long n = count < max_count ? count : max_count;
+        long blocklen = 1 + sizeof(intptr_t) + sizeof(long) + n * 2 * sizeof(long);
+        p = _reserve_code_block(blocklen, auto_retry);
+        if (p == NULL)
+            return -1;
+        t = p->data + p->data_size;
+        p->data_size += blocklen;
+        assert(p->data_size <= SINGLE_BUF_SIZE);
+        *t++ = MARKER_LINE_TABLE;
+        memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
+        memcpy(t, &n, sizeof(long)); t += sizeof(long);
+        memcpy(t, table, n * 2 * sizeof(long));
+        _release_code_block(p);
+        table += 2 * n;
+        count -= n;
     }
     return 0;
 }
 
-int get_stack_trace(PY_THREAD_STATE_T * current, void** result, int max_depth, intptr_t pc)
+int vmprof_register_code_alias(intptr_t code_uid, intptr_t stable_uid,
+                               int auto_retry)
 {
-    PY_STACK_FRAME_T * frame;
-#ifdef RPYTHON_VMPROF
-    // do nothing here,
-    frame = (PY_STACK_FRAME_T*)current;
-#else
-    if (current == NULL) {
-#if DEBUG
-        fprintf(stderr, "WARNING: get_stack_trace, current is NULL\n");
-#endif
-        return 0;
-    }
-    frame = current->frame;
-#endif
-    if (frame == NULL) {
-#if DEBUG
-        fprintf(stderr, "WARNING: get_stack_trace, frame is NULL\n");
-#endif
-        return 0;
+    /* samples taken before the code object got its stable id carry its
+       address, see vmp_stable_code_ids */
+    long blocklen = 1 + 2 * sizeof(intptr_t);
+    struct profbuf_s *p;
+    char *t;
+
+    p = _reserve_code_block(blocklen, auto_retry);
+    if (p == NULL)
+        return -1;
+    t = p->data + p->data_size;
+    p->data_size += blocklen;
+    assert(p->data_size <= SINGLE_BUF_SIZE);
+    *t++ = MARKER_CODE_ALIAS;
+    memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &stable_uid, sizeof(intptr_t));
+    _release_code_block(p);
+    return 0;
+}
+
+int vmprof_register_string(int64_t string_id, const char *string, long len,
+                           int auto_retry)
+{
+    /* defines the string that MARKER_CODE_NAME records refer to by its id,
+       it must fit into one buffer */
+    long blocklen = 1 + sizeof(int64_t) + sizeof(long) + len;
+    struct profbuf_s *p;
+    char *t;
+
+    if (blocklen > (long)SINGLE_BUF_SIZE)
+        return -1;
+    p = _reserve_code_block(blocklen, auto_retry);
+    if (p == NULL)
+        return -1;
+    t = p->data + p->data_size;
+    p->data_size += blocklen;
+    assert(p->data_size <= SINGLE_BUF_SIZE);
+    *t++ = MARKER_STRING;
+    memcpy(t, &string_id, sizeof(int64_t)); t += sizeof(int64_t);
+    memcpy(t, &len, sizeof(long)); t += sizeof(long);
+    memcpy(t, string, len);
+    _release_code_block(p);
+    return 0;
+}
+
+int vmprof_register_code_name(intptr_t code_uid, int64_t lang_id,
+                              int64_t name_id, long line, int64_t file_id,
+                              int auto_retry)
+{
+    /* the name of a code object, '<lang>:<name>:<line>:<file>' with the
+       ids of three strings, see vmprof_register_string */
+    long blocklen = 1 + sizeof(intptr_t) + 3 * sizeof(int64_t) + sizeof(long);
+    struct profbuf_s *p;
+    char *t;
+
+    p = _reserve_code_block(blocklen, auto_retry);
+    if (p == NULL)
+        return -1;
+    t = p->data + p->data_size;
+    p->data_size += blocklen;
+    assert(p->data_size <= SINGLE_BUF_SIZE);
+    *t++ = MARKER_CODE_NAME;
+    memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &lang_id, sizeof(int64_t)); t += sizeof(int64_t);
+    memcpy(t, &name_id, sizeof(int64_t)); t += sizeof(int64_t);
+    memcpy(t, &line, sizeof(long)); t += sizeof(long);
+    memcpy(t, &file_id, sizeof(int64_t));
+    _release_code_block(p);
+    return 0;
+}
+
+int vmprof_register_module(int event, uintptr_t base, uintptr_t start,
+                           uintptr_t end, const char *path,
+                           const unsigned char *build_id, long build_id_len,
+                           int auto_retry)
+{
+    /* a shared object was mapped (event 1) or unmapped (0), see
+       vmp_modules.h. Not batched with the code objects: the record is
+       committed right away to stay close to the samples of its time. */
+    int fd = vmp_profile_fileno();
+    long namelen = strnlen(path, 1023);
+    long blocklen = 2 + 3 * sizeof(intptr_t) + 2 * sizeof(long) + namelen + build_id_len;
+    struct profbuf_s *p;
+    char *t;
+
+    while ((p = reserve_buffer(fd)) == NULL) {
+        if (auto_retry-- <= 0)
+            return -1;
+        usleep(1);
     }
-    return vmp_walk_and_record_stack(frame, result, max_depth, 1, pc);
+    t = p->data;
+    p->data_offset = 0;
+    p->data_size = blocklen;
+    *t++ = MARKER_MODULE;
+    *t++ = (char)event;
+    memcpy(t, &base, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &start, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &end, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &namelen, sizeof(long)); t += sizeof(long);
+    memcpy(t, path, namelen); t += namelen;
+    memcpy(t, &build_id_len, sizeof(long)); t += sizeof(long);
+    memcpy(t, build_id, build_id_len);
+    commit_buffer(fd, p);
+    return 0;
+}
+
+int get_stack_trace(PY_THREAD_STATE_T * current, void** result, int max_depth, intptr_t pc)
+{
+    return _get_stack_trace(current, result, max_depth, NULL, pc);
 }
@@ -50,8 +50,31 @@ int get_stack_trace(PY_THREAD_STATE_T * current, void** result, int max_depth, i
 
 #include <setjmp.h>
 
+#ifdef VMPROF_APPLE
 void segfault_handler(int arg);
+#endif
 int _vmprof_sample_stack(struct profbuf_s *p, PY_THREAD_STATE_T * tstate, ucontext_t * uc);
+#ifndef RPYTHON_VMPROF
+int vmprof_sample_allocation(PY_THREAD_STATE_T * tstate, size_t size, size_t weight);
+#endif
+
+/* Telemetry of the signal handler: what happened to every signal */
+#define VMP_LATENCY_BUCKETS 32
+/* only longs, the counters of the shards are summed up one by one */
+struct vmprof_handler_stats_s {
+    long signals;            /* sigprof_handler was entered */
+    long ignored;            /* ... while sampling was stopped */
+    long faults;             /* reading the thread state crashed */
+    long no_thread_state;    /* the thread has no python thread state */
+    long no_buffer;          /* all buffers were in use */
+    long empty_stack;        /* no frame could be recorded */
+    long samples;            /* a sample was written */
+    long unwind_failures;    /* the native stack could not be walked */
+    /* time spent in the handler, bucket i counts [2**i, 2**(i+1)) ns */
+    long latency_ns_log2[VMP_LATENCY_BUCKETS];
+};
+
+void vmprof_get_handler_stats(struct vmprof_handler_stats_s *stats);
 void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext);
 
 
@@ -69,6 +92,15 @@ void atfork_enable_timer(void);
 void atfork_close_profile_file(void);
 int install_pthread_atfork_hooks(void);
 
+#ifdef VMPROF_LINUX
+#include <sys/types.h>
+#include <pthread.h>
+ssize_t insert_thread_timer(pthread_t tid, pid_t native_id);
+ssize_t insert_thread_timer_self(void);
+ssize_t remove_thread_timer(pthread_t tid);
+int remove_thread_timers(void);
+#endif
+
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
 void init_cpyprof(int native);
 static void disable_cpyprof(void);
@@ -83,6 +115,19 @@ int vmprof_disable(void);
 RPY_EXTERN
 int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
                                      int auto_retry);
+int vmprof_register_line_table(intptr_t code_uid, long count,
+                               const long *table, int auto_retry);
+int vmprof_register_code_alias(intptr_t code_uid, intptr_t stable_uid,
+                               int auto_retry);
+int vmprof_register_string(int64_t string_id, const char *string, long len,
+                           int auto_retry);
+int vmprof_register_code_name(intptr_t code_uid, int64_t lang_id,
+                              int64_t name_id, long line, int64_t file_id,
+                              int auto_retry);
+int vmprof_register_module(int event, uintptr_t base, uintptr_t start,
+                           uintptr_t end, const char *path,
+                           const unsigned char *build_id, long build_id_len,
+                           int auto_retry);
 
 
 void vmprof_aquire_lock(void);
@@ -27,6 +27,60 @@ int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
     return 0;
 }
 
+int vmprof_register_line_table(intptr_t code_uid, long count,
+                               const long *table, int auto_retry)
+{
+    char head[1 + sizeof(intptr_t) + sizeof(long)];
+
+    head[0] = MARKER_LINE_TABLE;
+    *(intptr_t*)(head + 1) = code_uid;
+    *(long*)(head + 1 + sizeof(intptr_t)) = count;
+    /* both parts must end up next to each other in the file, the mutex
+       can be taken again by vmp_write_all in the same thread */
+    WaitForSingleObject(write_mutex, INFINITE);
+    if (vmp_write_all(head, sizeof(head)) < 0 ||
+        vmp_write_all((const char *)table, count * 2 * sizeof(long)) < 0) {
+        ReleaseMutex(write_mutex);
+        return -1;
+    }
+    ReleaseMutex(write_mutex);
+    return 0;
+}
+
+int vmprof_register_string(int64_t string_id, const char *string, long len,
+                           int auto_retry)
+{
+    char head[1 + sizeof(int64_t) + sizeof(long)];
+
+    head[0] = MARKER_STRING;
+    *(int64_t*)(head + 1) = string_id;
+    *(long*)(head + 1 + sizeof(int64_t)) = len;
+    WaitForSingleObject(write_mutex, INFINITE);
+    if (vmp_write_all(head, sizeof(head)) < 0 ||
+        vmp_write_all(string, len) < 0) {
+        ReleaseMutex(write_mutex);
+        return -1;
+    }
+    ReleaseMutex(write_mutex);
+    return 0;
+}
+
+int vmprof_register_code_name(intptr_t code_uid, int64_t lang_id,
+                              int64_t name_id, long line, int64_t file_id,
+                              int auto_retry)
+{
+    char buf[1 + sizeof(intptr_t) + 3 * sizeof(int64_t) + sizeof(long)];
+    char *t = buf;
+
+    *t++ = MARKER_CODE_NAME;
+    memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &lang_id, sizeof(int64_t)); t += sizeof(int64_t);
+    memcpy(t, &name_id, sizeof(int64_t)); t += sizeof(int64_t);
+    memcpy(t, &line, sizeof(long)); t += sizeof(long);
+    memcpy(t, &file_id, sizeof(int64_t));
+    return vmp_write_all(buf, sizeof(buf)) < 0 ? -1 : 0;
+}
+
 int vmp_write_all(const char *buf, size_t bufsize)
 {
     int res;
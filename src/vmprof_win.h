@@ -21,6 +21,13 @@ typedef PyThreadState PY_WIN_THREAD_STATE;
 
 int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
                                      int auto_retry);
+int vmprof_register_line_table(intptr_t code_uid, long count,
+                               const long *table, int auto_retry);
+int vmprof_register_string(int64_t string_id, const char *string, long len,
+                           int auto_retry);
+int vmprof_register_code_name(intptr_t code_uid, int64_t lang_id,
+                              int64_t name_id, long line, int64_t file_id,
+                              int auto_retry);
 
 PY_WIN_THREAD_STATE * get_current_thread_state(void);
 int vmprof_enable(int memory, int native, int real_time);
@@ -1,5 +1,6 @@
 import os
 import sys
+import threading
 
 try:
     pass
@@ -21,8 +22,25 @@ IS_PYPY = "__pypy__" in sys.builtin_module_names
 # 1000Hz
 DEFAULT_PERIOD = 0.00099
 
+# policies of the background buffer writer, see enable(writer=...)
+WRITER_POLICIES = {None: 0, "drop_newest": 1, "drop_oldest": 2}
+
+# average number of bytes allocated between two allocation samples, see
+# enable(allocations=True)
+DEFAULT_ALLOC_SAMPLE_BYTES = 512 * 1024
+
+# False if the native addresses are left to vmprof.symbolize, see
+# enable(symbolize=...)
+_symbolize_native = True
+# directory of the cache of native symbols, see enable(symbol_cache=...)
+_symbol_cache = None
+# see enable(native_pcs=...) and enable(native_leaf=...)
+_native_pcs = False
+_native_leaf = False
+
 
 def disable():
+    _disarm_thread_timers()
     try:
         # fish the file descriptor that is still open!
         if hasattr(_vmprof, "stop_sampling"):
@@ -31,14 +49,62 @@ def disable():
                 # TODO does fileobj leak the fd? I dont think so, but need to check
                 fileobj = FdWrapper(fileno)
                 l = LogReaderDumpNative(fileobj, LogReaderState())
-                l.read_all()
-                if hasattr(_vmprof, "write_all_code_objects"):
-                    _vmprof.write_all_code_objects(l.dedup)
+                l.symbolize = _symbolize_native
+                l.symbol_cache = _symbol_cache
+                seen = None
+                if hasattr(_vmprof, "seen_addresses"):
+                    seen = _vmprof.seen_addresses()
+                if seen is not None:
+                    modules = []
+                    if hasattr(_vmprof, "loaded_modules"):
+                        modules = _vmprof.loaded_modules()
+                    l.dump_seen(seen, modules, _native_pcs, _native_leaf)
+                    # the code objects were written after their first
+                    # sample, except for the last ones
+                    _vmprof.write_seen_code_objects()
+                else:
+                    # the addresses are not known, read them back
+                    l.read_all()
+                    if hasattr(_vmprof, "write_all_code_objects"):
+                        _vmprof.write_all_code_objects(l.dedup)
         _vmprof.disable()
     except OSError as e:
         raise Exception("Error while writing profile: " + str(e))
 
 
+_previous_thread_profile_hook = None
+
+
+def _thread_timer_hook(frame, event, arg):
+    # installed with threading.setprofile(), thus runs once at the start of
+    # every new thread: arm the timer of the thread and get out of the way
+    sys.setprofile(_previous_thread_profile_hook)
+    if _vmprof.is_enabled():
+        _vmprof.insert_thread_timer()
+    if _previous_thread_profile_hook is not None:
+        _previous_thread_profile_hook(frame, event, arg)
+
+
+def _arm_thread_timers():
+    global _previous_thread_profile_hook
+    # the calling thread has been armed by _vmprof.enable
+    current = threading.current_thread()
+    for thread in threading.enumerate():
+        native_id = getattr(thread, "native_id", None)
+        if thread is current or not native_id:
+            continue
+        _vmprof.insert_thread_timer(thread.ident, native_id)
+    _previous_thread_profile_hook = getattr(threading, "_profile_hook", None)
+    threading.setprofile(_thread_timer_hook)
+
+
+def _disarm_thread_timers():
+    global _previous_thread_profile_hook
+    if threading._profile_hook is _thread_timer_hook:
+        threading.setprofile(_previous_thread_profile_hook)
+        _previous_thread_profile_hook = None
+
+
 def _is_native_enabled(native):
     if os.name == "nt":
         if native:
@@ -100,11 +166,77 @@ else:
         lines=False,
         native=None,
         real_time=False,
+        per_thread=False,
+        dedup=False,
+        writer=None,
+        rss_period=None,
+        allocations=False,
+        native_pcs=False,
+        native_leaf=False,
+        symbolize=True,
+        symbol_cache=None,
+        debug_dir=None,
+        stable_ids=False,
+        format=1,
     ):
+        global _symbolize_native, _symbol_cache, _native_pcs, _native_leaf
         if not isinstance(period, float):
             raise ValueError("period must be a float, not %s" % type(period))
+        if rss_period is None:
+            rss_period = 0.0
+        elif not isinstance(rss_period, float):
+            raise ValueError("rss_period must be a float, not %s" % type(rss_period))
+        if allocations is True:
+            allocations = DEFAULT_ALLOC_SAMPLE_BYTES
+        elif allocations is False or allocations is None:
+            allocations = 0
+        elif not isinstance(allocations, int) or allocations <= 0:
+            raise ValueError("allocations must be a bool or a positive int")
+        if writer not in WRITER_POLICIES:
+            raise ValueError("writer must be one of %r" % sorted(WRITER_POLICIES, key=str))
+        if format not in (1, 2):
+            raise ValueError("format must be 1 or 2")
+        if native_leaf:
+            # the leaf replaces the native stack walk
+            if native:
+                raise ValueError("native_leaf cannot be combined with native=True")
+            native = False
         native = _is_native_enabled(native)
-        _vmprof.enable(fileno, period, memory, lines, native, real_time)
+        if native_pcs and not native:
+            raise ValueError("native_pcs requires native profiling")
+        _vmprof.enable(
+            fileno,
+            period,
+            memory,
+            lines,
+            native,
+            real_time,
+            per_thread=per_thread,
+            dedup=dedup,
+            writer=WRITER_POLICIES[writer],
+            rss_period=rss_period,
+            allocations=allocations,
+            native_pcs=bool(native_pcs),
+            native_leaf=bool(native_leaf),
+            stable_ids=bool(stable_ids),
+            format=format,
+        )
+        # with symbolize=False only the modules and their build-ids are
+        # written, python -m vmprof.symbolize names the native frames later
+        _symbolize_native = bool(symbolize)
+        _native_pcs = bool(native_pcs)
+        _native_leaf = bool(native_leaf)
+        # symbols of earlier runs, by build-id (see vmprof.symcache)
+        if symbol_cache is True:
+            from vmprof.symcache import default_directory
+
+            symbol_cache = default_directory()
+        _symbol_cache = symbol_cache or None
+        # separate debug info of stripped modules (build-id or debuglink)
+        if debug_dir is not None and hasattr(_vmprof, "set_debug_dir"):
+            _vmprof.set_debug_dir(debug_dir)
+        if per_thread:
+            _arm_thread_timers()
 
     def sample_stack_now(skip=0):
         """Helper utility mostly for tests, this is considered
@@ -151,6 +283,30 @@ def is_enabled():
     raise NotImplementedError("is_enabled is not implemented on this platform")
 
 
+def get_profiler_stats():
+    """Returns a dict with counters of what happened to the profiling
+    signals of the last (or current) profile: how many produced a sample
+    and why the others did not, plus a log2 histogram of the nanoseconds
+    spent in the signal handler. The same counters are written to the end
+    of the profile, see Stats.profiler_stats.
+    """
+    if hasattr(_vmprof, "get_stats"):
+        return _vmprof.get_stats()
+    raise NotImplementedError("get_profiler_stats not implemented on this platform")
+
+
+def get_buffer_writer_stats():
+    """Returns a dict with counters of the sample buffers: how often no free
+    buffer was available ('fell_behind') and whether the new sample
+    ('dropped_newest') or the oldest waiting one ('dropped_oldest') was
+    lost, the number of writev() calls of the buffer writer and the biggest
+    backlog it wrote in one pass.
+    """
+    if hasattr(_vmprof, "get_buffer_writer_stats"):
+        return _vmprof.get_buffer_writer_stats()
+    raise NotImplementedError("get_buffer_writer_stats not implemented on this platform")
+
+
 def get_profile_path():
     """Returns the absolute path for the file that is currently open.
     None is returned if the backend implementation does not implement that function,
@@ -57,7 +57,12 @@ def main():
         prof_file = tempfile.NamedTemporaryFile(delete=False)
         prof_name = prof_file.name
 
-    vmprof.enable(prof_file.fileno(), args.period, args.mem, args.lines, native=native)
+    kwargs = {}
+    if args.offline_symbols:
+        kwargs["symbolize"] = False
+    vmprof.enable(
+        prof_file.fileno(), args.period, args.mem, args.lines, native=native, **kwargs
+    )
     if args.jitlog and _jitlog:
         fd = os.open(prof_name + ".jit", os.O_WRONLY | os.O_TRUNC | os.O_CREAT)
         _jitlog.enable(fd)
@@ -56,6 +56,12 @@ def build_argparser():
         action="store_true",
         help="Disable native profiling for this run",
     )
+    parser.add_argument(
+        "--offline-symbols",
+        action="store_true",
+        help="Do not symbolize native frames at the end of the run, "
+        "see 'python -m vmprof.symbolize'",
+    )
     output_mode_args = parser.add_mutually_exclusive_group()
     output_mode_args.add_argument(
         "--web",
@@ -85,6 +91,7 @@ def parse_args(argv):
             ("web-url", str),
             ("output", str),
             ("no-native", bool),
+            ("offline-symbols", bool),
         ]
 
         ini_parser = IniParser(args.config)
@@ -158,6 +165,26 @@ def show(stats):
         else:
             print(f" {v.ljust(7)} {k.ljust(max_len + 1)}")
 
+    show_profiler_stats(stats)
+
+
+def show_profiler_stats(stats):
+    if not stats.profiler_stats:
+        return
+    samples = stats.profiler_stats.get("samples", 0)
+    lost = stats.lost_samples()
+    print(
+        " %d samples, %d lost%s"
+        % (
+            samples,
+            sum(lost.values()),
+            "".join(", %s: %d" % item for item in sorted(lost.items())),
+        )
+    )
+    p99 = stats.handler_latency_percentile(99)
+    if p99 is not None:
+        print(" 99%% of the samples spent less than %dns in the signal handler" % p99)
+
 
 def _namelen(e):
     if e.startswith("py:"):
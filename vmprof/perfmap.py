@@ -0,0 +1,170 @@
+"""Names of the machine code that JIT compilers generate at runtime.
+
+It is not part of any ELF image, JIT compilers name it for perf(1) in one
+of two ways:
+
+* ``/tmp/perf-<pid>.map``, one ``START SIZE name`` line (hex numbers) per
+  function, e.g. CPython 3.12 with ``-X perf`` or numba with
+  ``NUMBA_ENABLE_PROFILING``
+* jitdump files (``jit-<pid>.dump``), binary records of the code that was
+  loaded or moved, with optional line information. The JIT compiler maps
+  the file into the process, that is how it is found.
+
+When profiling stops, the native addresses in such code are named with
+these files, before the ELF images are looked at. The names are written to
+the profile: the files are gone or overwritten by the time it is analysed.
+"""
+
+import bisect
+import os
+import struct
+
+JITDUMP_MAGIC = 0x4A695444
+JIT_CODE_LOAD = 0
+JIT_CODE_MOVE = 1
+JIT_CODE_DEBUG_INFO = 2
+JIT_CODE_CLOSE = 3
+
+
+def perf_map_path(pid):
+    return "/tmp/perf-%d.map" % pid
+
+
+def jitdump_paths(pid):
+    """The jitdump files the process has mapped"""
+    paths = []
+    try:
+        with open("/proc/%d/maps" % pid) as fd:
+            for line in fd:
+                fields = line.split()
+                if len(fields) >= 6 and os.path.basename(fields[5]) == "jit-%d.dump" % pid:
+                    if fields[5] not in paths:
+                        paths.append(fields[5])
+    except (IOError, OSError):
+        pass
+    return paths
+
+
+class JitSymbols:
+    """A sorted interval index of the code of JIT compilers. Code that is
+    named twice keeps its last name, a range that overlaps the next one
+    ends where the next one starts."""
+
+    def __init__(self):
+        # start -> (end, name, [(addr, line, file)] sorted or None)
+        self.code = {}
+        self.starts = None
+
+    @classmethod
+    def of_process(cls, pid):
+        symbols = cls()
+        symbols.read_perf_map(perf_map_path(pid))
+        for path in jitdump_paths(pid):
+            symbols.read_jitdump(path)
+        return symbols
+
+    def __len__(self):
+        return len(self.code)
+
+    def add(self, start, size, name, lines=None):
+        if size <= 0:
+            return
+        self.code[start] = (start + size, name, sorted(lines) if lines else None)
+        self.starts = None
+
+    def read_perf_map(self, path):
+        """Adds the functions of a perf map, a missing file is empty"""
+        try:
+            fd = open(path, "rb")
+        except (IOError, OSError):
+            return
+        with fd:
+            for line in fd:
+                fields = line.decode("utf-8", "replace").rstrip("\n").split(" ", 2)
+                if len(fields) != 3:
+                    continue
+                try:
+                    start, size = int(fields[0], 16), int(fields[1], 16)
+                except ValueError:
+                    continue
+                self.add(start, size, fields[2])
+
+    def read_jitdump(self, path):
+        """Adds the code of a jitdump file, stops at the first record that
+        is incomplete (the JIT compiler might still be writing)"""
+        try:
+            with open(path, "rb") as fd:
+                data = fd.read()
+        except (IOError, OSError):
+            return
+        if len(data) < 40:
+            return
+        for endian in "<>":
+            if struct.unpack_from(endian + "I", data)[0] == JITDUMP_MAGIC:
+                break
+        else:
+            return
+        header_size = struct.unpack_from(endian + "I", data, 8)[0]
+        offset = header_size
+        lines = {}  # code address -> debug info of the next load
+        while offset + 16 <= len(data):
+            record, size, _ = struct.unpack_from(endian + "IIQ", data, offset)
+            if size < 16 or offset + size > len(data):
+                break
+            body = offset + 16
+            if record == JIT_CODE_LOAD:
+                _, _, _, code_addr, code_size, _ = struct.unpack_from(
+                    endian + "IIQQQQ", data, body
+                )
+                name_start = body + 40
+                name_end = data.find(b"\x00", name_start, offset + size)
+                if name_end < 0:
+                    break
+                name = data[name_start:name_end].decode("utf-8", "replace")
+                self.add(code_addr, code_size, name, lines.pop(code_addr, None))
+            elif record == JIT_CODE_MOVE:
+                _, _, _, old_addr, new_addr, code_size, _ = struct.unpack_from(
+                    endian + "IIQQQQQ", data, body
+                )
+                moved = self.code.pop(old_addr, None)
+                if moved is not None:
+                    end, name, entries = moved
+                    if entries:
+                        entries = [(a - old_addr + new_addr, l, f) for a, l, f in entries]
+                    self.add(new_addr, code_size, name, entries)
+            elif record == JIT_CODE_DEBUG_INFO:
+                code_addr, count = struct.unpack_from(endian + "QQ", data, body)
+                entries = []
+                pos = body + 16
+                for _ in range(count):
+                    addr, line, _ = struct.unpack_from(endian + "QII", data, pos)
+                    file_end = data.find(b"\x00", pos + 16, offset + size)
+                    if file_end < 0:
+                        break
+                    srcfile = data[pos + 16 : file_end].decode("utf-8", "replace")
+                    entries.append((addr, line, srcfile))
+                    pos = file_end + 1
+                lines[code_addr] = entries
+            elif record == JIT_CODE_CLOSE:
+                break
+            offset += size
+
+    def find(self, addr):
+        """(name, line, file) of the code at addr, line 0 and file None if
+        they are not known, None if no JIT compiler named the address"""
+        if self.starts is None:
+            self.starts = sorted(self.code)
+        i = bisect.bisect_right(self.starts, addr) - 1
+        if i < 0:
+            return None
+        start = self.starts[i]
+        end, name, entries = self.code[start]
+        if i + 1 < len(self.starts):
+            end = min(end, self.starts[i + 1])
+        if addr >= end:
+            return None
+        if entries:
+            j = bisect.bisect_right(entries, (addr, float("inf"))) - 1
+            if j >= 0:
+                return (name, entries[j][1], entries[j][2])
+        return (name, 0, None)
@@ -38,12 +38,12 @@ class ProfilerContext:
         self.done = True
 
 
-def read_profile(prof_file):
+def read_profile(prof_file, chunk_filter=None):
     file_to_close = None
     if not hasattr(prof_file, "read"):
         prof_file = file_to_close = open(str(prof_file), "rb")
 
-    state = _read_prof(prof_file)
+    state = _read_prof(prof_file, chunk_filter=chunk_filter)
 
     if file_to_close:
         file_to_close.close()
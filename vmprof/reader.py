@@ -1,3 +1,6 @@
+import binascii
+import bisect
+import collections
 import datetime
 import gzip
 import io
@@ -16,6 +19,22 @@ MARKER_HEADER = b"\x05"
 MARKER_TIME_N_ZONE = b"\x06"
 MARKER_META = b"\x07"
 MARKER_NATIVE_SYMBOLS = b"\x08"
+MARKER_STACKTRACE_DEF = b"\x09"
+MARKER_STACKTRACE_REF = b"\x0a"
+MARKER_PROFILER_STATS = b"\x0b"
+MARKER_ALLOCATION = b"\x0c"
+MARKER_LINE_TABLE = b"\x0d"
+MARKER_MODULE = b"\x0e"
+MARKER_CODE_ALIAS = b"\x0f"
+MARKER_STRING = b"\x10"
+MARKER_CODE_NAME = b"\x11"
+MARKER_CHUNK = b"\x12"
+MARKER_CHUNK_INDEX = b"\x13"
+
+CHUNK_FOOTER_MAGIC = b"vmpchidx"
+
+MODULE_UNLOADED = 0
+MODULE_LOADED = 1
 
 
 VERSION_BASE = 0
@@ -25,11 +44,16 @@ VERSION_MEMORY = 3
 VERSION_MODE_AWARE = 4
 VERSION_DURATION = 5
 VERSION_TIMESTAMP = 6
+VERSION_LINE_OFFSETS = 7
+VERSION_CHUNKS = 8
 
 PROFILE_MEMORY = 1
 PROFILE_LINES = 2
 PROFILE_NATIVE = 4
 PROFILE_RPYTHON = 8
+PROFILE_REAL_TIME = 16
+PROFILE_NATIVE_PCS = 32
+PROFILE_NATIVE_LEAF = 64
 
 VMPROF_CODE_TAG = 1
 VMPROF_BLACKHOLE_TAG = 2
@@ -63,6 +87,145 @@ def wrap_kind(kind, pc):
     return pc
 
 
+class CodeName(str):
+    """The name of a code object or a native symbol,
+    '<lang>:<name>:<line>:<file>'. Keeps its parts, the strings of a
+    profile are interned: the code of one file shares its file name."""
+
+    __slots__ = ("lang", "name", "line", "file")
+
+    @classmethod
+    def of(cls, lang, name, line, file):
+        self = str.__new__(cls, "%s:%s:%d:%s" % (lang, name, line, file))
+        self.lang = lang
+        self.name = name
+        self.line = line
+        self.file = file
+        return self
+
+    @classmethod
+    def parse(cls, string):
+        """The name of a MARKER_VIRTUAL_IP or MARKER_NATIVE_SYMBOLS
+        record, the string itself if it has no line"""
+        parts = string.split(":", 1)
+        if len(parts) != 2:
+            return string
+        # native names can contain colons (C++), python files (windows)
+        for rest in (parts[1].rsplit(":", 2), parts[1].split(":", 2)):
+            if len(rest) == 3:
+                try:
+                    line = int(rest[1])
+                except ValueError:
+                    continue
+                return cls.of(
+                    sys.intern(parts[0]), rest[0], line, sys.intern(rest[2])
+                )
+        return string
+
+
+def string_id(string):
+    """The id of a string in MARKER_STRING records, FNV-1a of its UTF-8
+    bytes like in the profiler (src/_vmprof.c)"""
+    value = 14695981039346656037
+    for byte in bytearray(string.encode("utf-8")):
+        value = ((value ^ byte) * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+    return (value & 0x7FFFFFFFFFFFFFFF) or 1
+
+
+class NameRecords:
+    """Builds the MARKER_STRING and MARKER_CODE_NAME records that name
+    addresses, each string is written once"""
+
+    def __init__(self, addr_fmt="P", word_fmt="l"):
+        self.addr_fmt = addr_fmt
+        self.word_fmt = word_fmt
+        self.ids = {}
+        self.records = []
+
+    def string(self, string):
+        id = self.ids.get(string)
+        if id is None:
+            id = self.ids[string] = string_id(string)
+            data = string.encode("utf-8")
+            self.records.append(
+                MARKER_STRING
+                + struct.pack("<q", id)
+                + struct.pack(self.word_fmt, len(data))
+                + data
+            )
+        return id
+
+    def add(self, addr, lang, name, line, file):
+        lang, name, file = self.string(lang), self.string(name), self.string(file)
+        self.records.append(
+            MARKER_CODE_NAME
+            + struct.pack(self.addr_fmt, addr)
+            + struct.pack("<qq", lang, name)
+            + struct.pack(self.word_fmt, line)
+            + struct.pack("<q", file)
+        )
+
+    def getvalue(self):
+        return b"".join(self.records)
+
+
+# a MARKER_CHUNK: where it starts and its size (marker included), the
+# times are microseconds since profiling started
+ChunkInfo = collections.namedtuple(
+    "ChunkInfo", "offset size thread_id samples first_usec last_usec"
+)
+
+
+def read_varint(data, pos):
+    """The LEB128 number at data[pos], and the position after it"""
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        if byte < 0x80:
+            return value, pos
+        shift += 7
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def read_chunk_index_entries(fileobj):
+    """The body of a MARKER_CHUNK_INDEX record, None if the index could
+    not list all chunks"""
+    complete, count = struct.unpack("<qq", fileobj.read(16))
+    data = fileobj.read(count * 48)
+    if not complete or len(data) != count * 48:
+        return None
+    return [
+        ChunkInfo(*struct.unpack_from("<6q", data, i * 48)) for i in range(count)
+    ]
+
+
+def read_chunk_index(fileobj):
+    """The chunks of a profile written with format=2 (a list of ChunkInfo),
+    found with the footer at the end of the file: the profile is not read.
+    None if there is no complete index (another format, a compressed
+    profile or profiling did not stop)."""
+    try:
+        fileobj.seek(-16, os.SEEK_END)
+    except (IOError, OSError, ValueError):
+        return None
+    footer = fileobj.read(16)
+    if len(footer) != 16 or footer[8:] != CHUNK_FOOTER_MAGIC:
+        return None
+    (distance,) = struct.unpack("<q", footer[:8])
+    try:
+        fileobj.seek(-distance, os.SEEK_END)
+    except (IOError, OSError, ValueError):
+        return None
+    if fileobj.read(1) != MARKER_CHUNK_INDEX:
+        return None
+    return read_chunk_index_entries(fileobj)
+
+
 def gunzip(fileobj):
     is_gzipped = fileobj.read(2) == b"\037\213"
     fileobj.seek(-2, os.SEEK_CUR)
@@ -110,6 +273,14 @@ class LogReader:
         self.state = state
         self.word_size = None
         self.addr_size = None
+        # stack id -> trace, see MARKER_STACKTRACE_DEF
+        self.stacks = {}
+        self.pending_stack_refs = []
+        # string id -> string, see MARKER_STRING
+        self.strings = {}
+        self.pending_code_names = []
+        # ChunkInfo -> False to skip the samples of a MARKER_CHUNK
+        self.chunk_filter = None
         self.setup()
 
     def setup(self):
@@ -176,10 +347,14 @@ class LogReader:
             s.profile_memory = (mode & PROFILE_MEMORY) != 0
             s.profile_lines = (mode & PROFILE_LINES) != 0
             s.profile_rpython = (mode & PROFILE_RPYTHON) != 0
+            s.profile_native_pcs = (mode & PROFILE_NATIVE_PCS) != 0
+            s.profile_native_leaf = (mode & PROFILE_NATIVE_LEAF) != 0
         else:
             s.profile_memory = s.version == VERSION_MEMORY
             s.profile_lines = False
             s.profile_rpython = False
+            s.profile_native_pcs = False
+            s.profile_native_leaf = False
 
         lgt = ord(fileobj.read(1))
         s.interp_name = fileobj.read(lgt)
@@ -215,17 +390,20 @@ class LogReader:
         return bytes
 
     def read_trace(self, depth):
+        return self.trace_of([self.read_addr() for i in range(depth)])
+
+    def trace_of(self, words):
+        """The trace of the stack words of a sample, leaf first"""
         if self.state.profile_rpython:
-            assert depth & 1 == 0
-            depth = depth // 2
-            kinds_and_pcs = self.read_addresses(depth * 2)
+            assert len(words) & 1 == 0
+            kinds_and_pcs = self.wrap_addresses(words)
             # kinds_and_pcs is a list of [kind1, pc1, kind2, pc2, ...]
             return [
                 wrap_kind(kinds_and_pcs[i], kinds_and_pcs[i + 1])
                 for i in range(0, len(kinds_and_pcs), 2)
             ]
         else:
-            trace = self.read_addresses(depth)
+            trace = self.wrap_addresses(words)
 
             if self.state.profile_lines:
                 for i in range(0, len(trace), 2):
@@ -235,9 +413,11 @@ class LogReader:
             return trace
 
     def read_addresses(self, count):
+        return self.wrap_addresses([self.read_addr() for i in range(count)])
+
+    def wrap_addresses(self, words):
         addrs = []
-        for i in range(count):
-            addr = self.read_addr()
+        for addr in words:
             if addr > 0 and addr & 1 == 1:
                 addrs.append(NativeCode(addr))
             else:
@@ -281,7 +461,7 @@ class LogReader:
                 s.meta[key] = value
             elif marker == MARKER_TIME_N_ZONE:
                 s.start_time = self.read_time_and_zone()
-            elif marker == MARKER_STACKTRACE:
+            elif marker == MARKER_STACKTRACE or marker == MARKER_STACKTRACE_DEF:
                 count = self.read_word()
                 # for now
                 assert count == 1
@@ -295,14 +475,86 @@ class LogReader:
                 if s.profile_memory:
                     mem_in_kb = self.read_addr()
                 trace.reverse()
+                if marker == MARKER_STACKTRACE_DEF:
+                    self.stacks[self.read_addr()] = trace
                 self.add_trace(trace, 1, thread_id, mem_in_kb)
+            elif marker == MARKER_STACKTRACE_REF:
+                count = self.read_word()
+                assert count == 1
+                stack_id = self.read_word()
+                thread_id = self.read_addr()
+                mem_in_kb = 0
+                if s.profile_memory:
+                    mem_in_kb = self.read_addr()
+                self.add_stack_ref(stack_id, thread_id, mem_in_kb)
+            elif marker == MARKER_CHUNK:
+                self.read_chunk()
+            elif marker == MARKER_CHUNK_INDEX:
+                s.chunk_index_offset = fileobj.tell() - 1
+                s.chunk_index = read_chunk_index_entries(fileobj)
+            elif marker == MARKER_ALLOCATION:
+                # the count is the number of bytes the sample stands for
+                weight = self.read_word()
+                depth = self.read_word()
+                assert depth <= 2**16, "stack strace depth too high"
+                trace = self.read_trace(depth)
+                thread_id = self.read_addr()
+                size = self.read_addr()
+                trace.reverse()
+                self.add_allocation(trace, weight, thread_id, size)
+            elif marker == MARKER_LINE_TABLE:
+                code_id = self.read_addr()
+                pairs = s.line_tables.setdefault(code_id, [])
+                for i in range(self.read_word()):
+                    offset = self.read_word()
+                    pairs.append((offset, self.read_word()))
+            elif marker == MARKER_MODULE:
+                event = ord(self.read(1))
+                base = self.read_addr()
+                start = self.read_addr()
+                end = self.read_addr()
+                path = self.read_string()
+                build_id = binascii.hexlify(self.read(self.read_word())).decode("ascii")
+                # the number of samples read so far places the event in time
+                s.modules.append(
+                    (event, base, start, end, path, build_id, len(s.profiles))
+                )
+            elif marker == MARKER_CODE_ALIAS:
+                code_id = self.read_addr()
+                # it holds for the samples read so far, a freed address
+                # is reused by a code object that gets another id
+                s.code_aliases.append(
+                    (code_id, self.read_addr(), len(s.profiles), len(s.allocations))
+                )
             elif marker == MARKER_VIRTUAL_IP or marker == MARKER_NATIVE_SYMBOLS:
                 unique_id = self.read_addr()
-                name = self.read_string()
+                name = CodeName.parse(self.read_string())
                 self.add_virtual_ip(marker, unique_id, name)
+            elif marker == MARKER_STRING:
+                key = self.read_s64()
+                string = self.read(self.read_word()).decode("utf-8", "replace")
+                self.strings[key] = sys.intern(string)
+            elif marker == MARKER_CODE_NAME:
+                unique_id = self.read_addr()
+                lang = self.read_s64()
+                name = self.read_s64()
+                line = self.read_word()
+                code_name = (unique_id, lang, name, line, self.read_s64())
+                if not self.add_code_name(*code_name):
+                    # its strings were written after this record
+                    self.pending_code_names.append(code_name)
+            elif marker == MARKER_PROFILER_STATS:
+                for i in range(self.read_word()):
+                    key = self.read_string()
+                    s.profiler_stats[key] = self.read_word()
+                buckets = self.read_word()
+                s.profiler_stats["handler_latency_ns_log2"] = [
+                    self.read_word() for i in range(buckets)
+                ]
             elif marker == MARKER_TRAILER:
                 # if not virtual_ips_only:
                 #    symmap = read_ranges(fileobj.read())
+                s.trailer_offset = fileobj.tell() - 1
                 if s.version >= VERSION_DURATION:
                     s.end_time = self.read_time_and_zone()
                 break
@@ -310,8 +562,218 @@ class LogReader:
                 assert not marker, (fileobj.tell(), repr(marker))
                 break
 
+        self.resolve_pending_stack_refs()
+        self.resolve_pending_code_names()
+        self.resolve_code_aliases()
+        self.resolve_line_offsets()
+        self.resolve_native_pcs()
         self.finished_reading_profile()
 
+    def add_stack_ref(self, stack_id, thread_id, mem_in_kb):
+        trace = self.stacks.get(stack_id)
+        if trace is None:
+            # the definition was written after this reference
+            self.pending_stack_refs.append((stack_id, thread_id, mem_in_kb))
+        else:
+            self.add_trace(trace, 1, thread_id, mem_in_kb)
+
+    def read_chunk(self):
+        """Reads a MARKER_CHUNK (see src/vmprof_chunk.h), skips it if
+        chunk_filter returns False for its ChunkInfo"""
+        fileobj = self.fileobj
+        offset = fileobj.tell() - 1
+        (size,) = struct.unpack("<I", self.read(4))
+        # the header is four varints
+        data = self.read(min(size, 40))
+        mask = (1 << (8 * self.addr_size)) - 1
+        sign = 1 << (8 * self.addr_size - 1)
+        thread_id, pos = read_varint(data, 0)
+        samples, pos = read_varint(data, pos)
+        first_usec, pos = read_varint(data, pos)
+        last_usec, pos = read_varint(data, pos)
+        if thread_id & sign:
+            thread_id -= mask + 1
+        if self.chunk_filter is not None:
+            info = ChunkInfo(
+                offset, size + 5, thread_id, samples, first_usec, last_usec
+            )
+            if not self.chunk_filter(info):
+                fileobj.seek(size - len(data), os.SEEK_CUR)
+                return
+        data += self.read(size - len(data))
+
+        stack = []  # the previous stack, root first, unsigned words
+        trace = None
+        rss = 0
+        for i in range(samples):
+            tag, pos = read_varint(data, pos)
+            kind = tag & 3
+            if kind != 2:
+                keep, pos = read_varint(data, pos)
+                fresh, pos = read_varint(data, pos)
+                words = stack[:keep]
+                for depth in range(keep, keep + fresh):
+                    delta, pos = read_varint(data, pos)
+                    basis = stack[depth] if depth < len(stack) else 0
+                    words.append((basis + unzigzag(delta)) & mask)
+                stack = words
+                trace = self.trace_of(
+                    [w - (mask + 1) if w & sign else w for w in reversed(stack)]
+                )
+                trace.reverse()
+            if kind != 0:
+                stack_id, pos = read_varint(data, pos)
+                if stack_id & sign:
+                    stack_id -= mask + 1
+            if tag & 4:
+                delta, pos = read_varint(data, pos)
+                rss += unzigzag(delta)
+            if kind == 2:
+                self.add_stack_ref(stack_id, thread_id, rss)
+                continue
+            if kind == 1:
+                self.stacks[stack_id] = trace
+            self.add_trace(trace, 1, thread_id, rss)
+
+    def resolve_pending_stack_refs(self):
+        lost = 0
+        for stack_id, thread_id, mem_in_kb in self.pending_stack_refs:
+            trace = self.stacks.get(stack_id)
+            # the definition is lost if its buffer could not be written
+            if trace is not None:
+                self.add_trace(trace, 1, thread_id, mem_in_kb)
+            else:
+                lost += 1
+        self.pending_stack_refs = []
+        if lost:
+            stats = self.state.profiler_stats
+            stats["lost_stack_refs"] = stats.get("lost_stack_refs", 0) + lost
+
+    def add_code_name(self, unique_id, lang, name, line, file):
+        """Adds a MARKER_CODE_NAME record, False if a string is unknown"""
+        strings = self.strings
+        if lang not in strings or name not in strings or file not in strings:
+            return False
+        name = CodeName.of(strings[lang], strings[name], line, strings[file])
+        self.add_virtual_ip(MARKER_CODE_NAME, unique_id, name)
+        return True
+
+    def resolve_pending_code_names(self):
+        for code_name in self.pending_code_names:
+            # the name is lost if a string could not be written
+            self.add_code_name(*code_name)
+        self.pending_code_names = []
+
+    def resolve_code_aliases(self):
+        """With stable_ids=True the samples taken before a code object got
+        its stable id recorded its address, maps them to the id. An alias
+        is applied to the samples before it, up to the previous alias of
+        the same address."""
+        s = self.state
+        if not s.code_aliases:
+            return
+        # in lines mode every frame is followed by its offset
+        step = 2 if s.profile_lines else 1
+
+        def map_traces(samples, which):
+            # address -> ([number of samples before the alias], [stable id])
+            aliases = {}
+            for alias in s.code_aliases:
+                before, ids = aliases.setdefault(alias[0], ([], []))
+                before.append(alias[which])
+                ids.append(alias[1])
+            mapped_samples = []
+            for k, sample in enumerate(samples):
+                mapped = list(sample[0])
+                for i in range(0, len(mapped), step):
+                    alias = aliases.get(mapped[i])
+                    if alias is not None:
+                        j = bisect.bisect_right(alias[0], k)
+                        if j < len(alias[1]):
+                            mapped[i] = alias[1][j]
+                mapped_samples.append((mapped,) + tuple(sample[1:]))
+            return mapped_samples
+
+        s.profiles = map_traces(s.profiles, 2)
+        s.allocations = map_traces(s.allocations, 3)
+
+    def resolve_line_offsets(self):
+        """In lines mode a profile of version VERSION_LINE_OFFSETS carries
+        the instruction offset of every frame instead of its line number.
+        Maps them with the line tables of the code objects, the result
+        looks like the lines of older profiles (negative numbers)."""
+        s = self.state
+        if not s.profile_lines or s.version < VERSION_LINE_OFFSETS:
+            return
+        tables = {}
+        for code_id, pairs in s.line_tables.items():
+            pairs.sort()
+            tables[code_id] = ([o for o, _ in pairs], [l for _, l in pairs])
+        lines = {}
+
+        def map_trace(trace):
+            mapped = list(trace)
+            for i in range(1, len(mapped), 2):
+                key = (mapped[i - 1], mapped[i])
+                line = lines.get(key)
+                if line is None:
+                    line = 0
+                    table = tables.get(key[0])
+                    if table is not None:
+                        j = bisect.bisect_right(table[0], -key[1]) - 1
+                        if j >= 0:
+                            line = table[1][j]
+                    lines[key] = line
+                mapped[i] = -line
+            return mapped
+
+        s.profiles = [(map_trace(p[0]),) + p[1:] for p in s.profiles]
+        s.allocations = [(map_trace(a[0]),) + a[1:] for a in s.allocations]
+
+    def resolve_native_pcs(self):
+        """With native_pcs=True a native frame is the address of the
+        instruction it executes, not the start of its function. All
+        addresses of a function are mapped to one of them (the function
+        is named with its lowest line). In lines mode the line of every
+        address is kept like the line of a python frame."""
+        s = self.state
+        if not s.profile_native_pcs:
+            return
+        pcs = {}
+        functions = {}
+        # the symbols of all addresses are written, python code objects
+        # included (their names follow), native addresses are odd
+        for addr, name in dict(s.virtual_ips).items():
+            if not addr & 1 or not isinstance(name, CodeName) or name.lang != "n":
+                continue
+            function, line, srcfile = name.name, name.line, name.file
+            key, first_line = functions.get((function, srcfile), (addr, line))
+            functions[(function, srcfile)] = (key, min(first_line, line))
+            pcs[addr] = (key, line)
+        if not pcs:
+            return  # not symbolized (yet)
+        names = {}
+        for (function, srcfile), (key, line) in functions.items():
+            names[key] = CodeName.of("n", function, line, srcfile)
+        s.virtual_ips = [(addr, names.get(addr, name)) for addr, name in s.virtual_ips]
+
+        # in lines mode every address is followed by its line
+        step = 2 if s.profile_lines else 1
+
+        def map_trace(trace):
+            mapped = list(trace)
+            for i in range(0, len(mapped), step):
+                pc = pcs.get(mapped[i])
+                if pc is None:
+                    continue
+                mapped[i] = pc[0]
+                if step == 2 and i + 1 < len(mapped):
+                    mapped[i + 1] = -pc[1]
+            return mapped
+
+        s.profiles = [(map_trace(p[0]),) + p[1:] for p in s.profiles]
+        s.allocations = [(map_trace(a[0]),) + a[1:] for a in s.allocations]
+
     def finished_reading_profile(self):
         self.state.virtual_ips.sort()  # I think it's sorted, but who knows
 
@@ -321,11 +783,86 @@ class LogReader:
     def add_trace(self, trace, trace_count, thread_id, mem_in_kb):
         self.state.profiles.append((trace, trace_count, thread_id, mem_in_kb))
 
+    def add_allocation(self, trace, weight, thread_id, size):
+        self.state.allocations.append((trace, weight, thread_id, size))
+
 
 class LogReaderDumpNative(LogReader):
+    # False: collect the addresses but leave their symbols to
+    # vmprof.symbolize, see enable(symbolize=False)
+    symbolize = True
+    # directory of the symbols of earlier runs (see vmprof.symcache), None
+    # if there is none
+    symbol_cache = None
+
     def setup(self):
         self.dedup = set()
 
+    def dump_seen(self, addrs, modules, native_pcs, native_leaf=False):
+        """Writes the symbols of addrs, the addresses the profiler collected
+        while sampling (see _vmprof.seen_addresses), without reading the
+        profile. modules are those of stats.modules, the flags those of
+        the header."""
+        self.dedup = set(addrs)
+        self.state.modules = modules
+        # a leaf is the address of an instruction as well
+        self.state.profile_native_pcs = native_pcs or native_leaf
+        self.state.profile_native_leaf = native_leaf
+        self.finished_reading_profile()
+
+    def resolve_jitted(self, addrs):
+        """{addr: (name, line, file)} of the native addresses that JIT
+        compilers named, see vmprof.perfmap"""
+        from vmprof.perfmap import JitSymbols
+
+        jitted = JitSymbols.of_process(os.getpid())
+        symbols = {}
+        if not jitted:
+            return symbols
+        for addr in addrs:
+            if addr & 1:
+                symbol = jitted.find(addr & ~1)
+                if symbol is not None:
+                    symbols[addr] = symbol
+        return symbols
+
+    def resolve(self, addrs):
+        """{addr: (name, line, file) or None}, see _vmprof.resolve_addr"""
+        import _vmprof
+
+        cache = module_map = None
+        if self.symbol_cache is not None:
+            from vmprof.symcache import ModuleMap, SymbolCache
+
+            cache = SymbolCache(self.symbol_cache)
+            module_map = ModuleMap(self.state.modules)
+        # JIT code first, it is not part of the modules
+        symbols = self.resolve_jitted(addrs)
+        keys = {}
+        pending = []
+        for addr in addrs:
+            if addr in symbols:
+                continue
+            module = module_map.find(addr) if module_map is not None else None
+            if module is not None and module[5]:
+                # (build-id, offset)
+                keys[addr] = key = (module[5], addr - module[1])
+                symbols[addr] = cache.get(*key)
+                if symbols[addr] is not None:
+                    continue
+            pending.append(addr)
+        if hasattr(_vmprof, "resolve_addrs"):
+            resolved = _vmprof.resolve_addrs(pending)
+        else:
+            resolved = [_vmprof.resolve_addr(addr) for addr in pending]
+        for addr, symbol in zip(pending, resolved):
+            symbols[addr] = symbol
+            if symbol is not None and addr in keys:
+                cache.put(keys[addr][0], keys[addr][1], symbol)
+        if cache is not None:
+            cache.save()
+        return symbols
+
     def finished_reading_profile(self):
         import _vmprof
 
@@ -333,34 +870,35 @@ class LogReaderDumpNative(LogReader):
             # windows does not implement that!
             return
 
-        resolve_addr = _vmprof.resolve_addr
-        from _vmprof import resolve_addr
-
         LogReader.finished_reading_profile(self)
         if len(self.dedup) == 0:
             return
+        if self.symbolize:
+            symbols = self.resolve(sorted(self.dedup))
+        else:
+            # the names of JIT code do not survive the process
+            symbols = self.resolve_jitted(sorted(self.dedup))
+            if not symbols:
+                return
         self.fileobj.seek(0, os.SEEK_END)
-        # must match '<lang>:<name>:<line>:<file>'
         # 'n' has been chosen as lang here, because the symbol
         # can be generated from several languages (e.g. C, C++, ...)
-
-        for addr in self.dedup:
-            bytelist = [b"\x08"]
-            result = resolve_addr(addr)
+        records = NameRecords()
+        for addr, result in symbols.items():
             if result is None:
                 name, lineno, srcfile = None, 0, None
             else:
                 name, lineno, srcfile = result
             if not name:
-                name = "<native symbol 0x%x>" % addr
-            if not srcfile:
-                srcfile = "-"
-            string = "n:%s:%d:%s" % (name, lineno, srcfile)
-            bytestring = string.encode("utf-8")
-            bytelist.append(struct.pack("P", addr))
-            bytelist.append(struct.pack("l", len(bytestring)))
-            bytelist.append(bytestring)
-            self.fileobj.write(b"".join(bytelist))
+                start = None
+                if self.state.profile_native_pcs:
+                    # name the function, not the instruction
+                    start = _vmprof.native_function_start(addr)
+                name = "<native symbol 0x%x>" % (start or addr)
+            records.add(addr, "n", name, lineno, srcfile or "-")
+        data = records.getvalue()
+        while data:
+            data = data[self.fileobj.write(data) :]
 
     def add_virtual_ip(self, marker, unique_id, name):
         pass  # do nothing, no need to save this data
@@ -370,6 +908,9 @@ class LogReaderDumpNative(LogReader):
             if addr not in self.dedup:
                 self.dedup.add(addr)
 
+    def add_allocation(self, trace, weight, thread_id, size):
+        self.add_trace(trace, 1, thread_id, 0)
+
 
 class ReaderState:
     pass
@@ -379,6 +920,22 @@ class LogReaderState(ReaderState):
     def __init__(self):
         self.virtual_ips = []
         self.profiles = []
+        # (trace, bytes, thread id, sampled size), see MARKER_ALLOCATION
+        self.allocations = []
+        # code id -> [(offset, line)], see MARKER_LINE_TABLE
+        self.line_tables = {}
+        # (event, base, start, end, path, build-id in hex, samples before),
+        # see MARKER_MODULE
+        self.modules = []
+        # (code address, stable id, number of profiles and of allocations
+        # read before), in the order of the file, see MARKER_CODE_ALIAS
+        self.code_aliases = []
+        # where MARKER_TRAILER starts, None if the profile has none
+        self.trailer_offset = None
+        # where MARKER_CHUNK_INDEX starts and its ChunkInfo list (None if
+        # it is incomplete), see read_chunk_index()
+        self.chunk_index_offset = None
+        self.chunk_index = None
         self.interp_name = None
         self.start_time = None
         self.end_time = None
@@ -386,15 +943,17 @@ class LogReaderState(ReaderState):
         self.profile_memory = False
         self.profile_lines = False
         self.meta = {}
+        self.profiler_stats = {}
         self.little_endian = True
         self.period = 0
 
 
-def _read_prof(fileobj, virtual_ips_only=False):
+def _read_prof(fileobj, virtual_ips_only=False, chunk_filter=None):
     fileobj = gunzip(fileobj)
 
     state = LogReaderState()
     reader = LogReader(fileobj, state)
+    reader.chunk_filter = chunk_filter
     reader.read_all()
 
     if virtual_ips_only:
@@ -1,4 +1,4 @@
-from vmprof.reader import AssemblerCode, JittedCode, NativeCode
+from vmprof.reader import AssemblerCode, CodeName, JittedCode, NativeCode
 
 
 class EmptyProfileFile(Exception):
@@ -24,10 +24,20 @@ class Stats:
         if state:
             self.profile_lines = state.profile_lines
             self.profile_memory = state.profile_memory
+            self.profile_native_pcs = getattr(state, "profile_native_pcs", False)
+            self.profile_native_leaf = getattr(state, "profile_native_leaf", False)
+            self.profiler_stats = getattr(state, "profiler_stats", {})
+            self.allocations = getattr(state, "allocations", [])
+            self.modules = getattr(state, "modules", [])
         else:
             # unknown, for tests only
             self.profile_lines = False
             self.profile_memory = False
+            self.profile_native_pcs = False
+            self.profile_native_leaf = False
+            self.profiler_stats = {}
+            self.allocations = []
+            self.modules = []
         self.generate_top()
         if jit_frames is None:
             jit_frames = set()
@@ -49,11 +59,16 @@ class Stats:
         if addr not in self.adr_dict:
             return "unknown"
         line = self.adr_dict[addr]
+        if isinstance(line, CodeName):
+            return line.name
         return line.split(":")[1]
 
     def find_addrs_containing_name(self, part):
         for adr, name in self.adr_dict.items():
-            n, symbol, _, _ = name.split(":", 3)
+            if isinstance(name, CodeName):
+                symbol = name.name
+            else:
+                n, symbol, _, _ = name.split(":", 3)
             if part in symbol:
                 yield adr
 
@@ -61,6 +76,9 @@ class Stats:
         name = self.adr_dict.get(addr, None)
         if not name:
             return None
+        if isinstance(name, CodeName):
+            # the line is a string like the other parts
+            return name.lang, name.name, str(name.line), name.file
         lang, symbol, line, file = name.split(":", 3)
         return lang, symbol, line, file
 
@@ -70,6 +88,42 @@ class Stats:
     def getmeta(self, key, default):
         return self.meta.get(key, default)
 
+    # signals that should have produced a sample, but did not
+    LOST_SAMPLE_COUNTERS = (
+        "faults",
+        "no_thread_state",
+        "no_buffer",
+        "empty_stack",
+        "lost_stack_refs",
+    )
+
+    def lost_samples(self):
+        """Returns a dict counter name -> number of signals that did not
+        produce a sample (empty if the profile does not carry the
+        counters of the profiler)."""
+        return {
+            key: self.profiler_stats[key]
+            for key in self.LOST_SAMPLE_COUNTERS
+            if self.profiler_stats.get(key)
+        }
+
+    def handler_latency_percentile(self, percent):
+        """Bound in nanoseconds that the time the signal handler took
+        stays below for the given percentage of samples, None if
+        unknown. Bucket i of the histogram counts [2**i, 2**(i+1)) ns,
+        the bound is the end of the bucket the percentile falls into."""
+        buckets = self.profiler_stats.get("handler_latency_ns_log2")
+        if not buckets or not sum(buckets):
+            return None
+        wanted = sum(buckets) * percent / 100.0
+        seen = 0
+        for i, count in enumerate(buckets[:-1]):
+            seen += count
+            if seen >= wanted:
+                return 2 ** (i + 1)
+        # the last bucket also counts everything that took longer
+        return None
+
     def display(self, no):
         prof = self.profiles[no][0]
         return [self._get_name(elem) for elem in prof]
@@ -117,7 +171,7 @@ class Stats:
         result = sorted(result.items(), key=lambda a: a[1])
         return result, total
 
-    def get_top(self, profiles):
+    def get_top(self, profiles, weighted=False):
         for prof in profiles:
             if prof[0]:
                 break
@@ -125,15 +179,27 @@ class Stats:
             raise EmptyProfileFile()
         top_addr = prof[0][0]
         top = Node(top_addr, self._get_name(top_addr))
-        top.count = len(self.profiles)
+        if weighted:
+            top.count = sum(profile[1] for profile in profiles)
+        else:
+            top.count = len(profiles)
         return top
 
     def get_tree(self):
+        return self._get_tree(self.profiles)
+
+    def get_allocation_tree(self):
+        """The call tree of the allocation samples, the count of a node is
+        the (estimated) number of bytes allocated below it."""
+        return self._get_tree(self.allocations, weighted=True)
+
+    def _get_tree(self, profiles, weighted=False):
         # fine the first non-empty profile
 
-        top = self.get_top(self.profiles)
+        top = self.get_top(profiles, weighted)
         addr = None
-        for profile in self.profiles:
+        for profile in profiles:
+            weight = profile[1] if weighted else 1
             last_addr = top.addr
             cur = top
             for i in range(0, len(profile[0])):
@@ -143,13 +209,13 @@ class Stats:
 
                 if addr <= 0:
                     # negative address means line number
-                    cur.lines[-addr] = cur.lines.get(-addr, 0) + 1
+                    cur.lines[-addr] = cur.lines.get(-addr, 0) + weight
                 else:
                     if addr == last_addr:
                         continue  # ignore duplicates
                     last_addr = addr
                     name = self._get_name(addr)
-                    cur = cur.add_child(addr, name)
+                    cur = cur.add_child(addr, name, weight)
             if isinstance(addr, JittedCode):
                 cur.meta["jit"] = cur.meta.get("jit", 0) + 1
             if isinstance(addr, NativeCode):
@@ -261,12 +327,12 @@ class Node:
 
     self_count = property(get_self_count)
 
-    def add_child(self, addr, name):
+    def add_child(self, addr, name, count=1):
         try:
             next = self.children[addr]
-            next.count += 1
+            next.count += count
         except KeyError:
-            next = Node(addr, name)
+            next = Node(addr, name, count)
             self.children[addr] = next
         return next
 
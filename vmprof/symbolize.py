@@ -0,0 +1,379 @@
+"""Names the native frames of a profile after the fact.
+
+A profile written with ``vmprof.enable(..., symbolize=False)`` carries
+the load address, the path and the GNU build-id of every module that was
+mapped (see MARKER_MODULE), but no symbols. This looks the addresses up
+in local copies of the binaries, or in a debug directory keyed by
+build-id (``<dir>/.build-id/ab/cdef...debug``), and adds the symbols to
+the profile::
+
+    python -m vmprof.symbolize prof.dat --debug-dir ./debug -o named.dat
+
+Function names come from the ELF symbol tables, lines and source files
+from ``addr2line`` (binutils) if it is installed.
+"""
+
+import argparse
+import binascii
+import bisect
+import gzip
+import io
+import os
+import shutil
+import struct
+import subprocess
+import sys
+
+from vmprof.reader import (
+    CodeName,
+    LogReader,
+    LogReaderState,
+    NameRecords,
+    NativeCode,
+    gunzip,
+)
+from vmprof.symcache import ModuleMap
+
+DEFAULT_DEBUG_DIRS = ["/usr/lib/debug"]
+
+SHT_SYMTAB = 2
+SHT_NOTE = 7
+SHT_DYNSYM = 11
+STT_FUNC = 2
+STT_GNU_IFUNC = 10
+NT_GNU_BUILD_ID = 3
+
+
+class ElfFile:
+    """The symbol tables and the build-id of an ELF file, nothing else"""
+
+    def __init__(self, path):
+        self.path = path
+        with open(path, "rb") as fd:
+            self.data = fd.read()
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+        self.is64 = self.data[4] == 2
+        self.endian = "<" if self.data[5] == 1 else ">"
+        if self.is64:
+            shoff, = self.unpack("Q", 0x28)
+            shentsize, shnum, _ = self.unpack("HHH", 0x3A)
+        else:
+            shoff, = self.unpack("I", 0x20)
+            shentsize, shnum, _ = self.unpack("HHH", 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            offset = shoff + i * shentsize
+            if self.is64:
+                name, type, _, _, off, size, link, _, _, entsize = self.unpack(
+                    "IIQQQQIIQQ", offset
+                )
+            else:
+                name, type, _, _, off, size, link, _, _, entsize = self.unpack(
+                    "IIIIIIIIII", offset
+                )
+            self.sections.append((name, type, off, size, link, entsize))
+
+    def unpack(self, fmt, offset):
+        return struct.unpack_from(self.endian + fmt, self.data, offset)
+
+    def build_id(self):
+        for _, type, off, size, _, _ in self.sections:
+            if type != SHT_NOTE:
+                continue
+            end = off + size
+            while off + 12 <= end:
+                namesz, descsz, note_type = self.unpack("III", off)
+                name = self.data[off + 12 : off + 12 + namesz]
+                desc = off + 12 + ((namesz + 3) & ~3)
+                if note_type == NT_GNU_BUILD_ID and name == b"GNU\x00":
+                    return binascii.hexlify(self.data[desc : desc + descsz]).decode("ascii")
+                off = desc + ((descsz + 3) & ~3)
+        return ""
+
+    def functions(self):
+        """Sorted (address, size, name) of the functions of .symtab and
+        .dynsym"""
+        functions = {}
+        for _, type, off, size, link, entsize in self.sections:
+            if type not in (SHT_SYMTAB, SHT_DYNSYM) or not entsize:
+                continue
+            strtab = self.sections[link][2]
+            for offset in range(off, off + size, entsize):
+                if self.is64:
+                    name, info, _, shndx, value, symsize = self.unpack("IBBHQQ", offset)
+                else:
+                    name, value, symsize, info, _, shndx = self.unpack("IIIBBH", offset)
+                if info & 0xF not in (STT_FUNC, STT_GNU_IFUNC) or not value or not shndx:
+                    continue
+                end = self.data.index(b"\x00", strtab + name)
+                symbol = self.data[strtab + name : end].decode("utf-8", "replace")
+                # the first name wins, .symtab comes before .dynsym
+                functions.setdefault(value, (value, symsize, symbol))
+        return sorted(functions.values())
+
+
+class Module:
+    def __init__(self, base, start, end, path, build_id):
+        self.base = base
+        self.start = start
+        self.end = end
+        self.path = path
+        self.build_id = build_id
+        self.addresses = set()
+
+
+class Symbolizer:
+    def __init__(self, debug_dirs=None, search_dirs=(), sysroot="", addr2line=None):
+        if debug_dirs is None:
+            debug_dirs = DEFAULT_DEBUG_DIRS
+        self.debug_dirs = list(debug_dirs)
+        self.search_dirs = list(search_dirs)
+        self.sysroot = sysroot
+        self.addr2line = addr2line
+        self._elf_cache = {}
+
+    def _open(self, path, build_id):
+        if path not in self._elf_cache:
+            try:
+                self._elf_cache[path] = ElfFile(path)
+            except (IOError, OSError, ValueError, struct.error):
+                self._elf_cache[path] = None
+        elf = self._elf_cache[path]
+        if elf is None:
+            return None
+        if build_id and elf.build_id() not in ("", build_id):
+            return None  # another build of the module
+        return elf
+
+    def find(self, module):
+        """The ELF file with the symbols of the module, None if none of the
+        candidates exists (or has another build-id)"""
+        candidates = []
+        if module.build_id:
+            for d in self.debug_dirs:
+                candidates.append(
+                    os.path.join(
+                        d,
+                        ".build-id",
+                        module.build_id[:2],
+                        module.build_id[2:] + ".debug",
+                    )
+                )
+        if module.path:
+            candidates.append(self.sysroot + module.path)
+            for d in self.search_dirs:
+                candidates.append(os.path.join(d, os.path.basename(module.path)))
+        for path in candidates:
+            if os.path.isfile(path):
+                elf = self._open(path, module.build_id)
+                if elf is not None:
+                    return elf
+        return None
+
+    def lines(self, elf, vaddrs):
+        """{vaddr: (function, line, srcfile)} of addr2line"""
+        if not self.addr2line or not vaddrs:
+            return {}
+        try:
+            proc = subprocess.run(
+                [self.addr2line, "-f", "-e", elf.path],
+                input="".join("%x\n" % v for v in vaddrs).encode("ascii"),
+                stdout=subprocess.PIPE,
+                stderr=subprocess.DEVNULL,
+                check=True,
+            )
+        except (OSError, subprocess.CalledProcessError):
+            return {}
+        output = proc.stdout.decode("utf-8", "replace").splitlines()
+        result = {}
+        for vaddr, function, location in zip(vaddrs, output[0::2], output[1::2]):
+            # 'file:line', '??:0' or 'file:line (discriminator 2)'
+            srcfile, _, line = location.split(" ")[0].rpartition(":")
+            try:
+                line = int(line)
+            except ValueError:
+                line = 0
+            if srcfile in ("", "??"):
+                # without debug info addr2line names the closest symbol,
+                # even if the address is not part of it
+                continue
+            result[vaddr] = (None if function == "??" else function, line, srcfile)
+        return result
+
+    def symbolize(self, module, native_pcs=False):
+        """{address: CodeName 'n:name:line:file'} of the addresses of a
+        module"""
+        elf = self.find(module)
+        functions = elf.functions() if elf is not None else []
+        starts = [f[0] for f in functions]
+        # the tag of native addresses is the lowest bit
+        vaddrs = sorted(set((addr & ~1) - module.base for addr in module.addresses))
+        lines = self.lines(elf, vaddrs) if elf is not None else {}
+        names = {}
+        for addr in module.addresses:
+            vaddr = (addr & ~1) - module.base
+            name, lineno, srcfile = lines.get(vaddr, (None, 0, None))
+            start = None
+            i = bisect.bisect_right(starts, vaddr) - 1
+            if i >= 0:
+                fstart, fsize, fname = functions[i]
+                if vaddr < fstart + max(fsize, 1):
+                    start = fstart + module.base
+                    name = name or fname
+            if not name:
+                if native_pcs and start is not None:
+                    # name the function, not the instruction
+                    name = "<native symbol 0x%x>" % start
+                else:
+                    name = "<native symbol 0x%x>" % addr
+            names[addr] = CodeName.of("n", name, lineno, srcfile or "-")
+        return names
+
+
+def unresolved_addresses(state):
+    """The native addresses of the samples that have no symbol"""
+    named = set(addr for addr, _ in state.virtual_ips)
+    addresses = set()
+    for trace in [p[0] for p in state.profiles] + [a[0] for a in state.allocations]:
+        for addr in trace:
+            if isinstance(addr, NativeCode) and addr not in named:
+                addresses.add(int(addr))
+    return addresses
+
+
+def assign_modules(state, addresses):
+    """Groups the addresses by the module that mapped them. Returns
+    (modules, unknown)."""
+    modules = {}
+    unknown = set()
+    module_map = ModuleMap(state.modules)
+    for addr in addresses:
+        loaded = module_map.find(addr)
+        if loaded is None:
+            unknown.add(addr)
+            continue
+        module = modules.get(id(loaded))
+        if module is None:
+            _, base, start, end, path, build_id, _ = loaded
+            module = modules[id(loaded)] = Module(base, start, end, path, build_id)
+        module.addresses.add(addr)
+    return list(modules.values()), unknown
+
+
+def symbolize_profile(data, symbolizer):
+    """Returns the profile (bytes, not compressed) with a MARKER_CODE_NAME
+    record for every native address that had none, and the number of
+    addresses that got a symbol."""
+    state = LogReaderState()
+    reader = LogReader(io.BytesIO(data), state)
+    reader.read_all()
+
+    addresses = unresolved_addresses(state)
+    modules, unknown = assign_modules(state, addresses)
+    names = {}
+    for module in modules:
+        names.update(symbolizer.symbolize(module, state.profile_native_pcs))
+    for addr in unknown:
+        names[addr] = CodeName.of("n", "<native symbol 0x%x>" % addr, 0, "-")
+
+    records = NameRecords(
+        "<q" if reader.addr_size == 8 else "<l",
+        "<q" if reader.word_size == 8 else "<l",
+    )
+    for addr in sorted(names):
+        name = names[addr]
+        records.add(addr, name.lang, name.name, name.line, name.file)
+    # the reader stops at the trailer, the symbols go before it, and
+    # before the chunk index: the footer holds its distance to the end
+    if state.chunk_index_offset is not None:
+        split = state.chunk_index_offset
+    elif state.trailer_offset is not None:
+        split = state.trailer_offset
+    else:
+        split = len(data)
+    resolved = len(
+        [n for n in names.values() if not n.name.startswith("<native symbol")]
+    )
+    return data[:split] + records.getvalue() + data[split:], resolved
+
+
+def build_argparser():
+    parser = argparse.ArgumentParser(
+        prog="python -m vmprof.symbolize",
+        description="Adds the symbols of the native frames to a profile "
+        "that was written with symbolize=False",
+    )
+    parser.add_argument("profile", help="profile to symbolize")
+    parser.add_argument(
+        "--output",
+        "-o",
+        metavar="file.prof",
+        help="Write the result to this file instead of the profile",
+    )
+    parser.add_argument(
+        "--debug-dir",
+        "-d",
+        action="append",
+        dest="debug_dirs",
+        metavar="dir",
+        help="Directory with separate debug info by build-id "
+        "(dir/.build-id/xx/rest.debug), can be repeated. "
+        "Defaults to %s" % ", ".join(DEFAULT_DEBUG_DIRS),
+    )
+    parser.add_argument(
+        "--search-dir",
+        "-s",
+        action="append",
+        dest="search_dirs",
+        default=[],
+        metavar="dir",
+        help="Directory with copies of the binaries (found by file name), "
+        "can be repeated",
+    )
+    parser.add_argument(
+        "--sysroot",
+        default="",
+        help="Prefix of the paths of the modules as they were recorded",
+    )
+    parser.add_argument(
+        "--addr2line",
+        default=shutil.which("addr2line"),
+        help="addr2line executable that reads lines and source files",
+    )
+    parser.add_argument(
+        "--no-lines",
+        action="store_true",
+        help="Only name the functions, do not run addr2line",
+    )
+    return parser
+
+
+def main(argv=None):
+    args = build_argparser().parse_args(argv)
+    with open(args.profile, "rb") as fd:
+        compressed = fd.read(2) == b"\037\213"
+        fd.seek(0)
+        data = gunzip(fd).read()
+
+    symbolizer = Symbolizer(
+        args.debug_dirs,
+        args.search_dirs,
+        args.sysroot,
+        None if args.no_lines else args.addr2line,
+    )
+    data, resolved = symbolize_profile(data, symbolizer)
+
+    output = args.output or args.profile
+    with open(output, "wb") as fd:
+        if compressed:
+            with gzip.GzipFile(fileobj=fd, mode="wb") as gz:
+                gz.write(data)
+        else:
+            fd.write(data)
+    sys.stderr.write("vmprof: %d native addresses symbolized\n" % resolved)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
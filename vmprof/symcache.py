@@ -0,0 +1,115 @@
+"""A cache of native symbols on disk, keyed by build-id and offset.
+
+Every module of a native profile is recorded with its GNU build-id (see
+MARKER_MODULE). The symbol of an address only depends on the build of its
+module and on the offset of the address from the load bias, repeated
+runs of the same deployment thus look up the same (build-id, offset)
+pairs. One file per build-id holds the symbols that were resolved before::
+
+    <directory>/ab/cdef....json   {"<offset in hex>": [name, line, file]}
+"""
+
+import bisect
+import heapq
+import json
+import os
+import tempfile
+
+from vmprof.reader import MODULE_LOADED
+
+
+def default_directory():
+    cache = os.environ.get("XDG_CACHE_HOME") or os.path.join(
+        os.path.expanduser("~"), ".cache"
+    )
+    return os.path.join(cache, "vmprof", "symbols")
+
+
+class ModuleMap:
+    """The module of an address, the last one that was loaded there wins"""
+
+    def __init__(self, modules):
+        loaded = [m for m in modules if m[0] == MODULE_LOADED]
+        # the address space is cut into disjoint ranges at every start and
+        # end, each owned by the module loaded last over it (or by None)
+        bounds = sorted(set([m[2] for m in loaded] + [m[3] for m in loaded]))
+        events = sorted((m[2], i, m) for i, m in enumerate(loaded))
+        active = []  # (-order of loading, module)
+        self.starts = []
+        self.owners = []
+        k = 0
+        for bound in bounds:
+            while k < len(events) and events[k][0] <= bound:
+                heapq.heappush(active, (-events[k][1], events[k][2]))
+                k += 1
+            while active and active[0][1][3] <= bound:
+                heapq.heappop(active)
+            owner = active[0][1] if active else None
+            if not self.owners or self.owners[-1] is not owner:
+                self.starts.append(bound)
+                self.owners.append(owner)
+
+    def find(self, addr):
+        """(event, base, start, end, path, build_id, samples) or None"""
+        k = bisect.bisect_right(self.starts, addr) - 1
+        return self.owners[k] if k >= 0 else None
+
+
+class SymbolCache:
+    def __init__(self, directory=None):
+        self.directory = directory or default_directory()
+        self.entries = {}
+        self.dirty = set()
+
+    def path(self, build_id):
+        return os.path.join(self.directory, build_id[:2], build_id[2:] + ".json")
+
+    def _read(self, build_id):
+        try:
+            with open(self.path(build_id)) as fd:
+                return json.load(fd)
+        except (IOError, OSError, ValueError):
+            return {}
+
+    def _entries(self, build_id):
+        entries = self.entries.get(build_id)
+        if entries is None:
+            entries = self.entries[build_id] = self._read(build_id)
+        return entries
+
+    def get(self, build_id, offset):
+        """(name, line, file) or None"""
+        entry = self._entries(build_id).get("%x" % offset)
+        return tuple(entry) if entry is not None else None
+
+    def put(self, build_id, offset, symbol):
+        self._entries(build_id)["%x" % offset] = list(symbol)
+        self.dirty.add(build_id)
+
+    def save(self):
+        """Writes the files of the build-ids that got new symbols. Errors
+        are ignored, the cache only saves time."""
+        failed = set()
+        for build_id in self.dirty:
+            path = self.path(build_id)
+            # another process might have written the same file, the
+            # symbols of this one stay in memory if it can't be written
+            entries = self._read(build_id)
+            entries.update(self.entries[build_id])
+            tmp = None
+            try:
+                os.makedirs(os.path.dirname(path), exist_ok=True)
+                fd, tmp = tempfile.mkstemp(dir=os.path.dirname(path))
+                with os.fdopen(fd, "w") as f:
+                    json.dump(entries, f)
+                os.replace(tmp, path)
+            except (IOError, OSError):
+                if tmp is not None:
+                    try:
+                        os.unlink(tmp)
+                    except OSError:
+                        pass
+                failed.add(build_id)
+                continue
+            self.entries[build_id] = entries
+        self.dirty = failed
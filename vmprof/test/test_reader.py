@@ -2,6 +2,7 @@ import struct
 
 import py
 
+from vmprof.reader import CodeName, LogReader, LogReaderState
 from vmprof.test.test_run import BufferTooSmallError, FileObjWrapper
 
 
@@ -49,3 +50,73 @@ def test_fileobj_wrapper():
     assert fw.read(3) == b"123"
     assert fw.read(4) == b"4567"
     assert fw.read(2) == b"89"
+
+
+def test_code_name_parse():
+    name = CodeName.parse("n:ns::f:12:/src/a.cpp")
+    assert (name.lang, name.name, name.line, name.file) == ("n", "ns::f", 12, "/src/a.cpp")
+    name = CodeName.parse("py:main:3:C:\\code\\a.py")
+    assert (name.lang, name.name, name.line, name.file) == ("py", "main", 3, "C:\\code\\a.py")
+    assert name == "py:main:3:C:\\code\\a.py"
+    assert not isinstance(CodeName.parse("foo"), CodeName)
+
+
+def test_lost_stack_refs_are_counted():
+    state = LogReaderState()
+    reader = LogReader(None, state)
+    reader.stacks[1] = [0x1000]
+    reader.pending_stack_refs = [(1, 7, 0), (2, 7, 0), (2, 8, 0)]
+    reader.resolve_pending_stack_refs()
+    assert len(state.profiles) == 1
+    # the definition of stack 2 was never written
+    assert state.profiler_stats["lost_stack_refs"] == 2
+
+
+def test_module_map_last_loaded_wins():
+    from vmprof.reader import MODULE_LOADED
+    from vmprof.symcache import ModuleMap
+
+    a = (MODULE_LOADED, 0, 0x1000, 0x5000, "a.so", "", 0)
+    b = (MODULE_LOADED, 0, 0x2000, 0x3000, "b.so", "", 0)
+    c = (MODULE_LOADED, 0, 0x6000, 0x7000, "c.so", "", 0)
+    modules = ModuleMap([a, b, c])
+    assert modules.find(0xFFF) is None
+    assert modules.find(0x1000) is a
+    assert modules.find(0x2FFF) is b
+    assert modules.find(0x3000) is a
+    assert modules.find(0x5800) is None
+    assert modules.find(0x6FFF) is c
+    assert modules.find(0x7000) is None
+    # a module loaded again over a younger one owns the range
+    assert ModuleMap([b, a]).find(0x2800) is a
+
+
+def test_symbol_cache_save_error(tmpdir, monkeypatch):
+    import json
+
+    from vmprof.symcache import SymbolCache
+
+    def dump(obj, f):
+        raise OSError("disk full")
+
+    cache = SymbolCache(str(tmpdir))
+    cache.put("abcdef", 0x10, ("f", 1, "f.c"))
+    monkeypatch.setattr(json, "dump", dump)
+    cache.save()
+    monkeypatch.undo()
+    # no temporary file is left and the symbol is still known
+    assert tmpdir.join("ab").listdir() == []
+    assert cache.get("abcdef", 0x10) == ("f", 1, "f.c")
+    cache.save()
+    assert SymbolCache(str(tmpdir)).get("abcdef", 0x10) == ("f", 1, "f.c")
+
+
+def test_code_alias_of_a_reused_address():
+    state = LogReaderState()
+    reader = LogReader(None, state)
+    state.profiles = [([0x10], 1, 0), ([0x10], 1, 0), ([0x10, 0x20], 1, 0)]
+    # the first code object at 0x10 got id 7 after one sample, the one
+    # that reused its address got id 9 after two more
+    state.code_aliases = [(0x10, 7, 1, 0), (0x10, 9, 3, 0)]
+    reader.resolve_code_aliases()
+    assert [p[0] for p in state.profiles] == [[7], [9], [9, 0x20]]
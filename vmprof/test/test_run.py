@@ -157,6 +157,55 @@ def test_read_bit_by_bit():
     stats.get_tree()
 
 
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("sys.platform == 'win32'")
+def test_profiler_stats():
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno())
+    function_foo()
+    vmprof.disable()
+    tmpfile.close()
+    counters = vmprof.get_profiler_stats()
+    assert counters["samples"] > 0
+    assert counters["signals"] >= counters["samples"]
+    # every signal that went to sampling is in the histogram
+    assert sum(counters["handler_latency_ns_log2"]) == (
+        counters["samples"]
+        + counters["empty_stack"]
+        + counters["no_buffer"]
+        + counters["no_thread_state"]
+    )
+    stats = read_profile(tmpfile.name)
+    os.unlink(tmpfile.name)
+    assert stats.profiler_stats == counters
+    assert len(stats.profiles) == counters["samples"]
+    assert stats.handler_latency_percentile(99) > 0
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("sys.platform == 'win32'")
+def test_dedup():
+    from vmprof.reader import LogReader, LogReaderState
+
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), dedup=True)
+    function_foo()
+    vmprof.disable()
+    tmpfile.close()
+    state = LogReaderState()
+    with open(tmpfile.name, "rb") as fd:
+        reader = LogReader(fd, state)
+        reader.read_all()
+    # every stack is written once, all other samples reference it
+    assert reader.stacks
+    assert len(state.profiles) > len(reader.stacks)
+    for trace, _, _, _ in state.profiles:
+        assert trace in reader.stacks.values()
+    stats = read_profile(tmpfile.name)
+    d = dict(stats.top_profile())
+    assert d[foo_full_name] > 0
+
+
 def test_enable_disable():
     prof = vmprof.Profiler()
     with prof.measure():
@@ -285,6 +334,746 @@ def test_memory_measurment():
     prof.get_stats()
 
 
+def test_rss_period():
+    if not sys.platform.startswith("linux") or "__pypy__" in sys.builtin_module_names:
+        py.test.skip("unsupported platform")
+
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    # far longer than the test, the rss is read only for the first sample
+    vmprof.enable(tmpfile.fileno(), memory=True, rss_period=1000.0)
+    function_foo()
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    rss = set(mem for _, _, _, mem in stats.profiles)
+    assert len(stats.profiles) > 1
+    assert len(rss) == 1
+    assert rss.pop() > 0
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("sys.platform == 'win32'")
+def test_allocations():
+    def function_alloc():
+        return [bytearray(1000) for i in range(20000)]
+
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), allocations=64 * 1024)
+    function_alloc()
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    assert stats.meta["alloc_sample_bytes"] == str(64 * 1024)
+    assert len(stats.allocations) > 50
+    found = []
+
+    def visit(node):
+        if "function_alloc" in node.name:
+            found.append(node.count)
+
+    stats.get_allocation_tree().walk(visit)
+    # ~20MB were allocated, the estimate is within a factor of two
+    assert found
+    assert 10 * 10**6 < max(found) < 40 * 10**6
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("sys.platform == 'win32'")
+def test_allocations_keep_a_later_hook():
+    import tracemalloc
+
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), allocations=64 * 1024)
+    tracemalloc.start()
+    try:
+        with py.test.warns(RuntimeWarning):
+            vmprof.disable()
+        # the hook of tracemalloc was not removed
+        obj = [bytearray(1000) for i in range(10)]
+        assert tracemalloc.get_object_traceback(obj[0]) is not None
+    finally:
+        tracemalloc.stop()
+    tmpfile.close()
+    # the hooks left in place sample the next profile
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), allocations=64 * 1024)
+    obj = [bytearray(1000) for i in range(20000)]
+    vmprof.disable()
+    tmpfile.close()
+    assert len(read_profile(tmpfile.name).allocations) > 50
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("sys.platform == 'win32'")
+@py.test.mark.parametrize("native", [False, True])
+def test_sampled_stack(native):
+    if native and not sys.platform.startswith("linux"):
+        py.test.skip("native sampling from the signal context is tested on linux")
+
+    def stack_inner():
+        return sum(range(20000))
+
+    def stack_middle():
+        return stack_inner()
+
+    def stack_outer():
+        start = time.time()
+        while time.time() - start < 0.3:
+            stack_middle()
+
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, native=native)
+    stack_outer()
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    os.unlink(tmpfile.name)
+    sampled = 0
+    for trace, _, _, _ in stats.profiles:
+        names = [stats.adr_dict.get(addr, "") for addr in trace]
+        python = [name.split(":")[1] for name in names if name.startswith("py:")]
+        if "stack_inner" in python:
+            # root first, the callers of the sampled function below it
+            assert python[-3:] == ["stack_outer", "stack_middle", "stack_inner"]
+            assert python[0] != "stack_outer"
+            sampled += 1
+    assert sampled > 0
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("os.uname().machine not in ('x86_64', 'aarch64')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_native_builtin_unwind():
+    import zlib
+
+    data = bytes(range(256)) * 4096
+
+    def function_compress():
+        for i in range(60):
+            zlib.compress(data, 6)
+
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, native=True)
+    function_compress()
+    profiler_stats = vmprof.get_profiler_stats()
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    assert profiler_stats["samples"] > 20
+    assert profiler_stats["unwind_failures"] == 0
+    # most samples are in zlib, below the python function that called it
+    native = 0
+    for profile in stats.profiles[:100]:
+        names = [stats.adr_dict.get(addr, "") for addr in profile[0]]
+        if any(name.startswith("n:") for name in names):
+            assert any("function_compress" in name for name in names)
+            native += 1
+    assert native > len(stats.profiles[:100]) // 2
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_native_pcs():
+    import zlib
+
+    data = bytes(range(256)) * 4096
+
+    def function_compress():
+        for i in range(60):
+            zlib.compress(data, 6)
+
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, native=True, native_pcs=True, lines=True)
+    function_compress()
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    assert stats.profile_native_pcs
+    # the instructions of a function are merged into one node
+    native = set()
+    for profile in stats.profiles:
+        for addr in profile[0][::2]:
+            if stats.adr_dict.get(addr, "").startswith("n:"):
+                native.add(addr)
+    assert native
+    names = {stats.adr_dict[addr] for addr in native}
+    assert len(names) == len(native)
+    found = []
+
+    def visit(node):
+        if "function_compress" in node.name:
+            found.append(node)
+
+    stats.get_tree().walk(visit)
+    assert found
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_native_leaf():
+    import zlib
+
+    data = bytes(range(256)) * 4096
+
+    def function_compress():
+        for i in range(60):
+            zlib.compress(data, 6)
+
+    with py.test.raises(ValueError):
+        vmprof.enable(0, native=True, native_leaf=True)
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, native_leaf=True)
+    function_compress()
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    assert stats.profile_native_leaf
+    leafs = 0
+    for profile in stats.profiles:
+        # native addresses are odd
+        native = [i for i, addr in enumerate(profile[0]) if addr & 1]
+        # at most one native frame, the leaf
+        assert native in ([], [len(profile[0]) - 1])
+        leafs += len(native)
+    assert leafs > len(stats.profiles) // 2
+    found = []
+
+    def visit(node):
+        if "function_compress" in node.name:
+            found.append(node)
+
+    stats.get_tree().walk(visit)
+    assert found
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_native_module_events():
+    import ctypes
+    import _ctypes
+    import importlib.util
+
+    from vmprof.reader import MODULE_LOADED, MODULE_UNLOADED
+
+    # a shared object that is not mapped yet
+    for name in ("_testbuffer", "_ctypes_test", "xxlimited", "_testcapi"):
+        spec = importlib.util.find_spec(name)
+        if name not in sys.modules and spec is not None and spec.origin:
+            path = os.path.realpath(spec.origin)
+            break
+    else:
+        py.test.skip("no extension module to load")
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, native=True)
+    lib = ctypes.CDLL(path)
+    time.sleep(0.3)
+    _ctypes.dlclose(lib._handle)
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    loaded = [m for m in stats.modules if m[0] == MODULE_LOADED]
+    assert len(loaded) > 1
+    events = [m[0] for m in stats.modules if os.path.realpath(m[4]) == path]
+    assert events == [MODULE_LOADED, MODULE_UNLOADED]
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_native_symbolize_offline(tmpdir):
+    import zlib
+
+    from vmprof.symbolize import Symbolizer, symbolize_profile
+
+    data = bytes(range(256)) * 4096
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, native=True, symbolize=False)
+    for i in range(60):
+        zlib.compress(data, 6)
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    native = set(
+        addr for profile in stats.profiles for addr in profile[0] if addr & 1
+    )
+    assert native
+    assert not native & set(stats.adr_dict)
+    # the modules are found by build-id only
+    debug_dir = tmpdir.mkdir("debug")
+    for module in stats.modules:
+        build_id = module[5]
+        if build_id:
+            link = debug_dir.join(".build-id", build_id[:2], build_id[2:] + ".debug")
+            if not link.check():
+                link.dirpath().ensure(dir=True)
+                link.mksymlinkto(module[4])
+    symbolizer = Symbolizer([str(debug_dir)], sysroot="/nonexistent")
+    with open(tmpfile.name, "rb") as fd:
+        symbolized, resolved = symbolize_profile(fd.read(), symbolizer)
+    assert resolved > 0
+    path = tmpdir.join("symbolized.prof")
+    path.write_binary(symbolized)
+    stats = read_profile(str(path))
+    names = [stats.adr_dict[addr] for addr in native]
+    assert all(name.startswith("n:") for name in names)
+    assert len([n for n in names if "<native symbol" not in n]) == resolved
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_resolve_addrs():
+    import ctypes
+
+    import _vmprof
+
+    libc = ctypes.CDLL(None)
+    addrs = [
+        ctypes.cast(getattr(libc, name), ctypes.c_void_p).value
+        for name in ("malloc", "abs", "PyObject_Call", "PyLong_FromLong")
+    ]
+    addrs += [a + 1 for a in addrs] + [id(object()), 12345]
+    expected = [_vmprof.resolve_addr(addr) for addr in addrs]
+    assert _vmprof.resolve_addrs(addrs) == expected
+    assert _vmprof.resolve_addrs(addrs, 1) == expected
+    assert _vmprof.resolve_addrs([]) == []
+
+
+SYMBOL_MEMORY_SCRIPT = """
+import ctypes, sys
+import _vmprof
+lib = ctypes.CDLL(sys.argv[1])
+_vmprof.symbol_memory_limit(int(sys.argv[2]))
+addrs = [ctypes.cast(getattr(lib, "f%d_%d" % (i, j)), ctypes.c_void_p).value + 1
+         for i in range(8) for j in range(0, 40, 3)]
+names = [_vmprof.resolve_addr(a) for a in addrs] + _vmprof.resolve_addrs(addrs * 2, 4)
+print(repr((names, _vmprof.symbol_memory_stats())))
+"""
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_symbol_memory_limit(tmpdir):
+    import ast
+    import shutil
+    import subprocess
+
+    if shutil.which("cc") is None:
+        py.test.skip("needs a C compiler")
+    # libbacktrace reads the debug info of the modules that are mapped at
+    # the first lookup, the library is loaded by a new process
+    sources = []
+    for i in range(8):
+        source = tmpdir.join("unit%d.c" % i)
+        source.write("".join("int f%d_%d(int x) { return x + %d; }\n" % (i, j, j)
+                             for j in range(40)))
+        sources.append(str(source))
+    lib = str(tmpdir.join("libunits.so"))
+    subprocess.check_call(["cc", "-shared", "-fPIC", "-gdwarf-4", "-o", lib] + sources)
+    script = tmpdir.join("resolve.py")
+    script.write(SYMBOL_MEMORY_SCRIPT)
+
+    def resolve(limit):
+        output = subprocess.check_output([sys.executable, str(script), lib, str(limit)])
+        return ast.literal_eval(output.decode("utf-8"))
+
+    names, (_, decoded, evicted) = resolve(0)
+    assert decoded == 8 and evicted == 0
+    assert names[0] == ("f0_0", 1, str(tmpdir.join("unit0.c")))
+    # every unit is dropped by the next one, they are decoded again
+    bounded, (size, decoded, evicted) = resolve(1)
+    assert bounded == names
+    assert decoded > 8 and evicted == decoded - 1
+    assert size < 64 * 1024
+
+
+SEPARATE_DEBUG_SCRIPT = """
+import ctypes, sys
+import _vmprof
+_vmprof.set_debug_dir(sys.argv[1])
+libs = [ctypes.CDLL(path) for path in sys.argv[2:]]
+print(repr([_vmprof.resolve_addr(ctypes.cast(lib.one, ctypes.c_void_p).value + 1)
+            for lib in libs]))
+"""
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_separate_and_compressed_debug_info(tmpdir):
+    import ast
+    import shutil
+    import subprocess
+
+    if not all(shutil.which(tool) for tool in ("cc", "objcopy", "strip", "readelf")):
+        py.test.skip("needs a C compiler and binutils")
+    source = tmpdir.join("one.c")
+    source.write("int one(int x) { return x * 3 + 1; }\n")
+
+    def build(name, *flags):
+        path = str(tmpdir.join(name))
+        subprocess.check_call(
+            ["cc", "-shared", "-fPIC", "-gdwarf-4", "-Wl,--build-id", "-o", path, str(source)]
+            + list(flags)
+        )
+        return path
+
+    def split_debug_info(path, debug):
+        subprocess.check_call(["objcopy", "--only-keep-debug", path, debug])
+        subprocess.check_call(["strip", "--strip-debug", path])
+
+    # .gnu_debuglink, the debug file is next to the library
+    debuglink = build("liblink.so")
+    split_debug_info(debuglink, str(tmpdir.join("liblink.debug")))
+    subprocess.check_call(["objcopy", "--add-gnu-debuglink=liblink.debug", debuglink],
+                          cwd=str(tmpdir))
+    # build-id, the debug file is in the debug directory
+    buildid = build("libbuildid.so")
+    notes = subprocess.check_output(["readelf", "-n", buildid]).decode("ascii")
+    build_id = notes.split("Build ID:")[1].split()[0]
+    debug_dir = tmpdir.join("debug")
+    debug_dir.join(".build-id", build_id[:2]).ensure(dir=True)
+    split_debug_info(buildid, str(debug_dir.join(".build-id", build_id[:2], build_id[2:] + ".debug")))
+    # SHF_COMPRESSED debug sections
+    compressed = build("libcompressed.so", "-gz=zlib")
+    headers = subprocess.check_output(["readelf", "-S", "-W", compressed]).decode()
+    for line in headers.splitlines():
+        # [Nr] Name Type Address Off Size ES Flg Lk Inf Al, Flg may be empty
+        fields = line.split("]", 1)[-1].split()
+        if fields[:1] == [".debug_info"]:
+            flags = fields[6] if len(fields) == 10 else ""
+            break
+    else:
+        flags = ""
+    if "C" not in flags:
+        py.test.skip("the compiler does not compress debug sections")
+
+    script = tmpdir.join("resolve.py")
+    script.write(SEPARATE_DEBUG_SCRIPT)
+    output = subprocess.check_output(
+        [sys.executable, str(script), str(debug_dir), debuglink, buildid, compressed]
+    )
+    expected = ("one", 1, str(source))
+    assert ast.literal_eval(output.decode("utf-8")) == [expected] * 3
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_native_symbol_cache(tmpdir):
+    import json
+    import zlib
+
+    data = bytes(range(256)) * 4096
+    cache = tmpdir.join("symbols")
+
+    def run():
+        tmpfile = tempfile.NamedTemporaryFile(delete=False)
+        vmprof.enable(tmpfile.fileno(), period=0.001, native=True, symbol_cache=str(cache))
+        for i in range(60):
+            zlib.compress(data, 6)
+        vmprof.disable()
+        tmpfile.close()
+        stats = read_profile(tmpfile.name)
+        return set(v for k, v in stats.adr_dict.items() if k & 1)
+
+    run()
+    files = list(cache.visit("*.json"))
+    assert files
+    # the next run takes the symbols from the cache
+    for path in files:
+        entries = json.loads(path.read())
+        path.write(json.dumps({key: ["cached", 1, "cached.c"] for key in entries}))
+    assert "n:cached:1:cached.c" in run()
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_jit_perf_map(tmpdir, monkeypatch):
+    import struct
+    import zlib
+    from vmprof import perfmap
+    from vmprof.perfmap import JitSymbols
+
+    # pretend that libz is code of a JIT compiler
+    ranges = []
+    with open("/proc/self/maps") as fd:
+        for line in fd:
+            fields = line.split()
+            if len(fields) >= 6 and "libz.so" in fields[5] and "x" in fields[1]:
+                start, end = [int(x, 16) for x in fields[0].split("-")]
+                ranges.append((start, end))
+    if not ranges:
+        py.test.skip("zlib is not a shared library")
+    data = bytes(range(256)) * 4096
+    # not the real /tmp/perf-<pid>.map, which might belong to a JIT
+    path = str(tmpdir.join("perf.map"))
+    monkeypatch.setattr(perfmap, "perf_map_path", lambda pid: path)
+    with open(path, "w") as fd:
+        for start, end in ranges:
+            fd.write("%x %x jitted_zlib\n" % (start, end - start))
+    for symbolize in (True, False):
+        tmpfile = tempfile.NamedTemporaryFile(delete=False)
+        vmprof.enable(tmpfile.fileno(), period=0.001, native=True, symbolize=symbolize)
+        for i in range(60):
+            zlib.compress(data, 6)
+        vmprof.disable()
+        tmpfile.close()
+        stats = read_profile(tmpfile.name)
+        assert "n:jitted_zlib:0:-" in stats.adr_dict.values()
+
+    # a jitdump: load, debug info of the next load, load, move
+    def record(kind, body):
+        return struct.pack("<IIQ", kind, 16 + len(body), 0) + body
+
+    dump = struct.pack("<IIIIIIQQ", 0x4A695444, 1, 40, 62, 1, 0, 0, 0)
+    dump += record(0, struct.pack("<IIQQQQ", 1, 1, 0, 0x1000, 0x100, 0) + b"f\x00")
+    dump += record(
+        2,
+        struct.pack("<QQ", 0x2000, 2)
+        + struct.pack("<QII", 0x2000, 10, 0) + b"g.py\x00"
+        + struct.pack("<QII", 0x2010, 11, 0) + b"g.py\x00",
+    )
+    dump += record(0, struct.pack("<IIQQQQ", 1, 1, 0, 0x2000, 0x20, 1) + b"g\x00")
+    dump += record(1, struct.pack("<IIQQQQQ", 1, 1, 0, 0x2000, 0x3000, 0x20, 1))
+    dump += record(0, struct.pack("<IIQQQQ", 1, 1, 0, 0x1080, 0x100, 2) + b"h\x00")
+    jitdump = tmpdir.join("jit-1.dump")
+    jitdump.write_binary(dump + b"\x00" * 7)
+    symbols = JitSymbols()
+    symbols.read_jitdump(str(jitdump))
+    assert symbols.find(0x1010) == ("f", 0, None)
+    # f is cut where h starts
+    assert symbols.find(0x1090) == ("h", 0, None)
+    assert symbols.find(0x2000) is None
+    assert symbols.find(0x3012) == ("g", 11, "g.py")
+    assert symbols.find(0x3020) is None
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.parametrize("dedup", [False, True])
+def test_disable_does_not_read_profile(monkeypatch, dedup):
+    import zlib
+    from vmprof.reader import LogReaderDumpNative, NativeCode
+
+    def read_all(self):
+        raise AssertionError("the profile was read back")
+
+    data = bytes(range(256)) * 4096
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, native=True, dedup=dedup)
+    for i in range(60):
+        zlib.compress(data, 6)
+    monkeypatch.setattr(LogReaderDumpNative, "read_all", read_all)
+    vmprof.disable()
+    monkeypatch.undo()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    # every address of the samples got its symbol or its code object
+    addrs = set(addr for trace in stats.profiles for addr in trace[0])
+    assert addrs and addrs <= set(stats.adr_dict)
+    assert any(isinstance(addr, NativeCode) for addr in addrs)
+
+
+@py.test.mark.skipif("sys.platform == 'win32'")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_code_objects_written_when_sampled(monkeypatch):
+    import gc
+
+    def get_objects(*args):
+        raise AssertionError("the heap was scanned")
+
+    # compiled here, the code object is never tracked by the gc
+    namespace = {}
+    exec(compile("def spin():\n    return sum(range(200000))\n", "<spin>", "exec"), namespace)
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001)
+    start = time.time()
+    while time.time() - start < 0.3:
+        namespace["spin"]()
+    monkeypatch.setattr(gc, "get_objects", get_objects)
+    vmprof.disable()
+    monkeypatch.undo()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    addrs = set(addr for trace in stats.profiles for addr in trace[0])
+    assert addrs and addrs <= set(stats.adr_dict)
+    assert "py:spin:1:<spin>" in stats.adr_dict.values()
+
+
+@py.test.mark.skipif("sys.platform == 'win32'")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_code_at_a_freed_address_with_dedup():
+    import gc
+
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, dedup=True)
+    for i in range(10):
+        # the code object of the last round usually has the address of
+        # a freed one, and its stack is known
+        namespace = {}
+        exec(compile("def spin():\n    return sum(range(200000))\n", "<spin%d>" % i, "exec"),
+             namespace)
+        start = time.time()
+        while time.time() - start < 0.05:
+            namespace["spin"]()
+        if i < 9:
+            del namespace
+            gc.collect()
+    vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    assert "py:spin:1:<spin9>" in stats.adr_dict.values()
+
+
+@py.test.mark.skipif("sys.platform == 'win32' or sys.version_info < (3, 6)")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.parametrize("lines", [False, True])
+def test_stable_code_ids(lines):
+    from vmprof.reader import NativeCode
+
+    def run():
+        # a new code object every time, at another address
+        namespace = {}
+        source = (
+            "def spin():\n    return sum(range(200000))\n"
+            "a = lambda: sum(range(200000)); b = lambda: sum([x for x in range(50000)])\n"
+        )
+        exec(compile(source, "<spin>", "exec"), namespace)
+        tmpfile = tempfile.NamedTemporaryFile(delete=False)
+        vmprof.enable(tmpfile.fileno(), period=0.001, lines=lines, stable_ids=True)
+        start = time.time()
+        while time.time() - start < 0.3:
+            namespace["spin"]()
+            namespace["a"]()
+            namespace["b"]()
+        vmprof.disable()
+        tmpfile.close()
+        stats = read_profile(tmpfile.name)
+        step = 2 if lines else 1
+        addrs = set(a for trace in stats.profiles for a in trace[0][::step])
+        assert addrs and addrs <= set(stats.adr_dict)
+        # samples taken before the ids were assigned have been mapped
+        assert all(addr & 3 == 2 for addr in addrs if not isinstance(addr, NativeCode))
+        ids = [k for k, v in stats.adr_dict.items() if v == "py:spin:1:<spin>"]
+        assert len(ids) == 1
+        # the lambdas on one line differ in their bytecode
+        assert len([v for v in stats.adr_dict.values() if v == "py:<lambda>:3:<spin>"]) == 2
+        return ids[0]
+
+    assert run() == run()
+
+
+def test_code_names_interned():
+    import struct
+
+    from vmprof.reader import MARKER_STRING, CodeName, string_id
+
+    source = "".join("def f%d():\n    return sum(range(20000))\n" % i for i in range(20))
+    namespace = {}
+    exec(compile(source, "<many>", "exec"), namespace)
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.0005)
+    start = time.time()
+    while time.time() - start < 0.3:
+        for i in range(20):
+            namespace["f%d" % i]()
+    vmprof.disable()
+    tmpfile.close()
+    with open(tmpfile.name, "rb") as fd:
+        data = fd.read()
+    # the file of all code objects is written once
+    assert data.count(MARKER_STRING + struct.pack("<q", string_id("<many>"))) == 1
+    stats = read_profile(tmpfile.name)
+    names = [v for v in stats.adr_dict.values() if v.endswith(":<many>")]
+    assert len(names) > 1
+    assert all(isinstance(name, CodeName) for name in names)
+    assert len(set(id(name.file) for name in names)) == 1
+    addr = [k for k, v in stats.adr_dict.items() if v == names[0]][0]
+    assert stats.get_addr_info(addr) == ("py", names[0].name, str(names[0].line), "<many>")
+
+
+@py.test.mark.skipif("sys.platform == 'win32'")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.parametrize("lines,dedup", [(False, False), (True, False), (False, True)])
+def test_chunk_format(lines, dedup):
+    from vmprof.reader import read_chunk_index
+
+    def run(format):
+        tmpfile = tempfile.NamedTemporaryFile(delete=False)
+        vmprof.enable(
+            tmpfile.fileno(), period=0.001, lines=lines, dedup=dedup, format=format
+        )
+        start = time.time()
+        while time.time() - start < 0.3:
+            function_foo()
+        vmprof.disable()
+        tmpfile.close()
+        return tmpfile.name
+
+    v1, v2 = run(1), run(2)
+    assert os.path.getsize(v2) < os.path.getsize(v1)
+    stats = read_profile(v2)
+    assert dict(stats.top_profile())[foo_full_name] > 0
+    with open(v2, "rb") as fd:
+        chunks = read_chunk_index(fd)
+    with open(v1, "rb") as fd:
+        assert read_chunk_index(fd) is None
+    assert chunks
+    assert sum(chunk.samples for chunk in chunks) == len(stats.profiles)
+    assert all(chunk.first_usec <= chunk.last_usec for chunk in chunks)
+    # the chunks of the index are the ones read
+    seen = []
+    stats = read_profile(v2, chunk_filter=lambda chunk: seen.append(chunk) or False)
+    assert seen == chunks
+    assert not stats.profiles
+    assert foo_full_name in stats.adr_dict.values()
+
+
+PARTIAL_CHUNK_SCRIPT = """
+import os, resource, signal, sys, time
+import _vmprof, vmprof
+
+def spin():
+    start = time.time()
+    while time.time() - start < 0.2:
+        sum(range(10000))
+
+signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+fd = os.open(sys.argv[1], os.O_RDWR | os.O_CREAT | os.O_TRUNC)
+vmprof.enable(fd, period=0.001, format=2)
+spin()
+# the next chunk only fits in part
+limits = resource.getrlimit(resource.RLIMIT_FSIZE)
+resource.setrlimit(resource.RLIMIT_FSIZE, (os.fstat(fd).st_size + 50, limits[1]))
+try:
+    _vmprof.stop_sampling()
+except OSError:
+    print("failed")
+resource.setrlimit(resource.RLIMIT_FSIZE, limits)
+_vmprof.start_sampling()
+spin()
+vmprof.disable()
+os.close(fd)
+"""
+
+
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_chunk_written_in_part(tmpdir):
+    import subprocess
+
+    from vmprof.reader import read_chunk_index
+
+    script = tmpdir.join("partial.py")
+    script.write(PARTIAL_CHUNK_SCRIPT)
+    path = str(tmpdir.join("partial.prof"))
+    output = subprocess.check_output([sys.executable, str(script), path])
+    assert output.split() == [b"failed"]
+    # the rest of the chunk was written first, the file is intact
+    stats = read_profile(path)
+    with open(path, "rb") as fd:
+        chunks = read_chunk_index(fd)
+    assert chunks and sum(chunk.samples for chunk in chunks) == len(stats.profiles)
+    assert "py:spin:5:%s" % script in stats.adr_dict.values()
+
+
 @py.test.mark.skipif("sys.platform == 'win32'")
 def test_vmprof_real_time():
     prof = vmprof.Profiler()
@@ -386,6 +1175,174 @@ def test_vmprof_real_time_many_threads():
     assert bar_time_name in d
 
 
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+def test_per_thread_timers():
+    import threading
+
+    def f():
+        for k in range(100):
+            l = [a for a in xrange(COUNT)]
+
+    threads = [threading.Thread(target=f) for _ in range(3)]
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, per_thread=True)
+    try:
+        for t in threads:
+            t.start()
+        f()
+        for t in threads:
+            t.join()
+    finally:
+        vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    os.unlink(tmpfile.name)
+    all_ids = {x[2] for x in stats.profiles}
+    # every busy thread owns a timer, thus every one of them is sampled
+    assert len(all_ids) >= 4
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+def test_samples_of_the_sampled_thread():
+    import ctypes
+    import threading
+
+    get_tstate = ctypes.pythonapi.PyThreadState_Get
+    get_tstate.restype = ctypes.c_void_p
+    mask = (1 << (8 * ctypes.sizeof(ctypes.c_void_p))) - 1
+    tstates = {}
+
+    def spin_a():
+        return sum(range(20000))
+
+    def spin_b():
+        return sum(range(20000))
+
+    def run(spin):
+        tstates[spin.__name__] = get_tstate()
+        start = time.time()
+        while time.time() - start < 0.3:
+            spin()
+
+    thread = threading.Thread(target=run, args=(spin_b,))
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, per_thread=True)
+    try:
+        thread.start()
+        run(spin_a)
+        thread.join()
+    finally:
+        vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    os.unlink(tmpfile.name)
+    assert tstates["spin_a"] != tstates["spin_b"]
+    seen = set()
+    # every sample carries the thread state of the thread that took it
+    for trace, _, thread_id, _ in stats.profiles:
+        for addr in trace:
+            name = stats.adr_dict.get(addr, "")
+            for spin in ("spin_a", "spin_b"):
+                if name.startswith("py:%s:" % spin):
+                    assert thread_id & mask == tstates[spin]
+                    seen.add(spin)
+    assert seen == {"spin_a", "spin_b"}
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+def test_many_threads_sampled_concurrently():
+    import hashlib
+    import threading
+
+    data = b"x" * (1 << 20)
+
+    def f():
+        # hashlib releases the GIL, signal handlers of all
+        # threads run at the same time
+        h = hashlib.sha256()
+        for k in range(40):
+            h.update(data)
+
+    n_threads = 32
+    threads = [threading.Thread(target=f) for _ in range(n_threads)]
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), period=0.001, per_thread=True)
+    try:
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+    finally:
+        vmprof.disable()
+    tmpfile.close()
+    stats = read_profile(tmpfile.name)
+    os.unlink(tmpfile.name)
+    all_ids = {x[2] for x in stats.profiles}
+    assert len(all_ids) >= n_threads // 2
+    # the counters of all threads are summed up
+    assert vmprof.get_profiler_stats()["samples"] == len(stats.profiles)
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("sys.platform == 'win32'")
+@py.test.mark.parametrize("policy", ["drop_newest", "drop_oldest"])
+def test_buffer_writer(policy):
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), writer=policy)
+    function_foo()
+    vmprof.disable()
+    tmpfile.close()
+    counters = vmprof.get_buffer_writer_stats()
+    assert counters["writes"] > 0
+    stats = read_profile(tmpfile.name)
+    os.unlink(tmpfile.name)
+    d = dict(stats.top_profile())
+    assert d[foo_full_name] > 0
+    assert int(stats.meta["writer_fell_behind"]) == counters["fell_behind"]
+    with py.test.raises(ValueError):
+        vmprof.enable(tmpfile.fileno(), writer="drop_all")
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+def test_per_thread_timers_reject_real_time():
+    import _vmprof
+
+    tmpfile = tempfile.NamedTemporaryFile()
+    with py.test.raises(ValueError):
+        vmprof.enable(tmpfile.fileno(), real_time=True, per_thread=True)
+    assert not vmprof.is_enabled()
+    # the failed enable() did not leave per-thread timers switched on
+    with py.test.raises(ValueError):
+        _vmprof.remove_thread_timer()
+
+
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@py.test.mark.skipif("not sys.platform.startswith('linux')")
+def test_per_thread_timer_of_an_exited_thread():
+    import threading
+
+    import _vmprof
+
+    # armed by enable() from the main thread, it exits while profiling
+    stop = threading.Event()
+    thread = threading.Thread(target=stop.wait)
+    thread.start()
+    tmpfile = tempfile.NamedTemporaryFile()
+    vmprof.enable(tmpfile.fileno(), period=0.001, per_thread=True)
+    try:
+        armed = _vmprof.insert_thread_timer()
+        stop.set()
+        thread.join()
+        # its timer is removed the next time a thread is armed
+        assert _vmprof.insert_thread_timer() == armed - 1
+    finally:
+        vmprof.disable()
+
+
 if GZIP:
 
     def test_gzip_problem():
@@ -494,6 +1451,30 @@ def test_line_profiling():
     walk(stats.get_tree())
 
 
+@py.test.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_line_profiling_maps_offsets():
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), lines=True, native=False)
+    function_foo()
+    vmprof.disable()
+    tmpfile.close()
+
+    stats = read_profile(tmpfile.name)
+    first = function_foo.__code__.co_firstlineno
+    found = []
+
+    def visit(node):
+        if node.name == foo_full_name:
+            found.append(node)
+
+    stats.get_tree().walk(visit)
+    assert found
+    for node in found:
+        # the loop of function_foo, not offsets or the line of the def
+        assert node.lines
+        assert set(node.lines) <= set([first + 1, first + 2, first + 3])
+
+
 def test_vmprof_show():
     tmpfile = tempfile.NamedTemporaryFile(delete=False)
     vmprof.enable(tmpfile.fileno())